@@ -0,0 +1,616 @@
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../ext2.h"
+#include "../chunked.h"
+
+#define IMAGE_FILE "/tmp/trext2-bench.img"
+#define CONTAINER_FILE "/tmp/trext2-bench.ck"
+#define IMAGE_SIZE_MB 64
+#define DEFAULT_BLOCKSZ 4096
+
+#define CHUNK (64 * 1024)       // size of sequential reads/writes
+#define SEQ_FILE_SIZE (16 * 1024 * 1024)
+#define RAND_IO 4096            // size of random reads/writes
+#define RAND_OPS 2000
+#define SMALL_READ 64           // size of the reads of small_read
+#define SMALL_READ_OPS 65536
+#define SMALL_FILES 2000
+#define SMALL_FILE_SIZE 100
+#define DEPTH 16
+#define DEEP_OPENS 2000
+#define DIR_ENTRIES 2000
+#define TREE_FANOUT 4
+#define TREE_DEPTH 5
+#define RM_DIRS 16
+#define RM_FILES 512          // in each directory of rm_tree
+#define RM_WORKERS 4
+
+/*************************************
+ * Backends                          *
+ *************************************/
+typedef struct {
+    uint8_t* ram;          // image in memory, or NULL to use the file
+    ext2_chunked_t* chunked; // compressed container, used instead of both
+    int fd;
+    long latency_us;       // injected before every file access
+
+    _Atomic uint64_t reads, writes; // rm_tree_mt does I/O from several threads
+} backend_t;
+
+void inject_latency(backend_t* b) {
+    if (b->latency_us <= 0)
+        return;
+
+    struct timespec ts = { b->latency_us / 1000000, (b->latency_us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+int dev_read64(uint64_t start, uint32_t size, void* buffer, void* context) {
+    backend_t* b = context;
+    b->reads++;
+
+    if (b->chunked)
+        return ext2_chunked_read(start, size, buffer, b->chunked);
+
+    if (b->ram) {
+        memcpy(buffer, b->ram + start, size);
+        return 0;
+    }
+
+    inject_latency(b);
+    return (pread(b->fd, buffer, size, start) == size) ? 0 : -1;
+}
+
+int dev_write64(uint64_t start, uint32_t size, const void* buffer, void* context) {
+    backend_t* b = context;
+    b->writes++;
+
+    if (b->chunked)
+        return ext2_chunked_write(start, size, buffer, b->chunked);
+
+    if (b->ram) {
+        memcpy(b->ram + start, buffer, size);
+        return 0;
+    }
+
+    inject_latency(b);
+    return (pwrite(b->fd, buffer, size, start) == size) ? 0 : -1;
+}
+
+/*************************************
+ * Measurements                      *
+ *************************************/
+typedef struct {
+    const char* name;
+    uint32_t ops;
+    uint64_t bytes;     // payload moved, 0 for metadata benchmarks
+    double* latencies;  // of each op, in microseconds
+    double total_us;
+    uint64_t reads, writes;
+} result_t;
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double* sorted, uint32_t n, double p) {
+    uint32_t i = p / 100 * (n - 1);
+    return sorted[i];
+}
+
+void print_header() {
+    printf("%-12s %6s %10s %11s %9s %9s %9s %9s %9s %9s\n", "benchmark", "ops",
+            "total ms", "ops/s", "MB/s", "p50 us", "p90 us", "p99 us",
+            "reads/op", "writes/op");
+}
+
+void print_result(result_t* r) {
+    qsort(r->latencies, r->ops, sizeof(double), cmp_double);
+
+    double secs = r->total_us / 1e6;
+    printf("%-12s %6u %10.1f %11.0f %9.1f %9.1f %9.1f %9.1f %9.2f %9.2f\n",
+            r->name, r->ops, r->total_us / 1e3, r->ops / secs,
+            r->bytes / secs / (1024 * 1024),
+            percentile(r->latencies, r->ops, 50),
+            percentile(r->latencies, r->ops, 90),
+            percentile(r->latencies, r->ops, 99),
+            (double)r->reads / r->ops, (double)r->writes / r->ops);
+}
+
+/*************************************
+ * Benchmarks                        *
+ *************************************/
+typedef struct {
+    ext2_t ext2;
+    backend_t* backend;
+    result_t* result;
+    double op_start;
+} bench_t;
+
+// every op of a benchmark is timed and its device calls counted
+void timer_begin(bench_t* b) {
+    b->op_start = now_us();
+}
+
+void timer_end(bench_t* b) {
+    double t = now_us() - b->op_start;
+    b->result->latencies[b->result->ops++] = t;
+    b->result->total_us += t;
+}
+
+void check(ext2_error_t err, const char* what) {
+    if (err) {
+        fprintf(stderr, "%s failed with error %d\n", what, err);
+        exit(1);
+    }
+}
+
+uint32_t rng_state = 12345;
+
+uint32_t rng() {
+    rng_state = rng_state * 1103515245 + 12345;
+    return rng_state >> 8;
+}
+
+uint8_t data[CHUNK];
+
+void bench_seq_write(bench_t* b, bool measure) {
+    ext2_file_t file;
+    check(ext2_file_open(&b->ext2, "/seq", &file), "open");
+
+    for (uint32_t off = 0; off < SEQ_FILE_SIZE; off += CHUNK) {
+        if (measure)
+            timer_begin(b);
+        check(ext2_file_write(&b->ext2, &file, CHUNK, data), "write");
+        if (measure)
+            timer_end(b);
+    }
+
+    if (measure)
+        b->result->bytes = SEQ_FILE_SIZE;
+}
+
+void bench_seq_read(bench_t* b, bool measure) {
+    ext2_file_t file;
+
+    if (!measure) {
+        bench_seq_write(b, false);
+        return;
+    }
+
+    check(ext2_file_open(&b->ext2, "/seq", &file), "open");
+
+    for (uint32_t off = 0; off < SEQ_FILE_SIZE; off += CHUNK) {
+        timer_begin(b);
+        check(ext2_file_read(&b->ext2, &file, CHUNK, data), "read");
+        timer_end(b);
+    }
+
+    b->result->bytes = SEQ_FILE_SIZE;
+}
+
+void bench_rand_read(bench_t* b, bool measure) {
+    ext2_file_t file;
+
+    if (!measure) {
+        bench_seq_write(b, false);
+        return;
+    }
+
+    check(ext2_file_open(&b->ext2, "/seq", &file), "open");
+
+    for (uint32_t i = 0; i < RAND_OPS; i++) {
+        uint64_t off = (uint64_t)(rng() % (SEQ_FILE_SIZE / RAND_IO)) * RAND_IO;
+
+        timer_begin(b);
+        check(ext2_file_seek(&b->ext2, &file, off), "seek");
+        check(ext2_file_read(&b->ext2, &file, RAND_IO, data), "read");
+        timer_end(b);
+    }
+
+    b->result->bytes = (uint64_t)RAND_OPS * RAND_IO;
+}
+
+// small reads one after the other, where the cost of finding the block 
+// shows more than the copy
+void bench_small_read(bench_t* b, bool measure) {
+    ext2_file_t file;
+
+    if (!measure) {
+        bench_seq_write(b, false);
+        return;
+    }
+
+    check(ext2_file_open(&b->ext2, "/seq", &file), "open");
+
+    for (uint32_t i = 0; i < SMALL_READ_OPS; i++) {
+        timer_begin(b);
+        check(ext2_file_read(&b->ext2, &file, SMALL_READ, data), "read");
+        timer_end(b);
+    }
+
+    b->result->bytes = (uint64_t)SMALL_READ_OPS * SMALL_READ;
+}
+
+void bench_rand_write(bench_t* b, bool measure) {
+    ext2_file_t file;
+
+    if (!measure) {
+        bench_seq_write(b, false);
+        return;
+    }
+
+    check(ext2_file_open(&b->ext2, "/seq", &file), "open");
+
+    for (uint32_t i = 0; i < RAND_OPS; i++) {
+        uint64_t off = (uint64_t)(rng() % (SEQ_FILE_SIZE / RAND_IO)) * RAND_IO;
+
+        timer_begin(b);
+        check(ext2_file_seek(&b->ext2, &file, off), "seek");
+        check(ext2_file_write(&b->ext2, &file, RAND_IO, data), "write");
+        timer_end(b);
+    }
+
+    b->result->bytes = (uint64_t)RAND_OPS * RAND_IO;
+}
+
+void bench_create(bench_t* b, bool measure) {
+    char path[64];
+    ext2_file_t file;
+
+    if (!measure) {
+        check(ext2_mkdir(&b->ext2, "/small"), "mkdir");
+        return;
+    }
+
+    for (uint32_t i = 0; i < SMALL_FILES; i++) {
+        sprintf(path, "/small/file%u", i);
+
+        timer_begin(b);
+        check(ext2_file_open(&b->ext2, path, &file), "open");
+        check(ext2_file_write(&b->ext2, &file, SMALL_FILE_SIZE, data), "write");
+        timer_end(b);
+    }
+
+    b->result->bytes = (uint64_t)SMALL_FILES * SMALL_FILE_SIZE;
+}
+
+void bench_deep_open(bench_t* b, bool measure) {
+    char path[DEPTH * 8 + 16] = "";
+    ext2_file_t file;
+
+    for (int i = 0; i < DEPTH; i++) {
+        sprintf(path + strlen(path), "/level%d", i);
+        if (!measure)
+            check(ext2_mkdir(&b->ext2, path), "mkdir");
+    }
+
+    strcat(path, "/file");
+
+    if (!measure) {
+        check(ext2_file_open(&b->ext2, path, &file), "open");
+        return;
+    }
+
+    for (uint32_t i = 0; i < DEEP_OPENS; i++) {
+        timer_begin(b);
+        check(ext2_file_open(&b->ext2, path, &file), "open");
+        timer_end(b);
+    }
+}
+
+void bench_list(bench_t* b, bool measure) {
+    char path[64];
+    ext2_file_t file;
+
+    if (!measure) {
+        check(ext2_mkdir(&b->ext2, "/big"), "mkdir");
+        for (uint32_t i = 0; i < DIR_ENTRIES; i++) {
+            sprintf(path, "/big/entry%u", i);
+            check(ext2_file_open(&b->ext2, path, &file), "open");
+        }
+        return;
+    }
+
+    ext2_dir_t dir;
+    ext2_dir_record_t entry;
+    check(ext2_dir_open(&b->ext2, "/big", &dir), "dir open");
+
+    do {
+        timer_begin(b);
+        check(ext2_dir_read(&b->ext2, &dir, &entry), "dir read");
+        timer_end(b);
+    } while (entry.inode != 0);
+}
+
+void mkdir_tree(bench_t* b, char* path, int depth) {
+    if (depth == TREE_DEPTH)
+        return;
+
+    size_t len = strlen(path);
+
+    for (int i = 0; i < TREE_FANOUT; i++) {
+        sprintf(path + len, "/d%d", i);
+
+        timer_begin(b);
+        check(ext2_mkdir(&b->ext2, path), "mkdir");
+        timer_end(b);
+
+        mkdir_tree(b, path, depth + 1);
+    }
+
+    path[len] = '\0';
+}
+
+void bench_mkdir_tree(bench_t* b, bool measure) {
+    char path[TREE_DEPTH * 4 + 16] = "";
+
+    if (measure)
+        mkdir_tree(b, path, 0);
+}
+
+typedef struct {
+    void (*task)(uint32_t, void*);
+    void* arg;
+    uint32_t index;
+} thread_arg_t;
+
+void* run_task(void* p) {
+    thread_arg_t* t = p;
+    t->task(t->index, t->arg);
+    return NULL;
+}
+
+// runs every task on its own thread
+void parallel_for(void (*task)(uint32_t, void*), void* arg, uint32_t count,
+        void* context) {
+    pthread_t threads[count];
+    thread_arg_t args[count];
+
+    for (uint32_t i = 0; i < count; i++) {
+        args[i] = (thread_arg_t){ task, arg, i };
+        pthread_create(&threads[i], NULL, run_task, &args[i]);
+    }
+    for (uint32_t i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+}
+
+// the whole tree goes in a single op, with 'workers' threads
+void run_rm_tree(bench_t* b, bool measure, uint32_t workers) {
+    char path[64];
+    ext2_file_t file;
+
+    if (!measure) {
+        check(ext2_mkdir(&b->ext2, "/rm"), "mkdir");
+        for (uint32_t d = 0; d < RM_DIRS; d++) {
+            sprintf(path, "/rm/d%u", d);
+            check(ext2_mkdir(&b->ext2, path), "mkdir");
+
+            for (uint32_t i = 0; i < RM_FILES; i++) {
+                sprintf(path, "/rm/d%u/file%u", d, i);
+                check(ext2_file_open(&b->ext2, path, &file), "open");
+                check(ext2_file_write(&b->ext2, &file, SMALL_FILE_SIZE, data), 
+                        "write");
+            }
+        }
+        return;
+    }
+
+    uint32_t files = 1 + RM_DIRS * (1 + RM_FILES);
+    ext2_rm_tree_params_t params = {
+        .parallel_for = (workers > 1) ? parallel_for : NULL,
+        .workers = workers,
+        .workspace_size = ext2_rm_tree_workspace_size(&b->ext2, files),
+    };
+    params.workspace = malloc(params.workspace_size);
+
+    timer_begin(b);
+    check(ext2_rm_tree(&b->ext2, "/rm", &params), "rm tree");
+    timer_end(b);
+
+    free(params.workspace);
+}
+
+void bench_rm_tree(bench_t* b, bool measure) {
+    run_rm_tree(b, measure, 1);
+}
+
+void bench_rm_tree_mt(bench_t* b, bool measure) {
+    run_rm_tree(b, measure, RM_WORKERS);
+}
+
+typedef struct {
+    const char* name;
+    void (*run)(bench_t* b, bool measure); // prepares if measure is false
+    uint32_t max_ops;
+} benchmark_t;
+
+benchmark_t benchmarks[] = {
+    { "seq_write",  bench_seq_write,  SEQ_FILE_SIZE / CHUNK },
+    { "seq_read",   bench_seq_read,   SEQ_FILE_SIZE / CHUNK },
+    { "rand_read",  bench_rand_read,  RAND_OPS },
+    { "small_read", bench_small_read, SMALL_READ_OPS },
+    { "rand_write", bench_rand_write, RAND_OPS },
+    { "create",     bench_create,     SMALL_FILES },
+    { "deep_open",  bench_deep_open,  DEEP_OPENS },
+    { "list",       bench_list,       DIR_ENTRIES + 8 },
+    { "mkdir_tree", bench_mkdir_tree, 4 + 16 + 64 + 256 + 1024 },
+    { "rm_tree",    bench_rm_tree,    1 },
+    { "rm_tree_mt", bench_rm_tree_mt, 1 },
+};
+
+/*************************************
+ * Main                              *
+ *************************************/
+uint32_t block_size = DEFAULT_BLOCKSZ;
+
+uint8_t* load_image() {
+    char cmd[256];
+    snprintf(cmd, sizeof(cmd), "rm -f %s && truncate -s %dM %s && "
+            "mkfs.ext2 -q -b %d %s", IMAGE_FILE, IMAGE_SIZE_MB, IMAGE_FILE,
+            block_size, IMAGE_FILE);
+
+    if (system(cmd) != 0) {
+        fprintf(stderr, "could not create the image (is mkfs.ext2 installed?)\n");
+        exit(1);
+    }
+
+    size_t size = (size_t)IMAGE_SIZE_MB * 1024 * 1024;
+    uint8_t* image = malloc(size);
+    int fd = open(IMAGE_FILE, O_RDONLY);
+
+    if (image == NULL || fd < 0 || pread(fd, image, size, 0) != size) {
+        fprintf(stderr, "could not load the image\n");
+        exit(1);
+    }
+
+    close(fd);
+    return image;
+}
+
+void usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-b ram|file|chunked] [-l latency_us] [-s block_size] "
+            "[benchmark...]\n", prog);
+    exit(1);
+}
+
+// a container holding the image, with the zero chunks left out
+ext2_chunked_t* load_container(uint8_t* image, size_t size) {
+    ext2_chunked_params_t params = {0};
+    ext2_chunked_t* chunked;
+
+    if (ext2_chunked_create(CONTAINER_FILE, size, &params) ||
+            ext2_chunked_open(&chunked, CONTAINER_FILE, &params)) {
+        fprintf(stderr, "could not create the container\n");
+        exit(1);
+    }
+
+    for (size_t off = 0; off < size; off += CHUNK)
+        if (ext2_chunked_write(off, CHUNK, image + off, chunked)) {
+            fprintf(stderr, "could not fill the container\n");
+            exit(1);
+        }
+
+    ext2_chunked_flush(chunked);
+    return chunked;
+}
+
+int main(int argc, char** argv) {
+    bool use_ram = true;
+    bool use_chunked = false;
+    long latency_us = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:l:s:")) != -1) {
+        if (opt == 'b' && strcmp(optarg, "ram") == 0)
+            use_ram = true;
+        else if (opt == 'b' && strcmp(optarg, "file") == 0)
+            use_ram = false;
+        else if (opt == 'b' && strcmp(optarg, "chunked") == 0)
+            use_chunked = true, use_ram = false;
+        else if (opt == 'l')
+            latency_us = atol(optarg);
+        else if (opt == 's')
+            block_size = atol(optarg);
+        else
+            usage(argv[0]);
+    }
+
+    size_t size = (size_t)IMAGE_SIZE_MB * 1024 * 1024;
+    uint8_t* master = load_image();
+    uint8_t* ram = use_ram ? malloc(size) : NULL;
+
+    printf("backend: %s", use_chunked ? "chunked" : use_ram ? "ram" : "file");
+    if (!use_ram && !use_chunked)
+        printf(", %ld us per I/O", latency_us);
+    printf(", %d MiB image, %u-byte blocks\n", IMAGE_SIZE_MB, block_size);
+    print_header();
+
+    memset(data, 'x', sizeof(data));
+
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++) {
+        benchmark_t* bm = &benchmarks[i];
+        bool selected = (optind == argc);
+
+        for (int a = optind; a < argc; a++)
+            selected = selected || strcmp(argv[a], bm->name) == 0;
+
+        if (!selected)
+            continue;
+
+        // every benchmark starts from a fresh filesystem
+        backend_t backend = { .ram = ram, .fd = -1 };
+
+        if (use_chunked) {
+            backend.chunked = load_container(master, size);
+        } else if (use_ram) {
+            memcpy(ram, master, size);
+        } else {
+            backend.fd = open(IMAGE_FILE, O_RDWR);
+            if (backend.fd < 0 || pwrite(backend.fd, master, size, 0) != size) {
+                fprintf(stderr, "could not reset the image\n");
+                return 1;
+            }
+        }
+
+        result_t result = { .name = bm->name };
+        result.latencies = malloc(bm->max_ops * sizeof(double));
+
+        bench_t b = { .backend = &backend, .result = &result };
+        ext2_config_t cfg = {
+            .read64 = dev_read64,
+            .write64 = dev_write64,
+            .context = &backend,
+        };
+
+        rng_state = 12345;
+        check(ext2_mount(&b.ext2, &cfg), "mount");
+        bm->run(&b, false);
+
+        // only the measured part counts, with the injected latency
+        backend.latency_us = latency_us;
+        backend.reads = backend.writes = 0;
+        bm->run(&b, true);
+
+        result.reads = backend.reads;
+        result.writes = backend.writes;
+        print_result(&result);
+
+        free(result.latencies);
+        if (backend.fd >= 0)
+            close(backend.fd);
+
+        if (backend.chunked) {
+            ext2_chunked_stats_t stats;
+            ext2_chunked_flush(backend.chunked);
+            ext2_chunked_get_stats(backend.chunked, &stats);
+            printf("%-12s container holds %llu of %llu chunks in %llu KiB\n", "",
+                    (unsigned long long)stats.stored_chunks,
+                    (unsigned long long)stats.chunks,
+                    (unsigned long long)stats.stored_bytes / 1024);
+            ext2_chunked_close(backend.chunked);
+        }
+    }
+
+    free(master);
+    free(ram);
+    unlink(IMAGE_FILE);
+    unlink(CONTAINER_FILE);
+    return 0;
+}
@@ -0,0 +1,618 @@
+#define _FILE_OFFSET_BITS 64
+#define _XOPEN_SOURCE 700
+#include "chunked.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define CHUNKED_MAGIC "TREXT2CK"
+#define CHUNKED_VERSION 1
+#define HEADER_SIZE 64
+#define MIN_CHUNK_SIZE (4 * 1024)
+#define MAX_CHUNK_SIZE (16 * 1024 * 1024)
+#define DEFAULT_CHUNK_SIZE (64 * 1024)
+#define DEFAULT_CACHE_CHUNKS 256
+#define ALLOC_UNIT 512 // chunks take space in multiples of it
+#define NO_CHUNK UINT64_MAX
+
+// Start of the container file. The index follows it, at HEADER_SIZE, with an
+// entry per chunk, and then the chunk data. A stored chunk is never written
+// over while the index in the file refers to it: it goes to free space, and
+// its old space is free only once a flush wrote the new index. So after a
+// crash the file holds what the last flush wrote
+typedef struct {
+    char magic[8];      // CHUNKED_MAGIC
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t size;      // bytes of the device
+    uint64_t file_end;  // end of the space chunks take
+} chunked_header_t;
+
+// where a chunk is in the file
+typedef struct {
+    uint64_t offset;   // 0 if the chunk isn't stored, and reads as zeros
+    uint32_t size;     // bytes stored. chunk_size means it's not compressed
+    uint32_t capacity; // bytes taken at offset, size rounded up to ALLOC_UNIT
+} chunk_entry_t;
+
+// free space between the chunks
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} chunk_hole_t;
+
+// a decompressed chunk in memory
+typedef struct {
+    uint64_t chunk; // NO_CHUNK if the slot is free
+    bool used;      // accessed since the clock hand last passed
+    bool dirty;     // changed since it was loaded or stored
+    uint8_t* data;
+} chunk_slot_t;
+
+struct ext2_chunked {
+    int fd;
+    pthread_mutex_t lock; // taken by every call, the cache isn't split
+
+    chunked_header_t header;
+    uint64_t chunks;
+    chunk_entry_t* index;
+    chunk_entry_t* saved; // the index the file holds, its chunks are kept
+    uint32_t* cached; // slot of each chunk plus 1, 0 if it isn't cached
+    bool changed;     // index differs from saved
+
+    chunk_hole_t* holes; // sorted by offset, neighbours are merged
+    uint64_t hole_count;
+
+    chunk_slot_t* slots;
+    uint32_t slot_count;
+    uint32_t hand;    // next slot the clock looks at for eviction
+
+    uint8_t* zbuf;  // a compressed chunk, as big as zlib may need
+    uLong zbuf_size;
+    int level;
+
+    uint64_t hits, misses;
+    bool ready; // fully opened, so closing it flushes
+};
+
+int chunked_read_all(int fd, uint64_t offset, uint64_t size, void* buffer) {
+    uint8_t* p = buffer;
+
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, offset);
+        if (n <= 0)
+            return EXT2_CHUNKED_ERR_IO;
+
+        p += n;
+        offset += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+int chunked_write_all(int fd, uint64_t offset, uint64_t size, const void* buffer) {
+    const uint8_t* p = buffer;
+
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, offset);
+        if (n <= 0)
+            return EXT2_CHUNKED_ERR_IO;
+
+        p += n;
+        offset += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+bool chunked_is_zero(const uint8_t* data, uint64_t size) {
+    for (; size > 0 && ((uintptr_t)data % 8) != 0; size--)
+        if (*data++ != 0)
+            return false;
+
+    for (; size >= 8; size -= 8, data += 8)
+        if (*(const uint64_t*)data != 0)
+            return false;
+
+    for (; size > 0; size--)
+        if (*data++ != 0)
+            return false;
+
+    return true;
+}
+
+bool chunked_valid_size(uint32_t size) {
+    return size >= MIN_CHUNK_SIZE && size <= MAX_CHUNK_SIZE &&
+        (size & (size - 1)) == 0;
+}
+
+int ext2_chunked_create(const char* path, uint64_t size,
+        const ext2_chunked_params_t* params) {
+    uint32_t chunk_size = params->chunk_size ? params->chunk_size :
+        DEFAULT_CHUNK_SIZE;
+
+    if (!chunked_valid_size(chunk_size) || size == 0)
+        return EXT2_CHUNKED_ERR_BAD_PARAMS;
+
+    uint64_t chunks = (size + chunk_size - 1) / chunk_size;
+    uint8_t block[HEADER_SIZE] = {0};
+    chunked_header_t header = {
+        .magic = CHUNKED_MAGIC,
+        .version = CHUNKED_VERSION,
+        .chunk_size = chunk_size,
+        .size = size,
+        .file_end = HEADER_SIZE + chunks * sizeof(chunk_entry_t),
+    };
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return EXT2_CHUNKED_ERR_IO;
+
+    // the index is all zeros: no chunk is stored
+    memcpy(block, &header, sizeof(header));
+    int err = chunked_write_all(fd, 0, sizeof(block), block);
+    if (!err && ftruncate(fd, header.file_end) != 0)
+        err = EXT2_CHUNKED_ERR_IO;
+
+    close(fd);
+    return err;
+}
+
+// gives space back, merging it with the holes around it
+void chunked_release(ext2_chunked_t* c, uint64_t offset, uint64_t size) {
+    uint64_t i = 0;
+    while (i < c->hole_count && c->holes[i].offset < offset)
+        i++;
+
+    bool after = i > 0 && c->holes[i - 1].offset + c->holes[i - 1].size == offset;
+    bool before = i < c->hole_count && offset + size == c->holes[i].offset;
+
+    if (after && before) {
+        c->holes[i - 1].size += size + c->holes[i].size;
+        memmove(&c->holes[i], &c->holes[i + 1], 
+                (c->hole_count - i - 1) * sizeof(chunk_hole_t));
+        c->hole_count--;
+    } else if (after) {
+        c->holes[i - 1].size += size;
+    } else if (before) {
+        c->holes[i].offset = offset;
+        c->holes[i].size += size;
+    } else {
+        memmove(&c->holes[i + 1], &c->holes[i], 
+                (c->hole_count - i) * sizeof(chunk_hole_t));
+        c->holes[i] = (chunk_hole_t){ offset, size };
+        c->hole_count++;
+    }
+}
+
+// takes space from the first hole big enough, or from the end of the file
+uint64_t chunked_alloc(ext2_chunked_t* c, uint64_t size) {
+    for (uint64_t i = 0; i < c->hole_count; i++) {
+        chunk_hole_t* hole = &c->holes[i];
+        if (hole->size < size)
+            continue;
+
+        uint64_t offset = hole->offset;
+        hole->offset += size;
+        hole->size -= size;
+        if (hole->size == 0) {
+            memmove(hole, hole + 1, (c->hole_count - i - 1) * sizeof(chunk_hole_t));
+            c->hole_count--;
+        }
+        return offset;
+    }
+
+    uint64_t offset = c->header.file_end;
+    c->header.file_end += size;
+    return offset;
+}
+
+int chunked_by_offset(const void* a, const void* b) {
+    uint64_t x = ((const chunk_entry_t*)a)->offset;
+    uint64_t y = ((const chunk_entry_t*)b)->offset;
+    return (x > y) - (x < y);
+}
+
+// Finds the holes between the stored chunks of a container just opened. The
+// index is also copied to saved
+int chunked_find_holes(ext2_chunked_t* c) {
+    uint64_t data_start = HEADER_SIZE + c->chunks * sizeof(chunk_entry_t);
+    uint64_t stored = 0;
+
+    // saved is used for the sort
+    for (uint64_t i = 0; i < c->chunks; i++)
+        if (c->index[i].offset != 0)
+            c->saved[stored++] = c->index[i];
+    qsort(c->saved, stored, sizeof(chunk_entry_t), chunked_by_offset);
+
+    uint64_t at = data_start;
+    c->hole_count = 0;
+    for (uint64_t i = 0; i < stored; i++) {
+        const chunk_entry_t* e = &c->saved[i];
+        if (e->offset < at || e->size > e->capacity || 
+                e->offset + e->capacity > c->header.file_end)
+            return EXT2_CHUNKED_ERR_CORRUPT;
+
+        if (e->offset > at)
+            chunked_release(c, at, e->offset - at);
+        at = e->offset + e->capacity;
+    }
+
+    if (c->header.file_end < at)
+        return EXT2_CHUNKED_ERR_CORRUPT;
+    if (c->header.file_end > at)
+        chunked_release(c, at, c->header.file_end - at);
+
+    memcpy(c->saved, c->index, c->chunks * sizeof(chunk_entry_t));
+    return 0;
+}
+
+int ext2_chunked_open(ext2_chunked_t** chunked, const char* path,
+        const ext2_chunked_params_t* params) {
+    ext2_chunked_t* c = calloc(1, sizeof(*c));
+    if (c == NULL)
+        return EXT2_CHUNKED_ERR_NO_MEMORY;
+
+    c->fd = open(path, O_RDWR);
+    c->level = params->level ? params->level : Z_BEST_SPEED;
+    c->slot_count = params->cache_chunks ? params->cache_chunks :
+        DEFAULT_CACHE_CHUNKS;
+    pthread_mutex_init(&c->lock, NULL);
+    *chunked = c;
+
+    int err = (c->fd < 0) ? EXT2_CHUNKED_ERR_IO :
+        chunked_read_all(c->fd, 0, sizeof(c->header), &c->header);
+
+    if (!err && (memcmp(c->header.magic, CHUNKED_MAGIC, 8) != 0 ||
+                c->header.version != CHUNKED_VERSION ||
+                !chunked_valid_size(c->header.chunk_size)))
+        err = EXT2_CHUNKED_ERR_CORRUPT;
+
+    if (!err) {
+        uint32_t cs = c->header.chunk_size;
+        c->chunks = (c->header.size + cs - 1) / cs;
+        if (c->chunks == 0)
+            err = EXT2_CHUNKED_ERR_CORRUPT;
+
+        c->index = malloc(c->chunks * sizeof(chunk_entry_t));
+        c->saved = malloc(c->chunks * sizeof(chunk_entry_t));
+        c->cached = calloc(c->chunks, sizeof(uint32_t));
+
+        // holes lie between the chunks of the index and of saved
+        c->holes = malloc((2 * c->chunks + 1) * sizeof(chunk_hole_t));
+        c->slots = calloc(c->slot_count, sizeof(chunk_slot_t));
+        c->zbuf_size = compressBound(cs);
+        c->zbuf = malloc(c->zbuf_size);
+
+        if (c->index == NULL || c->saved == NULL || c->cached == NULL || 
+                c->holes == NULL || c->slots == NULL || c->zbuf == NULL)
+            err = EXT2_CHUNKED_ERR_NO_MEMORY;
+
+        for (uint32_t i = 0; i < c->slot_count && !err; i++) {
+            c->slots[i].chunk = NO_CHUNK;
+            c->slots[i].data = malloc(cs);
+            if (c->slots[i].data == NULL)
+                err = EXT2_CHUNKED_ERR_NO_MEMORY;
+        }
+    }
+
+    if (!err)
+        err = chunked_read_all(c->fd, HEADER_SIZE, c->chunks * sizeof(chunk_entry_t),
+                c->index);
+
+    if (!err)
+        err = chunked_find_holes(c);
+
+    if (err) {
+        ext2_chunked_close(c);
+        *chunked = NULL;
+    } else {
+        c->ready = true;
+    }
+
+    return err;
+}
+
+// Compresses a chunk of the cache and writes it to free space. A chunk of 
+// zeros is dropped from the file instead. The old space is given back, 
+// unless the index in the file still refers to it
+int chunked_store(ext2_chunked_t* c, chunk_slot_t* slot) {
+    const uint32_t cs = c->header.chunk_size;
+    chunk_entry_t* entry = &c->index[slot->chunk];
+    const chunk_entry_t old = *entry;
+    const uint8_t* out = c->zbuf;
+    uLongf len = c->zbuf_size;
+
+    if (chunked_is_zero(slot->data, cs)) {
+        memset(entry, 0, sizeof(*entry));
+    } else {
+        // chunks that don't shrink are kept as they are
+        if (compress2(c->zbuf, &len, slot->data, cs, c->level) != Z_OK ||
+                len >= cs) {
+            out = slot->data;
+            len = cs;
+        }
+
+        uint32_t capacity = (len + ALLOC_UNIT - 1) / ALLOC_UNIT * ALLOC_UNIT;
+        entry->offset = chunked_alloc(c, capacity);
+        entry->size = len;
+        entry->capacity = capacity;
+
+        int err = chunked_write_all(c->fd, entry->offset, len, out);
+        if (err) {
+            chunked_release(c, entry->offset, capacity);
+            *entry = old;
+            return err;
+        }
+    }
+
+    if (old.offset != 0 && old.offset != c->saved[slot->chunk].offset)
+        chunked_release(c, old.offset, old.capacity);
+
+    c->changed = true;
+    slot->dirty = false;
+    return 0;
+}
+
+int chunked_load(ext2_chunked_t* c, chunk_slot_t* slot) {
+    const uint32_t cs = c->header.chunk_size;
+    const chunk_entry_t* entry = &c->index[slot->chunk];
+
+    if (entry->offset == 0) {
+        memset(slot->data, 0, cs);
+        return 0;
+    }
+
+    if (entry->size == cs)
+        return chunked_read_all(c->fd, entry->offset, cs, slot->data);
+
+    if (entry->size > c->zbuf_size)
+        return EXT2_CHUNKED_ERR_CORRUPT;
+
+    int err = chunked_read_all(c->fd, entry->offset, entry->size, c->zbuf);
+    if (err)
+        return err;
+
+    uLongf len = cs;
+    if (uncompress(slot->data, &len, c->zbuf, entry->size) != Z_OK || len != cs)
+        return EXT2_CHUNKED_ERR_CORRUPT;
+
+    return 0;
+}
+
+chunk_slot_t* chunked_find_slot(ext2_chunked_t* c, uint64_t chunk) {
+    uint32_t i = c->cached[chunk];
+    return i ? &c->slots[i - 1] : NULL;
+}
+
+// Gets the slot of a chunk, loading it if it isn't cached. The slot it goes 
+// to is picked with the clock algorithm: the hand skips (and clears) slots 
+// used since it last passed. With 'load' false the caller overwrites the 
+// whole chunk, so it isn't read
+int chunked_get_slot(ext2_chunked_t* c, uint64_t chunk, bool load, 
+        chunk_slot_t** out) {
+    chunk_slot_t* slot = chunked_find_slot(c, chunk);
+
+    if (slot) {
+        c->hits++;
+    } else {
+        c->misses++;
+
+        while (true) {
+            slot = &c->slots[c->hand];
+            c->hand = (c->hand + 1) % c->slot_count;
+            if (!slot->used)
+                break;
+            slot->used = false;
+        }
+
+        if (slot->chunk != NO_CHUNK) {
+            if (slot->dirty) {
+                int err = chunked_store(c, slot);
+                if (err)
+                    return err;
+            }
+            c->cached[slot->chunk] = 0;
+            slot->chunk = NO_CHUNK;
+        }
+
+        slot->chunk = chunk;
+        int err = load ? chunked_load(c, slot) : 0;
+        if (err) {
+            slot->chunk = NO_CHUNK;
+            return err;
+        }
+
+        c->cached[chunk] = slot - c->slots + 1;
+    }
+
+    slot->used = true;
+    *out = slot;
+    return 0;
+}
+
+int ext2_chunked_read(uint64_t start, uint32_t size, void* buffer, void* context) {
+    ext2_chunked_t* c = context;
+    const uint32_t cs = c->header.chunk_size;
+    uint8_t* p = buffer;
+    int err = 0;
+
+    if (start + size > c->header.size || start + size < start)
+        return EXT2_CHUNKED_ERR_BAD_PARAMS;
+
+    pthread_mutex_lock(&c->lock);
+
+    while (size > 0 && !err) {
+        uint64_t chunk = start / cs;
+        uint32_t off = start % cs;
+        uint32_t n = (size < cs - off) ? size : cs - off;
+        chunk_slot_t* slot;
+
+        // chunks that aren't stored are zeros, no need to cache them
+        if (c->index[chunk].offset == 0 && chunked_find_slot(c, chunk) == NULL) {
+            memset(p, 0, n);
+        } else {
+            err = chunked_get_slot(c, chunk, true, &slot);
+            if (!err)
+                memcpy(p, slot->data + off, n);
+        }
+
+        start += n;
+        size -= n;
+        p += n;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+    return err;
+}
+
+int ext2_chunked_write(uint64_t start, uint32_t size, const void* buffer,
+        void* context) {
+    ext2_chunked_t* c = context;
+    const uint32_t cs = c->header.chunk_size;
+    const uint8_t* p = buffer;
+    int err = 0;
+
+    if (start + size > c->header.size || start + size < start)
+        return EXT2_CHUNKED_ERR_BAD_PARAMS;
+
+    pthread_mutex_lock(&c->lock);
+
+    while (size > 0 && !err) {
+        uint64_t chunk = start / cs;
+        uint32_t off = start % cs;
+        uint32_t n = (size < cs - off) ? size : cs - off;
+        chunk_slot_t* slot;
+
+        // zeros written over a chunk that isn't stored change nothing
+        if (c->index[chunk].offset == 0 && chunked_find_slot(c, chunk) == NULL &&
+                chunked_is_zero(p, n)) {
+            start += n;
+            size -= n;
+            p += n;
+            continue;
+        }
+
+        err = chunked_get_slot(c, chunk, n != cs, &slot);
+        if (!err) {
+            memcpy(slot->data + off, p, n);
+            slot->dirty = true;
+        }
+
+        start += n;
+        size -= n;
+        p += n;
+    }
+
+    pthread_mutex_unlock(&c->lock);
+    return err;
+}
+
+// Stores the dirty chunks, then writes the index once they're on the disk.
+// The space of the chunks the old index referred to is free after that, and
+// free space at the end of the file is cut
+int chunked_flush_locked(ext2_chunked_t* c) {
+    int err = 0;
+
+    for (uint32_t i = 0; i < c->slot_count && !err; i++)
+        if (c->slots[i].chunk != NO_CHUNK && c->slots[i].dirty)
+            err = chunked_store(c, &c->slots[i]);
+
+    if (err || !c->changed)
+        return err;
+
+    if (fdatasync(c->fd) != 0)
+        return EXT2_CHUNKED_ERR_IO;
+
+    err = chunked_write_all(c->fd, HEADER_SIZE, c->chunks * sizeof(chunk_entry_t),
+            c->index);
+    if (err)
+        return err;
+
+    for (uint64_t i = 0; i < c->chunks; i++) {
+        const chunk_entry_t* old = &c->saved[i];
+        if (old->offset != 0 && old->offset != c->index[i].offset)
+            chunked_release(c, old->offset, old->capacity);
+    }
+    memcpy(c->saved, c->index, c->chunks * sizeof(chunk_entry_t));
+    c->changed = false;
+
+    if (c->hole_count > 0) {
+        chunk_hole_t* last = &c->holes[c->hole_count - 1];
+        if (last->offset + last->size == c->header.file_end) {
+            c->header.file_end = last->offset;
+            c->hole_count--;
+        }
+    }
+
+    // the header goes last, and the file is only cut after it: until then 
+    // the old end is past every chunk of both indexes
+    err = chunked_write_all(c->fd, 0, sizeof(c->header), &c->header);
+    if (!err && ftruncate(c->fd, c->header.file_end) != 0)
+        err = EXT2_CHUNKED_ERR_IO;
+
+    return err;
+}
+
+int ext2_chunked_flush(ext2_chunked_t* c) {
+    pthread_mutex_lock(&c->lock);
+    int err = chunked_flush_locked(c);
+    pthread_mutex_unlock(&c->lock);
+
+    return err;
+}
+
+int ext2_chunked_close(ext2_chunked_t* c) {
+    int err = 0;
+
+    // a handle that failed to open has nothing to flush
+    if (c->ready)
+        err = chunked_flush_locked(c);
+
+    for (uint32_t i = 0; c->slots && i < c->slot_count; i++)
+        free(c->slots[i].data);
+
+    if (c->fd >= 0)
+        close(c->fd);
+
+    free(c->slots);
+    free(c->index);
+    free(c->saved);
+    free(c->holes);
+    free(c->cached);
+    free(c->zbuf);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+
+    return err;
+}
+
+void ext2_chunked_get_stats(ext2_chunked_t* c, ext2_chunked_stats_t* stats) {
+    struct stat st;
+
+    pthread_mutex_lock(&c->lock);
+
+    memset(stats, 0, sizeof(*stats));
+    stats->size = c->header.size;
+    stats->chunks = c->chunks;
+    stats->cache_hits = c->hits;
+    stats->cache_misses = c->misses;
+
+    for (uint64_t i = 0; i < c->chunks; i++) {
+        if (c->index[i].offset != 0) {
+            stats->stored_chunks++;
+            stats->stored_bytes += c->index[i].size;
+        }
+    }
+
+    if (fstat(c->fd, &st) == 0)
+        stats->file_bytes = st.st_size;
+
+    pthread_mutex_unlock(&c->lock);
+}
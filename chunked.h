@@ -0,0 +1,105 @@
+#ifndef EXT2_CHUNKED_H
+#define EXT2_CHUNKED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Device backend that keeps an image in a container file, as fixed-size
+// chunks compressed with zlib. Chunks that were never written (or that only
+// hold zeros) take no space and read as zeros. Unlike ext2.c, this is host
+// code: it needs POSIX files, pthreads, zlib (-lz) and malloc
+
+// errors of the backend. They're negative, so ext2 passes them back as
+// user-defined errors
+typedef enum {
+    EXT2_CHUNKED_ERR_IO = -1,         // the container file couldn't be read or written
+    EXT2_CHUNKED_ERR_NO_MEMORY = -2,  // malloc failed
+    EXT2_CHUNKED_ERR_BAD_PARAMS = -3, // bad chunk size, or an access past the end of the device
+    EXT2_CHUNKED_ERR_CORRUPT = -4,    // the file isn't a container, or a chunk doesn't decompress
+} ext2_chunked_error_t;
+
+/**
+ * options of ext2_chunked_create and ext2_chunked_open
+ */
+typedef struct {
+    // bytes of each chunk, a power of 2 from 4 KiB to 16 MiB. 0 means 64 KiB.
+    // Only used by ext2_chunked_create, the container keeps its own
+    uint32_t chunk_size;
+
+    // decompressed chunks kept in memory. Writes stay in them until they're
+    // evicted or flushed. 0 means 256
+    uint32_t cache_chunks;
+
+    // zlib level, from 1 (fastest) to 9. 0 means 1
+    int level;
+} ext2_chunked_params_t;
+
+/**
+ * what a container holds (see ext2_chunked_get_stats)
+ */
+typedef struct {
+    uint64_t size;          // bytes of the device
+    uint64_t chunks;        // chunks of the device
+    uint64_t stored_chunks; // those that take space in the file
+    uint64_t stored_bytes;  // compressed bytes of the stored chunks
+    uint64_t file_bytes;    // size of the container file, index and garbage included
+    uint64_t cache_hits;    // reads and writes of a chunk that was in memory
+    uint64_t cache_misses;  // those that had to load (and decompress) it
+} ext2_chunked_stats_t;
+
+typedef struct ext2_chunked ext2_chunked_t;
+
+/**
+ * Creates an empty container for a device of 'size' bytes, which reads as
+ * zeros. An existing file is replaced
+ *
+ * @param path   path of the container file
+ * @param size   bytes of the device
+ * @param params options (only chunk_size is used)
+ */
+int ext2_chunked_create(const char* path, uint64_t size,
+        const ext2_chunked_params_t* params);
+
+/**
+ * Opens a container. Sets 'chunked' to the handle, whose address goes in the
+ * context of ext2_config_t, next to the read64 and write64 callbacks below
+ *
+ * @param chunked where the handle is put
+ * @param path    path of the container file
+ * @param params  options of the cache and compression
+ */
+int ext2_chunked_open(ext2_chunked_t** chunked, const char* path,
+        const ext2_chunked_params_t* params);
+
+/**
+ * Compresses the chunks changed in the cache and writes them, then the
+ * index. Chunks are never written over the ones the index in the file
+ * refers to, so after a crash the container holds what the last flush 
+ * wrote. Their old space is reused, or cut from the end of the file
+ *
+ * @param chunked handle of the container
+ */
+int ext2_chunked_flush(ext2_chunked_t* chunked);
+
+/**
+ * Flushes the container and frees the handle, even if the flush fails
+ *
+ * @param chunked handle of the container
+ */
+int ext2_chunked_close(ext2_chunked_t* chunked);
+
+/**
+ * Fills 'stats' with the sizes and cache counters of a container
+ *
+ * @param chunked handle of the container
+ * @param stats   where they're put
+ */
+void ext2_chunked_get_stats(ext2_chunked_t* chunked, ext2_chunked_stats_t* stats);
+
+// read64 and write64 of ext2_config_t. The context is the handle. They can be
+// called from several threads at once
+int ext2_chunked_read(uint64_t start, uint32_t size, void* buffer, void* context);
+int ext2_chunked_write(uint64_t start, uint32_t size, const void* buffer,
+        void* context);
+
+#endif
@@ -1,6 +1,26 @@
 #include "ext2.h"
+#include <stdatomic.h>
+#include <stddef.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 #define CEIL(x, y) ((x)/(y) + (((x) % (y) == 0) ? 0 : 1))
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define BIT_IS_SET(map, bit) (((map)[(bit) / 8] >> ((bit) % 8)) & 1)
+#define SET_BIT(map, bit) ((map)[(bit) / 8] |= (1 << ((bit) % 8)))
+#define CLEAR_BIT(map, bit) ((map)[(bit) / 8] &= ~(1 << ((bit) % 8)))
+
+// device address of a block
+#define BLOCK_ADDR(ext2, block) ((uint64_t)(block) << (ext2)->block_shift)
+
+// rounds a size up to a multiple of 8 bytes
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+// source of zeros for the blocks that must be cleared
+static const uint8_t zero_block[EXT2_MAX_BLOCK_SIZE];
 
 // blk_indirection_info
 //
@@ -16,981 +36,7340 @@ typedef struct {
     // 4th element = index in the 3rd indirect block (if indirection > 2)
 } blk_indirection_info;
 
-ext2_error_t read_superblock(ext2_t* ext2, ext2_superblock_t* superblk) {
-    // superblock starts at 1024th byte
-    return ext2->read(SUPERBLOCK_ADDR, sizeof(ext2_superblock_t), 
-                      superblk, ext2->context);
+#if EXT2_STATS
+// public function that this thread is running, the counters of ext2_stats_t
+// are attributed to it
+static _Thread_local ext2_op_t current_op;
+
+#define STAT_ADD(ext2, field, n) atomic_fetch_add_explicit( \
+        (_Atomic uint64_t*)&(ext2)->stats.ops[current_op].field, (n), \
+        memory_order_relaxed)
+
+// called by helper threads that work for a public function
+#define STAT_JOIN(op) (current_op = (op))
+
+// adds a duration to a latency histogram
+void add_latency(uint64_t* histogram, uint64_t duration) {
+    uint32_t bucket = 0;
+
+    while (bucket < EXT2_LATENCY_BUCKETS - 1 && (duration >> bucket) != 0)
+        bucket++;
+
+    atomic_fetch_add_explicit((_Atomic uint64_t*)&histogram[bucket], 1, 
+            memory_order_relaxed);
 }
 
-ext2_error_t write_superblock(ext2_t* ext2, const ext2_superblock_t* superblk) {
-    // superblock starts at 1024th byte
-    return ext2->write(SUPERBLOCK_ADDR, sizeof(ext2_superblock_t), 
-                      superblk, ext2->context);
+// Called at the start of a public function. Returns the time it started (0
+// if there's no clock)
+uint64_t op_begin(ext2_t* ext2, ext2_op_t op) {
+    current_op = op;
+    STAT_ADD(ext2, calls, 1);
+
+    return ext2->clock ? ext2->clock(ext2->trace_context) : 0;
 }
 
-ext2_error_t get_bgd_address(ext2_t* ext2, uint32_t group, uint32_t* addr) {
-    if (group >= ext2->block_group_count)
-        return EXT2_ERR_BGD_NOT_FOUND;
+// called at the end of a public function, with what goes into the trace
+void op_end(ext2_t* ext2, ext2_op_t op, uint64_t start, uint32_t inode, 
+        uint64_t offset, uint64_t size, ext2_error_t error) {
+    if (!ext2->clock)
+        return;
+
+    ext2_trace_event_t event = {
+        .op = op,
+        .inode = inode,
+        .offset = offset,
+        .size = size,
+        .start = start,
+        .duration = ext2->clock(ext2->trace_context) - start,
+        .error = error,
+    };
+
+    add_latency(ext2->stats.ops[op].latency, event.duration);
+
+    // each call takes its own slot, so threads don't wait for each other
+    if (ext2->trace_size > 0) {
+        uint64_t n = atomic_fetch_add_explicit(
+                (_Atomic uint64_t*)&ext2->trace_head, 1, memory_order_relaxed);
+        ext2->trace[n % ext2->trace_size] = event;
+    }
 
-    // size of a block group descriptor
-    uint32_t size = sizeof(ext2_bgd_t);
+    if (ext2->on_slow && event.duration >= ext2->slow_threshold)
+        ext2->on_slow(&event, ext2->trace_context);
+}
 
-    // first block of the block group descriptor table
-    uint32_t first_block = (ext2->block_size > 1024) ? 1 : 2; 
+uint64_t dev_begin(ext2_t* ext2) {
+    return ext2->clock ? ext2->clock(ext2->trace_context) : 0;
+}
 
-    // address of the block group descriptor
-    *addr = first_block * ext2->block_size + group * size;
+void dev_end(ext2_t* ext2, ext2_dev_op_t dev, uint64_t start) {
+    if (ext2->clock)
+        add_latency(ext2->stats.dev_latency[dev], 
+                ext2->clock(ext2->trace_context) - start);
+}
+#else
+#define STAT_ADD(ext2, field, n) ((void)0)
+#define STAT_JOIN(op) ((void)0)
 
+// without statistics these do nothing, and are optimized away
+uint64_t op_begin(ext2_t* ext2, ext2_op_t op) {
     return 0;
 }
 
-ext2_error_t read_bgd(ext2_t* ext2, uint32_t group, ext2_bgd_t* bgd) {
-    uint32_t addr;
-    ext2_error_t err = get_bgd_address(ext2, group, &addr);
+void op_end(ext2_t* ext2, ext2_op_t op, uint64_t start, uint32_t inode, 
+        uint64_t offset, uint64_t size, ext2_error_t error) {
+}
 
-    if (err)
-        return err;
+uint64_t dev_begin(ext2_t* ext2) {
+    return 0;
+}
 
-    return ext2->read(addr, sizeof(ext2_bgd_t), bgd, ext2->context);
+void dev_end(ext2_t* ext2, ext2_dev_op_t dev, uint64_t start) {
 }
+#endif
 
-ext2_error_t write_bgd(ext2_t* ext2, uint32_t group, const ext2_bgd_t* bgd) {
-    uint32_t addr;
-    ext2_error_t err = get_bgd_address(ext2, group, &addr);
+// Every disk access goes through these. The 64-bit callbacks are preferred,
+// the 32-bit ones can only reach the first 4 GiB of the device
+ext2_error_t dev_read_raw(ext2_t* ext2, uint64_t start, uint32_t size, 
+        void* buffer) {
+    STAT_ADD(ext2, dev_reads, 1);
+    STAT_ADD(ext2, dev_read_bytes, size);
 
-    if (err)
-        return err;
+    if (!ext2->read64 && start + size > (uint64_t)UINT32_MAX + 1)
+        return EXT2_ERR_BIG_ADDRESS;
 
-    return ext2->write(addr, sizeof(ext2_bgd_t), bgd, ext2->context);
-}
+    uint64_t t = dev_begin(ext2);
+    ext2_error_t err = ext2->read64 ? 
+        ext2->read64(start, size, buffer, ext2->context) :
+        ext2->read(start, size, buffer, ext2->context);
+    dev_end(ext2, EXT2_DEV_READ, t);
 
-uint32_t get_inode_group(ext2_t* ext2, uint32_t inode) {
-    uint32_t inodes_per_group = ext2->superblk.inodes_per_group;
-    uint32_t block_group = (inode - 1) / inodes_per_group; 
-    return block_group;
+    return err;
 }
 
-ext2_error_t get_inode_address(ext2_t* ext2, uint32_t inonum, uint32_t* addr) {
-    if (inonum > ext2->superblk.inodes_count) {
-        return EXT2_ERR_INODE_NOT_FOUND;
-    }
+// Caches (see ext2_config_t.arena). The arena is carved once, at mount (or
+// by ext2_cache_init, for a cache shared by several mounts), into the block
+// buffers (first, so they keep the arena's alignment), their slots and hash
+// buckets, the directory entry slots and buckets, and the counters of each
+// volume. Slots are keyed by volume too, and a single clock goes over the 
+// slots of all the volumes. Both caches are write-through, evict with the 
+// clock algorithm and are guarded by a spinlock, held only while slots and
+// buffers are looked at or copied. Device reads of a missing block are made
+// without it, into a slot marked busy, and the block only enters the cache
+// if no write touched its bucket meanwhile
+
+// keys of the block slots that don't hold a block
+#define CACHE_FREE UINT32_MAX
+#define CACHE_BUSY (UINT32_MAX - 1)
+#define CACHE_NONE UINT32_MAX // end of a hash chain
+
+// names up to this long are cached, longer ones are always looked up
+#define CACHE_NAME_LEN 32
 
-    uint32_t inodes_per_group = ext2->superblk.inodes_per_group;
-    uint32_t block_group = get_inode_group(ext2, inonum);
-    uint32_t offset_inside_group = (inonum - 1) % inodes_per_group;
+typedef struct {
+    uint32_t key;    // block number, CACHE_FREE or CACHE_BUSY
+    uint32_t volume;
+    uint32_t next;   // next slot of the hash chain
+    bool ref;        // used since the clock last passed
+} cache_block_t;
 
-    ext2_bgd_t bgd;
-    ext2_error_t bgd_error = read_bgd(ext2, block_group, &bgd);
+typedef struct {
+    uint32_t dir;    // 0 if the slot is free
+    uint32_t volume;
+    uint32_t inode;  // 0 for a name known not to exist (read-only mounts)
+    uint32_t next;
+    bool ref;
+    uint8_t len;
+    uint8_t type;    // file_type of the entry (EXT2_ET_UNKNOWN without filetype)
+    char name[CACHE_NAME_LEN];
+} cache_name_t;
+
+// what a volume holds in the cache (see ext2_memory_stats_t)
+typedef struct {
+    uint32_t blocks;
+    uint32_t names;
+    uint64_t block_hits, block_misses;
+    uint64_t name_hits, name_misses;
+} cache_volume_t;
+
+// smallest power of 2 that is >= n
+uint32_t round_pow2(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
 
-    if (bgd_error)
-        return bgd_error;
+// Lays the pools out from 'base' (assumed aligned to 'align'). With a NULL
+// cache only the size is computed
+uint64_t cache_layout(ext2_cache_t* cache, uint8_t* base, uint32_t block_size,
+        uint32_t blocks, uint32_t names, uint32_t volumes, uint32_t align) {
+    align = MAX(align, 8);
+
+    uint32_t stride = CEIL(block_size, align) * align;
+    uint32_t block_buckets = round_pow2(blocks);
+    uint32_t name_buckets = round_pow2(names);
+    uint64_t off = 0;
+
+    uint64_t data_off = off;
+    off += (uint64_t)blocks * stride;
+    uint64_t slots_off = off;
+    off += ALIGN8((uint64_t)blocks * sizeof(cache_block_t));
+    uint64_t buckets_off = off;
+    off += ALIGN8((uint64_t)block_buckets * sizeof(uint32_t));
+    uint64_t gens_off = off;
+    off += ALIGN8((uint64_t)block_buckets * sizeof(uint32_t));
+    uint64_t names_off = off;
+    off += ALIGN8((uint64_t)names * sizeof(cache_name_t));
+    uint64_t name_buckets_off = off;
+    off += ALIGN8((uint64_t)name_buckets * sizeof(uint32_t));
+    uint64_t volumes_off = off;
+    off += ALIGN8((uint64_t)volumes * sizeof(cache_volume_t));
+
+    if (cache == NULL)
+        return off;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->block_size = block_size;
+    cache->data = base + data_off;
+    cache->stride = stride;
+    cache->block_slots = base + slots_off;
+    cache->block_buckets = (uint32_t*)(base + buckets_off);
+    cache->block_gens = (uint32_t*)(base + gens_off);
+    cache->block_count = blocks;
+    cache->block_mask = block_buckets - 1;
+    cache->name_slots = base + names_off;
+    cache->name_buckets = (uint32_t*)(base + name_buckets_off);
+    cache->name_count = names;
+    cache->name_mask = name_buckets - 1;
+    cache->volumes = base + volumes_off;
+    cache->volume_count = volumes;
+    cache->arena_used = off;
+
+    cache_block_t* slots = cache->block_slots;
+    for (uint32_t i = 0; i < blocks; i++)
+        slots[i] = (cache_block_t){ CACHE_FREE, 0, CACHE_NONE, false };
+
+    memset(cache->name_slots, 0, (uint64_t)names * sizeof(cache_name_t));
+    memset(cache->block_buckets, 0xFF, (uint64_t)block_buckets * sizeof(uint32_t));
+    memset(cache->block_gens, 0, (uint64_t)block_buckets * sizeof(uint32_t));
+    memset(cache->name_buckets, 0xFF, (uint64_t)name_buckets * sizeof(uint32_t));
+    memset(cache->volumes, 0, (uint64_t)volumes * sizeof(cache_volume_t));
+
+    return off;
+}
 
-    uint32_t inode_table_addr = bgd.inode_table * ext2->block_size;
-    uint32_t inode_size = sizeof(ext2_inode_t);
+uint64_t ext2_arena_size(uint32_t block_size, uint32_t cache_blocks, 
+        uint32_t cache_names, uint32_t arena_align) {
+    return cache_layout(NULL, NULL, block_size, cache_blocks, cache_names, 1,
+            arena_align);
+}
 
-    *addr= inode_table_addr + offset_inside_group * inode_size;
+uint64_t ext2_cache_arena_size(const ext2_cache_params_t* params) {
+    return cache_layout(NULL, NULL, params->block_size, params->cache_blocks,
+            params->cache_names, params->volumes, params->arena_align);
+}
 
+// lays the pools out inside an arena, skipping what's needed to align it
+ext2_error_t cache_carve(ext2_cache_t* cache, void* arena, uint64_t arena_size,
+        uint32_t align, uint32_t block_size, uint32_t blocks, uint32_t names, 
+        uint32_t volumes) {
+    align = MAX(align, 8);
+    uint64_t skip = (align - (uintptr_t)arena % align) % align;
+    uint64_t size = cache_layout(NULL, NULL, block_size, blocks, names, 
+            volumes, align);
+
+    if (skip + size > arena_size)
+        return EXT2_ERR_BUFFER_TOO_SMALL;
+
+    cache_layout(cache, (uint8_t*)arena + skip, block_size, blocks, names, 
+            volumes, align);
+    cache->arena_used += skip;
     return 0;
 }
 
-ext2_error_t read_inode(ext2_t* ext2, uint32_t inode_number, ext2_inode_t* inode) {
-    uint32_t inode_addr;
-    ext2_error_t err = get_inode_address(ext2, inode_number, &inode_addr);
-
-    if (err)
-        return err;
+ext2_error_t ext2_cache_init(ext2_cache_t* cache, const ext2_cache_params_t* params) {
+    memset(cache, 0, sizeof(*cache));
 
-    return ext2->read(inode_addr, sizeof(ext2_inode_t), inode, ext2->context);
+    return cache_carve(cache, params->arena, params->arena_size, 
+            params->arena_align, params->block_size, params->cache_blocks, 
+            params->cache_names, params->volumes);
 }
 
-ext2_error_t write_inode(ext2_t* ext2, uint32_t inode_number, const ext2_inode_t* inode) {
-    uint32_t inode_addr;
-    ext2_error_t err = get_inode_address(ext2, inode_number, &inode_addr);
+// drops what a shared cache holds for a volume, before it's mounted again
+void cache_drop_volume(ext2_cache_t* cache, uint32_t volume);
 
-    if (err)
-        return err;
+// carves the arena of the config, once the block size is known, or attaches
+// to the shared cache
+ext2_error_t cache_init(ext2_t* ext2, const ext2_config_t* cfg) {
+    ext2_cache_t* shared = cfg->shared_cache;
 
-    return ext2->write(inode_addr, sizeof(ext2_inode_t), inode, ext2->context);
-}
+    ext2->cache = &ext2->own_cache;
+    ext2->cache_volume = 0;
+    memset(&ext2->own_cache, 0, sizeof(ext2->own_cache));
 
-blk_indirection_info locate_offset(ext2_t* ext2, uint32_t offset) {
-    blk_indirection_info ind_info;
-    uint32_t blk_index = offset / ext2->block_size;
+    if (shared != NULL) {
+        if (cfg->cache_volume >= shared->volume_count)
+            return EXT2_ERR_BUFFER_TOO_SMALL;
+        if (ext2->block_size > shared->block_size)
+            return EXT2_ERR_BIG_BLOCK;
 
-    if (blk_index < 12) {
-        ind_info.indirection = 0;
-        ind_info.indexes[0] = blk_index;
-        return ind_info;
+        cache_drop_volume(shared, cfg->cache_volume);
+        ext2->cache = shared;
+        ext2->cache_volume = cfg->cache_volume;
+        return 0;
     }
 
-    blk_index -= 11;
-
-    uint32_t bpb = ext2->block_size / sizeof(uint32_t);
-    uint32_t i1 = blk_index % bpb;
-    uint32_t i3 = blk_index/(bpb * bpb);
-    uint32_t i2 = blk_index/bpb - i3 * bpb;
+    if (cfg->arena == NULL || (cfg->cache_blocks == 0 && cfg->cache_names == 0))
+        return 0;
 
-    int ind = (i3 > 0) ? 3 : (i2 > 0) ? 2 : 1;
+    return cache_carve(&ext2->own_cache, cfg->arena, cfg->arena_size, 
+            cfg->arena_align, ext2->block_size, cfg->cache_blocks, 
+            cfg->cache_names, 1);
+}
 
-    ind_info.indirection = ind;
-    ind_info.indexes[0] = 11 + ind;
-    ind_info.indexes[1] = (ind == 3) ? i3 - 1 : (ind == 2) ? i2 - 1 : i1 - 1;
-    ind_info.indexes[2] = (ind == 3) ? i2 - 1 : i1 - 1;
-    ind_info.indexes[3] = i1 - 1;
+void spin_lock(uint32_t* lock) {
+    while (atomic_exchange_explicit((_Atomic uint32_t*)lock, 1, 
+                memory_order_acquire))
+        ;
+}
 
-    return ind_info;
+void spin_unlock(uint32_t* lock) {
+    atomic_store_explicit((_Atomic uint32_t*)lock, 0, memory_order_release);
 }
 
-ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint32_t offset, uint32_t* block) {
-    ext2_inode_t inode_struct;
-    ext2_error_t error = read_inode(ext2, inode, &inode_struct);
-    if (error)
-        return error;
+void cache_lock(ext2_cache_t* cache) {
+    spin_lock(&cache->lock);
+}
 
-    blk_indirection_info ind_info = locate_offset(ext2, offset);
+void cache_unlock(ext2_cache_t* cache) {
+    spin_unlock(&cache->lock);
+}
 
-    *block = inode_struct.block[ind_info.indexes[0]];
+uint32_t cache_hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    return x;
+}
 
-    for(int i = 1; i <= ind_info.indirection; i++) {
-        if (*block == 0) // block 0 implies data block is all zeros, so stop here
-            break;
+// hash bucket of a block of a volume
+uint32_t cache_block_bucket(ext2_cache_t* cache, uint32_t volume, 
+        uint32_t block) {
+    return cache_hash(block ^ (volume * 0x9E3779B9)) & cache->block_mask;
+}
 
-        uint32_t addr = *block * ext2->block_size + ind_info.indexes[i] * sizeof(uint32_t);
+// slot holding a block, or CACHE_NONE
+uint32_t cache_find_block(ext2_cache_t* cache, uint32_t volume, uint32_t block) {
+    cache_block_t* slots = cache->block_slots;
+    uint32_t i = cache->block_buckets[cache_block_bucket(cache, volume, block)];
 
-        error = ext2->read(addr, sizeof(uint32_t), block, ext2->context);
-        if (error)
-            return error;
-    }
+    while (i != CACHE_NONE && (slots[i].key != block || slots[i].volume != volume))
+        i = slots[i].next;
 
-    return 0;
+    return i;
 }
 
-ext2_error_t read_data(ext2_t* ext2, uint32_t inode, uint32_t offset, 
-        uint32_t size, void* buffer) {
-    ext2_inode_t inode_struct;
+// takes a slot out of its hash chain
+void cache_unlink_block(ext2_cache_t* cache, uint32_t slot) {
+    cache_block_t* slots = cache->block_slots;
+    uint32_t* link = &cache->block_buckets[cache_block_bucket(cache, 
+            slots[slot].volume, slots[slot].key)];
 
-    ext2_error_t error = read_inode(ext2, inode, &inode_struct);
-    if (error)
-        return error;
+    while (*link != slot)
+        link = &slots[*link].next;
 
-    if (offset + size > inode_struct.size) {
-        // access is outside of file
-        return EXT2_ERR_DATA_OUT_OF_BOUNDS;
-    }
+    *link = slots[slot].next;
+    slots[slot].next = CACHE_NONE;
+}
 
-    while (size > 0) {
-        uint32_t datablock;
+// empties a slot that holds a block
+void cache_free_block(ext2_cache_t* cache, uint32_t slot) {
+    cache_block_t* slots = cache->block_slots;
 
-        error = block_map(ext2, inode, offset, &datablock);
-        if (error)
-            return error;
+    cache_unlink_block(cache, slot);
+    ((cache_volume_t*)cache->volumes)[slots[slot].volume].blocks--;
+    slots[slot].key = CACHE_FREE;
+    cache->blocks_used--;
+}
 
-        uint32_t block_offset = offset % ext2->block_size;
-        uint32_t remaining = ext2->block_size - block_offset;
-        uint32_t bytes_to_read = (remaining < size) ? remaining : size;
+// Frees a slot to hold a new block, and marks it busy. Returns CACHE_NONE if
+// every slot is busy
+uint32_t cache_evict_block(ext2_cache_t* cache) {
+    cache_block_t* slots = cache->block_slots;
 
-        ext2_error_t error;
+    for (uint32_t n = 0; n < 2 * cache->block_count; n++) {
+        uint32_t i = cache->block_hand;
+        cache->block_hand = (i + 1 == cache->block_count) ? 0 : i + 1;
 
-        if (datablock == 0) {
-            memset(buffer, 0, bytes_to_read);
-        } else {
-            error = ext2->read(datablock * ext2->block_size + block_offset,  
-                bytes_to_read, (uint8_t*)buffer, ext2->context);
+        if (slots[i].key == CACHE_BUSY)
+            continue;
+
+        if (slots[i].key != CACHE_FREE && slots[i].ref) {
+            slots[i].ref = false;
+            continue;
         }
 
-        if (error)
-            return error;
+        if (slots[i].key != CACHE_FREE)
+            cache_free_block(cache, i);
 
-        buffer = (uint8_t*)buffer + bytes_to_read;
-        offset += bytes_to_read;
-        size -= bytes_to_read;
+        cache->blocks_used++;
+        cache->blocks_high = MAX(cache->blocks_high, cache->blocks_used);
+        slots[i].key = CACHE_BUSY;
+        return i;
     }
 
-    return 0;
+    return CACHE_NONE;
 }
 
-// extracts the first name before the '/' in a file path. filename should have
-// at least EXT2_MAX_FILE_NAME + 1 bytes. 
-ext2_error_t parse_filename(const char* path, char* filename, uint32_t* chars_read) {
-    int i = 0;
-    char c = *(path++);
-
-    while (c != '\0' && c != '/') {
-        if (i >= EXT2_MAX_FILE_NAME) {
-            return EXT2_ERR_FILENAME_TOO_BIG;
-        }
-
-        filename[i++] = c;
-        c = *(path++);
+// A read inside a single block. On a miss the whole block is read into a 
+// free slot and kept
+ext2_error_t cache_read(ext2_t* ext2, uint64_t start, uint32_t size, 
+        void* buffer) {
+    ext2_cache_t* cache = ext2->cache;
+    uint32_t volume = ext2->cache_volume;
+    uint32_t block = start >> ext2->block_shift;
+    uint32_t off = start & (ext2->block_size - 1);
+    uint32_t bucket = cache_block_bucket(cache, volume, block);
+    cache_block_t* slots = cache->block_slots;
+    cache_volume_t* vol = &((cache_volume_t*)cache->volumes)[volume];
+
+    cache_lock(cache);
+
+    uint32_t i = cache_find_block(cache, volume, block);
+    if (i != CACHE_NONE) {
+        slots[i].ref = true;
+        cache->block_hits++;
+        vol->block_hits++;
+        memcpy(buffer, cache->data + (uint64_t)i * cache->stride + off, size);
+        cache_unlock(cache);
+        return 0;
     }
 
-    filename[i] = '\0';
+    cache->block_misses++;
+    vol->block_misses++;
+    uint32_t gen = cache->block_gens[bucket];
+    i = cache_evict_block(cache);
+    cache_unlock(cache);
+
+    if (i == CACHE_NONE)
+        return dev_read_raw(ext2, start, size, buffer);
+
+    uint8_t* data = cache->data + (uint64_t)i * cache->stride;
+    ext2_error_t err = dev_read_raw(ext2, BLOCK_ADDR(ext2, block), 
+            ext2->block_size, data);
+    if (!err)
+        memcpy(buffer, data + off, size);
+
+    cache_lock(cache);
+
+    // another thread may have cached it, or written to it, meanwhile
+    if (!err && cache->block_gens[bucket] == gen && 
+            cache_find_block(cache, volume, block) == CACHE_NONE) {
+        slots[i].key = block;
+        slots[i].volume = volume;
+        slots[i].ref = true;
+        slots[i].next = cache->block_buckets[bucket];
+        cache->block_buckets[bucket] = i;
+        vol->blocks++;
+    } else {
+        slots[i].key = CACHE_FREE;
+        cache->blocks_used--;
+    }
 
-    *chars_read = i;
-    return 0;
+    cache_unlock(cache);
+    return err;
 }
 
-ext2_error_t read_dir_entry(ext2_t* ext2, uint32_t offset, 
-        uint32_t dir_inode, ext2_directory_entry_t* entry) {
-    ext2_inode_t inode_struct;
-
-    ext2_error_t error = read_inode(ext2, dir_inode, &inode_struct);
-    if (error)
-        return error;
-
-    if (GET_FILE_FMT(inode_struct.mode) != EXT2_FMT_DIR)
-        return EXT2_ERR_NOT_A_DIR;
+// Called after a device write (or copy) to [start, start + size). Cached 
+// blocks get the new data, or are dropped if there's no data or the write 
+// failed
+void cache_written(ext2_t* ext2, uint64_t start, uint32_t size, 
+        const void* buffer) {
+    ext2_cache_t* cache = ext2->cache;
+    uint32_t volume = ext2->cache_volume;
 
-    // total size of the fields of the dir entry struct that precede the name
-    // of the file
-    uint32_t headersz = (uint8_t*)&entry->name - (uint8_t*)entry;
+    if (cache->block_count == 0 || size == 0)
+        return;
 
-    error = read_data(ext2, dir_inode, offset, headersz, entry);
-    if (error)
-        return error;
+    uint32_t first = start >> ext2->block_shift;
+    uint32_t last = (start + size - 1) >> ext2->block_shift;
 
-    error = read_data(ext2, dir_inode, offset + headersz, entry->name_len, 
-            &entry->name);
-    if (error)
-        return error;
+    cache_lock(cache);
 
-    entry->name[entry->name_len] = '\0';
-    return 0;
-}
+    for (uint32_t block = first; block <= last; block++) {
+        cache->block_gens[cache_block_bucket(cache, volume, block)]++;
 
-ext2_error_t locate_inode_in_dir(ext2_t* ext2, uint32_t parent_inode, 
-        const char* name, uint32_t* inode) {
-    ext2_directory_entry_t entry;
-    uint32_t offset = 0;
+        uint32_t i = cache_find_block(cache, volume, block);
+        if (i == CACHE_NONE)
+            continue;
 
-    ext2_inode_t inode_struct;
-    ext2_error_t error = read_inode(ext2, parent_inode, &inode_struct);
+        if (buffer == NULL) {
+            cache_free_block(cache, i);
+            continue;
+        }
 
-    if (error)
-        return error;
+        uint64_t block_start = BLOCK_ADDR(ext2, block);
+        uint64_t from = MAX(start, block_start);
+        uint64_t to = MIN(start + size, block_start + ext2->block_size);
 
-    do {
-        error = read_dir_entry(ext2, offset, parent_inode, &entry);
+        memcpy(cache->data + (uint64_t)i * cache->stride + (from - block_start),
+                (const uint8_t*)buffer + (from - start), to - from);
+    }
 
-        if (error)
-            return error;
+    cache_unlock(cache);
+}
 
-        if (strcmp(entry.name, name) == 0) {
-            *inode = entry.inode;
-            return 0;
-        }
+// slot holding a directory entry, or CACHE_NONE
+uint32_t cache_find_name(ext2_cache_t* cache, uint32_t bucket, uint32_t volume,
+        uint32_t dir, const char* name, uint32_t len) {
+    cache_name_t* slots = cache->name_slots;
+    uint32_t i = cache->name_buckets[bucket];
 
-        offset += entry.rec_len;
-    } while (offset < inode_struct.size);
+    while (i != CACHE_NONE && (slots[i].dir != dir || slots[i].volume != volume ||
+                slots[i].len != len || memcmp(slots[i].name, name, len) != 0))
+        i = slots[i].next;
 
-    return EXT2_ERR_FILE_NOT_FOUND;
+    return i;
 }
 
-// Reserves a block inside a group. Sets 'block' to the first free block inside 
-// group or 0 if group has no free blocks. 
-ext2_error_t get_free_block_in_group(ext2_t* ext2, uint32_t group, 
-        uint32_t* block) {
-    ext2_bgd_t bgd;
-    ext2_error_t error = read_bgd(ext2, group, &bgd);
+uint32_t cache_name_bucket(ext2_cache_t* cache, uint32_t volume, uint32_t dir,
+        const char* name, uint32_t len) {
+    uint32_t h = 2166136261u ^ dir ^ (volume * 0x9E3779B9);
 
-    if (error)
-        return error;
+    for (uint32_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
 
-    const uint32_t bitmap_addr = bgd.block_bitmap * ext2->block_size;
-    const uint32_t blocks_per_group = ext2->superblk.blocks_per_group;
-    const uint32_t inode_table_size = ext2->superblk.inodes_per_group * 
-        sizeof(ext2_inode_t);
-    const uint32_t inode_table_block_count = inode_table_size / ext2->block_size + 
-        ((inode_table_size % ext2->block_size == 0) ? 0 : 1);
-    const uint32_t data_blocks_start = bgd.inode_table + inode_table_block_count;
+    return cache_hash(h) & cache->name_mask;
+}
 
-    *block = 0; // no free block found yet
+// empties a slot that holds a directory entry
+void cache_free_name(ext2_cache_t* cache, uint32_t slot) {
+    cache_name_t* slots = cache->name_slots;
+    uint32_t* link = &cache->name_buckets[cache_name_bucket(cache, 
+            slots[slot].volume, slots[slot].dir, slots[slot].name, 
+            slots[slot].len)];
 
-    if (bgd.free_blocks_count == 0)
-        return 0;
+    while (*link != slot)
+        link = &slots[*link].next;
+    *link = slots[slot].next;
 
-    for (int i = 0; i < blocks_per_group/8; i++) {
-        uint8_t bitmap_byte;
-        error = ext2->read(bitmap_addr + i, 1, &bitmap_byte, ext2->context);
+    ((cache_volume_t*)cache->volumes)[slots[slot].volume].names--;
+    slots[slot].dir = 0;
+    cache->names_used--;
+}
 
-        if (error)
-            return error;
+// Looks up a name of a directory. Returns false if it isn't cached
+bool cache_get_name(ext2_t* ext2, uint32_t dir, const char* name, 
+        uint32_t* inode, uint8_t* type) {
+    ext2_cache_t* cache = ext2->cache;
+    uint32_t volume = ext2->cache_volume;
+    uint32_t len = strlen(name);
+
+    if (cache->name_count == 0 || len > CACHE_NAME_LEN)
+        return false;
+
+    uint32_t bucket = cache_name_bucket(cache, volume, dir, name, len);
+    cache_volume_t* vol = &((cache_volume_t*)cache->volumes)[volume];
+
+    cache_lock(cache);
+    uint32_t i = cache_find_name(cache, bucket, volume, dir, name, len);
+
+    if (i != CACHE_NONE) {
+        cache_name_t* slot = &((cache_name_t*)cache->name_slots)[i];
+        slot->ref = true;
+        *inode = slot->inode;
+        *type = slot->type;
+        cache->name_hits++;
+        vol->name_hits++;
+    } else {
+        cache->name_misses++;
+        vol->name_misses++;
+    }
+
+    cache_unlock(cache);
+    return i != CACHE_NONE;
+}
 
-        bool found_block = false;
-        int shift;
+void cache_put_name(ext2_t* ext2, uint32_t dir, const char* name, 
+        uint32_t inode, uint8_t type) {
+    ext2_cache_t* cache = ext2->cache;
+    cache_name_t* slots = cache->name_slots;
+    uint32_t volume = ext2->cache_volume;
+    uint32_t len = strlen(name);
 
-        for (shift = 0; shift < 8; shift++) {
-            found_block = ((bitmap_byte & (1 << shift)) == 0);
-            if (found_block)
-                break;
-        }
+    if (cache->name_count == 0 || len > CACHE_NAME_LEN)
+        return;
 
-        if (found_block) {
-            *block = i * 8 + shift + data_blocks_start;
+    uint32_t bucket = cache_name_bucket(cache, volume, dir, name, len);
 
-            bitmap_byte |= (1 << shift);
-            ext2->write(bitmap_addr + i, 1, &bitmap_byte, ext2->context);
+    cache_lock(cache);
 
-            bgd.free_blocks_count -= 1;
-            write_bgd(ext2, group, &bgd);
+    if (cache_find_name(cache, bucket, volume, dir, name, len) != CACHE_NONE) {
+        cache_unlock(cache);
+        return;
+    }
 
-            ext2->superblk.free_blocks_count -= 1;
-            write_superblock(ext2, &ext2->superblk);
+    // the clock finds a slot: free, or not used since it last passed
+    uint32_t i;
+    while (true) {
+        i = cache->name_hand;
+        cache->name_hand = (i + 1 == cache->name_count) ? 0 : i + 1;
 
+        if (slots[i].dir == 0 || !slots[i].ref)
             break;
-        }
+        slots[i].ref = false;
     }
 
-    return 0;
-}
+    if (slots[i].dir != 0)
+        cache_free_name(cache, i);
 
-ext2_error_t get_new_block(ext2_t* ext2, uint32_t preferred_group, 
-        uint32_t* block) {
-    int group = preferred_group;
-    do {
-        ext2_error_t err = get_free_block_in_group(ext2, group, block);
+    cache->names_used++;
+    cache->names_high = MAX(cache->names_high, cache->names_used);
+    ((cache_volume_t*)cache->volumes)[volume].names++;
 
-        if (err)
-            return err;
+    slots[i].dir = dir;
+    slots[i].volume = volume;
+    slots[i].inode = inode;
+    slots[i].ref = true;
+    slots[i].len = len;
+    slots[i].type = type;
+    memcpy(slots[i].name, name, len);
+    slots[i].next = cache->name_buckets[bucket];
+    cache->name_buckets[bucket] = i;
 
-        if (*block != 0)
-            return 0;
+    cache_unlock(cache);
+}
 
-        group = (group + 1) % ext2->block_group_count;
-    } while (group != preferred_group);
+// forgets a name of a directory, after it was removed
+void cache_drop_name(ext2_t* ext2, uint32_t dir, const char* name) {
+    ext2_cache_t* cache = ext2->cache;
+    uint32_t volume = ext2->cache_volume;
+    uint32_t len = strlen(name);
 
-    return EXT2_ERR_DISK_FULL;
+    if (cache->name_count == 0 || len > CACHE_NAME_LEN)
+        return;
+
+    uint32_t bucket = cache_name_bucket(cache, volume, dir, name, len);
+
+    cache_lock(cache);
+    uint32_t i = cache_find_name(cache, bucket, volume, dir, name, len);
+    if (i != CACHE_NONE)
+        cache_free_name(cache, i);
+    cache_unlock(cache);
 }
 
-ext2_error_t add_block(ext2_t* ext2, uint32_t inode, uint32_t* block) {
-    ext2_inode_t inode_struct;
-    uint32_t inode_addr;
-    uint32_t group;
-    ext2_error_t err;
+// Forgets every name of a directory that was removed, since its inode number
+// can come back as another directory
+void cache_drop_dir(ext2_t* ext2, uint32_t dir) {
+    ext2_cache_t* cache = ext2->cache;
+    cache_name_t* names = cache->name_slots;
+    uint32_t volume = ext2->cache_volume;
 
-    err = get_inode_address(ext2, inode, &inode_addr);
-    if (err) 
-        return err;
-    err = read_inode(ext2, inode, &inode_struct);
-    group = get_inode_group(ext2, inode);
+    cache_lock(cache);
 
-    uint32_t offset = inode_struct.size + ext2->block_size - 1;
-    blk_indirection_info ind_info = locate_offset(ext2, offset);
+    for (uint32_t i = 0; i < cache->name_count; i++)
+        if (names[i].dir == dir && names[i].volume == volume)
+            cache_free_name(cache, i);
 
-    uint32_t block_ptr;
+    cache_unlock(cache);
+}
 
-    block_ptr = ((uint8_t*)(&inode_struct.block[ind_info.indexes[0]]) - 
-            (uint8_t*)&inode_struct) + inode_addr;
+// Forgets every name of the filesystem, when more directories were removed
+// than are worth dropping one at a time
+void cache_drop_names(ext2_t* ext2) {
+    ext2_cache_t* cache = ext2->cache;
+    cache_name_t* names = cache->name_slots;
+    uint32_t volume = ext2->cache_volume;
 
-    uint32_t next_block;
+    cache_lock(cache);
 
-    for (int i = 1; i <= ind_info.indirection; i++) {
-        bool is_blk_missing = true;
-        for (int j = i; j <= ind_info.indirection; j++)
-            is_blk_missing = is_blk_missing && (ind_info.indexes[j] == 0);
+    for (uint32_t i = 0; i < cache->name_count; i++)
+        if (names[i].dir != 0 && names[i].volume == volume)
+            cache_free_name(cache, i);
 
-        if (is_blk_missing) {
-            err = get_new_block(ext2, group, &next_block);
+    cache_unlock(cache);
+}
 
-            if (err)
-                return err;
+void cache_drop_volume(ext2_cache_t* cache, uint32_t volume) {
+    cache_block_t* blocks = cache->block_slots;
+    cache_name_t* names = cache->name_slots;
 
-            ext2->write(block_ptr, 4, &next_block, ext2->context);
-        } else {
-            ext2->read(block_ptr, 4, &next_block, ext2->context);
-        }
+    cache_lock(cache);
 
-        block_ptr = next_block * ext2->block_size + 
-            ind_info.indexes[i] * sizeof(uint32_t);
-    }
+    for (uint32_t i = 0; i < cache->block_count; i++)
+        if (blocks[i].key < CACHE_BUSY && blocks[i].volume == volume)
+            cache_free_block(cache, i);
 
-    err = get_new_block(ext2, group, block);
+    for (uint32_t i = 0; i < cache->name_count; i++)
+        if (names[i].dir != 0 && names[i].volume == volume)
+            cache_free_name(cache, i);
 
-    if (err)
-        return err;
+    memset(&((cache_volume_t*)cache->volumes)[volume], 0, sizeof(cache_volume_t));
+    cache_unlock(cache);
+}
 
-    ext2->write(block_ptr, 4, block, ext2->context);
-    return 0;
+// reads what the device holds, through the cache
+ext2_error_t dev_read_disk(ext2_t* ext2, uint64_t start, uint32_t size, 
+        void* buffer) {
+    // reads inside a single block go through the cache
+    if (ext2->cache->block_count != 0 && size > 0 && 
+            (start >> ext2->block_shift) == ((start + size - 1) >> ext2->block_shift))
+        return cache_read(ext2, start, size, buffer);
+
+    return dev_read_raw(ext2, start, size, buffer);
 }
 
-ext2_error_t  write_data(ext2_t* ext2, uint32_t inode, uint32_t offset,
-        uint32_t size, const void* buffer) {
-    ext2_error_t error;
-    ext2_inode_t inode_struct;
+ext2_error_t dev_write_raw(ext2_t* ext2, uint64_t start, uint32_t size, 
+        const void* buffer) {
+    // public functions refuse to change a read-only filesystem before 
+    // getting here, this only guards against a missed write path
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
 
-    error = read_inode(ext2, inode, &inode_struct);
+    STAT_ADD(ext2, dev_writes, 1);
+    STAT_ADD(ext2, dev_write_bytes, size);
 
-    if (error)
-        return error;
+    if (!ext2->write64 && start + size > (uint64_t)UINT32_MAX + 1)
+        return EXT2_ERR_BIG_ADDRESS;
 
-    if (offset > inode_struct.size)
-        return EXT2_ERR_DATA_OUT_OF_BOUNDS;
+    uint64_t t = dev_begin(ext2);
+    ext2_error_t err = ext2->write64 ? 
+        ext2->write64(start, size, buffer, ext2->context) :
+        ext2->write(start, size, buffer, ext2->context);
+    dev_end(ext2, EXT2_DEV_WRITE, t);
 
-    uint32_t allocated_size = CEIL(inode_struct.size, ext2->block_size) * 
-                                  ext2->block_size;
+    cache_written(ext2, start, size, err ? NULL : buffer);
+    return err;
+}
 
-    uint32_t sz = size;
-    uint32_t off = offset;
-    while (sz > 0) {
-        uint32_t datablock;
+// Transactions (see ext2_txn_begin). While one is open, writes inside a 
+// single block are staged in the transaction buffer, bigger writes update 
+// the staged blocks they touch and go to the device, and reads see the 
+// staged blocks. The buffer holds, in order: room for the log header and
+// block list, the staged blocks, and their keys, hash chains and buckets.
+// Commits sort the staged blocks by address, so the header, the list and 
+// the blocks go to the log in one write, and every run of consecutive 
+// blocks goes home in one write. The spinlock is held while slots are 
+// looked at or copied, but never during device calls. Commits mark the set
+// as flushing and write it without the lock: reads still see it, while 
+// writes wait for the commit to end. Device reads of blocks that are about
+// to be staged are retried if a commit or a direct write happened meanwhile
+
+#define TXN_LOG_MAGIC 0x4C573254 // "T2WL"
+
+// start of the log, followed by the block list, the blocks and nothing else
+typedef struct {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t count; // blocks in the log
+    uint32_t crc;   // crc32c of the block list and the blocks
+} txn_log_header_t;
+
+// blocks taken by the log header and a list of 'count' blocks
+uint32_t txn_head_blocks(uint32_t block_size, uint32_t count) {
+    return CEIL(sizeof(txn_log_header_t) + (uint64_t)count * sizeof(uint32_t),
+            block_size);
+}
 
-        if (off >= allocated_size) {
-            error = add_block(ext2, inode, &datablock);
-        } else {
-            error = block_map(ext2, inode, off, &datablock);  
-        }
+// Lays a transaction out from 'base'. With a NULL txn only the size is 
+// computed
+uint64_t txn_layout(ext2_txn_t* txn, uint8_t* base, uint32_t block_size,
+        uint32_t capacity) {
+    uint32_t buckets = round_pow2(capacity);
+    uint64_t off = (uint64_t)txn_head_blocks(block_size, capacity) * block_size;
+
+    uint64_t data_off = off;
+    off += (uint64_t)capacity * block_size;
+    uint64_t keys_off = off;
+    off += ALIGN8((uint64_t)capacity * sizeof(uint32_t));
+    uint64_t next_off = off;
+    off += ALIGN8((uint64_t)capacity * sizeof(uint32_t));
+    uint64_t buckets_off = off;
+    off += ALIGN8((uint64_t)buckets * sizeof(uint32_t));
+
+    if (txn == NULL)
+        return off;
+
+    txn->data = base + data_off;
+    txn->keys = (uint32_t*)(base + keys_off);
+    txn->next = (uint32_t*)(base + next_off);
+    txn->buckets = (uint32_t*)(base + buckets_off);
+    txn->mask = buckets - 1;
+    txn->capacity = capacity;
+    txn->count = 0;
+    memset(txn->buckets, 0xFF, (uint64_t)buckets * sizeof(uint32_t));
+
+    return off;
+}
 
-        if (error)
-            return error;
+uint64_t ext2_txn_buffer_size(uint32_t block_size, uint32_t blocks) {
+    return txn_layout(NULL, NULL, block_size, blocks);
+}
 
-        uint32_t block_offset = off % ext2->block_size;
-        uint32_t remaining = ext2->block_size - block_offset;
-        uint32_t bytes_to_write = (remaining < sz) ? remaining : sz;
+// slot holding a block, or CACHE_NONE
+uint32_t txn_find(ext2_txn_t* txn, uint32_t block) {
+    uint32_t i = txn->buckets[cache_hash(block) & txn->mask];
 
-        // TODO: write 0 to inode block number if block is all zeros
-        error = ext2->write(datablock * ext2->block_size + block_offset,
-            bytes_to_write, buffer, ext2->context);
+    while (i != CACHE_NONE && txn->keys[i] != block)
+        i = txn->next[i];
 
-        if (error)
-            return error;
+    return i;
+}
 
-        buffer = (uint8_t*)buffer + bytes_to_write;
-        off += bytes_to_write;
-        sz -= bytes_to_write;
+// Copies between 'buffer' and the staged blocks inside [start, start + size),
+// into the buffer if 'to_buffer', into the blocks otherwise. Lock held
+void txn_copy(ext2_t* ext2, uint64_t start, uint32_t size, uint8_t* buffer, 
+        bool to_buffer) {
+    ext2_txn_t* txn = &ext2->txn;
+    uint32_t first = start >> ext2->block_shift;
+    uint32_t last = (start + size - 1) >> ext2->block_shift;
+
+    // looks the blocks up, or goes over the slots if there are fewer
+    bool by_block = last - first < txn->count;
+    uint32_t n = by_block ? last - first + 1 : txn->count;
+
+    for (uint32_t k = 0; k < n; k++) {
+        uint32_t i = by_block ? txn_find(txn, first + k) : k;
+        if (i == CACHE_NONE || txn->keys[i] < first || txn->keys[i] > last)
+            continue;
+
+        uint64_t block_start = BLOCK_ADDR(ext2, txn->keys[i]);
+        uint64_t from = MAX(start, block_start);
+        uint64_t to = MIN(start + size, block_start + ext2->block_size);
+        uint8_t* data = txn->data + ((uint64_t)i << ext2->block_shift) + 
+            (from - block_start);
+
+        if (to_buffer)
+            memcpy(buffer + (from - start), data, to - from);
+        else
+            memcpy(data, buffer + (from - start), to - from);
     }
+}
 
-    // re-read inode because it might have changed
-    error = read_inode(ext2, inode, &inode_struct);
-    inode_struct.size = MAX(inode_struct.size, offset + size);
-    write_inode(ext2, inode, &inode_struct);
+// Whether a transaction is open, read without the lock. It only says if the
+// lock is worth taking: the flag is checked again under it, since a commit 
+// might close the transaction meanwhile
+bool txn_is_open(ext2_txn_t* txn) {
+    return atomic_load_explicit((_Atomic bool*)&txn->open, 
+            memory_order_acquire);
+}
 
-    return 0;
+void txn_set_open(ext2_txn_t* txn, bool open) {
+    atomic_store_explicit((_Atomic bool*)&txn->open, open, 
+            memory_order_release);
 }
 
-ext2_error_t locate_inode(ext2_t* ext2, const char* path, uint32_t* inode) {
-    uint32_t ino = EXT2_ROOT_INODE;
-    char current_name[EXT2_MAX_FILE_NAME + 1];
+bool txn_overlaps(ext2_t* ext2, uint64_t start, uint32_t size) {
+    ext2_txn_t* txn = &ext2->txn;
+    uint32_t first = start >> ext2->block_shift;
+    uint32_t last = (start + size - 1) >> ext2->block_shift;
+    bool found = false;
 
-    uint32_t chars_read;
-    ext2_error_t error;
+    spin_lock(&txn->lock);
+    for (uint32_t i = 0; txn->open && i < txn->count && !found; i++)
+        found = txn->keys[i] >= first && txn->keys[i] <= last;
+    spin_unlock(&txn->lock);
 
-    if (path[0] != '/') {
-        return EXT2_ERR_BAD_PATH;
-    } else if (path[1] != '\0') {
-        while (*path == '/') {
-            path++;
+    return found;
+}
 
-            error = parse_filename(path, current_name, &chars_read);
+// Sorts the staged blocks by block number, moving them inside the buffer.
+// The hash chains are used for the order and then built again, so the 
+// blocks can still be looked up while a commit writes them
+void txn_sort(ext2_t* ext2) {
+    ext2_txn_t* txn = &ext2->txn;
+    uint32_t* keys = txn->keys;
+    uint32_t* order = txn->next;
+    uint32_t n = txn->count;
+    uint32_t bs = ext2->block_size;
+
+    for (uint32_t i = 0; i < n; i++)
+        order[i] = i;
+
+    // shell sort of the slots by their block
+    for (uint32_t gap = n / 2; gap > 0; gap /= 2) {
+        for (uint32_t i = gap; i < n; i++) {
+            uint32_t slot = order[i];
+            uint32_t j = i;
+            for (; j >= gap && keys[order[j - gap]] > keys[slot]; j -= gap)
+                order[j] = order[j - gap];
+            order[j] = slot;
+        }
+    }
 
-            if (error)
-                return error;
+    // slot i takes the block of slot order[i]. Each cycle of the permutation
+    // is followed with one block kept aside
+    uint8_t aside[EXT2_MAX_BLOCK_SIZE];
 
-            error = locate_inode_in_dir(ext2, ino, current_name, &ino);
+    for (uint32_t i = 0; i < n; i++) {
+        if (order[i] == i)
+            continue;
 
-            if (error)
-                return error;
+        uint32_t key = keys[i];
+        memcpy(aside, txn->data + (uint64_t)i * bs, bs);
 
-            path += chars_read;
+        uint32_t j = i;
+        while (order[j] != i) {
+            uint32_t k = order[j];
+            memcpy(txn->data + (uint64_t)j * bs, txn->data + (uint64_t)k * bs, bs);
+            keys[j] = keys[k];
+            order[j] = j;
+            j = k;
         }
+
+        memcpy(txn->data + (uint64_t)j * bs, aside, bs);
+        keys[j] = key;
+        order[j] = j;
     }
 
-    *inode = ino;
+    // the hash chains were used for the order
+    memset(txn->buckets, 0xFF, (uint64_t)(txn->mask + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t bucket = cache_hash(keys[i]) & txn->mask;
+        txn->next[i] = txn->buckets[bucket];
+        txn->buckets[bucket] = i;
+    }
+}
 
-    return 0;
+// Waits for a commit that's writing the staged blocks. Lock held, but 
+// released while waiting
+void txn_wait(ext2_txn_t* txn) {
+    while (txn->flushing) {
+        spin_unlock(&txn->lock);
+        while (atomic_load_explicit((_Atomic bool*)&txn->flushing, 
+                    memory_order_relaxed))
+            ;
+        spin_lock(&txn->lock);
+    }
 }
 
-ext2_error_t locate_parent_inode(ext2_t* ext2, const char* path, uint32_t* parent) {
-    uint32_t ino = EXT2_ROOT_INODE;
-    uint32_t previous_ino = ino;
-    char current_name[EXT2_MAX_FILE_NAME + 1];
+// Writes the staged blocks (through the log, if there's one) and empties 
+// the transaction. Lock held, with no other commit running. It's released
+// during the device writes, while the set is marked as flushing
+ext2_error_t txn_flush(ext2_t* ext2) {
+    ext2_txn_t* txn = &ext2->txn;
+    uint32_t n = txn->count;
+    uint32_t bs = ext2->block_size;
+    ext2_error_t err = 0;
 
-    uint32_t chars_read;
-    ext2_error_t error;
+    if (n == 0)
+        return 0;
 
-    if (path[0] != '/') {
-        return EXT2_ERR_BAD_PATH;
-    } else if (path[1] != '\0') {
-        while (*path == '/') {
-            path++;
+    txn_sort(ext2);
+    atomic_store_explicit((_Atomic bool*)&txn->flushing, true, 
+            memory_order_relaxed);
+    spin_unlock(&txn->lock);
 
-            error = parse_filename(path, current_name, &chars_read);
+    if (ext2->log_size > 0) {
+        // the header and list go right before the blocks
+        uint32_t head = txn_head_blocks(bs, n);
+        uint8_t* log = txn->data - (uint64_t)head * bs;
+        uint32_t list_size = n * sizeof(uint32_t);
+        txn_log_header_t* header = (txn_log_header_t*)log;
 
-            if (error)
-                return error;
+        memcpy(log + sizeof(*header), txn->keys, list_size);
+        memset(log + sizeof(*header) + list_size, 0, 
+                (uint64_t)head * bs - sizeof(*header) - list_size);
 
-            path += chars_read;
+        uint32_t crc = ext2_crc32c(0, log + sizeof(*header), list_size);
+        for (uint32_t i = 0; i < n; i++)
+            crc = ext2_crc32c(crc, txn->data + (uint64_t)i * bs, bs);
 
-            previous_ino = ino;
+        *header = (txn_log_header_t){ TXN_LOG_MAGIC, bs, n, crc };
+        err = dev_write_raw(ext2, ext2->log_start, (head + n) * bs, log);
+    }
 
-            if (*path == '\0')
-                break;
+    for (uint32_t i = 0; i < n && !err; ) {
+        uint32_t j = i + 1;
+        while (j < n && txn->keys[j] == txn->keys[j - 1] + 1)
+            j++;
 
-            error = locate_inode_in_dir(ext2, ino, current_name, &ino);
+        err = dev_write_raw(ext2, BLOCK_ADDR(ext2, txn->keys[i]), (j - i) * bs,
+                txn->data + (uint64_t)i * bs);
+        i = j;
+    }
 
-            if (error)
-                return error;
+    // the blocks are home, the log must not be replayed over later writes
+    if (!err && ext2->log_size > 0)
+        err = dev_write_raw(ext2, ext2->log_start, sizeof(txn_log_header_t), 
+                zero_block);
 
-        }
-    }
+    spin_lock(&txn->lock);
+    txn->count = 0;
+    txn->gen++;
+    atomic_store_explicit((_Atomic bool*)&txn->flushing, false, 
+            memory_order_relaxed);
+    memset(txn->buckets, 0xFF, (uint64_t)(txn->mask + 1) * sizeof(uint32_t));
 
-    *parent = previous_ino;
-    return 0;
+    return err;
 }
 
-ext2_error_t get_free_inode_in_group(ext2_t* ext2, uint32_t group, uint32_t* inode) {
-    ext2_bgd_t bgd;
-    ext2_error_t error = read_bgd(ext2, group, &bgd);
+// stages a write inside a single block
+ext2_error_t txn_write(ext2_t* ext2, uint64_t start, uint32_t size, 
+        const void* buffer) {
+    ext2_txn_t* txn = &ext2->txn;
+    uint32_t block = start >> ext2->block_shift;
+    uint32_t off = start & (ext2->block_size - 1);
+    uint8_t base[EXT2_MAX_BLOCK_SIZE];
+    bool whole = (size == ext2->block_size);
+    bool have_base = whole;
+    uint32_t gen = 0;
+
+    // a block written in part is first read, unless it's already staged
+    while (true) {
+        spin_lock(&txn->lock);
+        txn_wait(txn);
+
+        // committed while the lock was awaited, the write goes to the device
+        if (!txn->open) {
+            spin_unlock(&txn->lock);
+            return dev_write_raw(ext2, start, size, buffer);
+        }
 
-    if (error)
-        return error;
+        uint32_t i = txn_find(txn, block);
+        if (i != CACHE_NONE) {
+            memcpy(txn->data + ((uint64_t)i << ext2->block_shift) + off, 
+                    buffer, size);
+            spin_unlock(&txn->lock);
+            return 0;
+        }
 
-    uint32_t bitmap_addr = bgd.inode_bitmap * ext2->block_size;
-    uint32_t first_inode = group * ext2->superblk.inodes_per_group + 1;
-    *inode = 0; // no free inode found yet
+        // the base is stale if a direct write was running when it was read
+        if (have_base && (whole || (txn->gen == gen && txn->writing == 0)))
+            break;
 
-    if (bgd.free_inodes_count == 0)
-        return 0;
+        gen = txn->gen;
+        spin_unlock(&txn->lock);
 
-    for (int i = 0; i < ext2->superblk.inodes_per_group/8; i++) {
-        uint8_t bitmap_byte;
-        error = ext2->read(bitmap_addr + i, 1, &bitmap_byte, ext2->context);
+        ext2_error_t err = dev_read_disk(ext2, BLOCK_ADDR(ext2, block), 
+                ext2->block_size, base);
+        if (err)
+            return err;
+        have_base = true;
+    }
 
-        if (error)
-            return error;
+    // a full transaction is committed early. The block isn't staged, so the
+    // commit doesn't change it, and other writes wait until it's done
+    if (txn->count == txn->capacity) {
+        ext2_error_t err = txn_flush(ext2);
+        if (err) {
+            spin_unlock(&txn->lock);
+            return err;
+        }
+    }
 
-        bool found_inode = false;
-        int shift;
+    uint32_t i = txn->count++;
+    uint32_t bucket = cache_hash(block) & txn->mask;
+    uint8_t* data = txn->data + ((uint64_t)i << ext2->block_shift);
 
-        for (shift = 0; shift < 8; shift++) {
-            found_inode = ((bitmap_byte & (1 << shift)) == 0);
-            if (found_inode)
-                break;
-        }
+    if (!whole)
+        memcpy(data, base, ext2->block_size);
+    memcpy(data + off, buffer, size);
 
-        if (found_inode) {
-            *inode = i * 8 + shift + first_inode;
+    txn->keys[i] = block;
+    txn->next[i] = txn->buckets[bucket];
+    txn->buckets[bucket] = i;
 
-            bitmap_byte |= (1 << shift);
-            ext2->write(bitmap_addr + i, 1, &bitmap_byte, ext2->context);
+    spin_unlock(&txn->lock);
+    return 0;
+}
 
-            bgd.free_inodes_count -= 1;
-            write_bgd(ext2, group, &bgd);
+ext2_error_t dev_read(ext2_t* ext2, uint64_t start, uint32_t size, void* buffer) {
+    ext2_txn_t* txn = &ext2->txn;
 
-            ext2->superblk.free_inodes_count -= 1;
-            write_superblock(ext2, &ext2->superblk);
+    if (!txn_is_open(txn) || size == 0)
+        return dev_read_disk(ext2, start, size, buffer);
 
-            break;
-        }
-    }
+    // staged blocks are newer than what the device holds
+    while (true) {
+        spin_lock(&txn->lock);
+        uint32_t gen = txn->gen;
 
-    return 0;
-}
+        // the buffer belongs to the caller again after a commit
+        if (!txn->open) {
+            spin_unlock(&txn->lock);
+            return dev_read_disk(ext2, start, size, buffer);
+        }
 
-ext2_error_t get_free_inode(ext2_t* ext2, uint32_t preferred_group, 
-        uint32_t* inode) {
-    int group = preferred_group;
+        if ((start >> ext2->block_shift) == ((start + size - 1) >> ext2->block_shift)) {
+            uint32_t i = txn_find(txn, start >> ext2->block_shift);
+            if (i != CACHE_NONE) {
+                memcpy(buffer, txn->data + ((uint64_t)i << ext2->block_shift) + 
+                        (start & (ext2->block_size - 1)), size);
+                spin_unlock(&txn->lock);
+                return 0;
+            }
+        }
 
-    do {
-        ext2_error_t err = get_free_inode_in_group(ext2, group, inode);
+        spin_unlock(&txn->lock);
 
+        ext2_error_t err = dev_read_disk(ext2, start, size, buffer);
         if (err)
             return err;
 
-        if (*inode != 0)
+        // a commit that ended meanwhile changed the generation, unless it
+        // had nothing staged
+        spin_lock(&txn->lock);
+        bool same = (txn->gen == gen);
+        if (same && txn->open)
+            txn_copy(ext2, start, size, buffer, true);
+        spin_unlock(&txn->lock);
+
+        if (same)
             return 0;
+    }
+}
 
-        group = (group + 1) % ext2->block_group_count;
-    } while (group != preferred_group);
+ext2_error_t dev_write(ext2_t* ext2, uint64_t start, uint32_t size, 
+        const void* buffer) {
+    ext2_txn_t* txn = &ext2->txn;
 
-    return EXT2_ERR_INODES_DEPLETED;
-}
+    if (txn_is_open(txn) && size > 0) {
+        if ((start >> ext2->block_shift) == ((start + size - 1) >> ext2->block_shift))
+            return txn_write(ext2, start, size, buffer);
 
-ext2_error_t create_dir_entry(ext2_t* ext2, uint32_t inode, const char* name,
-        ext2_directory_entry_t* entry) {
-    uint32_t namelen = strlen(name);
-    if (namelen > EXT2_MAX_FILE_NAME)
-        return EXT2_ERR_FILENAME_TOO_BIG;
+        spin_lock(&txn->lock);
+        txn_wait(txn);
+        if (!txn->open) {
+            spin_unlock(&txn->lock);
+            return dev_write_raw(ext2, start, size, buffer);
+        }
 
-    entry->inode = inode;
-    entry->name_len = namelen;
-    entry->file_type = 0;
-    strcpy(entry->name, name);
+        txn_copy(ext2, start, size, (uint8_t*)buffer, false);
+        txn->writing++;
+        spin_unlock(&txn->lock);
 
-    return 0;
-}
+        ext2_error_t err = dev_write_raw(ext2, start, size, buffer);
 
-ext2_error_t get_last_dir_entry_offset(ext2_t* ext2, uint32_t dir_inode, 
-        uint32_t* offset) {
+        // reads that overlapped it are made again
+        spin_lock(&txn->lock);
+        txn->writing--;
+        txn->gen++;
+        spin_unlock(&txn->lock);
 
-    ext2_inode_t inode_struct;
-    ext2_error_t err = read_inode(ext2, dir_inode, &inode_struct);
-    if (err)
         return err;
+    }
 
-    // obtain the last directory entry
-    ext2_directory_entry_t last_entry;
-    uint32_t off, last_entry_off = -1;
+    return dev_write_raw(ext2, start, size, buffer);
+}
 
-    for (off = 0; off < inode_struct.size; off += last_entry.rec_len) {
-        err = read_dir_entry(ext2, off, dir_inode, &last_entry);
-        if (err)
-            return err;
-        last_entry_off = off;
+ext2_error_t dev_copy(ext2_t* ext2, uint64_t dst, uint64_t src, uint32_t size) {
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    // the device doesn't know about staged blocks, so copies that touch them
+    // go through memory
+    if (txn_is_open(&ext2->txn) && size > 0 && (txn_overlaps(ext2, src, size) || 
+                txn_overlaps(ext2, dst, size))) {
+        uint8_t buf[EXT2_COPY_BUFFER_SIZE];
+
+        for (uint32_t done = 0; done < size; ) {
+            uint32_t chunk = MIN(size - done, sizeof(buf));
+            ext2_error_t err = dev_read(ext2, src + done, chunk, buf);
+            if (!err)
+                err = dev_write(ext2, dst + done, chunk, buf);
+            if (err)
+                return err;
+            done += chunk;
+        }
+
+        return 0;
     }
 
-    *offset = last_entry_off;
-    return 0;
-}
+    uint64_t t = dev_begin(ext2);
+    ext2_error_t err = ext2->copy(dst, src, size, ext2->context);
+    dev_end(ext2, EXT2_DEV_COPY, t);
 
-uint32_t get_dir_entry_size(const ext2_directory_entry_t* entry) {
-    uint32_t headersz = ((uint8_t*)&entry->name - (uint8_t*)entry);
-    return headersz + entry->name_len;
+    cache_written(ext2, dst, size, NULL);
+    return err;
 }
 
-ext2_error_t add_dir_entry(ext2_t* ext2, uint32_t dir_inode, 
-        ext2_directory_entry_t* entry) {
+// Locks are only taken if the user gave lock callbacks. When several are held
+// at once, they're taken in this order: inodes (lowest number first), then a
+// single group, then the shared lock
+void take_lock(ext2_t* ext2, ext2_lock_kind_t kind, uint32_t id, bool exclusive) {
+    if (ext2->lock)
+        ext2->lock(kind, id, exclusive, ext2->lock_context);
+}
 
-    ext2_inode_t inode_struct;
-    ext2_error_t err = read_inode(ext2, dir_inode, &inode_struct);
-    if (err)
-        return err;
+void release_lock(ext2_t* ext2, ext2_lock_kind_t kind, uint32_t id, 
+        bool exclusive) {
+    if (ext2->unlock)
+        ext2->unlock(kind, id, exclusive, ext2->lock_context);
+}
 
-    // get last entry in the directory
-    uint32_t last_entry_offset;
-    ext2_directory_entry_t last_entry;
-    err = get_last_dir_entry_offset(ext2, dir_inode, &last_entry_offset);
-    if (err)
-        return err;
+ext2_error_t read_superblock(ext2_t* ext2, ext2_superblock_t* superblk) {
+    // superblock starts at 1024th byte
+    return dev_read(ext2, SUPERBLOCK_ADDR, sizeof(ext2_superblock_t), superblk);
+}
 
-    bool is_first_entry = (last_entry_offset == -1);
+ext2_error_t write_superblock(ext2_t* ext2, const ext2_superblock_t* superblk) {
+    STAT_ADD(ext2, sb_writes, 1);
 
-    uint32_t new_entry_offset;
+    // superblock starts at 1024th byte
+    return dev_write(ext2, SUPERBLOCK_ADDR, sizeof(ext2_superblock_t), superblk);
+}
 
-    if (is_first_entry) {
-        new_entry_offset = 0;
-    } else {
-        err = read_dir_entry(ext2, last_entry_offset, dir_inode, &last_entry);
-        if (err)
-            return err;
+// adds to the free block and inode counters of the superblock
+ext2_error_t update_free_counts(ext2_t* ext2, int32_t blocks, int32_t inodes) {
+    take_lock(ext2, EXT2_LOCK_SHARED, 0, true);
 
-        new_entry_offset = last_entry_offset + get_dir_entry_size(&last_entry);
-    }
+    ext2->superblk.free_blocks_count += blocks;
+    ext2->superblk.free_inodes_count += inodes;
+    ext2_error_t err = write_superblock(ext2, &ext2->superblk);
 
-    // align address
-    new_entry_offset = CEIL(new_entry_offset, 4) * 4; // 4-byte aligned
+    release_lock(ext2, EXT2_LOCK_SHARED, 0, true);
+    return err;
+}
 
-    // make sure new entry won't span two blocks
-    uint32_t starting_block = new_entry_offset / ext2->block_size;
-    uint32_t entry_size = get_dir_entry_size(entry);
-    uint32_t ending_block = (new_entry_offset + entry_size) / ext2->block_size;
-    if (starting_block < ending_block)
-        // push everything to the next block
-        new_entry_offset = ending_block * ext2->block_size;
+ext2_error_t get_bgd_address(ext2_t* ext2, uint32_t group, uint64_t* addr) {
+    if (group >= ext2->block_group_count)
+        return EXT2_ERR_BGD_NOT_FOUND;
 
-    // add padding if needed
-    if (!is_first_entry) {
-        int off = last_entry_offset + get_dir_entry_size(&last_entry);
-        char pad = '0';
-        while (off < new_entry_offset) {
-            write_data(ext2, dir_inode, off, 1, &pad);
-            off++;
-        }
-    }
+    // size of a block group descriptor
+    uint32_t size = sizeof(ext2_bgd_t);
 
-    // write next entry
-    entry->rec_len = (ending_block + 1) * ext2->block_size - new_entry_offset;
-    write_data(ext2, dir_inode, new_entry_offset, get_dir_entry_size(entry), 
-            entry);
+    // first block of the block group descriptor table
+    uint32_t first_block = (ext2->block_size > 1024) ? 1 : 2; 
 
-    if (!is_first_entry) {
-        // update previous last entry
-        last_entry.rec_len = new_entry_offset - last_entry_offset;
-        err = write_data(ext2, dir_inode, last_entry_offset, 
-                get_dir_entry_size(&last_entry), &last_entry);
-        if (err)
-            return err;
-    }
+    // address of the block group descriptor
+    *addr = BLOCK_ADDR(ext2, first_block) + group * size;
 
     return 0;
 }
 
-ext2_error_t link(ext2_t* ext2, uint32_t dir_inode, uint32_t inode, 
-        const char* name) {
-
-    ext2_directory_entry_t entry;
-    ext2_error_t err = create_dir_entry(ext2, inode, name, &entry);
-    if (err)
-        return err;
-
-    err = add_dir_entry(ext2, dir_inode, &entry);
-    if (err)
-        return err;
+ext2_error_t read_bgd(ext2_t* ext2, uint32_t group, ext2_bgd_t* bgd) {
+    uint64_t addr;
+    ext2_error_t err = get_bgd_address(ext2, group, &addr);
 
-    ext2_inode_t inode_struct;
-    err = read_inode(ext2, inode, &inode_struct);
-    if (err)
-        return err;
-    inode_struct.links_count += 1;
-    err = write_inode(ext2, inode, &inode_struct);
     if (err)
         return err;
 
-    return 0;
+    return dev_read(ext2, addr, sizeof(ext2_bgd_t), bgd);
 }
 
-// extracts the filename from a full path
-ext2_error_t get_file_name(const char* path, char* name) {
-    const char* lastsep = path;
-    while (*path != '\0') {
-        if (*path == '/')
-            lastsep = path + 1;
-        path++;
-    }
-    
-    if (strlen(lastsep) > EXT2_MAX_FILE_NAME)
-        return EXT2_ERR_FILENAME_TOO_BIG;
+// crc16 (polynomial 0x8005, bit-reversed) used by the descriptor checksums
+uint16_t crc16(uint16_t crc, const void* buf, uint32_t size) {
+    const uint8_t* p = buf;
 
-    strcpy(name, lastsep);
+    for (uint32_t i = 0; i < size; i++) {
+        crc ^= p[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
 
-    return 0;
+    return crc;
 }
 
-// creates a new inode and links the path to it. Stores the new inode number in
-// the 'ino' pointer
-ext2_error_t create_and_link_inode(ext2_t* ext2, const char* path, uint32_t* ino) {
-    // locate parent dir inode
-    uint32_t dir_inode;
-    ext2_error_t err = locate_parent_inode(ext2, path, &dir_inode);
-    if (err)
-        return err;
+// CRC32C (polynomial 0x1EDC6F41, bit-reversed) of ext2_crc32c and ext2_scrub.
+// Without a crc32 instruction it goes 8 bytes at a time through 8 tables
+#define CRC32C_POLY 0x82F63B78
 
-    // allocate a new inode for the file
-    uint32_t inode;
-    err = get_free_inode(ext2, get_inode_group(ext2, dir_inode), &inode);
-    if (err)
-        return err;
+uint32_t crc32c_table[8][256];
+uint32_t crc32c_x2n[32];     // x^(2^n) modulo the polynomial
+atomic_bool crc32c_ready;
 
-    // link inode to the desired file
-    char filename[EXT2_MAX_FILE_NAME + 1];
-    err = get_file_name(path, filename);
-    if (err)
-        return err;
-    err = link(ext2, dir_inode, inode, filename);
-    if (err)
-        return err;
+// a * b modulo the polynomial, both bit-reversed
+uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
 
-    *ino = inode;
-    return 0;
-}
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
 
-void set_inode_file_fmt(ext2_inode_t* inode_struct, ext2_file_format_t fmt) {
-    inode_struct->mode &= 0x0FFF;
-    inode_struct->mode |= fmt;
+    return p;
 }
 
-ext2_error_t ext2_mount(ext2_t* ext2, ext2_config_t* cfg) {
-    ext2_superblock_t superblk;
-
-    ext2->read = cfg->read;
-    ext2->write = cfg->write;
-    ext2->context = cfg->context;
-
-    int superblk_error = read_superblock(ext2, &superblk);
+// Fills the tables. Threads that get here at the same time write the same 
+// values, so there's no need for a lock
+void crc32c_init(void) {
+    if (atomic_load_explicit(&crc32c_ready, memory_order_acquire))
+        return;
+
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
 
-    if (superblk_error)
-        return superblk_error;
-    
-    ext2->superblk = superblk;
-    ext2->block_size = 1024 << superblk.log_block_size;
-    ext2->block_group_count = superblk.inodes_count / superblk.inodes_per_group;
+    for (uint32_t n = 0; n < 256; n++)
+        for (int k = 1; k < 8; k++)
+            crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8) ^ 
+                crc32c_table[0][crc32c_table[k - 1][n] & 0xFF];
 
-    // if the block size is huge (> 2 GiB), block_size will overflow
-    if (ext2->block_size == 0) {
-        return EXT2_ERR_BIG_BLOCK;
-    }
+    uint32_t p = (uint32_t)1 << 30; // x^1
+    crc32c_x2n[0] = p;
+    for (int n = 1; n < 32; n++)
+        crc32c_x2n[n] = p = crc32c_multmodp(p, p);
 
-    return 0; 
+    atomic_store_explicit(&crc32c_ready, true, memory_order_release);
 }
 
-ext2_error_t ext2_file_open(ext2_t* ext2, const char* path, ext2_file_t* file) {
-    uint32_t inode;
-    ext2_error_t error;
-    ext2_inode_t inode_struct;
+// x^(8 * len) modulo the polynomial: what a crc is multiplied by when 'len'
+// bytes are added after it
+uint32_t crc32c_shift(uint64_t len) {
+    uint32_t p = (uint32_t)1 << 31; // x^0
+    int k = 3;
 
-    error = locate_inode(ext2, path, &inode);
+    for (; len; len >>= 1, k++)
+        if (len & 1)
+            p = crc32c_multmodp(crc32c_x2n[k & 31], p);
 
-    if (error == EXT2_ERR_FILE_NOT_FOUND) {
-        error = create_and_link_inode(ext2, path, &inode);
-        if (error)
-            return error;
+    return p;
+}
 
-        error = read_inode(ext2, inode, &inode_struct);
-        if (error)
-            return error;
+// crc of 'len' zero bytes
+uint32_t crc32c_zeros(uint64_t len) {
+    return crc32c_multmodp(crc32c_shift(len), 0xFFFFFFFF) ^ 0xFFFFFFFF;
+}
 
-        set_inode_file_fmt(&inode_struct, EXT2_FMT_REG);
-        error = write_inode(ext2, inode, &inode_struct);
-        if (error)
-            return error;
+// crc of A followed by B, from the crc of each. 'shift' is crc32c_shift of
+// the length of B
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint32_t shift) {
+    return crc32c_multmodp(shift, crc_a) ^ crc_b;
+}
+
+uint32_t ext2_crc32c(uint32_t crc, const void* data, uint32_t size) {
+    const uint8_t* p = data;
+    uint32_t c = ~crc;
+
+#if defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32)
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+#if defined(__SSE4_2__)
+        c = (uint32_t)_mm_crc32_u64(c, word);
+#else
+        c = __crc32cd(c, word);
+#endif
     }
 
-    if (error)
-        return error;
+    for (; size > 0; p++, size--)
+#if defined(__SSE4_2__)
+        c = _mm_crc32_u8(c, *p);
+#else
+        c = __crc32cb(c, *p);
+#endif
+#else
+    crc32c_init();
+
+    for (; size >= 8; p += 8, size -= 8) {
+        uint32_t lo = c ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        c = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+            crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+            crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^
+            crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    }
 
-    error = read_inode(ext2, inode, &inode_struct);
+    for (; size > 0; p++, size--)
+        c = (c >> 8) ^ crc32c_table[0][(c ^ *p) & 0xFF];
+#endif
 
-    if (error)
-        return error;
+    return ~c;
+}
 
-    // ensure inode actually refers to a file
-    if (GET_FILE_FMT(inode_struct.mode) != EXT2_FMT_REG)
-        return EXT2_ERR_NOT_A_FILE;
+// checksum of a group descriptor, for the uninit_bg feature
+uint16_t get_bgd_checksum(ext2_t* ext2, uint32_t group, const ext2_bgd_t* bgd) {
+    uint16_t crc = crc16(0xFFFF, ext2->superblk.uuid, sizeof(ext2->superblk.uuid));
+    crc = crc16(crc, &group, sizeof(group));
+    return crc16(crc, bgd, offsetof(ext2_bgd_t, checksum));
+}
 
-    file->inode = inode;
-    file->offset = 0;
-    return 0;
+// whether a flag of a group descriptor is in effect. They're ignored without
+// the uninit_bg feature
+bool bgd_flag(ext2_t* ext2, const ext2_bgd_t* bgd, uint16_t flag) {
+    return (ext2->superblk.feature_ro_compat & EXT2_FEATURE_RO_COMPAT_GDT_CSUM)
+        && (bgd->flags & flag);
 }
 
-ext2_error_t ext2_file_read(ext2_t* ext2, ext2_file_t* file, 
-        uint32_t size, void* buf) {
-    ext2_error_t error = read_data(ext2, file->inode, file->offset, size, buf);
+ext2_error_t write_bgd(ext2_t* ext2, uint32_t group, const ext2_bgd_t* bgd) {
+    uint64_t addr;
+    ext2_error_t err = get_bgd_address(ext2, group, &addr);
 
-    if (!error)
-        file->offset += size;
+    if (err)
+        return err;
 
-    return error;
+    ext2_bgd_t copy = *bgd;
+    if (ext2->superblk.feature_ro_compat & EXT2_FEATURE_RO_COMPAT_GDT_CSUM)
+        copy.checksum = get_bgd_checksum(ext2, group, &copy);
+
+    STAT_ADD(ext2, bgd_writes, 1);
+    return dev_write(ext2, addr, sizeof(ext2_bgd_t), &copy);
 }
 
-ext2_error_t ext2_file_seek(ext2_t* ext2, ext2_file_t* file, uint32_t offset) {
-    ext2_inode_t inode_struct;
-    ext2_error_t error = read_inode(ext2, file->inode, &inode_struct);
-    if (error)
-        return error;
+uint32_t get_inode_group(ext2_t* ext2, uint32_t inode) {
+    uint32_t inodes_per_group = ext2->superblk.inodes_per_group;
+    uint32_t block_group = (inode - 1) / inodes_per_group; 
+    return block_group;
+}
 
-    if (offset > inode_struct.size) {
-        return EXT2_ERR_SEEK_OUT_OF_BOUNDS;
+ext2_error_t get_inode_address(ext2_t* ext2, uint32_t inonum, uint64_t* addr) {
+    if (inonum > ext2->superblk.inodes_count) {
+        return EXT2_ERR_INODE_NOT_FOUND;
     }
 
-    file->offset = offset;
+    uint32_t inodes_per_group = ext2->superblk.inodes_per_group;
+    uint32_t block_group = get_inode_group(ext2, inonum);
+    uint32_t offset_inside_group = (inonum - 1) % inodes_per_group;
+
+    ext2_bgd_t bgd;
+    ext2_error_t bgd_error = read_bgd(ext2, block_group, &bgd);
+
+    if (bgd_error)
+        return bgd_error;
+
+    uint64_t inode_table_addr = BLOCK_ADDR(ext2, bgd.inode_table);
+
+    *addr= inode_table_addr + (uint64_t)offset_inside_group * ext2->inode_size;
+
     return 0;
 }
 
-uint32_t ext2_file_tell(ext2_t* ext2, const ext2_file_t* file) {
-    return file->offset;
+ext2_error_t read_inode(ext2_t* ext2, uint32_t inode_number, ext2_inode_t* inode) {
+    uint64_t inode_addr;
+    ext2_error_t err = get_inode_address(ext2, inode_number, &inode_addr);
+
+    if (err)
+        return err;
+
+    STAT_ADD(ext2, inode_reads, 1);
+    return dev_read(ext2, inode_addr, sizeof(ext2_inode_t), inode);
 }
 
-ext2_error_t ext2_file_write(ext2_t* ext2, ext2_file_t* file, 
-        uint32_t size, const void* buf) {
-    ext2_error_t error = write_data(ext2, file->inode, file->offset, size, buf);
+ext2_error_t write_inode(ext2_t* ext2, uint32_t inode_number, const ext2_inode_t* inode) {
+    uint64_t inode_addr;
+    ext2_error_t err = get_inode_address(ext2, inode_number, &inode_addr);
 
-    if (!error)
-        file->offset += size;
+    if (err)
+        return err;
 
-    return error;
+    STAT_ADD(ext2, inode_writes, 1);
+    return dev_write(ext2, inode_addr, sizeof(ext2_inode_t), inode);
 }
 
-ext2_error_t ext2_dir_open(ext2_t* ext2, const char* path, ext2_dir_t* dir) {
-    uint32_t inode;
-    ext2_error_t error;
+// size of a file. Regular files keep the upper 32 bits of their size in dir_acl
+uint64_t get_inode_size(const ext2_inode_t* inode_struct) {
+    uint64_t size = inode_struct->size;
 
-    error = locate_inode(ext2, path, &inode);
+    if (GET_FILE_FMT(inode_struct->mode) == EXT2_FMT_REG)
+        size |= (uint64_t)inode_struct->dir_acl << 32;
+
+    return size;
+}
+
+// turns on the large_file feature (and, on revision 0 filesystems, the 
+// dynamic revision that large_file depends on). The caller must hold the 
+// shared lock
+ext2_error_t enable_large_file(ext2_t* ext2) {
+    if (ext2->superblk.feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE)
+        return 0;
+
+    if (ext2->superblk.rev_level == EXT2_GOOD_OLD_REV) {
+        ext2->superblk.rev_level = EXT2_DYNAMIC_REV;
+        ext2->superblk.first_ino = EXT2_GOOD_OLD_FIRST_INO;
+        ext2->superblk.inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+    }
+
+    ext2->superblk.feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+
+    return write_superblock(ext2, &ext2->superblk);
+}
+
+// Sets the size of a file. The first file bigger than 2 GiB turns on the 
+// large_file feature
+ext2_error_t set_inode_size(ext2_t* ext2, ext2_inode_t* inode_struct, 
+        uint64_t size) {
+    bool is_reg = (GET_FILE_FMT(inode_struct->mode) == EXT2_FMT_REG);
+
+    if (size > ext2->max_file_size || (!is_reg && size > UINT32_MAX))
+        return EXT2_ERR_FILE_TOO_BIG;
+
+    if (size > INT32_MAX) {
+        take_lock(ext2, EXT2_LOCK_SHARED, 0, true);
+        ext2_error_t err = enable_large_file(ext2);
+        release_lock(ext2, EXT2_LOCK_SHARED, 0, true);
+
+        if (err)
+            return err;
+    }
+
+    inode_struct->size = size & UINT32_MAX;
+
+    if (is_reg)
+        inode_struct->dir_acl = size >> 32;
 
+    return 0;
+}
+
+// Defines LOCATE, which finds the path from the inode.block array to the 
+// blk_index'th block of a file, and GET, which follows it (see 
+// get_data_block), for blocks of 2^SHIFT bytes. With a constant SHIFT the 
+// divisions by the pointers per block become shifts and masks known at 
+// compile time
+#define DEFINE_BLOCK_MAP(LOCATE, GET, SHIFT)                                    \
+blk_indirection_info LOCATE(ext2_t* ext2, uint32_t blk_index) {                 \
+    blk_indirection_info ind_info;                                              \
+    const uint32_t ptr_shift = (SHIFT) - 2; /* log2 of pointers per block */    \
+    const uint32_t ptr_mask = ((uint32_t)1 << ptr_shift) - 1;                   \
+                                                                                \
+    if (blk_index < 12) {                                                       \
+        ind_info.indirection = 0;                                               \
+        ind_info.indexes[0] = blk_index;                                        \
+        return ind_info;                                                        \
+    }                                                                           \
+                                                                                \
+    blk_index -= 12;                                                            \
+                                                                                \
+    if ((blk_index >> ptr_shift) == 0) {                                        \
+        ind_info.indirection = 1;                                               \
+        ind_info.indexes[0] = 12;                                               \
+        ind_info.indexes[1] = blk_index;                                        \
+        return ind_info;                                                        \
+    }                                                                           \
+                                                                                \
+    blk_index -= (uint32_t)1 << ptr_shift;                                      \
+                                                                                \
+    if (((uint64_t)blk_index >> (2 * ptr_shift)) == 0) {                        \
+        ind_info.indirection = 2;                                               \
+        ind_info.indexes[0] = 13;                                               \
+        ind_info.indexes[1] = blk_index >> ptr_shift;                           \
+        ind_info.indexes[2] = blk_index & ptr_mask;                             \
+        return ind_info;                                                        \
+    }                                                                           \
+                                                                                \
+    blk_index -= (uint32_t)1 << (2 * ptr_shift);                                \
+                                                                                \
+    ind_info.indirection = 3;                                                   \
+    ind_info.indexes[0] = 14;                                                   \
+    ind_info.indexes[1] = blk_index >> (2 * ptr_shift);                         \
+    ind_info.indexes[2] = (blk_index >> ptr_shift) & ptr_mask;                  \
+    ind_info.indexes[3] = blk_index & ptr_mask;                                 \
+                                                                                \
+    return ind_info;                                                            \
+}                                                                               \
+                                                                                \
+ext2_error_t GET(ext2_t* ext2, const ext2_inode_t* inode_struct,                \
+        uint32_t blk_index, uint32_t* block) {                                  \
+    blk_indirection_info ind_info = LOCATE(ext2, blk_index);                    \
+    int levels = ind_info.indirection;                                          \
+    ext2_error_t error = 0;                                                     \
+                                                                                \
+    *block = inode_struct->block[ind_info.indexes[0]];                          \
+                                                                                \
+    /* one read per level. Block 0 means the rest is a hole */                  \
+    if (levels >= 1 && *block != 0)                                             \
+        error = dev_read(ext2, ((uint64_t)*block << (SHIFT)) +                  \
+                ind_info.indexes[1] * sizeof(uint32_t), sizeof(uint32_t), block); \
+    if (levels >= 2 && *block != 0 && !error)                                   \
+        error = dev_read(ext2, ((uint64_t)*block << (SHIFT)) +                  \
+                ind_info.indexes[2] * sizeof(uint32_t), sizeof(uint32_t), block); \
+    if (levels >= 3 && *block != 0 && !error)                                   \
+        error = dev_read(ext2, ((uint64_t)*block << (SHIFT)) +                  \
+                ind_info.indexes[3] * sizeof(uint32_t), sizeof(uint32_t), block); \
+                                                                                \
+    return error;                                                               \
+}
+
+// any block size, and the common ones. set_block_size picks one at mount
+DEFINE_BLOCK_MAP(locate_block, get_data_block_any, ext2->block_shift)
+DEFINE_BLOCK_MAP(locate_block_1k, get_data_block_1k, 10)
+DEFINE_BLOCK_MAP(locate_block_4k, get_data_block_4k, 12)
+
+blk_indirection_info locate_offset(ext2_t* ext2, uint32_t offset) {
+    return locate_block(ext2, offset >> ext2->block_shift);
+}
+
+// Gets the block that stores the blk_index'th block of a file. Sets 'block' to
+// 0 if that part of the file is a hole
+ext2_error_t get_data_block(ext2_t* ext2, const ext2_inode_t* inode_struct,
+        uint32_t blk_index, uint32_t* block) {
+    return ext2->get_data_block(ext2, inode_struct, blk_index, block);
+}
+
+// sets the block size and the code specialized for it
+void set_block_size(ext2_t* ext2, uint32_t block_size) {
+    ext2->block_size = block_size;
+    ext2->block_shift = 0;
+    while (((uint32_t)1 << ext2->block_shift) < block_size)
+        ext2->block_shift++;
+
+    if (block_size == 1024)
+        ext2->get_data_block = get_data_block_1k;
+    else if (block_size == 4096)
+        ext2->get_data_block = get_data_block_4k;
+    else
+        ext2->get_data_block = get_data_block_any;
+}
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block) {
+    ext2_inode_t inode_struct;
+    ext2_error_t error = read_inode(ext2, inode, &inode_struct);
     if (error)
         return error;
 
+    return get_data_block(ext2, &inode_struct, offset >> ext2->block_shift, block);
+}
+
+ext2_error_t read_data(ext2_t* ext2, uint32_t inode, uint64_t offset, 
+        uint32_t size, void* buffer) {
     ext2_inode_t inode_struct;
-    error = read_inode(ext2, inode, &inode_struct);
 
+    ext2_error_t error = read_inode(ext2, inode, &inode_struct);
     if (error)
         return error;
 
-    // ensure inode actually refers to a dir
-    if (GET_FILE_FMT(inode_struct.mode) != EXT2_FMT_DIR)
-        return EXT2_ERR_NOT_A_DIR;
+    if (offset + size > get_inode_size(&inode_struct)) {
+        // access is outside of file
+        return EXT2_ERR_DATA_OUT_OF_BOUNDS;
+    }
+
+    while (size > 0) {
+        uint32_t datablock;
+
+        error = get_data_block(ext2, &inode_struct, offset >> ext2->block_shift,
+                &datablock);
+        if (error)
+            return error;
+
+        uint32_t block_offset = offset & (ext2->block_size - 1);
+        uint32_t remaining = ext2->block_size - block_offset;
+        uint32_t bytes_to_read = (remaining < size) ? remaining : size;
+
+        if (datablock == 0) {
+            memset(buffer, 0, bytes_to_read);
+        } else {
+            error = dev_read(ext2, BLOCK_ADDR(ext2, datablock) + block_offset,  
+                bytes_to_read, (uint8_t*)buffer);
+        }
+
+        if (error)
+            return error;
+
+        buffer = (uint8_t*)buffer + bytes_to_read;
+        offset += bytes_to_read;
+        size -= bytes_to_read;
+    }
 
-    dir->inode = inode;
-    dir->offset = 0;
     return 0;
 }
 
-ext2_error_t ext2_mkdir(ext2_t* ext2, const char* path) {
-    uint32_t inode;
+// extracts the first name before the '/' in a file path. filename should have
+// at least EXT2_MAX_FILE_NAME + 1 bytes. 
+ext2_error_t parse_filename(const char* path, char* filename, uint32_t* chars_read) {
+    int i = 0;
+    char c = *(path++);
+
+    while (c != '\0' && c != '/') {
+        if (i >= EXT2_MAX_FILE_NAME) {
+            return EXT2_ERR_FILENAME_TOO_BIG;
+        }
+
+        filename[i++] = c;
+        c = *(path++);
+    }
+
+    filename[i] = '\0';
+
+    *chars_read = i;
+    return 0;
+}
+
+ext2_error_t read_dir_entry(ext2_t* ext2, uint32_t offset, 
+        uint32_t dir_inode, ext2_directory_entry_t* entry) {
     ext2_inode_t inode_struct;
-    ext2_error_t error = create_and_link_inode(ext2, path, &inode);
-    if (error)
-        return error;
 
-    error = read_inode(ext2, inode, &inode_struct);
+    ext2_error_t error = read_inode(ext2, dir_inode, &inode_struct);
     if (error)
         return error;
 
-    set_inode_file_fmt(&inode_struct, EXT2_FMT_DIR);
-    error = write_inode(ext2, inode, &inode_struct);
-    if (error)
-        return error;
+    if (GET_FILE_FMT(inode_struct.mode) != EXT2_FMT_DIR)
+        return EXT2_ERR_NOT_A_DIR;
 
-    uint32_t parent_inode;
-    locate_parent_inode(ext2, path, &parent_inode);
+    // total size of the fields of the dir entry struct that precede the name
+    // of the file
+    uint32_t headersz = (uint8_t*)&entry->name - (uint8_t*)entry;
 
-    error = link(ext2, inode, inode, ".");
-    if (error)
-        return error;
+    STAT_ADD(ext2, dir_entries_scanned, 1);
 
-    error = link(ext2, inode, parent_inode, "..");
+    error = read_data(ext2, dir_inode, offset, headersz, entry);
     if (error)
         return error;
 
-    uint32_t group = get_inode_group(ext2, parent_inode);
-    ext2_bgd_t bgd;
-    error = read_bgd(ext2, group, &bgd);
-    if (error)
-        return error;
-    bgd.used_dirs_count += 1;
-    error = write_bgd(ext2, group, &bgd);
+    error = read_data(ext2, dir_inode, offset + headersz, entry->name_len, 
+            &entry->name);
     if (error)
         return error;
 
+    entry->name[entry->name_len] = '\0';
     return 0;
 }
 
-ext2_error_t ext2_dir_read(ext2_t* ext2, ext2_dir_t* dir, ext2_dir_record_t* entry) {
+// Finds a name in a directory. 'type' gets the file_type of its entry, which
+// is EXT2_ET_UNKNOWN unless the filesystem has the filetype feature. It can 
+// be NULL
+ext2_error_t locate_inode_in_dir(ext2_t* ext2, uint32_t parent_inode, 
+        const char* name, uint32_t* inode, uint8_t* type) {
+    ext2_directory_entry_t entry;
+    uint32_t offset = 0;
+    uint8_t ignored;
+
+    if (type == NULL)
+        type = &ignored;
+
+    if (cache_get_name(ext2, parent_inode, name, inode, type))
+        return (*inode == 0) ? EXT2_ERR_FILE_NOT_FOUND : 0;
+
     ext2_inode_t inode_struct;
-    ext2_error_t error = read_inode(ext2, dir->inode, &inode_struct);
+    ext2_error_t error = read_inode(ext2, parent_inode, &inode_struct);
+
     if (error)
         return error;
 
-    if (dir->offset == inode_struct.size) { // already read all entries
-        // subsequent reads return an empty name and inode 0
-        entry->inode = 0;
-        entry->name[0] = '\0'; 
-        return 0;
+    do {
+        error = read_dir_entry(ext2, offset, parent_inode, &entry);
+
+        if (error)
+            return error;
+
+        // the first record of a block keeps its name after it's removed
+        if (entry.inode != 0 && strcmp(entry.name, name) == 0) {
+            *inode = entry.inode;
+            *type = entry.file_type;
+            cache_put_name(ext2, parent_inode, name, entry.inode, 
+                    entry.file_type);
+            return 0;
+        }
+
+        offset += entry.rec_len;
+    } while (offset < inode_struct.size);
+
+    // nothing is created on a read-only filesystem, so misses are kept too
+    if (ext2->read_only)
+        cache_put_name(ext2, parent_inode, name, 0, EXT2_ET_UNKNOWN);
+
+    return EXT2_ERR_FILE_NOT_FOUND;
+}
+
+// number of the group a block belongs to
+uint32_t get_block_group(ext2_t* ext2, uint32_t block) {
+    return (block - ext2->superblk.first_data_block) / 
+        ext2->superblk.blocks_per_group;
+}
+
+// number of blocks inside a group (the last group might be smaller)
+uint32_t get_group_block_count(ext2_t* ext2, uint32_t group) {
+    uint32_t first = group * ext2->superblk.blocks_per_group + 
+        ext2->superblk.first_data_block;
+    uint32_t count = ext2->superblk.blocks_count - first;
+
+    return (count < ext2->superblk.blocks_per_group) ? count : 
+        ext2->superblk.blocks_per_group;
+}
+
+// whether a group holds a copy of the superblock and descriptor table. With
+// sparse_super, only groups 0, 1 and powers of 3, 5 and 7 do
+bool group_has_super(ext2_t* ext2, uint32_t group) {
+    if (group <= 1 || ext2->superblk.rev_level == EXT2_GOOD_OLD_REV ||
+            !(ext2->superblk.feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+        return true;
+
+    for (uint64_t base = 3; base <= 7; base += 2) {
+        uint64_t power = base;
+        while (power < group)
+            power *= base;
+        if (power == group)
+            return true;
     }
 
-    ext2_directory_entry_t disk_entry;
-    error = read_dir_entry(ext2, dir->offset, dir->inode, &disk_entry);
-    if (error)
-        return error;
+    return false;
+}
 
-    entry->inode = disk_entry.inode;
-    strcpy(entry->name, disk_entry.name);
-    dir->offset += disk_entry.rec_len;
-    return 0;
+// number of blocks taken by the descriptor table
+uint32_t get_gdt_blocks(ext2_t* ext2) {
+    return CEIL(ext2->block_group_count * sizeof(ext2_bgd_t), ext2->block_size);
 }
 
-ext2_error_t ext2_dir_seek(ext2_t* ext2, ext2_dir_t* dir, uint32_t offset) {
-    ext2_inode_t inode_struct;
-    ext2_error_t error = read_inode(ext2, dir->inode, &inode_struct);
-    if (error)
-        return error;
+// first block of a group
+uint32_t get_group_first_block(ext2_t* ext2, uint32_t group) {
+    return group * ext2->superblk.blocks_per_group + 
+        ext2->superblk.first_data_block;
+}
 
-    if (offset > inode_struct.size) {
-        return EXT2_ERR_SEEK_OUT_OF_BOUNDS;
+// Fills a whole block with what the block bitmap of a group holds before any
+// of its blocks is allocated: the superblock and descriptor table copies, the
+// bitmaps and the inode table are in use, and so are the padding bits past 
+// the end of the group
+void build_block_bitmap(ext2_t* ext2, uint32_t group, const ext2_bgd_t* bgd,
+        uint8_t* bitmap) {
+    uint32_t first = get_group_first_block(ext2, group);
+    uint32_t nbits = get_group_block_count(ext2, group);
+    uint32_t table_blocks = CEIL(ext2->superblk.inodes_per_group * 
+            ext2->inode_size, ext2->block_size);
+
+    memset(bitmap, 0, ext2->block_size);
+
+    if (group_has_super(ext2, group)) {
+        uint32_t n = 1 + get_gdt_blocks(ext2) + ext2->superblk.reserved_gdt_blocks;
+        for (uint32_t i = 0; i < n && i < nbits; i++)
+            SET_BIT(bitmap, i);
     }
 
-    dir->offset = offset;
-    return 0;
+    uint32_t meta[] = { bgd->block_bitmap, bgd->inode_bitmap };
+    for (uint32_t i = 0; i < 2; i++)
+        if (meta[i] >= first && meta[i] - first < nbits)
+            SET_BIT(bitmap, meta[i] - first);
+
+    for (uint32_t i = 0; i < table_blocks; i++)
+        if (bgd->inode_table + i >= first && bgd->inode_table + i - first < nbits)
+            SET_BIT(bitmap, bgd->inode_table + i - first);
+
+    for (uint32_t i = nbits; i < ext2->block_size * 8; i++)
+        SET_BIT(bitmap, i);
 }
 
-uint32_t ext2_dir_tell(ext2_t* ext2, const ext2_dir_t* dir) {
-    return dir->offset;
+// same for the inode bitmap: only the padding bits are set
+void build_inode_bitmap(ext2_t* ext2, uint8_t* bitmap) {
+    memset(bitmap, 0, ext2->block_size);
+
+    for (uint32_t i = ext2->superblk.inodes_per_group; 
+            i < ext2->block_size * 8; i++)
+        SET_BIT(bitmap, i);
+}
+
+// Writes the block bitmap of a group flagged as uninitialized (see 
+// ext2_format_params_t.lazy_init). Changes 'bgd' but leaves writing it to the
+// caller, which must hold the group lock
+ext2_error_t init_block_bitmap(ext2_t* ext2, uint32_t group, ext2_bgd_t* bgd) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+
+    if (!bgd_flag(ext2, bgd, EXT2_BG_BLOCK_UNINIT))
+        return 0;
+
+    build_block_bitmap(ext2, group, bgd, bitmap);
+    ext2_error_t err = dev_write(ext2, BLOCK_ADDR(ext2, bgd->block_bitmap), 
+            ext2->block_size, bitmap);
+
+    if (!err)
+        bgd->flags &= ~EXT2_BG_BLOCK_UNINIT;
+
+    return err;
+}
+
+// Looks for 'want' consecutive clear bits in a bitmap, starting the search at
+// bit 'start' and wrapping around. Sets 'bit' and 'len' to the first run that 
+// is long enough or, if there's none, to the longest run found (len is 0 if
+// every bit is set)
+void find_free_run(const uint8_t* bitmap, uint32_t nbits, uint32_t start,
+        uint32_t want, uint32_t* bit, uint32_t* len) {
+    uint32_t scanned = 0;
+    uint32_t pos = (start < nbits) ? start : 0;
+
+    *bit = 0;
+    *len = 0;
+
+    while (scanned < nbits) {
+        if (pos >= nbits)
+            pos = 0;
+
+        // skip full bytes at once
+        if (pos % 8 == 0 && pos + 8 <= nbits && scanned + 8 <= nbits &&
+                bitmap[pos / 8] == 0xFF) {
+            pos += 8;
+            scanned += 8;
+            continue;
+        }
+
+        if (BIT_IS_SET(bitmap, pos)) {
+            pos++;
+            scanned++;
+            continue;
+        }
+
+        uint32_t run = 0;
+        while (run < want && pos + run < nbits && scanned + run < nbits && 
+                !BIT_IS_SET(bitmap, pos + run))
+            run++;
+
+        if (run > *len) {
+            *bit = pos;
+            *len = run;
+
+            if (run == want)
+                return;
+        }
+
+        pos += run;
+        scanned += run;
+    }
+}
+
+// Sets or clears 'count' bits of a bitmap, starting at 'bit'. The whole 
+// bytes in between are filled at once
+void fill_bits(uint8_t* map, uint32_t bit, uint32_t count, bool value) {
+    for (; count > 0 && bit % 8 != 0; bit++, count--) {
+        if (value)
+            SET_BIT(map, bit);
+        else
+            CLEAR_BIT(map, bit);
+    }
+
+    memset(map + bit / 8, value ? 0xFF : 0, count / 8);
+    bit += count / 8 * 8;
+    count %= 8;
+
+    for (; count > 0; bit++, count--) {
+        if (value)
+            SET_BIT(map, bit);
+        else
+            CLEAR_BIT(map, bit);
+    }
+}
+
+// Marks 'count' blocks starting at 'block' as used (or free, if 'used' is 
+// false) with a single bitmap write, then updates the group descriptor. The 
+// superblock is left to the caller. All blocks must belong to the same group,
+// whose lock the caller must hold
+ext2_error_t mark_blocks(ext2_t* ext2, uint32_t block, uint32_t count, 
+        bool used) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    uint32_t group = get_block_group(ext2, block);
+    ext2_bgd_t bgd;
+
+    ext2_error_t err = read_bgd(ext2, group, &bgd);
+    if (!err)
+        err = init_block_bitmap(ext2, group, &bgd);
+    if (err)
+        return err;
+
+    // only the bytes that hold bits of the run are touched
+    uint32_t first_bit = (block - ext2->superblk.first_data_block) % 
+        ext2->superblk.blocks_per_group;
+    uint32_t first_byte = first_bit / 8;
+    uint32_t last_byte = (first_bit + count - 1) / 8;
+    uint64_t addr = BLOCK_ADDR(ext2, bgd.block_bitmap) + first_byte;
+    uint32_t size = last_byte - first_byte + 1;
+
+    err = dev_read(ext2, addr, size, bitmap);
+    if (err)
+        return err;
+
+    fill_bits(bitmap, first_bit - first_byte * 8, count, used);
+
+    err = dev_write(ext2, addr, size, bitmap);
+    if (err)
+        return err;
+
+    if (used)
+        bgd.free_blocks_count -= count;
+    else
+        bgd.free_blocks_count += count;
+
+    return write_bgd(ext2, group, &bgd);
+}
+
+// Looks for 'want' consecutive free blocks in a group, starting the search at
+// block 'start'. Sets 'block' and 'count' to the run found (see 
+// find_free_run). Groups with no more than 'skip' free blocks aren't searched
+// and give a count of 0. The caller must hold the group lock
+ext2_error_t find_in_group(ext2_t* ext2, uint32_t group, uint32_t start, 
+        uint32_t want, uint32_t skip, uint32_t* block, uint32_t* count) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    ext2_bgd_t bgd;
+
+    *count = 0;
+
+    ext2_error_t err = read_bgd(ext2, group, &bgd);
+    if (err)
+        return err;
+
+    if (bgd.free_blocks_count <= skip)
+        return 0;
+
+    uint32_t nbits = get_group_block_count(ext2, group);
+    uint32_t first_block = group * ext2->superblk.blocks_per_group + 
+        ext2->superblk.first_data_block;
+    uint32_t bit;
+
+    STAT_ADD(ext2, bitmap_scans, 1);
+
+    if (bgd_flag(ext2, &bgd, EXT2_BG_BLOCK_UNINIT))
+        build_block_bitmap(ext2, group, &bgd, bitmap);
+    else
+        err = dev_read(ext2, BLOCK_ADDR(ext2, bgd.block_bitmap), CEIL(nbits, 8),
+                bitmap);
+    if (err)
+        return err;
+
+    find_free_run(bitmap, nbits, (start > first_block) ? start - first_block : 0,
+            want, &bit, count);
+
+    *block = first_block + bit;
+    return 0;
+}
+
+// Reserves up to 'want' consecutive blocks in the 'n' groups that start at 
+// 'first', preferably starting at 'goal'. Groups are searched for a run that
+// is long enough, starting at the group of 'goal'. If there's no such run, the
+// longest one found is reserved. Sets 'block' to the first reserved block and
+// 'count' to the amount reserved. The superblock is left to the caller
+ext2_error_t alloc_in_groups(ext2_t* ext2, uint32_t first, uint32_t n, 
+        uint32_t goal, uint32_t want, uint32_t* block, uint32_t* count) {
+    ext2_error_t err;
+    uint32_t goal_group = first;
+
+    if (goal >= ext2->superblk.first_data_block && 
+            goal < ext2->superblk.blocks_count &&
+            get_block_group(ext2, goal) - first < n)
+        goal_group = get_block_group(ext2, goal);
+
+    while (true) {
+        uint32_t best_block = 0, best_len = 0;
+        uint32_t group = goal_group;
+        uint32_t found, len;
+
+        do {
+            // only this group is locked while it's searched, so threads that
+            // allocate in different groups don't wait for each other
+            take_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+            err = find_in_group(ext2, group, (group == goal_group) ? goal : 0,
+                    want, best_len, &found, &len);
+            if (!err && len == want)
+                err = mark_blocks(ext2, found, len, true);
+
+            release_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+            if (err)
+                return err;
+
+            if (len == want) {
+                *block = found;
+                *count = len;
+                return 0;
+            }
+
+            if (len > best_len) {
+                best_block = found;
+                best_len = len;
+            }
+
+            group = first + (group - first + 1) % n;
+        } while (group != goal_group);
+
+        if (best_len == 0)
+            return EXT2_ERR_DISK_FULL;
+
+        // other threads may have taken the best run since it was found, so 
+        // it's looked for again with the lock held
+        group = get_block_group(ext2, best_block);
+        take_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+        err = find_in_group(ext2, group, best_block, best_len, 0, &found, &len);
+        if (!err && len > 0)
+            err = mark_blocks(ext2, found, len, true);
+
+        release_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+        if (err)
+            return err;
+
+        if (len > 0) {
+            *block = found;
+            *count = len;
+            return 0;
+        }
+    }
+}
+
+// Allocation through a context (see ext2_alloc_ctx_init). Blocks come from
+// the home groups of the context. Only when they're full, free space is taken
+// from the other groups, starting with the ones right after home. The change
+// to the superblock is kept in the context, so no shared lock is needed
+ext2_error_t alloc_blocks_ctx(ext2_t* ext2, ext2_alloc_ctx_t* ctx, 
+        uint32_t goal, uint32_t want, uint32_t* block, uint32_t* count) {
+    uint32_t home_start = get_group_first_block(ext2, ctx->first_group);
+    uint32_t home_end = get_group_first_block(ext2, 
+            ctx->first_group + ctx->group_count);
+
+    // goals outside home (a file that was started by someone else) are 
+    // brought back
+    if (goal < home_start || goal >= home_end)
+        goal = (ctx->goal >= home_start && ctx->goal < home_end) ? 
+            ctx->goal : home_start;
+
+    ext2_error_t err = alloc_in_groups(ext2, ctx->first_group, 
+            ctx->group_count, goal, want, block, count);
+
+    if (err == EXT2_ERR_DISK_FULL && ctx->group_count < ext2->block_group_count) {
+        uint32_t next = (ctx->first_group + ctx->group_count) % 
+            ext2->block_group_count;
+
+        err = alloc_in_groups(ext2, 0, ext2->block_group_count, 
+                get_group_first_block(ext2, next), want, block, count);
+    }
+
+    if (err)
+        return err;
+
+    ctx->goal = *block + *count;
+    ctx->free_blocks -= *count;
+    return 0;
+}
+
+// Reserves up to 'want' consecutive blocks, preferably starting at 'goal' 
+// (see alloc_in_groups). 'ctx' is optional
+ext2_error_t alloc_blocks(ext2_t* ext2, ext2_alloc_ctx_t* ctx, uint32_t goal,
+        uint32_t want, uint32_t* block, uint32_t* count) {
+    ext2_error_t err;
+
+    if (ctx)
+        err = alloc_blocks_ctx(ext2, ctx, goal, want, block, count);
+    else
+        err = alloc_in_groups(ext2, 0, ext2->block_group_count, goal, want, 
+                block, count);
+    if (err)
+        return err;
+
+    STAT_ADD(ext2, blocks_allocated, *count);
+
+    if (ctx)
+        return 0;
+
+    return update_free_counts(ext2, -(int32_t)*count, 0);
+}
+
+ext2_error_t get_new_block(ext2_t* ext2, ext2_alloc_ctx_t* ctx, uint32_t goal,
+        uint32_t* block) {
+    uint32_t count;
+    return alloc_blocks(ext2, ctx, goal, 1, block, &count);
+}
+
+// a run of consecutive blocks waiting to be freed
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} blk_run;
+
+ext2_error_t flush_blk_run(ext2_t* ext2, blk_run* run) {
+    if (run->count == 0)
+        return 0;
+
+    uint32_t group = get_block_group(ext2, run->start);
+
+    take_lock(ext2, EXT2_LOCK_GROUP, group, true);
+    ext2_error_t err = mark_blocks(ext2, run->start, run->count, false);
+    release_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+    if (!err)
+        err = update_free_counts(ext2, run->count, 0);
+
+    run->count = 0;
+    return err;
+}
+
+#define FREE_BATCH_RUNS 64
+
+// Blocks waiting to be freed, in runs of consecutive blocks of a group. When
+// the batch fills up, the runs are freed group by group, so each group's 
+// bitmap and descriptor are written once. The superblock isn't touched until
+// finish_blk_batch
+typedef struct {
+    blk_run runs[FREE_BATCH_RUNS];
+    uint32_t count;
+    uint32_t freed; // blocks freed so far, not counted in the superblock yet
+
+    // if set, blocks are only marked in this map, a bit per block from 
+    // first_data_block, and the caller frees them later (see rm_tree)
+    _Atomic uint8_t* map;
+} blk_batch;
+
+// Frees sorted runs that are all in 'group'. Only the bytes of the bitmap 
+// between the first and the last run are read and written
+ext2_error_t free_runs_in_group(ext2_t* ext2, uint32_t group, 
+        const blk_run* runs, uint32_t n) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    const uint32_t base = get_group_first_block(ext2, group);
+    const blk_run* last = &runs[n - 1];
+    uint32_t first_byte = (runs[0].start - base) / 8;
+    uint32_t last_byte = (last->start + last->count - 1 - base) / 8;
+    uint32_t freed = 0;
+    ext2_bgd_t bgd;
+
+    take_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+    ext2_error_t err = read_bgd(ext2, group, &bgd);
+    if (!err)
+        err = init_block_bitmap(ext2, group, &bgd);
+
+    uint64_t addr = BLOCK_ADDR(ext2, bgd.block_bitmap) + first_byte;
+    if (!err)
+        err = dev_read(ext2, addr, last_byte - first_byte + 1, bitmap);
+
+    if (!err) {
+        for (uint32_t i = 0; i < n; i++) {
+            fill_bits(bitmap, runs[i].start - base - first_byte * 8, 
+                    runs[i].count, false);
+            freed += runs[i].count;
+        }
+
+        err = dev_write(ext2, addr, last_byte - first_byte + 1, bitmap);
+    }
+
+    if (!err) {
+        bgd.free_blocks_count += freed;
+        err = write_bgd(ext2, group, &bgd);
+    }
+
+    release_lock(ext2, EXT2_LOCK_GROUP, group, true);
+    return err;
+}
+
+// frees the runs gathered in a batch
+ext2_error_t flush_blk_batch(ext2_t* ext2, blk_batch* batch) {
+    blk_run* runs = batch->runs;
+
+    // runs mostly come in order already
+    for (uint32_t i = 1; i < batch->count; i++) {
+        blk_run run = runs[i];
+        uint32_t j = i;
+
+        for (; j > 0 && runs[j - 1].start > run.start; j--)
+            runs[j] = runs[j - 1];
+        runs[j] = run;
+    }
+
+    for (uint32_t i = 0; i < batch->count; ) {
+        uint32_t group = get_block_group(ext2, runs[i].start);
+        uint32_t end = i + 1;
+
+        while (end < batch->count && get_block_group(ext2, runs[end].start) == group)
+            end++;
+
+        ext2_error_t err = free_runs_in_group(ext2, group, runs + i, end - i);
+        if (err)
+            return err;
+
+        for (; i < end; i++)
+            batch->freed += runs[i].count;
+    }
+
+    batch->count = 0;
+    return 0;
+}
+
+// Frees what's left in a batch and adds every block it freed, along with 
+// 'inodes' freed inodes, to the superblock in a single write
+ext2_error_t finish_blk_batch(ext2_t* ext2, blk_batch* batch, int32_t inodes) {
+    ext2_error_t err = flush_blk_batch(ext2, batch);
+    if (err)
+        return err;
+
+    if (batch->freed > 0 || inodes != 0)
+        err = update_free_counts(ext2, batch->freed, inodes);
+
+    batch->freed = 0;
+    return err;
+}
+
+// Schedules a block to be freed. Consecutive blocks of the same group join 
+// the same run, so a contiguous file is freed with a few bitmap updates
+ext2_error_t free_block(ext2_t* ext2, blk_batch* batch, uint32_t block) {
+    if (batch->map) {
+        uint32_t bit = block - ext2->superblk.first_data_block;
+
+        // a pointer past the end is corruption, there's nothing to free
+        if (block < ext2->superblk.first_data_block || 
+                block >= ext2->superblk.blocks_count)
+            return 0;
+
+        atomic_fetch_or_explicit(&batch->map[bit / 8], 1 << (bit % 8), 
+                memory_order_relaxed);
+        return 0;
+    }
+
+    if (batch->count > 0) {
+        blk_run* run = &batch->runs[batch->count - 1];
+
+        if (block == run->start + run->count &&
+                get_block_group(ext2, block) == get_block_group(ext2, run->start)) {
+            run->count++;
+            return 0;
+        }
+    }
+
+    if (batch->count == FREE_BATCH_RUNS) {
+        ext2_error_t err = flush_blk_batch(ext2, batch);
+        if (err)
+            return err;
+    }
+
+    batch->runs[batch->count].start = block;
+    batch->runs[batch->count].count = 1;
+    batch->count++;
+    return 0;
+}
+
+// writes zeros to 'count' blocks starting at 'block'
+ext2_error_t zero_blocks(ext2_t* ext2, uint32_t block, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        ext2_error_t err = dev_write(ext2, BLOCK_ADDR(ext2, block + i), 
+                ext2->block_size, zero_block);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+// Makes 'count' consecutive blocks of a file, starting at the blk_index'th, 
+// point to consecutive blocks starting at 'block'. Missing indirect blocks are
+// allocated (near 'goal') and zeroed, and pointers that share an indirect 
+// block are written together. Changes to the inode are only made in 
+// inode_struct, the caller is responsible for writing it back
+ext2_error_t set_data_blocks(ext2_t* ext2, ext2_alloc_ctx_t* ctx, 
+        ext2_inode_t* inode_struct, uint32_t blk_index, uint32_t block, 
+        uint32_t count, uint32_t goal) {
+    uint32_t ptrs[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    const uint32_t bpb = ext2->block_size / sizeof(uint32_t);
+    ext2_error_t err;
+
+    while (count > 0) {
+        blk_indirection_info ind_info = locate_block(ext2, blk_index);
+        uint32_t* top = &inode_struct->block[ind_info.indexes[0]];
+
+        if (ind_info.indirection == 0) {
+            *top = block;
+            blk_index++;
+            block++;
+            count--;
+            continue;
+        }
+
+        if (*top == 0) {
+            err = get_new_block(ext2, ctx, goal, top);
+            if (err)
+                return err;
+            err = zero_blocks(ext2, *top, 1);
+            if (err)
+                return err;
+            inode_struct->blocks += ext2->block_size / 512;
+        }
+
+        // walk down to the indirect block that holds the data pointers
+        uint32_t next_block = *top;
+
+        for (int i = 1; i < ind_info.indirection; i++) {
+            uint64_t ptr_addr = BLOCK_ADDR(ext2, next_block) + 
+                ind_info.indexes[i] * sizeof(uint32_t);
+
+            err = dev_read(ext2, ptr_addr, sizeof(uint32_t), &next_block);
+            if (err)
+                return err;
+
+            if (next_block == 0) {
+                err = get_new_block(ext2, ctx, goal, &next_block);
+                if (err)
+                    return err;
+                err = zero_blocks(ext2, next_block, 1);
+                if (err)
+                    return err;
+                inode_struct->blocks += ext2->block_size / 512;
+
+                err = dev_write(ext2, ptr_addr, sizeof(uint32_t), &next_block);
+                if (err)
+                    return err;
+            }
+        }
+
+        uint32_t first_ptr = ind_info.indexes[ind_info.indirection];
+        uint32_t n = bpb - first_ptr;
+        if (n > count)
+            n = count;
+
+        for (uint32_t i = 0; i < n; i++)
+            ptrs[i] = block + i;
+
+        err = dev_write(ext2, BLOCK_ADDR(ext2, next_block) + 
+                first_ptr * sizeof(uint32_t), n * sizeof(uint32_t), ptrs);
+        if (err)
+            return err;
+
+        blk_index += n;
+        block += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+// Picks a good place for the blk_index'th block of a file: right after the
+// block that precedes it or, if there's none, where the allocation context
+// stopped or at the start of the inode's group
+ext2_error_t get_alloc_goal(ext2_t* ext2, ext2_alloc_ctx_t* ctx, uint32_t inode,
+        const ext2_inode_t* inode_struct, uint32_t blk_index, uint32_t* goal) {
+    uint32_t prev = 0;
+
+    if (blk_index > 0) {
+        ext2_error_t err = get_data_block(ext2, inode_struct, blk_index - 1, &prev);
+        if (err)
+            return err;
+    }
+
+    if (prev != 0)
+        *goal = prev + 1;
+    else if (ctx)
+        *goal = ctx->goal;
+    else
+        *goal = get_group_first_block(ext2, get_inode_group(ext2, inode));
+
+    return 0;
+}
+
+// Frees the blocks of the subtree under the indirect block 'block' that map
+// file blocks >= 'keep'. 'level' is the indirection level of 'block' and 
+// 'first' the first file block it maps. 'freed' is incremented by the number
+// of freed blocks, and 'emptied' is set if 'block' itself was freed
+ext2_error_t truncate_tree(ext2_t* ext2, uint32_t block, int level, 
+        uint64_t first, uint32_t keep, blk_batch* batch, uint32_t* freed, 
+        bool* emptied) {
+    uint32_t ptrs[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    const uint32_t bpb = ext2->block_size / sizeof(uint32_t);
+    uint64_t span = 1; // file blocks mapped by each pointer
+
+    for (int i = 1; i < level; i++)
+        span *= bpb;
+
+    ext2_error_t err = dev_read(ext2, BLOCK_ADDR(ext2, block), ext2->block_size,
+            ptrs);
+    if (err)
+        return err;
+
+    bool changed = false;
+    bool empty = true;
+
+    for (uint32_t i = 0; i < bpb; i++) {
+        uint64_t entry_first = first + i * span;
+
+        if (ptrs[i] == 0)
+            continue;
+
+        if (entry_first + span <= keep) {
+            empty = false;
+            continue;
+        }
+
+        bool child_emptied = true;
+
+        if (level == 1) {
+            err = free_block(ext2, batch, ptrs[i]);
+            (*freed)++;
+        } else {
+            err = truncate_tree(ext2, ptrs[i], level - 1, entry_first, keep, 
+                    batch, freed, &child_emptied);
+        }
+
+        if (err)
+            return err;
+
+        if (child_emptied) {
+            ptrs[i] = 0;
+            changed = true;
+        } else {
+            empty = false;
+        }
+    }
+
+    *emptied = empty;
+
+    if (empty) {
+        (*freed)++;
+        return free_block(ext2, batch, block);
+    }
+
+    if (changed)
+        return dev_write(ext2, BLOCK_ADDR(ext2, block), ext2->block_size, ptrs);
+
+    return 0;
+}
+
+// zeros the part of the file's last block that comes after 'size'
+ext2_error_t zero_block_tail(ext2_t* ext2, const ext2_inode_t* inode_struct,
+        uint64_t size) {
+    uint32_t block_offset = size % ext2->block_size;
+    uint32_t block;
+
+    if (block_offset == 0)
+        return 0;
+
+    ext2_error_t err = get_data_block(ext2, inode_struct, 
+            size / ext2->block_size, &block);
+    if (err || block == 0)
+        return err;
+
+    return dev_write(ext2, BLOCK_ADDR(ext2, block) + block_offset, 
+            ext2->block_size - block_offset, zero_block);
+}
+
+// Changes the size of a file. Blocks past the new end are freed in runs of
+// consecutive blocks. Growing the file leaves a hole
+ext2_error_t truncate_data(ext2_t* ext2, uint32_t inode, uint64_t size) {
+    ext2_inode_t inode_struct;
+    ext2_error_t err = read_inode(ext2, inode, &inode_struct);
+    if (err)
+        return err;
+
+    const uint64_t old_size = get_inode_size(&inode_struct);
+
+    if (size >= old_size) {
+        // the old last block might have garbage after the old end of file
+        err = zero_block_tail(ext2, &inode_struct, old_size);
+        if (err)
+            return err;
+
+        err = set_inode_size(ext2, &inode_struct, size);
+        if (err)
+            return err;
+
+        return write_inode(ext2, inode, &inode_struct);
+    }
+
+    const uint32_t bpb = ext2->block_size / sizeof(uint32_t);
+    const uint32_t keep = CEIL(size, ext2->block_size);
+    blk_batch batch = { .count = 0, .freed = 0 };
+    uint32_t freed = 0;
+
+    for (uint32_t i = keep; i < 12; i++) {
+        if (inode_struct.block[i] == 0)
+            continue;
+
+        err = free_block(ext2, &batch, inode_struct.block[i]);
+        if (err)
+            return err;
+
+        inode_struct.block[i] = 0;
+        freed++;
+    }
+
+    uint64_t first = 12;
+    uint64_t span = bpb;
+
+    for (int level = 1; level <= 3; level++) {
+        uint32_t* top = &inode_struct.block[11 + level];
+
+        if (*top != 0 && first + span > keep) {
+            bool emptied;
+            err = truncate_tree(ext2, *top, level, first, keep, &batch, 
+                    &freed, &emptied);
+            if (err)
+                return err;
+
+            if (emptied)
+                *top = 0;
+        }
+
+        first += span;
+        span *= bpb;
+    }
+
+    err = finish_blk_batch(ext2, &batch, 0);
+    if (err)
+        return err;
+
+    err = zero_block_tail(ext2, &inode_struct, size);
+    if (err)
+        return err;
+
+    inode_struct.blocks -= freed * (ext2->block_size / 512);
+
+    err = set_inode_size(ext2, &inode_struct, size);
+    if (err)
+        return err;
+
+    return write_inode(ext2, inode, &inode_struct);
+}
+
+// Adds every data and indirect block of an inode to a batch. Each indirect 
+// block is read once, and none is written
+ext2_error_t free_inode_blocks(ext2_t* ext2, const ext2_inode_t* inode_struct,
+        blk_batch* batch) {
+    const uint32_t bpb = ext2->block_size / sizeof(uint32_t);
+    uint32_t freed = 0;
+    ext2_error_t err = 0;
+
+    for (uint32_t i = 0; i < 12 && !err; i++) {
+        if (inode_struct->block[i] != 0)
+            err = free_block(ext2, batch, inode_struct->block[i]);
+    }
+
+    uint64_t first = 12;
+    uint64_t span = bpb;
+
+    for (int level = 1; level <= 3 && !err; level++) {
+        bool emptied;
+        if (inode_struct->block[11 + level] != 0)
+            err = truncate_tree(ext2, inode_struct->block[11 + level], level, 
+                    first, 0, batch, &freed, &emptied);
+
+        first += span;
+        span *= bpb;
+    }
+
+    return err;
+}
+
+// Length of the run of blocks that starts at the blk_index'th block of a file
+// and is either stored in consecutive blocks or is a hole. At most 'max'
+ext2_error_t get_block_run(ext2_t* ext2, const ext2_inode_t* inode_struct,
+        uint32_t blk_index, uint32_t max, uint32_t* block, uint32_t* len) {
+    ext2_error_t err = get_data_block(ext2, inode_struct, blk_index, block);
+    if (err)
+        return err;
+
+    *len = 1;
+    while (*len < max) {
+        uint32_t next;
+        err = get_data_block(ext2, inode_struct, blk_index + *len, &next);
+        if (err)
+            return err;
+
+        if ((*block == 0) ? (next != 0) : (next != *block + *len))
+            break;
+
+        (*len)++;
+    }
+
+    return 0;
+}
+
+// Allocates every missing block among the 'count' blocks of a file that start
+// at blk_index. Each stretch of missing blocks is reserved as a single run
+// whenever the disk has one that is big enough, and new indirect blocks go
+// right after the run, keeping it contiguous. New blocks are zeroed if 'zero'
+// is set. Changes to the inode are only made in inode_struct
+ext2_error_t reserve_data_blocks(ext2_t* ext2, ext2_alloc_ctx_t* ctx, 
+        uint32_t inode, ext2_inode_t* inode_struct, uint32_t blk_index, 
+        uint32_t count, bool zero) {
+    const uint32_t end = blk_index + count;
+
+    while (blk_index < end) {
+        uint32_t block, missing;
+        ext2_error_t err = get_block_run(ext2, inode_struct, blk_index, 
+                end - blk_index, &block, &missing);
+        if (err)
+            return err;
+
+        if (block != 0) {
+            blk_index += missing;
+            continue;
+        }
+
+        while (missing > 0) {
+            uint32_t goal, first, count;
+            err = get_alloc_goal(ext2, ctx, inode, inode_struct, blk_index, 
+                    &goal);
+            if (err)
+                return err;
+
+            err = alloc_blocks(ext2, ctx, goal, missing, &first, &count);
+            if (err)
+                return err;
+
+            if (zero) {
+                err = zero_blocks(ext2, first, count);
+                if (err)
+                    return err;
+            }
+
+            inode_struct->blocks += count * (ext2->block_size / 512);
+
+            err = set_data_blocks(ext2, ctx, inode_struct, blk_index, first, 
+                    count, first + count);
+            if (err)
+                return err;
+
+            blk_index += count;
+            missing -= count;
+        }
+    }
+
+    return 0;
+}
+
+ext2_error_t write_data(ext2_t* ext2, ext2_alloc_ctx_t* ctx, uint32_t inode,
+        uint64_t offset, uint32_t size, const void* buffer) {
+    ext2_error_t error;
+    ext2_inode_t inode_struct;
+
+    error = read_inode(ext2, inode, &inode_struct);
+
+    if (error)
+        return error;
+
+    const uint64_t old_size = get_inode_size(&inode_struct);
+
+    if (offset > old_size)
+        return EXT2_ERR_DATA_OUT_OF_BOUNDS;
+
+    if (offset + size > ext2->max_file_size)
+        return EXT2_ERR_FILE_TOO_BIG;
+
+    if (size == 0)
+        return 0;
+
+    // The first and last blocks might be written only in part. If they are
+    // holes inside the file, the rest of them must read back as zeros
+    const uint32_t first_blk = offset >> ext2->block_shift;
+    const uint32_t last_blk = (offset + size - 1) >> ext2->block_shift;
+    const uint64_t end = offset + size;
+    bool zero_first = false, zero_last = false;
+    uint32_t block;
+
+    if (offset % ext2->block_size != 0 || (end % ext2->block_size != 0 && 
+                first_blk == last_blk && end < old_size)) {
+        error = get_data_block(ext2, &inode_struct, first_blk, &block);
+        if (error)
+            return error;
+        zero_first = (block == 0);
+    }
+
+    if (last_blk != first_blk && end % ext2->block_size != 0 && end < old_size) {
+        error = get_data_block(ext2, &inode_struct, last_blk, &block);
+        if (error)
+            return error;
+        zero_last = (block == 0);
+    }
+
+    // every missing block is allocated at once
+    error = reserve_data_blocks(ext2, ctx, inode, &inode_struct, first_blk, 
+            last_blk - first_blk + 1, false);
+    if (error)
+        return error;
+
+    if (zero_first) {
+        error = get_data_block(ext2, &inode_struct, first_blk, &block);
+        if (!error)
+            error = zero_blocks(ext2, block, 1);
+        if (error)
+            return error;
+    }
+
+    if (zero_last) {
+        error = get_data_block(ext2, &inode_struct, last_blk, &block);
+        if (!error)
+            error = zero_blocks(ext2, block, 1);
+        if (error)
+            return error;
+    }
+
+    uint32_t sz = size;
+    uint64_t off = offset;
+
+    // chunks that land on consecutive blocks are sent in a single write
+    uint64_t pending_addr = 0;
+    uint32_t pending_size = 0;
+    const uint8_t* pending_buf = buffer;
+
+    while (sz > 0) {
+        uint32_t blk_index = off >> ext2->block_shift;
+        uint32_t block_offset = off & (ext2->block_size - 1);
+        uint32_t remaining = ext2->block_size - block_offset;
+        uint32_t bytes_to_write = (remaining < sz) ? remaining : sz;
+        uint32_t datablock;
+
+        error = get_data_block(ext2, &inode_struct, blk_index, &datablock);
+        if (error)
+            return error;
+
+        uint64_t addr = BLOCK_ADDR(ext2, datablock) + block_offset;
+
+        if (pending_size > 0 && addr != pending_addr + pending_size) {
+            error = dev_write(ext2, pending_addr, pending_size, pending_buf);
+            if (error)
+                return error;
+
+            pending_buf += pending_size;
+            pending_size = 0;
+        }
+
+        if (pending_size == 0)
+            pending_addr = addr;
+
+        pending_size += bytes_to_write;
+        off += bytes_to_write;
+        sz -= bytes_to_write;
+    }
+
+    if (pending_size > 0) {
+        error = dev_write(ext2, pending_addr, pending_size, pending_buf);
+        if (error)
+            return error;
+    }
+
+    error = set_inode_size(ext2, &inode_struct, MAX(old_size, offset + size));
+    if (error)
+        return error;
+
+    return write_inode(ext2, inode, &inode_struct);
+}
+
+// Allocates every missing block in [offset, offset + size) and zeros them
+ext2_error_t fallocate_data(ext2_t* ext2, ext2_alloc_ctx_t* ctx, uint32_t inode,
+        uint64_t offset, uint64_t size) {
+    ext2_inode_t inode_struct;
+    ext2_error_t err = read_inode(ext2, inode, &inode_struct);
+    if (err)
+        return err;
+
+    if (offset + size > ext2->max_file_size)
+        return EXT2_ERR_FILE_TOO_BIG;
+
+    // like truncate_data, the old last block might have garbage after the
+    // old end of file
+    const uint64_t old_size = get_inode_size(&inode_struct);
+    if (offset + size > old_size) {
+        err = zero_block_tail(ext2, &inode_struct, old_size);
+        if (err)
+            return err;
+    }
+
+    uint32_t blk_index = offset / ext2->block_size;
+    uint32_t end = CEIL(offset + size, ext2->block_size);
+
+    err = reserve_data_blocks(ext2, ctx, inode, &inode_struct, blk_index, 
+            end - blk_index, true);
+    if (err)
+        return err;
+
+    err = set_inode_size(ext2, &inode_struct, 
+            MAX(old_size, offset + size));
+    if (err)
+        return err;
+
+    return write_inode(ext2, inode, &inode_struct);
+}
+
+// Copies 'count' blocks from 'src' to 'dst' in as few device calls as 
+// possible: a single call to the copy callback if there's one, otherwise
+// buffer-sized reads and writes
+ext2_error_t copy_blocks(ext2_t* ext2, uint32_t src, uint32_t dst, 
+        uint32_t count) {
+    uint8_t buf[EXT2_COPY_BUFFER_SIZE];
+    uint64_t src_addr = BLOCK_ADDR(ext2, src);
+    uint64_t dst_addr = BLOCK_ADDR(ext2, dst);
+    uint64_t remaining = BLOCK_ADDR(ext2, count);
+
+    while (remaining > 0) {
+        ext2_error_t err;
+        uint32_t chunk;
+
+        if (ext2->copy) {
+            chunk = (remaining < (1U << 30)) ? remaining : (1U << 30);
+            err = dev_copy(ext2, dst_addr, src_addr, chunk);
+        } else {
+            chunk = (remaining < sizeof(buf)) ? remaining : sizeof(buf);
+            err = dev_read(ext2, src_addr, chunk, buf);
+            if (!err)
+                err = dev_write(ext2, dst_addr, chunk, buf);
+        }
+
+        if (err)
+            return err;
+
+        src_addr += chunk;
+        dst_addr += chunk;
+        remaining -= chunk;
+    }
+
+    return 0;
+}
+
+// copies file data through a buffer. Used for the parts of a copy that don't
+// cover whole blocks
+ext2_error_t copy_data_buffered(ext2_t* ext2, ext2_alloc_ctx_t* ctx, 
+        uint32_t src, uint64_t src_off, uint32_t dst, uint64_t dst_off, 
+        uint64_t len) {
+    uint8_t buf[EXT2_COPY_BUFFER_SIZE];
+
+    while (len > 0) {
+        uint32_t chunk = (len < sizeof(buf)) ? len : sizeof(buf);
+
+        ext2_error_t err = read_data(ext2, src, src_off, chunk, buf);
+        if (err)
+            return err;
+
+        err = write_data(ext2, ctx, dst, dst_off, chunk, buf);
+        if (err)
+            return err;
+
+        src_off += chunk;
+        dst_off += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+// Copies 'count' whole blocks of the file 'src' into the file 'dst'. Holes
+// stay holes (unless they land on allocated blocks, which are zeroed). Missing
+// destination blocks are reserved for each stretch of data at once, so the
+// copy is contiguous even if the source isn't
+ext2_error_t copy_data_blocks(ext2_t* ext2, ext2_alloc_ctx_t* ctx, 
+        uint32_t src, uint32_t src_blk, uint32_t dst, uint32_t dst_blk, 
+        uint32_t count) {
+    ext2_inode_t src_struct, dst_struct;
+
+    ext2_error_t err = read_inode(ext2, src, &src_struct);
+    if (err)
+        return err;
+    err = read_inode(ext2, dst, &dst_struct);
+    if (err)
+        return err;
+
+    while (count > 0) {
+        uint32_t src_block, len;
+        err = get_block_run(ext2, &src_struct, src_blk, count, &src_block, &len);
+        if (err)
+            return err;
+
+        if (src_block == 0) {
+            for (uint32_t done = 0; done < len; ) {
+                uint32_t dst_block, dst_len;
+                err = get_block_run(ext2, &dst_struct, dst_blk + done, 
+                        len - done, &dst_block, &dst_len);
+                if (err)
+                    return err;
+
+                if (dst_block != 0) {
+                    err = zero_blocks(ext2, dst_block, dst_len);
+                    if (err)
+                        return err;
+                }
+
+                done += dst_len;
+            }
+        } else {
+            // the stretch of data goes on until the next hole
+            while (len < count) {
+                uint32_t block;
+                err = get_data_block(ext2, &src_struct, src_blk + len, &block);
+                if (err)
+                    return err;
+                if (block == 0)
+                    break;
+                len++;
+            }
+
+            err = reserve_data_blocks(ext2, ctx, dst, &dst_struct, dst_blk, len, 
+                    false);
+            if (err)
+                return err;
+
+            for (uint32_t done = 0; done < len; ) {
+                uint32_t dst_block, run;
+
+                err = get_block_run(ext2, &src_struct, src_blk + done, 
+                        len - done, &src_block, &run);
+                if (err)
+                    return err;
+
+                err = get_block_run(ext2, &dst_struct, dst_blk + done, run, 
+                        &dst_block, &run);
+                if (err)
+                    return err;
+
+                err = copy_blocks(ext2, src_block, dst_block, run);
+                if (err)
+                    return err;
+
+                done += run;
+            }
+        }
+
+        src_blk += len;
+        dst_blk += len;
+        count -= len;
+    }
+
+    uint64_t end = BLOCK_ADDR(ext2, dst_blk);
+    err = set_inode_size(ext2, &dst_struct, MAX(get_inode_size(&dst_struct), end));
+    if (err)
+        return err;
+
+    return write_inode(ext2, dst, &dst_struct);
+}
+
+// Copies 'len' bytes from one file to another. When both offsets sit at the 
+// same position inside a block, the whole blocks in the middle are copied 
+// block-to-block (keeping holes); everything else goes through a buffer
+ext2_error_t copy_data(ext2_t* ext2, ext2_alloc_ctx_t* ctx, uint32_t src, 
+        uint64_t src_off, uint32_t dst, uint64_t dst_off, uint64_t len) {
+    ext2_inode_t inode_struct;
+    ext2_error_t err = read_inode(ext2, src, &inode_struct);
+    if (err)
+        return err;
+
+    if (src_off + len > get_inode_size(&inode_struct))
+        return EXT2_ERR_DATA_OUT_OF_BOUNDS;
+
+    err = read_inode(ext2, dst, &inode_struct);
+    if (err)
+        return err;
+
+    if (dst_off > get_inode_size(&inode_struct))
+        return EXT2_ERR_DATA_OUT_OF_BOUNDS;
+
+    if (dst_off + len > ext2->max_file_size)
+        return EXT2_ERR_FILE_TOO_BIG;
+
+    if (src == dst && src_off < dst_off + len && dst_off < src_off + len)
+        return EXT2_ERR_RANGES_OVERLAP;
+
+    if (src_off % ext2->block_size != dst_off % ext2->block_size)
+        return copy_data_buffered(ext2, ctx, src, src_off, dst, dst_off, len);
+
+    // partial block at the start
+    uint64_t head = (ext2->block_size - dst_off % ext2->block_size) % 
+        ext2->block_size;
+    if (head > len)
+        head = len;
+
+    err = copy_data_buffered(ext2, ctx, src, src_off, dst, dst_off, head);
+    if (err)
+        return err;
+
+    src_off += head;
+    dst_off += head;
+    len -= head;
+
+    uint32_t count = len / ext2->block_size;
+    if (count > 0) {
+        err = copy_data_blocks(ext2, ctx, src, src_off / ext2->block_size, dst, 
+                dst_off / ext2->block_size, count);
+        if (err)
+            return err;
+    }
+
+    // partial block at the end
+    uint64_t middle = BLOCK_ADDR(ext2, count);
+    return copy_data_buffered(ext2, ctx, src, src_off + middle, dst, 
+            dst_off + middle, len - middle);
+}
+
+// Looks a name up in a directory, holding a shared lock on it meanwhile. 
+// When the path goes on past the name, the file_type of the entry tells if 
+// it's a directory without reading its inode
+ext2_error_t lookup(ext2_t* ext2, uint32_t dir_inode, const char* name, 
+        const char* rest, uint32_t* inode) {
+    uint8_t type;
+
+    take_lock(ext2, EXT2_LOCK_INODE, dir_inode, false);
+    ext2_error_t error = locate_inode_in_dir(ext2, dir_inode, name, inode, &type);
+    release_lock(ext2, EXT2_LOCK_INODE, dir_inode, false);
+
+    if (!error && *rest == '/' && type != EXT2_ET_UNKNOWN && type != EXT2_ET_DIR)
+        return EXT2_ERR_NOT_A_DIR;
+
+    return error;
+}
+
+ext2_error_t locate_inode(ext2_t* ext2, const char* path, uint32_t* inode) {
+    uint32_t ino = EXT2_ROOT_INODE;
+    char current_name[EXT2_MAX_FILE_NAME + 1];
+
+    uint32_t chars_read;
+    ext2_error_t error;
+
+    if (path[0] != '/') {
+        return EXT2_ERR_BAD_PATH;
+    } else if (path[1] != '\0') {
+        while (*path == '/') {
+            path++;
+
+            error = parse_filename(path, current_name, &chars_read);
+
+            if (error)
+                return error;
+
+            path += chars_read;
+
+            error = lookup(ext2, ino, current_name, path, &ino);
+
+            if (error)
+                return error;
+        }
+    }
+
+    *inode = ino;
+
+    return 0;
+}
+
+ext2_error_t locate_parent_inode(ext2_t* ext2, const char* path, uint32_t* parent) {
+    uint32_t ino = EXT2_ROOT_INODE;
+    uint32_t previous_ino = ino;
+    char current_name[EXT2_MAX_FILE_NAME + 1];
+
+    uint32_t chars_read;
+    ext2_error_t error;
+
+    if (path[0] != '/') {
+        return EXT2_ERR_BAD_PATH;
+    } else if (path[1] != '\0') {
+        while (*path == '/') {
+            path++;
+
+            error = parse_filename(path, current_name, &chars_read);
+
+            if (error)
+                return error;
+
+            path += chars_read;
+
+            previous_ino = ino;
+
+            if (*path == '\0')
+                break;
+
+            error = lookup(ext2, ino, current_name, path, &ino);
+
+            if (error)
+                return error;
+
+        }
+    }
+
+    *parent = previous_ino;
+    return 0;
+}
+
+// Reserves the first free inode of a group, or sets 'inode' to 0 if there's
+// none. The caller must hold the group lock
+ext2_error_t alloc_inode_in_group(ext2_t* ext2, uint32_t group, uint32_t* inode) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    ext2_bgd_t bgd;
+
+    *inode = 0; // no free inode found yet
+
+    ext2_error_t error = read_bgd(ext2, group, &bgd);
+    if (error)
+        return error;
+
+    if (bgd.free_inodes_count == 0)
+        return 0;
+
+    uint64_t bitmap_addr = BLOCK_ADDR(ext2, bgd.inode_bitmap);
+    uint32_t nbits = ext2->superblk.inodes_per_group;
+    uint32_t bit, len;
+
+    STAT_ADD(ext2, bitmap_scans, 1);
+
+    // an uninitialized bitmap is written whole on first use
+    if (bgd_flag(ext2, &bgd, EXT2_BG_INODE_UNINIT)) {
+        build_inode_bitmap(ext2, bitmap);
+        error = dev_write(ext2, bitmap_addr, ext2->block_size, bitmap);
+        bgd.flags &= ~EXT2_BG_INODE_UNINIT;
+    } else {
+        error = dev_read(ext2, bitmap_addr, CEIL(nbits, 8), bitmap);
+    }
+    if (error)
+        return error;
+
+    find_free_run(bitmap, nbits, 0, 1, &bit, &len);
+
+    if (len == 0)
+        return 0;
+
+    SET_BIT(bitmap, bit);
+    error = dev_write(ext2, bitmap_addr + bit / 8, 1, &bitmap[bit / 8]);
+    if (error)
+        return error;
+
+    // With uninit_bg, the end of the inode table may have never been written.
+    // Slots that come into use are zeroed, so they hold no garbage
+    if ((ext2->superblk.feature_ro_compat & EXT2_FEATURE_RO_COMPAT_GDT_CSUM) &&
+            bit >= nbits - bgd.itable_unused) {
+        if (!(bgd.flags & EXT2_BG_INODE_ZEROED)) {
+            uint32_t from = nbits - bgd.itable_unused;
+            uint64_t addr = BLOCK_ADDR(ext2, bgd.inode_table) + 
+                (uint64_t)from * ext2->inode_size;
+
+            for (uint32_t i = from; i <= bit && !error; i++) {
+                error = dev_write(ext2, addr, ext2->inode_size, zero_block);
+                addr += ext2->inode_size;
+            }
+            if (error)
+                return error;
+        }
+
+        bgd.itable_unused = nbits - bit - 1;
+    }
+
+    bgd.free_inodes_count -= 1;
+    error = write_bgd(ext2, group, &bgd);
+    if (error)
+        return error;
+
+    *inode = group * ext2->superblk.inodes_per_group + bit + 1;
+    return update_free_counts(ext2, 0, -1);
+}
+
+ext2_error_t get_free_inode_in_group(ext2_t* ext2, uint32_t group, uint32_t* inode) {
+    take_lock(ext2, EXT2_LOCK_GROUP, group, true);
+    ext2_error_t error = alloc_inode_in_group(ext2, group, inode);
+    release_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+    return error;
+}
+
+ext2_error_t get_free_inode(ext2_t* ext2, uint32_t preferred_group, 
+        uint32_t* inode) {
+    int group = preferred_group;
+
+    do {
+        ext2_error_t err = get_free_inode_in_group(ext2, group, inode);
+
+        if (err)
+            return err;
+
+        if (*inode != 0)
+            return 0;
+
+        group = (group + 1) % ext2->block_group_count;
+    } while (group != preferred_group);
+
+    return EXT2_ERR_INODES_DEPLETED;
+}
+
+// file_type of the dir entries of a file with the given mode. Only 
+// filesystems with the filetype feature keep it, others get EXT2_ET_UNKNOWN
+uint8_t get_dir_entry_type(ext2_t* ext2, uint16_t mode) {
+    if (ext2->superblk.rev_level == EXT2_GOOD_OLD_REV ||
+            !(ext2->superblk.feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE))
+        return EXT2_ET_UNKNOWN;
+
+    switch (GET_FILE_FMT(mode)) {
+    case EXT2_FMT_REG:  return EXT2_ET_REG;
+    case EXT2_FMT_DIR:  return EXT2_ET_DIR;
+    case EXT2_FMT_CHR:  return EXT2_ET_CHR;
+    case EXT2_FMT_BLK:  return EXT2_ET_BLK;
+    case EXT2_FMT_FIFO: return EXT2_ET_FIFO;
+    case EXT2_FMT_SOCK: return EXT2_ET_SOCK;
+    case EXT2_FMT_LNK:  return EXT2_ET_LNK;
+    default:            return EXT2_ET_UNKNOWN;
+    }
+}
+
+ext2_error_t create_dir_entry(ext2_t* ext2, uint32_t inode, uint16_t mode,
+        const char* name, ext2_directory_entry_t* entry) {
+    uint32_t namelen = strlen(name);
+    if (namelen > EXT2_MAX_FILE_NAME)
+        return EXT2_ERR_FILENAME_TOO_BIG;
+
+    entry->inode = inode;
+    entry->name_len = namelen;
+    entry->file_type = get_dir_entry_type(ext2, mode);
+    strcpy(entry->name, name);
+
+    return 0;
+}
+
+// size of the fields of a dir entry that precede the name
+#define DIR_ENTRY_HEADER_SIZE 8
+
+// space a dir entry takes on disk (entries are 4-byte aligned)
+#define DIR_REC_LEN(name_len) ((DIR_ENTRY_HEADER_SIZE + (name_len) + 3) & ~3)
+
+// Adds an entry to a directory. It goes into the first gap that can hold it,
+// either the unused end of another entry's record or an empty record. If 
+// there's none, a block is appended to the directory. Blocks are read and 
+// written whole, so directories always end at a block boundary
+ext2_error_t add_dir_entry(ext2_t* ext2, uint32_t dir_inode, 
+        ext2_directory_entry_t* entry) {
+    uint32_t block[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    uint8_t* data = (uint8_t*)block;
+    uint32_t needed = DIR_REC_LEN(entry->name_len);
+
+    ext2_inode_t inode_struct;
+    ext2_error_t err = read_inode(ext2, dir_inode, &inode_struct);
+    if (err)
+        return err;
+
+    for (uint32_t off = 0; off < inode_struct.size; off += ext2->block_size) {
+        uint32_t chunk = inode_struct.size - off;
+        if (chunk > ext2->block_size)
+            chunk = ext2->block_size;
+
+        err = read_data(ext2, dir_inode, off, chunk, data);
+        if (err)
+            return err;
+
+        uint32_t pos = 0;
+
+        while (pos + DIR_ENTRY_HEADER_SIZE <= chunk) {
+            ext2_directory_entry_t cur;
+            memcpy(&cur, data + pos, DIR_ENTRY_HEADER_SIZE);
+            STAT_ADD(ext2, dir_entries_scanned, 1);
+
+            if (cur.rec_len < DIR_ENTRY_HEADER_SIZE)
+                break; // corrupted block, leave it alone
+
+            uint32_t used = (cur.inode != 0) ? DIR_REC_LEN(cur.name_len) : 0;
+
+            if (cur.rec_len >= used + needed) {
+                entry->rec_len = cur.rec_len - used;
+
+                if (used > 0) {
+                    cur.rec_len = used;
+                    memcpy(data + pos, &cur, DIR_ENTRY_HEADER_SIZE);
+                    pos += used;
+                }
+
+                memcpy(data + pos, entry, DIR_ENTRY_HEADER_SIZE + entry->name_len);
+                return write_data(ext2, NULL, dir_inode, off, chunk, data);
+            }
+
+            pos += cur.rec_len;
+        }
+    }
+
+    // no room left, the entry takes a whole new block
+    memset(data, 0, ext2->block_size);
+    entry->rec_len = ext2->block_size;
+    memcpy(data, entry, DIR_ENTRY_HEADER_SIZE + entry->name_len);
+
+    return write_data(ext2, NULL, dir_inode, inode_struct.size, 
+            ext2->block_size, data);
+}
+
+// adds an entry for 'inode', a file of format 'fmt', to a directory
+ext2_error_t link(ext2_t* ext2, uint32_t dir_inode, uint32_t inode, 
+        ext2_file_format_t fmt, const char* name) {
+
+    ext2_directory_entry_t entry;
+    ext2_error_t err = create_dir_entry(ext2, inode, fmt, name, &entry);
+    if (err)
+        return err;
+
+    err = add_dir_entry(ext2, dir_inode, &entry);
+    if (err)
+        return err;
+
+    ext2_inode_t inode_struct;
+    err = read_inode(ext2, inode, &inode_struct);
+    if (err)
+        return err;
+    inode_struct.links_count += 1;
+    err = write_inode(ext2, inode, &inode_struct);
+    if (err)
+        return err;
+
+    return 0;
+}
+
+// extracts the filename from a full path
+ext2_error_t get_file_name(const char* path, char* name) {
+    const char* lastsep = path;
+    while (*path != '\0') {
+        if (*path == '/')
+            lastsep = path + 1;
+        path++;
+    }
+    
+    if (strlen(lastsep) > EXT2_MAX_FILE_NAME)
+        return EXT2_ERR_FILENAME_TOO_BIG;
+
+    strcpy(name, lastsep);
+
+    return 0;
+}
+
+void set_inode_file_fmt(ext2_inode_t* inode_struct, ext2_file_format_t fmt) {
+    inode_struct->mode &= 0x0FFF;
+    inode_struct->mode |= fmt;
+}
+
+// counts a new directory in the descriptor of its group
+ext2_error_t add_used_dir(ext2_t* ext2, uint32_t group) {
+    ext2_bgd_t bgd;
+
+    take_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+    ext2_error_t error = read_bgd(ext2, group, &bgd);
+    if (!error) {
+        bgd.used_dirs_count += 1;
+        error = write_bgd(ext2, group, &bgd);
+    }
+
+    release_lock(ext2, EXT2_LOCK_GROUP, group, true);
+    return error;
+}
+
+// Creates a file of format 'fmt' called 'name' inside a directory. If the name
+// is taken, 'ino' is set to the existing inode and EXT2_ERR_FILE_EXISTS is 
+// returned. The caller must hold an exclusive lock on the directory
+ext2_error_t create_in_dir(ext2_t* ext2, uint32_t dir_inode, const char* name,
+        ext2_file_format_t fmt, uint32_t* ino) {
+    ext2_error_t err = locate_inode_in_dir(ext2, dir_inode, name, ino, NULL);
+
+    if (err == 0)
+        return EXT2_ERR_FILE_EXISTS;
+    if (err != EXT2_ERR_FILE_NOT_FOUND)
+        return err;
+
+    uint32_t inode;
+    err = get_free_inode(ext2, get_inode_group(ext2, dir_inode), &inode);
+    if (err)
+        return err;
+
+    // nobody can reach the inode before it's linked to the directory, so it's
+    // set up without locking it
+    ext2_inode_t inode_struct;
+    memset(&inode_struct, 0, sizeof(inode_struct));
+    set_inode_file_fmt(&inode_struct, fmt);
+
+    err = write_inode(ext2, inode, &inode_struct);
+    if (err)
+        return err;
+
+    if (fmt == EXT2_FMT_DIR) {
+        err = link(ext2, inode, inode, EXT2_FMT_DIR, ".");
+        if (err)
+            return err;
+
+        err = link(ext2, inode, dir_inode, EXT2_FMT_DIR, "..");
+        if (err)
+            return err;
+
+        err = add_used_dir(ext2, get_inode_group(ext2, inode));
+        if (err)
+            return err;
+    }
+
+    err = link(ext2, dir_inode, inode, fmt, name);
+    if (err)
+        return err;
+
+    *ino = inode;
+    return 0;
+}
+
+// Creates a file (or directory) at 'path', see create_in_dir. The parent 
+// directory stays locked from the lookup of the name until the new entry is 
+// in place, so threads creating the same path end up with the same file
+ext2_error_t create_file(ext2_t* ext2, const char* path, ext2_file_format_t fmt,
+        uint32_t* ino) {
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    uint32_t dir_inode;
+    ext2_error_t err = locate_parent_inode(ext2, path, &dir_inode);
+    if (err)
+        return err;
+
+    char filename[EXT2_MAX_FILE_NAME + 1];
+    err = get_file_name(path, filename);
+    if (err)
+        return err;
+
+    if (filename[0] == '\0')
+        return EXT2_ERR_BAD_PATH;
+
+    take_lock(ext2, EXT2_LOCK_INODE, dir_inode, true);
+    err = create_in_dir(ext2, dir_inode, filename, fmt, ino);
+    release_lock(ext2, EXT2_LOCK_INODE, dir_inode, true);
+
+    return err;
+}
+
+// Consistency checker (see ext2_check). Groups are checked in two parallel
+// passes: the first walks the inode table of each group, marking every block
+// the inodes use and counting the references in every directory entry. The 
+// second compares the bitmaps, link counts and group counters of each group
+// with what was found. Both passes share the maps in the workspace, which are
+// only touched through atomic operations
+
+// results for a single group
+typedef struct {
+    ext2_check_report_t report;
+    uint32_t dirs;        // directories among the group's inodes
+    uint32_t free_blocks; // blocks of the group that nothing uses
+    uint32_t free_inodes; // inodes of the group that nothing uses
+    ext2_error_t error;
+} check_group_t;
+
+typedef struct {
+    ext2_t* ext2;
+    const ext2_check_params_t* params;
+    uint32_t first_ino;        // first inode that isn't reserved
+    check_group_t* groups;
+    uint16_t* links;           // link count of each inode, as stored on disk
+    _Atomic uint16_t* refs;    // dir entries that point to each inode
+    _Atomic uint8_t* used;     // blocks in use (bit 0 is first_data_block)
+} check_state_t;
+
+// sizes of the parts of the checker's workspace, rounded up to 8 bytes
+
+uint64_t check_groups_size(ext2_t* ext2) {
+    return ALIGN8((uint64_t)ext2->block_group_count * sizeof(check_group_t));
+}
+
+uint64_t check_inodes_size(ext2_t* ext2) {
+    return ALIGN8(((uint64_t)ext2->superblk.inodes_count + 1) * sizeof(uint16_t));
+}
+
+uint64_t check_blocks_size(ext2_t* ext2) {
+    return ALIGN8(CEIL((uint64_t)ext2->superblk.blocks_count - 
+                ext2->superblk.first_data_block, 8));
+}
+
+// marks a block as used. Returns false if it's outside the filesystem
+bool check_mark_block(check_state_t* st, check_group_t* res, uint32_t block) {
+    ext2_superblock_t* sb = &st->ext2->superblk;
+
+    if (block < sb->first_data_block || block >= sb->blocks_count) {
+        res->report.bad_blocks++;
+        return false;
+    }
+
+    uint32_t bit = block - sb->first_data_block;
+    uint8_t old = atomic_fetch_or_explicit(&st->used[bit / 8], 
+            1 << (bit % 8), memory_order_relaxed);
+
+    if (old & (1 << (bit % 8)))
+        res->report.dup_blocks++;
+
+    return true;
+}
+
+// Checks the rec_len chain of a directory block and counts the references 
+// its entries make
+ext2_error_t check_dir_block(check_state_t* st, check_group_t* res, 
+        uint32_t block) {
+    uint32_t data[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    ext2_t* ext2 = st->ext2;
+
+    ext2_error_t err = dev_read(ext2, BLOCK_ADDR(ext2, block), ext2->block_size,
+            data);
+    if (err)
+        return err;
+
+    for (uint32_t pos = 0; pos < ext2->block_size; ) {
+        ext2_directory_entry_t entry;
+        memcpy(&entry, (uint8_t*)data + pos, DIR_ENTRY_HEADER_SIZE);
+        STAT_ADD(ext2, dir_entries_scanned, 1);
+
+        if (entry.rec_len < DIR_ENTRY_HEADER_SIZE || entry.rec_len % 4 != 0 ||
+                pos + entry.rec_len > ext2->block_size ||
+                entry.inode > ext2->superblk.inodes_count ||
+                (entry.inode != 0 && DIR_REC_LEN(entry.name_len) > entry.rec_len)) {
+            res->report.bad_dir_blocks++;
+            return 0;
+        }
+
+        if (entry.inode != 0)
+            atomic_fetch_add_explicit(&st->refs[entry.inode], 1, 
+                    memory_order_relaxed);
+
+        pos += entry.rec_len;
+    }
+
+    return 0;
+}
+
+// Marks the blocks under a block pointer of an inode. 'level' is 0 for data
+// blocks and goes up to 3 for triply-indirect blocks. 'count' is incremented
+// by the number of blocks found
+ext2_error_t check_walk(check_state_t* st, check_group_t* res, uint32_t block,
+        int level, bool is_dir, uint32_t* count) {
+    uint32_t ptrs[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    ext2_t* ext2 = st->ext2;
+
+    if (block == 0 || !check_mark_block(st, res, block))
+        return 0;
+
+    (*count)++;
+
+    if (level == 0)
+        return is_dir ? check_dir_block(st, res, block) : 0;
+
+    ext2_error_t err = dev_read(ext2, BLOCK_ADDR(ext2, block), ext2->block_size,
+            ptrs);
+    if (err)
+        return err;
+
+    for (uint32_t i = 0; i < ext2->block_size / sizeof(uint32_t); i++) {
+        err = check_walk(st, res, ptrs[i], level - 1, is_dir, count);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+ext2_error_t check_inode(check_state_t* st, check_group_t* res, uint32_t ino,
+        const ext2_inode_t* inode) {
+    ext2_t* ext2 = st->ext2;
+    ext2_file_format_t fmt = GET_FILE_FMT(inode->mode);
+    bool is_dir = (fmt == EXT2_FMT_DIR);
+    uint32_t count = 0;
+
+    st->links[ino] = inode->links_count;
+
+    if (is_dir)
+        res->dirs++;
+
+    if (inode->file_acl != 0 && check_mark_block(st, res, inode->file_acl))
+        count++;
+
+    // device files keep device numbers in the block pointers and fast 
+    // symlinks keep their target
+    bool has_blocks = (fmt != EXT2_FMT_CHR && fmt != EXT2_FMT_BLK && 
+            fmt != EXT2_FMT_FIFO && fmt != EXT2_FMT_SOCK &&
+            !(fmt == EXT2_FMT_LNK && inode->blocks == count * (ext2->block_size / 512)));
+
+    for (int i = 0; has_blocks && i < 15; i++) {
+        int level = (i < 12) ? 0 : i - 11;
+        ext2_error_t err = check_walk(st, res, inode->block[i], level, is_dir, 
+                &count);
+        if (err)
+            return err;
+    }
+
+    if (has_blocks && inode->blocks != count * (ext2->block_size / 512))
+        res->report.bad_block_counts++;
+
+    return 0;
+}
+
+// first pass over a group: metadata blocks and inode table
+ext2_error_t check_group_inodes(check_state_t* st, uint32_t group) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    uint8_t table[EXT2_COPY_BUFFER_SIZE];
+    ext2_t* ext2 = st->ext2;
+    check_group_t* res = &st->groups[group];
+    ext2_bgd_t bgd;
+
+    ext2_error_t err = read_bgd(ext2, group, &bgd);
+    if (err)
+        return err;
+
+    if (group_has_super(ext2, group)) {
+        uint32_t first = get_group_first_block(ext2, group);
+        uint32_t gdt_blocks = CEIL(ext2->block_group_count * sizeof(ext2_bgd_t),
+                ext2->block_size);
+
+        for (uint32_t i = 0; i < 1 + gdt_blocks; i++)
+            check_mark_block(st, res, first + i);
+    }
+
+    uint32_t ipg = ext2->superblk.inodes_per_group;
+    uint32_t table_blocks = CEIL(ipg * ext2->inode_size, ext2->block_size);
+
+    check_mark_block(st, res, bgd.block_bitmap);
+    check_mark_block(st, res, bgd.inode_bitmap);
+    for (uint32_t i = 0; i < table_blocks; i++)
+        check_mark_block(st, res, bgd.inode_table + i);
+
+    if (bgd_flag(ext2, &bgd, EXT2_BG_INODE_UNINIT))
+        return 0;
+
+    err = dev_read(ext2, BLOCK_ADDR(ext2, bgd.inode_bitmap), CEIL(ipg, 8), bitmap);
+    if (err)
+        return err;
+
+    // with uninit_bg, the end of the table was never used
+    uint32_t used_ipg = ipg;
+    if (ext2->superblk.feature_ro_compat & EXT2_FEATURE_RO_COMPAT_GDT_CSUM)
+        used_ipg = ipg - bgd.itable_unused;
+
+    // the table is read in big chunks, skipping the ones with no used inode
+    uint32_t per_chunk = sizeof(table) / ext2->inode_size;
+
+    for (uint32_t first = 0; first < used_ipg; first += per_chunk) {
+        uint32_t n = (used_ipg - first < per_chunk) ? used_ipg - first : per_chunk;
+        bool any = false;
+
+        for (uint32_t i = first; i < first + n && !any; i++)
+            any = BIT_IS_SET(bitmap, i);
+
+        if (!any)
+            continue;
+
+        err = dev_read(ext2, BLOCK_ADDR(ext2, bgd.inode_table) + 
+                (uint64_t)first * ext2->inode_size, n * ext2->inode_size, table);
+        if (err)
+            return err;
+
+        for (uint32_t i = first; i < first + n; i++) {
+            if (!BIT_IS_SET(bitmap, i))
+                continue;
+
+            ext2_inode_t inode;
+            memcpy(&inode, table + (i - first) * ext2->inode_size, sizeof(inode));
+
+            err = check_inode(st, res, group * ipg + i + 1, &inode);
+            if (err)
+                return err;
+        }
+    }
+
+    return 0;
+}
+
+// second pass over a group: bitmaps, link counts and descriptor counters
+ext2_error_t check_group_maps(check_state_t* st, uint32_t group) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    ext2_t* ext2 = st->ext2;
+    check_group_t* res = &st->groups[group];
+    ext2_bgd_t bgd;
+
+    ext2_error_t err = read_bgd(ext2, group, &bgd);
+    if (err)
+        return err;
+
+    uint32_t nbits = get_group_block_count(ext2, group);
+    uint32_t first_bit = group * ext2->superblk.blocks_per_group;
+
+    if (bgd_flag(ext2, &bgd, EXT2_BG_BLOCK_UNINIT))
+        build_block_bitmap(ext2, group, &bgd, bitmap);
+    else
+        err = dev_read(ext2, BLOCK_ADDR(ext2, bgd.block_bitmap), CEIL(nbits, 8),
+                bitmap);
+    if (err)
+        return err;
+
+    res->free_blocks = 0;
+    for (uint32_t i = 0; i < nbits; i++) {
+        uint32_t bit = first_bit + i;
+        bool used = (atomic_load_explicit(&st->used[bit / 8], 
+                    memory_order_relaxed) >> (bit % 8)) & 1;
+
+        if (used != BIT_IS_SET(bitmap, i))
+            res->report.block_bitmap_errors++;
+
+        res->free_blocks += !used;
+    }
+
+    uint32_t ipg = ext2->superblk.inodes_per_group;
+
+    if (bgd_flag(ext2, &bgd, EXT2_BG_INODE_UNINIT))
+        build_inode_bitmap(ext2, bitmap);
+    else
+        err = dev_read(ext2, BLOCK_ADDR(ext2, bgd.inode_bitmap), CEIL(ipg, 8), 
+                bitmap);
+    if (err)
+        return err;
+
+    res->free_inodes = 0;
+    for (uint32_t i = 0; i < ipg; i++) {
+        uint32_t ino = group * ipg + i + 1;
+        uint16_t refs = atomic_load_explicit(&st->refs[ino], memory_order_relaxed);
+        bool used = (ino < st->first_ino) || refs > 0;
+
+        if (used != BIT_IS_SET(bitmap, i))
+            res->report.inode_bitmap_errors++;
+
+        res->free_inodes += !used;
+
+        // reserved inodes other than the root have no meaningful link count
+        bool counted = (ino == EXT2_ROOT_INODE || ino >= st->first_ino);
+
+        if (!counted || !BIT_IS_SET(bitmap, i) || st->links[ino] == refs)
+            continue;
+
+        res->report.bad_link_counts++;
+
+        if (st->params->repair && refs > 0) {
+            ext2_inode_t inode;
+            err = read_inode(ext2, ino, &inode);
+            if (err)
+                return err;
+
+            inode.links_count = refs;
+            err = write_inode(ext2, ino, &inode);
+            if (err)
+                return err;
+
+            res->report.repaired++;
+        }
+    }
+
+    if (bgd.free_blocks_count == res->free_blocks && 
+            bgd.free_inodes_count == res->free_inodes &&
+            bgd.used_dirs_count == res->dirs)
+        return 0;
+
+    res->report.bad_group_counts++;
+
+    if (!st->params->repair)
+        return 0;
+
+    bgd.free_blocks_count = res->free_blocks;
+    bgd.free_inodes_count = res->free_inodes;
+    bgd.used_dirs_count = res->dirs;
+    res->report.repaired++;
+
+    return write_bgd(ext2, group, &bgd);
+}
+
+void check_pass1_task(uint32_t group, void* arg) {
+    check_state_t* st = arg;
+    STAT_JOIN(EXT2_OP_CHECK);
+    st->groups[group].error = check_group_inodes(st, group);
+}
+
+void check_pass2_task(uint32_t group, void* arg) {
+    check_state_t* st = arg;
+    STAT_JOIN(EXT2_OP_CHECK);
+    if (!st->groups[group].error)
+        st->groups[group].error = check_group_maps(st, group);
+}
+
+// runs a task for every group, in parallel if the caller gave a way to
+void check_run(check_state_t* st, void (*task)(uint32_t, void*)) {
+    const ext2_check_params_t* params = st->params;
+
+    if (params->parallel_for) {
+        params->parallel_for(task, st, st->ext2->block_group_count, 
+                params->parallel_context);
+        return;
+    }
+
+    for (uint32_t group = 0; group < st->ext2->block_group_count; group++)
+        task(group, st);
+}
+
+// write_data with the inode locked, allocating through the handle's context
+ext2_error_t write_file(ext2_t* ext2, ext2_file_t* file, uint64_t offset, 
+        uint32_t size, const void* buf) {
+    take_lock(ext2, EXT2_LOCK_INODE, file->inode, true);
+    ext2_error_t error = write_data(ext2, file->alloc_ctx, file->inode, offset,
+            size, buf);
+    release_lock(ext2, EXT2_LOCK_INODE, file->inode, true);
+
+    return error;
+}
+
+// sets the amount of data in the buffer of a handle, and the end that other
+// threads see through buffered_size
+void set_buf_len(ext2_file_t* file, uint32_t len) {
+    file->buf_len = len;
+    atomic_store_explicit((_Atomic uint64_t*)&file->buf_end, 
+            len == 0 ? 0 : file->buf_offset + len, memory_order_release);
+}
+
+// adds a handle to the buffered handles of the mount, once
+void link_buffered(ext2_t* ext2, ext2_file_t* file) {
+    spin_lock(&ext2->buffered_lock);
+
+    ext2_file_t* f = ext2->buffered;
+    while (f != NULL && f != file)
+        f = f->next_buffered;
+
+    if (f == NULL) {
+        file->next_buffered = ext2->buffered;
+        atomic_store_explicit((_Atomic(ext2_file_t*)*)&ext2->buffered, file, 
+                memory_order_release);
+    }
+
+    spin_unlock(&ext2->buffered_lock);
+}
+
+void unlink_buffered(ext2_t* ext2, ext2_file_t* file) {
+    spin_lock(&ext2->buffered_lock);
+
+    for (ext2_file_t** link = &ext2->buffered; *link != NULL; 
+            link = &(*link)->next_buffered) {
+        if (*link == file) {
+            atomic_store_explicit((_Atomic(ext2_file_t*)*)link, 
+                    file->next_buffered, memory_order_release);
+            break;
+        }
+    }
+
+    spin_unlock(&ext2->buffered_lock);
+}
+
+// where the data buffered for an inode by the handles of the mount ends, 0 
+// if none is. Called under the inode lock, so a flush isn't halfway through
+uint64_t buffered_size(ext2_t* ext2, uint32_t inode) {
+    if (atomic_load_explicit((_Atomic(ext2_file_t*)*)&ext2->buffered, 
+                memory_order_acquire) == NULL)
+        return 0;
+
+    uint64_t end = 0;
+    spin_lock(&ext2->buffered_lock);
+
+    for (ext2_file_t* f = ext2->buffered; f != NULL; f = f->next_buffered) {
+        if (f->inode == inode)
+            end = MAX(end, atomic_load_explicit((_Atomic uint64_t*)&f->buf_end, 
+                        memory_order_acquire));
+    }
+
+    spin_unlock(&ext2->buffered_lock);
+    return end;
+}
+
+// writes the data waiting in the buffer of a handle
+ext2_error_t flush_file(ext2_t* ext2, ext2_file_t* file) {
+    if (file->buf_len == 0)
+        return 0;
+
+    ext2_error_t error = write_file(ext2, file, file->buf_offset, 
+            file->buf_len, file->buf);
+
+    // on errors the data stays in the buffer, so the flush can be retried
+    if (!error)
+        set_buf_len(file, 0);
+
+    return error;
+}
+
+// computes the values kept in ext2_t from the copy of the superblock
+ext2_error_t init_fs_info(ext2_t* ext2) {
+    ext2_superblock_t superblk = ext2->superblk;
+
+    ext2->block_group_count = superblk.inodes_count / superblk.inodes_per_group;
+
+    // if the block size is huge (> 2 GiB), it would overflow. The rec_len of
+    // a directory entry (16 bits) can't cover a 64 KiB block
+    if (superblk.log_block_size > 5 || 
+            (1024u << superblk.log_block_size) > EXT2_MAX_BLOCK_SIZE) {
+        return EXT2_ERR_BIG_BLOCK;
+    }
+
+    set_block_size(ext2, 1024 << superblk.log_block_size);
+
+    if (superblk.rev_level == EXT2_GOOD_OLD_REV) {
+        ext2->inode_size = EXT2_GOOD_OLD_INODE_SIZE;
+    } else {
+        if (superblk.feature_incompat & ~EXT2_FEATURE_INCOMPAT_SUPP)
+            return EXT2_ERR_UNSUPPORTED_FEATURE;
+
+        ext2->inode_size = superblk.inode_size;
+    }
+
+    // biggest file the block pointers can map. i_blocks (counted in 512-byte 
+    // sectors) limits files to 2 TiB as well
+    const uint64_t bpb = ext2->block_size / sizeof(uint32_t);
+    uint64_t max_blocks = 12 + bpb + bpb * bpb + bpb * bpb * bpb;
+
+    if (max_blocks > UINT32_MAX)
+        max_blocks = UINT32_MAX;
+
+    ext2->max_file_size = max_blocks * ext2->block_size;
+
+    if (ext2->max_file_size > ((uint64_t)UINT32_MAX + 1) * 512)
+        ext2->max_file_size = ((uint64_t)UINT32_MAX + 1) * 512;
+
+    return 0; 
+}
+
+// Finishes a transaction that reached the log (see txn_flush) but maybe 
+// not its home blocks. The log is only trusted if its checksum matches
+ext2_error_t replay_log(ext2_t* ext2) {
+    uint8_t block[EXT2_MAX_BLOCK_SIZE];
+    txn_log_header_t header;
+
+    if (ext2->log_size == 0)
+        return 0;
+
+    ext2_error_t err = dev_read_raw(ext2, ext2->log_start, sizeof(header), 
+            &header);
+    if (err)
+        return err;
+
+    uint32_t bs = header.block_size;
+    if (header.magic != TXN_LOG_MAGIC || header.count == 0 || bs < 1024 || 
+            bs > EXT2_MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0)
+        return 0;
+
+    uint64_t head = txn_head_blocks(bs, header.count);
+    if ((head + header.count) * bs > ext2->log_size)
+        return 0;
+
+    // the list comes right after the header, the blocks after 'head' blocks
+    uint64_t list = ext2->log_start + sizeof(header);
+    uint64_t list_end = list + (uint64_t)header.count * sizeof(uint32_t);
+    uint64_t blocks = ext2->log_start + head * bs;
+    uint32_t crc = 0;
+
+    for (uint64_t at = list; at < list_end && !err; at += bs) {
+        uint32_t len = MIN(list_end - at, bs);
+        err = dev_read_raw(ext2, at, len, block);
+        crc = ext2_crc32c(crc, block, len);
+    }
+
+    for (uint32_t i = 0; i < header.count && !err; i++) {
+        err = dev_read_raw(ext2, blocks + (uint64_t)i * bs, bs, block);
+        crc = ext2_crc32c(crc, block, bs);
+    }
+
+    if (err || crc != header.crc)
+        return err;
+
+    // the home blocks may be from before the commit, and can't be written
+    if (ext2->read_only)
+        return EXT2_ERR_LOG_PENDING;
+
+    for (uint32_t i = 0; i < header.count && !err; i++) {
+        uint32_t home;
+        err = dev_read_raw(ext2, list + (uint64_t)i * sizeof(uint32_t), 
+                sizeof(home), &home);
+        if (!err)
+            err = dev_read_raw(ext2, blocks + (uint64_t)i * bs, bs, block);
+        if (!err)
+            err = dev_write_raw(ext2, (uint64_t)home * bs, bs, block);
+    }
+
+    if (err)
+        return err;
+
+    return dev_write_raw(ext2, ext2->log_start, sizeof(header), zero_block);
+}
+
+// reads the superblock and computes the values kept in ext2_t
+ext2_error_t load_superblock(ext2_t* ext2) {
+    ext2_error_t err = read_superblock(ext2, &ext2->superblk);
+    if (err)
+        return err;
+
+    return init_fs_info(ext2);
+}
+
+// copies the callbacks of a configuration and clears the statistics
+void set_config(ext2_t* ext2, ext2_config_t* cfg) {
+    ext2->read = cfg->read;
+    ext2->write = cfg->write;
+    ext2->read64 = cfg->read64;
+    ext2->write64 = cfg->write64;
+    ext2->copy = cfg->copy;
+    ext2->context = cfg->context;
+    ext2->lock_context = cfg->lock_context;
+    ext2->cache = &ext2->own_cache;
+    ext2->cache_volume = 0;
+    memset(&ext2->own_cache, 0, sizeof(ext2->own_cache));
+    memset(&ext2->txn, 0, sizeof(ext2->txn));
+    ext2->log_start = cfg->log_start;
+    ext2->read_only = (cfg->flags & EXT2_MOUNT_RDONLY) != 0;
+    ext2->delalloc = (cfg->flags & EXT2_MOUNT_DELALLOC) != 0;
+    ext2->buffered_lock = 0;
+    ext2->buffered = NULL;
+
+    // nothing changes on a read-only filesystem, so there's nothing to lock.
+    // The log is still looked at, to refuse mounts that would miss a commit
+    ext2->lock = ext2->read_only ? NULL : cfg->lock;
+    ext2->unlock = ext2->read_only ? NULL : cfg->unlock;
+    ext2->log_size = cfg->log_size;
+
+#if EXT2_STATS
+    memset(&ext2->stats, 0, sizeof(ext2->stats));
+    ext2->clock = cfg->clock;
+    ext2->trace = cfg->trace;
+    ext2->trace_size = cfg->trace ? cfg->trace_size : 0;
+    ext2->trace_head = 0;
+    ext2->on_slow = cfg->on_slow;
+    ext2->slow_threshold = cfg->slow_threshold;
+    ext2->trace_context = cfg->trace_context;
+#endif
+}
+
+// Block group layout used by ext2_format: the copies of the superblock and 
+// descriptor table (if the group has them), then the block bitmap, the inode
+// bitmap and the inode table. With lazy_init, only the first and last groups
+// are initialized
+void format_bgd(ext2_t* ext2, uint32_t group, bool lazy, ext2_bgd_t* bgd) {
+    uint32_t first = get_group_first_block(ext2, group);
+    uint32_t meta = first;
+    uint32_t ipg = ext2->superblk.inodes_per_group;
+    uint32_t table_blocks = CEIL(ipg * ext2->inode_size, ext2->block_size);
+
+    if (group_has_super(ext2, group))
+        meta += 1 + get_gdt_blocks(ext2);
+
+    memset(bgd, 0, sizeof(*bgd));
+    bgd->block_bitmap = meta;
+    bgd->inode_bitmap = meta + 1;
+    bgd->inode_table = meta + 2;
+    bgd->free_blocks_count = get_group_block_count(ext2, group) - 
+        (meta + 2 + table_blocks - first);
+
+    // the reserved inodes are in the first group
+    bgd->free_inodes_count = ipg;
+    if (group == 0)
+        bgd->free_inodes_count -= ext2->superblk.first_ino - 1;
+
+    if (!lazy)
+        return;
+
+    bgd->itable_unused = bgd->free_inodes_count;
+
+    if (group != 0)
+        bgd->flags |= EXT2_BG_INODE_UNINIT;
+
+    // e2fsck wants the last block bitmap written
+    if (group != 0 && group != ext2->block_group_count - 1)
+        bgd->flags |= EXT2_BG_BLOCK_UNINIT;
+}
+
+// Fills the superblock copy of ext2_t for a new filesystem. Groups whose 
+// metadata wouldn't leave room for data are left out
+ext2_error_t format_superblock(ext2_t* ext2, const ext2_format_params_t* params) {
+    uint32_t bs = params->block_size ? params->block_size : 4096;
+    uint32_t isz = params->inode_size ? params->inode_size : 128;
+    uint32_t ratio = params->bytes_per_inode ? params->bytes_per_inode : 16384;
+
+    if ((bs != 1024 && bs != 2048 && bs != 4096) || bs > EXT2_MAX_BLOCK_SIZE ||
+            (isz != 128 && isz != 256) || ratio < 1024)
+        return EXT2_ERR_BAD_FORMAT;
+
+    ext2_superblock_t* sb = &ext2->superblk;
+    memset(sb, 0, sizeof(*sb));
+
+    uint64_t blocks = params->size / bs;
+    if (blocks > UINT32_MAX)
+        blocks = UINT32_MAX;
+
+    sb->first_data_block = (bs == 1024) ? 1 : 0;
+    sb->log_block_size = (bs == 1024) ? 0 : (bs == 2048) ? 1 : 2;
+    sb->log_frag_size = sb->log_block_size;
+    sb->blocks_per_group = bs * 8;
+    sb->frags_per_group = sb->blocks_per_group;
+    sb->magic = EXT2_SUPER_MAGIC;
+    sb->state = 1;  // clean
+    sb->errors = 1; // continue
+    sb->max_mnt_count = 0xFFFF;
+    sb->rev_level = EXT2_DYNAMIC_REV;
+    sb->first_ino = EXT2_GOOD_OLD_FIRST_INO;
+    sb->inode_size = isz;
+    sb->feature_incompat = EXT2_FEATURE_INCOMPAT_FILETYPE;
+    sb->feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+    if (params->lazy_init)
+        sb->feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_GDT_CSUM;
+    memcpy(sb->uuid, params->uuid, sizeof(sb->uuid));
+    memcpy(sb->volume_name, params->volume_name, sizeof(sb->volume_name));
+
+    set_block_size(ext2, bs);
+    ext2->inode_size = isz;
+
+    while (true) {
+        if (blocks <= sb->first_data_block)
+            return EXT2_ERR_BAD_FORMAT;
+
+        uint32_t groups = CEIL(blocks - sb->first_data_block, sb->blocks_per_group);
+
+        // inodes come in whole table blocks and whole bitmap bytes, and the 
+        // first group holds at least the reserved ones
+        uint64_t unit = MAX(bs / isz, 8);
+        uint64_t ipg = CEIL(params->size / ratio, groups);
+        ipg = CEIL(MAX(ipg, 16), unit) * unit;
+        if (ipg > sb->blocks_per_group)
+            ipg = sb->blocks_per_group;
+        if (ipg * groups > UINT32_MAX)
+            ipg = UINT32_MAX / groups / unit * unit;
+
+        sb->blocks_count = blocks;
+        sb->inodes_per_group = ipg;
+        sb->inodes_count = ipg * groups;
+        ext2->block_group_count = groups;
+
+        uint32_t last = groups - 1;
+        uint32_t overhead = 2 + CEIL(ipg * isz, bs) + 
+            (group_has_super(ext2, last) ? 1 + get_gdt_blocks(ext2) : 0);
+
+        // a last group with (almost) no room for data is dropped, like 
+        // mke2fs does
+        if (get_group_block_count(ext2, last) >= overhead + 50)
+            return 0;
+
+        if (groups == 1)
+            return (get_group_block_count(ext2, last) > overhead) ? 0 :
+                EXT2_ERR_BAD_FORMAT;
+
+        blocks = get_group_first_block(ext2, last);
+    }
+}
+
+// writes the superblock and its backups
+ext2_error_t write_super_copies(ext2_t* ext2) {
+    uint8_t buf[SUPERBLOCK_ADDR];
+
+    for (uint32_t group = 0; group < ext2->block_group_count; group++) {
+        if (!group_has_super(ext2, group))
+            continue;
+
+        ext2_superblock_t copy = ext2->superblk;
+        copy.block_group_nr = group;
+
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, &copy, sizeof(copy));
+
+        uint64_t addr = (group == 0) ? SUPERBLOCK_ADDR : 
+            BLOCK_ADDR(ext2, get_group_first_block(ext2, group));
+
+        STAT_ADD(ext2, sb_writes, 1);
+        ext2_error_t err = dev_write(ext2, addr, sizeof(buf), buf);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+// writes every copy of the descriptor table, a block at a time
+ext2_error_t write_gdt_copies(ext2_t* ext2, bool lazy) {
+    uint32_t block[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    ext2_bgd_t* bgds = (ext2_bgd_t*)block;
+    uint32_t per_block = ext2->block_size / sizeof(ext2_bgd_t);
+
+    for (uint32_t b = 0; b < get_gdt_blocks(ext2); b++) {
+        memset(block, 0, ext2->block_size);
+
+        for (uint32_t i = 0; i < per_block; i++) {
+            uint32_t group = b * per_block + i;
+            if (group >= ext2->block_group_count)
+                break;
+
+            format_bgd(ext2, group, lazy, &bgds[i]);
+            if (lazy)
+                bgds[i].checksum = get_bgd_checksum(ext2, group, &bgds[i]);
+        }
+
+        for (uint32_t group = 0; group < ext2->block_group_count; group++) {
+            if (!group_has_super(ext2, group))
+                continue;
+
+            uint32_t at = get_group_first_block(ext2, group) + 1 + b;
+            ext2_error_t err = dev_write(ext2, BLOCK_ADDR(ext2, at), 
+                    ext2->block_size, block);
+            if (err)
+                return err;
+        }
+    }
+
+    return 0;
+}
+
+// writes the bitmaps and inode table of a group, as far as they're initialized
+ext2_error_t format_group(ext2_t* ext2, uint32_t group, bool lazy) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    ext2_bgd_t bgd;
+    ext2_error_t err = 0;
+
+    format_bgd(ext2, group, lazy, &bgd);
+
+    if (!(bgd.flags & EXT2_BG_BLOCK_UNINIT)) {
+        build_block_bitmap(ext2, group, &bgd, bitmap);
+        err = dev_write(ext2, BLOCK_ADDR(ext2, bgd.block_bitmap), 
+                ext2->block_size, bitmap);
+        if (err)
+            return err;
+    }
+
+    if (!(bgd.flags & EXT2_BG_INODE_UNINIT)) {
+        build_inode_bitmap(ext2, bitmap);
+        if (group == 0)
+            for (uint32_t i = 0; i < ext2->superblk.first_ino - 1; i++)
+                SET_BIT(bitmap, i);
+
+        err = dev_write(ext2, BLOCK_ADDR(ext2, bgd.inode_bitmap), 
+                ext2->block_size, bitmap);
+        if (err)
+            return err;
+    }
+
+    uint32_t ipg = ext2->superblk.inodes_per_group;
+    uint32_t table_blocks = CEIL(ipg * ext2->inode_size, ext2->block_size);
+
+    // the rest of a lazy table is zeroed as its inodes come into use
+    if (lazy)
+        table_blocks = CEIL((ipg - bgd.itable_unused) * ext2->inode_size, 
+                ext2->block_size);
+
+    return zero_blocks(ext2, bgd.inode_table, table_blocks);
+}
+
+// creates the root directory and lost+found
+ext2_error_t format_root(ext2_t* ext2) {
+    ext2_inode_t inode_struct;
+    uint32_t lost_found;
+
+    memset(&inode_struct, 0, sizeof(inode_struct));
+    inode_struct.mode = EXT2_FMT_DIR | 0755;
+
+    ext2_error_t err = write_inode(ext2, EXT2_ROOT_INODE, &inode_struct);
+    if (!err)
+        err = link(ext2, EXT2_ROOT_INODE, EXT2_ROOT_INODE, EXT2_FMT_DIR, ".");
+    if (!err)
+        err = link(ext2, EXT2_ROOT_INODE, EXT2_ROOT_INODE, EXT2_FMT_DIR, 
+                "..");
+    if (!err)
+        err = add_used_dir(ext2, 0);
+    if (!err)
+        err = create_in_dir(ext2, EXT2_ROOT_INODE, "lost+found", EXT2_FMT_DIR,
+                &lost_found);
+    if (!err)
+        err = read_inode(ext2, lost_found, &inode_struct);
+    if (err)
+        return err;
+
+    inode_struct.mode |= 0700;
+    return write_inode(ext2, lost_found, &inode_struct);
+}
+
+ext2_error_t ext2_format(ext2_config_t* cfg, const ext2_format_params_t* params) {
+    ext2_t fs;
+    ext2_t* ext2 = &fs;
+
+    set_config(ext2, cfg);
+    ext2->lock = NULL;
+    ext2->unlock = NULL;
+
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    ext2_error_t err = format_superblock(ext2, params);
+    if (err)
+        return err;
+
+    // a transaction left in the log belongs to the old filesystem
+    if (ext2->log_size > 0) {
+        err = dev_write_raw(ext2, ext2->log_start, sizeof(txn_log_header_t), 
+                zero_block);
+        if (err)
+            return err;
+    }
+
+    uint32_t free_blocks = 0, free_inodes = 0;
+
+    for (uint32_t group = 0; group < ext2->block_group_count; group++) {
+        ext2_bgd_t bgd;
+        format_bgd(ext2, group, params->lazy_init, &bgd);
+        free_blocks += bgd.free_blocks_count;
+        free_inodes += bgd.free_inodes_count;
+
+        err = format_group(ext2, group, params->lazy_init);
+        if (err)
+            return err;
+    }
+
+    ext2->superblk.free_blocks_count = free_blocks;
+    ext2->superblk.free_inodes_count = free_inodes;
+
+    err = init_fs_info(ext2);
+    if (!err)
+        err = write_gdt_copies(ext2, params->lazy_init);
+    if (!err)
+        err = write_super_copies(ext2);
+    if (err)
+        return err;
+
+    // the root and lost+found are made by the usual code, which keeps the 
+    // primary superblock up to date
+    return format_root(ext2);
+}
+
+ext2_error_t ext2_mount(ext2_t* ext2, ext2_config_t* cfg) {
+    set_config(ext2, cfg);
+
+    uint64_t t = op_begin(ext2, EXT2_OP_MOUNT);
+    ext2_error_t error = replay_log(ext2);
+    if (!error)
+        error = load_superblock(ext2);
+    if (!error)
+        error = cache_init(ext2, cfg);
+    op_end(ext2, EXT2_OP_MOUNT, t, 0, 0, 0, error);
+
+    return error;
+}
+
+ext2_error_t open_file(ext2_t* ext2, const char* path, ext2_file_t* file) {
+    uint32_t inode;
+    ext2_error_t error;
+    ext2_inode_t inode_struct;
+
+    error = locate_inode(ext2, path, &inode);
+
+    if (error == EXT2_ERR_FILE_NOT_FOUND && !ext2->read_only) {
+        error = create_file(ext2, path, EXT2_FMT_REG, &inode);
+
+        // another thread may have created it in the meantime
+        if (error == EXT2_ERR_FILE_EXISTS)
+            error = 0;
+    }
+
+    if (error)
+        return error;
+
+    take_lock(ext2, EXT2_LOCK_INODE, inode, false);
+    error = read_inode(ext2, inode, &inode_struct);
+    release_lock(ext2, EXT2_LOCK_INODE, inode, false);
+
+    if (error)
+        return error;
+
+    // ensure inode actually refers to a file
+    if (GET_FILE_FMT(inode_struct.mode) != EXT2_FMT_REG)
+        return EXT2_ERR_NOT_A_FILE;
+
+    file->inode = inode;
+    file->offset = 0;
+    file->buf = NULL;
+    file->buf_size = 0;
+    set_buf_len(file, 0);
+    file->alloc_ctx = NULL;
+    return 0;
+}
+
+ext2_error_t ext2_file_open(ext2_t* ext2, const char* path, ext2_file_t* file) {
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_OPEN);
+    ext2_error_t error = open_file(ext2, path, file);
+    op_end(ext2, EXT2_OP_FILE_OPEN, t, error ? 0 : file->inode, 0, 0, error);
+
+    return error;
+}
+
+ext2_error_t ext2_alloc_ctx_init(ext2_t* ext2, ext2_alloc_ctx_t* ctx, 
+        uint32_t index, uint32_t count) {
+    if (count == 0 || index >= count)
+        return EXT2_ERR_BGD_NOT_FOUND;
+
+    // the groups are split in 'count' slices. If there are more contexts 
+    // than groups, some groups are home to more than one context
+    uint32_t groups = ext2->block_group_count;
+    uint32_t first = (uint64_t)index * groups / count;
+    uint32_t end = (uint64_t)(index + 1) * groups / count;
+
+    if (end == first) {
+        first = index % groups;
+        end = first + 1;
+    }
+
+    ctx->first_group = first;
+    ctx->group_count = end - first;
+    ctx->goal = get_group_first_block(ext2, first);
+    ctx->free_blocks = 0;
+    return 0;
+}
+
+ext2_error_t flush_alloc_ctx(ext2_t* ext2, ext2_alloc_ctx_t* ctx) {
+    if (ctx->free_blocks == 0)
+        return 0;
+
+    ext2_error_t error = update_free_counts(ext2, ctx->free_blocks, 0);
+
+    if (!error)
+        ctx->free_blocks = 0;
+
+    return error;
+}
+
+ext2_error_t ext2_alloc_ctx_flush(ext2_t* ext2, ext2_alloc_ctx_t* ctx) {
+    uint64_t t = op_begin(ext2, EXT2_OP_ALLOC_CTX_FLUSH);
+    ext2_error_t error = flush_alloc_ctx(ext2, ctx);
+    op_end(ext2, EXT2_OP_ALLOC_CTX_FLUSH, t, 0, 0, 0, error);
+
+    return error;
+}
+
+ext2_error_t set_file_alloc_ctx(ext2_t* ext2, ext2_file_t* file, 
+        ext2_alloc_ctx_t* ctx) {
+    // data waiting in the buffer is allocated through the old context
+    ext2_error_t error = flush_file(ext2, file);
+
+    if (!error)
+        file->alloc_ctx = ctx;
+
+    return error;
+}
+
+ext2_error_t ext2_file_set_alloc_ctx(ext2_t* ext2, ext2_file_t* file, 
+        ext2_alloc_ctx_t* ctx) {
+    uint64_t offset = file->buf_offset, size = file->buf_len;
+
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_SET_ALLOC_CTX);
+    ext2_error_t error = set_file_alloc_ctx(ext2, file, ctx);
+    op_end(ext2, EXT2_OP_FILE_SET_ALLOC_CTX, t, file->inode, offset, size, error);
+
+    return error;
+}
+
+ext2_error_t set_file_buffer(ext2_t* ext2, ext2_file_t* file, void* buf,
+        uint32_t size) {
+    if (buf != NULL && size < ext2->block_size)
+        return EXT2_ERR_BUFFER_TOO_SMALL;
+
+    ext2_error_t error = flush_file(ext2, file);
+    if (error)
+        return error;
+
+    // only whole blocks are used, so flushes end at block boundaries
+    file->buf = buf;
+    file->buf_size = (buf == NULL) ? 0 : size / ext2->block_size * ext2->block_size;
+
+    if (buf != NULL)
+        link_buffered(ext2, file);
+    else
+        unlink_buffered(ext2, file);
+
+    return 0;
+}
+
+ext2_error_t ext2_file_set_buffer(ext2_t* ext2, ext2_file_t* file, void* buf,
+        uint32_t size) {
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_SET_BUFFER);
+    ext2_error_t error = set_file_buffer(ext2, file, buf, size);
+    op_end(ext2, EXT2_OP_FILE_SET_BUFFER, t, file->inode, 0, size, error);
+
+    return error;
+}
+
+ext2_error_t ext2_file_flush(ext2_t* ext2, ext2_file_t* file) {
+    uint64_t offset = file->buf_offset, size = file->buf_len;
+
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_FLUSH);
+    ext2_error_t error = flush_file(ext2, file);
+    op_end(ext2, EXT2_OP_FILE_FLUSH, t, file->inode, offset, size, error);
+
+    return error;
+}
+
+ext2_error_t close_file(ext2_t* ext2, ext2_file_t* file) {
+    ext2_error_t error = flush_file(ext2, file);
+
+    if (!error) {
+        file->buf = NULL;
+        file->buf_size = 0;
+        unlink_buffered(ext2, file);
+    }
+
+    return error;
+}
+
+ext2_error_t ext2_file_close(ext2_t* ext2, ext2_file_t* file) {
+    uint64_t offset = file->buf_offset, size = file->buf_len;
+
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_CLOSE);
+    ext2_error_t error = close_file(ext2, file);
+    op_end(ext2, EXT2_OP_FILE_CLOSE, t, file->inode, offset, size, error);
+
+    return error;
+}
+
+// Reads at the offset of a handle whose buffer might hold data that isn't on
+// the device yet (see EXT2_MOUNT_DELALLOC): what the device has, then the 
+// buffered bytes on top. The buffer starts inside the file, so together they
+// cover everything up to the end of the buffer
+ext2_error_t read_buffered(ext2_t* ext2, const ext2_file_t* file, 
+        uint32_t size, void* buf) {
+    const uint64_t start = file->offset, end = start + size;
+    const uint64_t buf_end = file->buf_offset + file->buf_len;
+
+    if (file->buf_len == 0)
+        return read_data(ext2, file->inode, start, size, buf);
+
+    ext2_inode_t inode_struct;
+    ext2_error_t error = read_inode(ext2, file->inode, &inode_struct);
+    if (error)
+        return error;
+
+    const uint64_t disk_size = get_inode_size(&inode_struct);
+    if (end > MAX(disk_size, buf_end))
+        return EXT2_ERR_DATA_OUT_OF_BOUNDS;
+
+    if (disk_size > start) {
+        error = read_data(ext2, file->inode, start, MIN(end, disk_size) - start,
+                buf);
+        if (error)
+            return error;
+    }
+
+    const uint64_t from = MAX(start, file->buf_offset), to = MIN(end, buf_end);
+    if (from < to)
+        memcpy((uint8_t*)buf + (from - start), 
+                file->buf + (from - file->buf_offset), to - from);
+
+    return 0;
+}
+
+ext2_error_t read_file(ext2_t* ext2, ext2_file_t* file, uint32_t size, 
+        void* buf) {
+    ext2_error_t error;
+
+    // with delayed allocation, reads don't send the buffer out
+    if (!ext2->delalloc) {
+        error = flush_file(ext2, file);
+        if (error)
+            return error;
+    }
+
+    // readers of a file only wait for its writers
+    take_lock(ext2, EXT2_LOCK_INODE, file->inode, false);
+    error = read_buffered(ext2, file, size, buf);
+    release_lock(ext2, EXT2_LOCK_INODE, file->inode, false);
+
+    if (!error)
+        file->offset += size;
+
+    return error;
+}
+
+ext2_error_t ext2_file_read(ext2_t* ext2, ext2_file_t* file, 
+        uint32_t size, void* buf) {
+    uint64_t offset = file->offset;
+
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_READ);
+    ext2_error_t error = read_file(ext2, file, size, buf);
+    op_end(ext2, EXT2_OP_FILE_READ, t, file->inode, offset, size, error);
+
+    return error;
+}
+
+ext2_error_t seek_file(ext2_t* ext2, ext2_file_t* file, uint64_t offset) {
+    ext2_error_t error;
+
+    // with delayed allocation the buffer stays, and the next write sends it
+    // out if it doesn't continue it
+    if (!ext2->delalloc) {
+        error = flush_file(ext2, file);
+        if (error)
+            return error;
+    }
+
+    ext2_inode_t inode_struct;
+    take_lock(ext2, EXT2_LOCK_INODE, file->inode, false);
+    error = read_inode(ext2, file->inode, &inode_struct);
+    release_lock(ext2, EXT2_LOCK_INODE, file->inode, false);
+
+    if (error)
+        return error;
+
+    uint64_t size = get_inode_size(&inode_struct);
+    if (file->buf_len > 0)
+        size = MAX(size, file->buf_offset + file->buf_len);
+
+    if (offset > size) {
+        return EXT2_ERR_SEEK_OUT_OF_BOUNDS;
+    }
+
+    file->offset = offset;
+    return 0;
+}
+
+ext2_error_t ext2_file_seek(ext2_t* ext2, ext2_file_t* file, uint64_t offset) {
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_SEEK);
+    ext2_error_t error = seek_file(ext2, file, offset);
+    op_end(ext2, EXT2_OP_FILE_SEEK, t, file->inode, offset, 0, error);
+
+    return error;
+}
+
+uint64_t ext2_file_tell(ext2_t* ext2, const ext2_file_t* file) {
+    return file->offset;
+}
+
+// writes at the offset of a handle, through its buffer if it has one
+ext2_error_t buffered_write(ext2_t* ext2, ext2_file_t* file, uint32_t size, 
+        const void* buf) {
+    ext2_error_t error;
+
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    // the buffer holds a single range, and a read or a seek (which don't 
+    // flush with delayed allocation) might have moved away from its end
+    if (file->buf_len > 0 && file->offset != file->buf_offset + file->buf_len) {
+        error = flush_file(ext2, file);
+        if (error)
+            return error;
+    }
+
+    if (file->buf_size == 0) {
+        error = write_file(ext2, file, file->offset, size, buf);
+
+        if (!error)
+            file->offset += size;
+
+        return error;
+    }
+
+    while (size > 0) {
+        if (file->buf_len == 0) {
+            file->buf_offset = file->offset;
+
+            // writes that would fill the buffer anyway skip it
+            if (size >= file->buf_size) {
+                uint32_t direct = size - (file->offset + size) % ext2->block_size;
+
+                error = write_file(ext2, file, file->offset, direct, buf);
+                if (error)
+                    return error;
+
+                file->offset += direct;
+                buf = (const uint8_t*)buf + direct;
+                size -= direct;
+                continue;
+            }
+        }
+
+        // buffered data ends at a block boundary
+        uint32_t capacity = file->buf_size - file->buf_offset % ext2->block_size;
+        uint32_t chunk = capacity - file->buf_len;
+
+        if (chunk > size)
+            chunk = size;
+
+        memcpy(file->buf + file->buf_len, buf, chunk);
+        set_buf_len(file, file->buf_len + chunk);
+        file->offset += chunk;
+        buf = (const uint8_t*)buf + chunk;
+        size -= chunk;
+
+        if (file->buf_len == capacity) {
+            error = flush_file(ext2, file);
+            if (error)
+                return error;
+        }
+    }
+
+    return 0;
+}
+
+ext2_error_t ext2_file_write(ext2_t* ext2, ext2_file_t* file, 
+        uint32_t size, const void* buf) {
+    uint64_t offset = file->offset;
+
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_WRITE);
+    ext2_error_t error = buffered_write(ext2, file, size, buf);
+    op_end(ext2, EXT2_OP_FILE_WRITE, t, file->inode, offset, size, error);
+
+    return error;
+}
+
+ext2_error_t truncate_file(ext2_t* ext2, ext2_file_t* file, uint64_t size) {
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    // with delayed allocation, buffered data past the new end is dropped 
+    // before it ever gets blocks
+    if (ext2->delalloc && file->buf_len > 0) {
+        if (size <= file->buf_offset)
+            set_buf_len(file, 0);
+        else if (size < file->buf_offset + file->buf_len)
+            set_buf_len(file, size - file->buf_offset);
+    }
+
+    ext2_error_t error = flush_file(ext2, file);
+    if (error)
+        return error;
+
+    take_lock(ext2, EXT2_LOCK_INODE, file->inode, true);
+    error = truncate_data(ext2, file->inode, size);
+    release_lock(ext2, EXT2_LOCK_INODE, file->inode, true);
+
+    if (!error && file->offset > size)
+        file->offset = size;
+
+    return error;
+}
+
+ext2_error_t ext2_file_truncate(ext2_t* ext2, ext2_file_t* file, uint64_t size) {
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_TRUNCATE);
+    ext2_error_t error = truncate_file(ext2, file, size);
+    op_end(ext2, EXT2_OP_FILE_TRUNCATE, t, file->inode, size, 0, error);
+
+    return error;
+}
+
+ext2_error_t fallocate_file(ext2_t* ext2, ext2_file_t* file, 
+        uint64_t offset, uint64_t size) {
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    ext2_error_t error = flush_file(ext2, file);
+    if (error)
+        return error;
+
+    take_lock(ext2, EXT2_LOCK_INODE, file->inode, true);
+    error = fallocate_data(ext2, file->alloc_ctx, file->inode, offset, size);
+    release_lock(ext2, EXT2_LOCK_INODE, file->inode, true);
+
+    return error;
+}
+
+ext2_error_t ext2_file_fallocate(ext2_t* ext2, ext2_file_t* file, 
+        uint64_t offset, uint64_t size) {
+    uint64_t t = op_begin(ext2, EXT2_OP_FILE_FALLOCATE);
+    ext2_error_t error = fallocate_file(ext2, file, offset, size);
+    op_end(ext2, EXT2_OP_FILE_FALLOCATE, t, file->inode, offset, size, error);
+
+    return error;
+}
+
+ext2_error_t copy_range(ext2_t* ext2, ext2_file_t* src, uint64_t src_off, 
+        ext2_file_t* dst, uint64_t dst_off, uint64_t len) {
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    ext2_error_t error = flush_file(ext2, src);
+    if (error)
+        return error;
+
+    error = flush_file(ext2, dst);
+    if (error)
+        return error;
+
+    uint32_t src_ino = src->inode, dst_ino = dst->inode;
+
+    if (src_ino == dst_ino) {
+        take_lock(ext2, EXT2_LOCK_INODE, dst_ino, true);
+        error = copy_data(ext2, dst->alloc_ctx, src_ino, src_off, dst_ino, 
+                dst_off, len);
+        release_lock(ext2, EXT2_LOCK_INODE, dst_ino, true);
+        return error;
+    }
+
+    // the lowest inode number is locked first, so two copies going in 
+    // opposite directions can't deadlock
+    if (src_ino < dst_ino) {
+        take_lock(ext2, EXT2_LOCK_INODE, src_ino, false);
+        take_lock(ext2, EXT2_LOCK_INODE, dst_ino, true);
+    } else {
+        take_lock(ext2, EXT2_LOCK_INODE, dst_ino, true);
+        take_lock(ext2, EXT2_LOCK_INODE, src_ino, false);
+    }
+
+    error = copy_data(ext2, dst->alloc_ctx, src_ino, src_off, dst_ino, 
+            dst_off, len);
+
+    release_lock(ext2, EXT2_LOCK_INODE, dst_ino, true);
+    release_lock(ext2, EXT2_LOCK_INODE, src_ino, false);
+    return error;
+}
+
+ext2_error_t ext2_copy_file_range(ext2_t* ext2, ext2_file_t* src,
+        uint64_t src_off, ext2_file_t* dst, uint64_t dst_off, 
+        uint64_t len) {
+    uint64_t t = op_begin(ext2, EXT2_OP_COPY_FILE_RANGE);
+    ext2_error_t error = copy_range(ext2, src, src_off, dst, dst_off, len);
+    op_end(ext2, EXT2_OP_COPY_FILE_RANGE, t, dst->inode, dst_off, len, error);
+
+    return error;
+}
+
+// Reads the entry at the offset of a dir handle and moves past it. Unused 
+// records (inode 0, left at the start of a block by removals) are skipped
+ext2_error_t read_dir_record(ext2_t* ext2, ext2_dir_t* dir, 
+        ext2_dir_record_t* entry) {
+    ext2_directory_entry_t disk_entry;
+    ext2_inode_t inode_struct;
+    ext2_error_t error = read_inode(ext2, dir->inode, &inode_struct);
+    if (error)
+        return error;
+
+    do {
+        if (dir->offset >= inode_struct.size) { // already read all entries
+            // subsequent reads return an empty name and inode 0
+            entry->inode = 0;
+            entry->type = EXT2_ET_UNKNOWN;
+            entry->name[0] = '\0'; 
+            return 0;
+        }
+
+        error = read_dir_entry(ext2, dir->offset, dir->inode, &disk_entry);
+        if (error)
+            return error;
+
+        dir->offset += disk_entry.rec_len;
+    } while (disk_entry.inode == 0);
+
+    entry->inode = disk_entry.inode;
+    entry->type = disk_entry.file_type;
+    strcpy(entry->name, disk_entry.name);
+    return 0;
+}
+
+ext2_error_t open_dir(ext2_t* ext2, const char* path, ext2_dir_t* dir) {
+    uint32_t inode;
+    ext2_error_t error;
+
+    error = locate_inode(ext2, path, &inode);
+
+    if (error)
+        return error;
+
+    ext2_inode_t inode_struct;
+    take_lock(ext2, EXT2_LOCK_INODE, inode, false);
+    error = read_inode(ext2, inode, &inode_struct);
+    release_lock(ext2, EXT2_LOCK_INODE, inode, false);
+
+    if (error)
+        return error;
+
+    // ensure inode actually refers to a dir
+    if (GET_FILE_FMT(inode_struct.mode) != EXT2_FMT_DIR)
+        return EXT2_ERR_NOT_A_DIR;
+
+    dir->inode = inode;
+    dir->offset = 0;
+    return 0;
+}
+
+ext2_error_t ext2_dir_open(ext2_t* ext2, const char* path, ext2_dir_t* dir) {
+    uint64_t t = op_begin(ext2, EXT2_OP_DIR_OPEN);
+    ext2_error_t error = open_dir(ext2, path, dir);
+    op_end(ext2, EXT2_OP_DIR_OPEN, t, error ? 0 : dir->inode, 0, 0, error);
+
+    return error;
+}
+
+ext2_error_t ext2_mkdir(ext2_t* ext2, const char* path) {
+    uint32_t inode = 0;
+
+    uint64_t t = op_begin(ext2, EXT2_OP_MKDIR);
+    ext2_error_t error = create_file(ext2, path, EXT2_FMT_DIR, &inode);
+    op_end(ext2, EXT2_OP_MKDIR, t, inode, 0, 0, error);
+
+    return error;
+}
+
+ext2_error_t ext2_dir_read(ext2_t* ext2, ext2_dir_t* dir, ext2_dir_record_t* entry) {
+    uint64_t offset = dir->offset;
+    uint64_t t = op_begin(ext2, EXT2_OP_DIR_READ);
+
+    take_lock(ext2, EXT2_LOCK_INODE, dir->inode, false);
+    ext2_error_t error = read_dir_record(ext2, dir, entry);
+    release_lock(ext2, EXT2_LOCK_INODE, dir->inode, false);
+
+    op_end(ext2, EXT2_OP_DIR_READ, t, dir->inode, offset, 0, error);
+    return error;
+}
+
+ext2_error_t seek_dir(ext2_t* ext2, ext2_dir_t* dir, uint32_t offset) {
+    ext2_inode_t inode_struct;
+    take_lock(ext2, EXT2_LOCK_INODE, dir->inode, false);
+    ext2_error_t error = read_inode(ext2, dir->inode, &inode_struct);
+    release_lock(ext2, EXT2_LOCK_INODE, dir->inode, false);
+
+    if (error)
+        return error;
+
+    if (offset > inode_struct.size) {
+        return EXT2_ERR_SEEK_OUT_OF_BOUNDS;
+    }
+
+    dir->offset = offset;
+    return 0;
+}
+
+ext2_error_t ext2_dir_seek(ext2_t* ext2, ext2_dir_t* dir, uint32_t offset) {
+    uint64_t t = op_begin(ext2, EXT2_OP_DIR_SEEK);
+    ext2_error_t error = seek_dir(ext2, dir, offset);
+    op_end(ext2, EXT2_OP_DIR_SEEK, t, dir->inode, offset, 0, error);
+
+    return error;
+}
+
+uint32_t ext2_dir_tell(ext2_t* ext2, const ext2_dir_t* dir) {
+    return dir->offset;
+}
+
+void fill_stat(uint32_t inode, const ext2_inode_t* inode_struct, 
+        ext2_stat_t* st) {
+    st->inode = inode;
+    st->mode = inode_struct->mode;
+    st->links_count = inode_struct->links_count;
+    st->uid = inode_struct->uid;
+    st->gid = inode_struct->gid;
+    st->size = get_inode_size(inode_struct);
+    st->blocks = inode_struct->blocks;
+    st->atime = inode_struct->atime;
+    st->ctime = inode_struct->ctime;
+    st->mtime = inode_struct->mtime;
+}
+
+ext2_error_t stat_path(ext2_t* ext2, const char* path, ext2_stat_t* st) {
+    ext2_inode_t inode_struct;
+    uint32_t inode;
+
+    ext2_error_t err = locate_inode(ext2, path, &inode);
+    if (err)
+        return err;
+
+    take_lock(ext2, EXT2_LOCK_INODE, inode, false);
+    err = read_inode(ext2, inode, &inode_struct);
+    uint64_t buffered = buffered_size(ext2, inode);
+    release_lock(ext2, EXT2_LOCK_INODE, inode, false);
+
+    if (!err) {
+        fill_stat(inode, &inode_struct, st);
+        st->size = MAX(st->size, buffered);
+    }
+
+    return err;
+}
+
+ext2_error_t ext2_stat(ext2_t* ext2, const char* path, ext2_stat_t* st) {
+    uint64_t t = op_begin(ext2, EXT2_OP_STAT);
+    ext2_error_t error = stat_path(ext2, path, st);
+    op_end(ext2, EXT2_OP_STAT, t, error ? 0 : st->inode, 0, 0, error);
+
+    return error;
+}
+
+void sift_down(uint32_t* a, uint32_t i, uint32_t n) {
+    uint32_t v = a[i];
+
+    while (true) {
+        uint64_t child = 2 * (uint64_t)i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && a[child + 1] > a[child])
+            child++;
+        if (a[child] <= v)
+            break;
+
+        a[i] = a[child];
+        i = child;
+    }
+
+    a[i] = v;
+}
+
+// heapsort, which needs no memory for any number of values
+void sort_uint32(uint32_t* a, uint32_t n) {
+    for (uint32_t i = n / 2; i-- > 0; )
+        sift_down(a, i, n);
+
+    for (uint32_t end = n; end-- > 1; ) {
+        uint32_t top = a[0];
+        a[0] = a[end];
+        a[end] = top;
+        sift_down(a, 0, end);
+    }
+}
+
+// moves order[i] down the heap of the first 'n' positions, which are 
+// compared by their value in 'keys'
+void sift_down_order(uint32_t* order, const uint32_t* keys, uint32_t i, 
+        uint32_t n) {
+    uint32_t v = order[i];
+
+    while (true) {
+        uint64_t child = 2 * (uint64_t)i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && keys[order[child + 1]] > keys[order[child]])
+            child++;
+        if (keys[order[child]] <= keys[v])
+            break;
+
+        order[i] = order[child];
+        i = child;
+    }
+
+    order[i] = v;
+}
+
+// fills 'order' with the positions of 'keys', sorted by their value
+void sort_order(uint32_t* order, const uint32_t* keys, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++)
+        order[i] = i;
+
+    for (uint32_t i = n / 2; i-- > 0; )
+        sift_down_order(order, keys, i, n);
+
+    for (uint32_t end = n; end-- > 1; ) {
+        uint32_t top = order[0];
+        order[0] = order[end];
+        order[end] = top;
+        sift_down_order(order, keys, 0, end);
+    }
+}
+
+// Inodes are read a window at a time, in increasing order: from the block 
+// of the first one up to the block of the last one that fits, in a single 
+// read, with the inodes in it locked (in increasing order, as the lock order
+// asks). The order is kept in the workspace, so 'inodes' and 'out' keep the
+// caller's order
+ext2_error_t stat_many(ext2_t* ext2, const uint32_t* inodes, uint32_t count, 
+        ext2_stat_t* out, uint32_t* order) {
+    uint8_t window[EXT2_COPY_BUFFER_SIZE];
+    uint32_t group = UINT32_MAX;
+    uint64_t table = 0, table_end = 0; // device addresses of the inode table
+    ext2_error_t err = 0;
+
+    for (uint32_t i = 0; i < count; i++)
+        if (inodes[i] == 0 || inodes[i] > ext2->superblk.inodes_count)
+            return EXT2_ERR_INODE_NOT_FOUND;
+
+    sort_order(order, inodes, count);
+
+    for (uint32_t i = 0; i < count && !err; ) {
+        uint32_t ipg = ext2->superblk.inodes_per_group;
+        if (get_inode_group(ext2, inodes[order[i]]) != group) {
+            ext2_bgd_t bgd;
+            group = get_inode_group(ext2, inodes[order[i]]);
+            err = read_bgd(ext2, group, &bgd);
+            if (err)
+                return err;
+
+            table = BLOCK_ADDR(ext2, bgd.inode_table);
+            table_end = table + (uint64_t)ipg * ext2->inode_size;
+        }
+
+        uint64_t first = table + (uint64_t)((inodes[order[i]] - 1) % ipg) * 
+            ext2->inode_size;
+        uint64_t start = first & ~(uint64_t)(ext2->block_size - 1);
+        uint64_t limit = MIN(start + sizeof(window), table_end);
+        uint64_t end = first + ext2->inode_size;
+
+        uint32_t j = i + 1;
+        while (j < count && get_inode_group(ext2, inodes[order[j]]) == group) {
+            uint64_t addr = table + (uint64_t)((inodes[order[j]] - 1) % ipg) * 
+                ext2->inode_size;
+            if (addr + ext2->inode_size > limit)
+                break;
+            end = addr + ext2->inode_size;
+            j++;
+        }
+
+        // whole blocks, so the read can be cached and staged blocks are seen
+        end = MIN(CEIL(end, ext2->block_size) * ext2->block_size, table_end);
+
+        for (uint32_t k = i; k < j; k++)
+            if (k == i || inodes[order[k]] != inodes[order[k - 1]])
+                take_lock(ext2, EXT2_LOCK_INODE, inodes[order[k]], false);
+
+        STAT_ADD(ext2, inode_reads, j - i);
+        err = dev_read(ext2, start, end - start, window);
+
+        for (uint32_t k = i; k < j && !err; k++) {
+            ext2_inode_t inode_struct;
+            uint64_t addr = table + (uint64_t)((inodes[order[k]] - 1) % ipg) * 
+                ext2->inode_size;
+
+            memcpy(&inode_struct, window + (addr - start), sizeof(inode_struct));
+            fill_stat(inodes[order[k]], &inode_struct, &out[order[k]]);
+            out[order[k]].size = MAX(out[order[k]].size, 
+                    buffered_size(ext2, inodes[order[k]]));
+        }
+
+        for (uint32_t k = j; k-- > i; )
+            if (k == i || inodes[order[k]] != inodes[order[k - 1]])
+                release_lock(ext2, EXT2_LOCK_INODE, inodes[order[k]], false);
+
+        i = j;
+    }
+
+    return err;
+}
+
+ext2_error_t ext2_stat_many(ext2_t* ext2, const uint32_t* inodes, 
+        uint32_t count, ext2_stat_t* out, uint32_t* workspace) {
+    uint64_t t = op_begin(ext2, EXT2_OP_STAT_MANY);
+    ext2_error_t error = stat_many(ext2, inodes, count, out, workspace);
+    op_end(ext2, EXT2_OP_STAT_MANY, t, 0, 0, count, error);
+
+    return error;
+}
+
+// gives an inode back to its group: its bit in the inode bitmap and the 
+// counters of the descriptor
+ext2_error_t release_inode(ext2_t* ext2, uint32_t inode, bool dir) {
+    uint32_t group = get_inode_group(ext2, inode);
+    uint32_t bit = (inode - 1) % ext2->superblk.inodes_per_group;
+    uint8_t byte;
+    ext2_bgd_t bgd;
+
+    take_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+    ext2_error_t err = read_bgd(ext2, group, &bgd);
+    uint64_t addr = BLOCK_ADDR(ext2, bgd.inode_bitmap) + bit / 8;
+
+    if (!err)
+        err = dev_read(ext2, addr, 1, &byte);
+    if (!err) {
+        byte &= ~(1 << (bit % 8));
+        err = dev_write(ext2, addr, 1, &byte);
+    }
+    if (!err) {
+        bgd.free_inodes_count += 1;
+        if (dir)
+            bgd.used_dirs_count -= 1;
+        err = write_bgd(ext2, group, &bgd);
+    }
+
+    release_lock(ext2, EXT2_LOCK_GROUP, group, true);
+    return err;
+}
+
+// where an entry was found in a directory (see find_dir_entry)
+typedef struct {
+    uint32_t off;  // of its block in the directory
+    uint32_t pos;  // of the entry in the block
+    uint32_t prev; // of the entry before it in the block, if pos isn't 0
+} dir_pos_t;
+
+// Looks for the first entry in use of a directory that 'match' accepts, 
+// reading a block at a time into 'data', which is left holding the block of
+// the entry. Fails with EXT2_ERR_FILE_NOT_FOUND if there's none
+ext2_error_t find_dir_entry(ext2_t* ext2, uint32_t dir_inode, 
+        bool (*match)(const ext2_directory_entry_t* entry, const void* arg),
+        const void* arg, uint8_t* data, dir_pos_t* at) {
+    ext2_inode_t inode_struct;
+    ext2_error_t err = read_inode(ext2, dir_inode, &inode_struct);
+    if (err)
+        return err;
+
+    for (at->off = 0; at->off < inode_struct.size; at->off += ext2->block_size) {
+        uint32_t chunk = MIN(inode_struct.size - at->off, ext2->block_size);
+
+        err = read_data(ext2, dir_inode, at->off, chunk, data);
+        if (err)
+            return err;
+
+        at->prev = 0;
+        for (at->pos = 0; at->pos + DIR_ENTRY_HEADER_SIZE <= chunk; ) {
+            const ext2_directory_entry_t* entry = (void*)(data + at->pos);
+            STAT_ADD(ext2, dir_entries_scanned, 1);
+
+            if (entry->rec_len < DIR_ENTRY_HEADER_SIZE)
+                break; // corrupted block, leave it alone
+
+            if (entry->inode != 0 && match(entry, arg))
+                return 0;
+
+            at->prev = at->pos;
+            at->pos += entry->rec_len;
+        }
+    }
+
+    return EXT2_ERR_FILE_NOT_FOUND;
+}
+
+bool is_named(const ext2_directory_entry_t* entry, const void* name) {
+    return entry->name_len == strlen(name) && 
+        memcmp(entry->name, name, entry->name_len) == 0;
+}
+
+bool is_not_dot(const ext2_directory_entry_t* entry, const void* arg) {
+    return !is_named(entry, ".") && !is_named(entry, "..");
+}
+
+// Takes the entry of 'name' out of a directory. Its record is merged into 
+// the one before it in the block or, if it's the first of the block, it's 
+// only marked unused. Only the header that changed is written
+ext2_error_t remove_dir_entry(ext2_t* ext2, uint32_t dir_inode, 
+        const char* name) {
+    uint32_t block[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    uint8_t* data = (uint8_t*)block;
+    dir_pos_t at;
+
+    ext2_error_t err = find_dir_entry(ext2, dir_inode, is_named, name, data, 
+            &at);
+    if (err)
+        return err;
+
+    ext2_directory_entry_t* entry = (void*)(data + at.pos);
+    uint32_t changed = at.pos;
+
+    if (at.pos == 0) {
+        entry->inode = 0;
+    } else {
+        ext2_directory_entry_t* before = (void*)(data + at.prev);
+        before->rec_len += entry->rec_len;
+        changed = at.prev;
+    }
+
+    return write_data(ext2, NULL, dir_inode, at.off + changed, 
+            DIR_ENTRY_HEADER_SIZE, data + changed);
+}
+
+// Takes the entry of 'name' out of a directory and forgets the name. For a 
+// subdirectory, the link its ".." made to the directory goes away too
+ext2_error_t unlink_entry(ext2_t* ext2, uint32_t dir_inode, const char* name,
+        bool is_dir) {
+    ext2_inode_t dir_struct;
+
+    ext2_error_t err = remove_dir_entry(ext2, dir_inode, name);
+    if (err)
+        return err;
+
+    cache_drop_name(ext2, dir_inode, name);
+
+    if (!is_dir)
+        return 0;
+
+    err = read_inode(ext2, dir_inode, &dir_struct);
+    if (err)
+        return err;
+
+    dir_struct.links_count -= 1;
+    return write_inode(ext2, dir_inode, &dir_struct);
+}
+
+// Removes 'name', which refers to 'inode', from a directory. Both are locked
+// by the caller. The inode and its blocks are freed once nothing links to it
+ext2_error_t remove_locked(ext2_t* ext2, uint32_t dir_inode, const char* name,
+        uint32_t inode) {
+    uint32_t block[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    ext2_inode_t inode_struct;
+    dir_pos_t at;
+
+    ext2_error_t err = read_inode(ext2, inode, &inode_struct);
+    if (err)
+        return err;
+
+    const bool is_dir = GET_FILE_FMT(inode_struct.mode) == EXT2_FMT_DIR;
+
+    if (is_dir) {
+        err = find_dir_entry(ext2, inode, is_not_dot, NULL, (uint8_t*)block,
+                &at);
+        if (err == 0)
+            return EXT2_ERR_DIR_NOT_EMPTY;
+        if (err != EXT2_ERR_FILE_NOT_FOUND)
+            return err;
+    }
+
+    err = unlink_entry(ext2, dir_inode, name, is_dir);
+    if (err)
+        return err;
+
+    if (is_dir) {
+        cache_drop_dir(ext2, inode);
+        inode_struct.links_count = 0; // "." goes away too
+    } else if (inode_struct.links_count > 0) {
+        inode_struct.links_count -= 1;
+    }
+
+    if (inode_struct.links_count > 0)
+        return write_inode(ext2, inode, &inode_struct);
+
+    // fast symlinks keep their target in the block pointers
+    blk_batch batch = { .count = 0, .freed = 0 };
+    if (GET_FILE_FMT(inode_struct.mode) != EXT2_FMT_LNK || inode_struct.blocks != 0)
+        err = free_inode_blocks(ext2, &inode_struct, &batch);
+    if (!err)
+        err = release_inode(ext2, inode, is_dir);
+    if (err)
+        return err;
+
+    memset(&inode_struct, 0, sizeof(inode_struct));
+    err = write_inode(ext2, inode, &inode_struct);
+    if (err)
+        return err;
+
+    return finish_blk_batch(ext2, &batch, 1);
+}
+
+// state of ext2_rm_tree, shared by its workers
+typedef struct {
+    ext2_t* ext2;
+    int pass;                // 1 frees the inodes, 2 writes the block bitmaps
+    _Atomic uint8_t* map;    // a bit per block to free, from first_data_block
+    uint32_t* inodes;        // every file and directory of the tree
+    uint32_t count;
+    uint32_t capacity;       // inodes that fit in the workspace
+    _Atomic uint32_t next_group;
+    _Atomic uint32_t freed_blocks;
+    _Atomic uint32_t freed_inodes;
+    _Atomic int error;       // first error of a worker
+} rm_tree_state_t;
+
+// Lists every file and directory under 'top' (and 'top' itself) into 
+// st->inodes, a directory at a time. Files fill the list from the front and 
+// directories, which are the queue of the walk, from the back. Without the
+// filetype feature, the inode of each entry is read to tell which it is
+ext2_error_t list_tree(rm_tree_state_t* st, uint32_t top, bool is_dir) {
+    uint32_t block[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    uint8_t* data = (uint8_t*)block;
+    ext2_t* ext2 = st->ext2;
+    uint32_t* dirs = st->inodes + st->capacity; // dirs[-1] is the first one
+    uint32_t files = 0, ndirs = 0;
+
+    if (st->capacity == 0)
+        return EXT2_ERR_BUFFER_TOO_SMALL;
+
+    if (is_dir)
+        dirs[-1 - (int64_t)ndirs++] = top;
+    else
+        st->inodes[files++] = top;
+
+    for (uint32_t d = 0; d < ndirs; d++) {
+        uint32_t dir = dirs[-1 - (int64_t)d];
+        ext2_inode_t inode_struct;
+
+        ext2_error_t err = read_inode(ext2, dir, &inode_struct);
+        if (err)
+            return err;
+
+        for (uint32_t off = 0; off < inode_struct.size; off += ext2->block_size) {
+            uint32_t chunk = MIN(inode_struct.size - off, ext2->block_size);
+
+            err = read_data(ext2, dir, off, chunk, data);
+            if (err)
+                return err;
+
+            for (uint32_t pos = 0; pos + DIR_ENTRY_HEADER_SIZE <= chunk; ) {
+                const ext2_directory_entry_t* entry = (void*)(data + pos);
+                STAT_ADD(ext2, dir_entries_scanned, 1);
+
+                if (entry->rec_len < DIR_ENTRY_HEADER_SIZE)
+                    break; // corrupted block, leave it alone
+                pos += entry->rec_len;
+
+                if (entry->inode == 0 || !is_not_dot(entry, NULL))
+                    continue;
+
+                bool child_dir = entry->file_type == EXT2_ET_DIR;
+                if (entry->file_type == EXT2_ET_UNKNOWN) {
+                    ext2_inode_t child;
+                    err = read_inode(ext2, entry->inode, &child);
+                    if (err)
+                        return err;
+                    child_dir = GET_FILE_FMT(child.mode) == EXT2_FMT_DIR;
+                }
+
+                if (files + ndirs == st->capacity)
+                    return EXT2_ERR_BUFFER_TOO_SMALL;
+
+                if (child_dir)
+                    dirs[-1 - (int64_t)ndirs++] = entry->inode;
+                else
+                    st->inodes[files++] = entry->inode;
+            }
+        }
+    }
+
+    memmove(st->inodes + files, dirs - ndirs, ndirs * sizeof(uint32_t));
+    st->count = files + ndirs;
+    return 0;
+}
+
+// Lists the tree under 'inode', which 'name' refers to, and takes it out of
+// the directory. Both are locked by the caller. Nothing is freed yet, and if
+// the list doesn't fit the tree stays where it was
+ext2_error_t detach_tree(ext2_t* ext2, uint32_t dir_inode, const char* name,
+        uint32_t inode, rm_tree_state_t* st) {
+    ext2_inode_t inode_struct;
+
+    ext2_error_t err = read_inode(ext2, inode, &inode_struct);
+    if (err)
+        return err;
+
+    const bool is_dir = GET_FILE_FMT(inode_struct.mode) == EXT2_FMT_DIR;
+
+    err = list_tree(st, inode, is_dir);
+    if (err)
+        return err;
+
+    return unlink_entry(ext2, dir_inode, name, is_dir);
+}
+
+// Removes a file or, if 'tree' is given, a whole tree (see detach_tree)
+ext2_error_t remove_path(ext2_t* ext2, const char* path, uint32_t* inode,
+        rm_tree_state_t* tree) {
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    uint32_t dir_inode;
+    ext2_error_t err = locate_parent_inode(ext2, path, &dir_inode);
+    if (err)
+        return err;
+
+    char name[EXT2_MAX_FILE_NAME + 1];
+    err = get_file_name(path, name);
+    if (err)
+        return err;
+
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return EXT2_ERR_BAD_PATH;
+
+    while (true) {
+        err = lookup(ext2, dir_inode, name, "", inode);
+        if (err)
+            return err;
+
+        // the lowest inode number is locked first
+        uint32_t low = MIN(dir_inode, *inode), high = MAX(dir_inode, *inode);
+        take_lock(ext2, EXT2_LOCK_INODE, low, true);
+        take_lock(ext2, EXT2_LOCK_INODE, high, true);
+
+        // the name may have been removed or replaced before the locks
+        uint32_t now;
+        err = locate_inode_in_dir(ext2, dir_inode, name, &now, NULL);
+        if (!err && now == *inode)
+            err = tree ? detach_tree(ext2, dir_inode, name, *inode, tree) :
+                remove_locked(ext2, dir_inode, name, *inode);
+
+        release_lock(ext2, EXT2_LOCK_INODE, high, true);
+        release_lock(ext2, EXT2_LOCK_INODE, low, true);
+
+        if (err || now == *inode)
+            return err;
+    }
+}
+
+ext2_error_t ext2_rm(ext2_t* ext2, const char* path) {
+    uint32_t inode = 0;
+
+    uint64_t t = op_begin(ext2, EXT2_OP_RM);
+    ext2_error_t error = remove_path(ext2, path, &inode, NULL);
+    op_end(ext2, EXT2_OP_RM, t, inode, 0, 0, error);
+
+    return error;
+}
+
+uint32_t rm_tree_workers(const ext2_rm_tree_params_t* params) {
+    return (params->parallel_for && params->workers > 0) ? params->workers : 1;
+}
+
+uint64_t rm_tree_map_size(ext2_t* ext2) {
+    return ALIGN8(CEIL((uint64_t)ext2->superblk.blocks_count - 
+                ext2->superblk.first_data_block, 8));
+}
+
+uint64_t ext2_rm_tree_workspace_size(ext2_t* ext2, uint32_t files) {
+    return rm_tree_map_size(ext2) + (uint64_t)files * sizeof(uint32_t);
+}
+
+// first position of the sorted list whose inode is >= 'inode'
+uint32_t rm_tree_lower_bound(rm_tree_state_t* st, uint32_t inode) {
+    uint32_t low = 0, high = st->count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (st->inodes[mid] < inode)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+// Frees the blocks of an inode that 'refs' entries of the tree link to, 
+// marking them in the map. If other links are left, only the link count 
+// goes down. 'gone' tells if the inode itself must be freed
+ext2_error_t rm_tree_inode(ext2_t* ext2, uint32_t inode, uint32_t refs,
+        blk_batch* batch, bool* dir, bool* gone) {
+    ext2_inode_t inode_struct;
+
+    take_lock(ext2, EXT2_LOCK_INODE, inode, true);
+
+    ext2_error_t err = read_inode(ext2, inode, &inode_struct);
+    *dir = !err && GET_FILE_FMT(inode_struct.mode) == EXT2_FMT_DIR;
+    *gone = !err && (*dir || inode_struct.links_count <= refs);
+
+    if (!err && !*gone) {
+        inode_struct.links_count -= refs;
+        err = write_inode(ext2, inode, &inode_struct);
+    } else if (!err && (GET_FILE_FMT(inode_struct.mode) != EXT2_FMT_LNK || 
+                inode_struct.blocks != 0)) {
+        // fast symlinks keep their target in the block pointers
+        err = free_inode_blocks(ext2, &inode_struct, batch);
+    }
+
+    release_lock(ext2, EXT2_LOCK_INODE, inode, true);
+    return err;
+}
+
+// Writes zeros over the records of the inodes set in 'gone', in runs of
+// consecutive inodes
+ext2_error_t rm_tree_zero_inodes(ext2_t* ext2, const ext2_bgd_t* bgd,
+        const uint8_t* gone) {
+    const uint32_t ipg = ext2->superblk.inodes_per_group;
+    const uint32_t max_run = sizeof(zero_block) / ext2->inode_size;
+    ext2_error_t err = 0;
+
+    for (uint32_t bit = 0; bit < ipg && !err; ) {
+        uint32_t run = 0;
+
+        if (!BIT_IS_SET(gone, bit)) {
+            bit++;
+            continue;
+        }
+
+        while (bit + run < ipg && run < max_run && BIT_IS_SET(gone, bit + run))
+            run++;
+
+        uint64_t addr = BLOCK_ADDR(ext2, bgd->inode_table) + 
+            (uint64_t)bit * ext2->inode_size;
+        err = dev_write(ext2, addr, run * ext2->inode_size, zero_block);
+        bit += run;
+    }
+
+    return err;
+}
+
+// Frees the inodes of the tree that are in 'group'. Their blocks are only 
+// marked in the map, and the inode bitmap and descriptor of the group are 
+// written once
+ext2_error_t rm_tree_group_inodes(rm_tree_state_t* st, uint32_t group) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    uint8_t gone_map[EXT2_MAX_BLOCK_SIZE]; // inodes of the group to free
+    ext2_t* ext2 = st->ext2;
+    const uint32_t ipg = ext2->superblk.inodes_per_group;
+    const uint32_t first = rm_tree_lower_bound(st, group * ipg + 1);
+    const uint32_t end = rm_tree_lower_bound(st, (group + 1) * ipg + 1);
+    blk_batch batch = { .count = 0, .freed = 0, .map = st->map };
+    uint32_t freed = 0, dirs = 0;
+    ext2_error_t err = 0;
+
+    if (first == end)
+        return 0;
+
+    memset(gone_map, 0, CEIL(ipg, 8));
+
+    for (uint32_t i = first; i < end && !err; ) {
+        uint32_t inode = st->inodes[i];
+        uint32_t refs = 1; // entries of the tree that link to it
+        bool dir, gone;
+
+        while (i + refs < end && st->inodes[i + refs] == inode)
+            refs++;
+
+        err = rm_tree_inode(ext2, inode, refs, &batch, &dir, &gone);
+        if (gone) {
+            SET_BIT(gone_map, (inode - 1) % ipg);
+            freed++;
+            dirs += dir;
+        }
+
+        i += refs;
+    }
+
+    if (err || freed == 0)
+        return err;
+
+    ext2_bgd_t bgd;
+    take_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+    // the records are cleared before the bits, so a new file can't get one
+    // of the inodes and see it zeroed afterwards
+    err = read_bgd(ext2, group, &bgd);
+    if (!err)
+        err = rm_tree_zero_inodes(ext2, &bgd, gone_map);
+
+    uint64_t addr = BLOCK_ADDR(ext2, bgd.inode_bitmap);
+    if (!err)
+        err = dev_read(ext2, addr, CEIL(ipg, 8), bitmap);
+
+    if (!err) {
+        for (uint32_t i = 0; i < CEIL(ipg, 8); i++)
+            bitmap[i] &= ~gone_map[i];
+
+        err = dev_write(ext2, addr, CEIL(ipg, 8), bitmap);
+    }
+
+    if (!err) {
+        bgd.free_inodes_count += freed;
+        bgd.used_dirs_count -= dirs;
+        err = write_bgd(ext2, group, &bgd);
+    }
+
+    release_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+    atomic_fetch_add_explicit(&st->freed_inodes, freed, memory_order_relaxed);
+    return err;
+}
+
+// Clears the bits of the map that fall in 'group' from its block bitmap. 
+// Only the bytes between the first and the last freed block are read and 
+// written, once
+ext2_error_t rm_tree_group_blocks(rm_tree_state_t* st, uint32_t group) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    ext2_t* ext2 = st->ext2;
+    _Atomic uint8_t* map = st->map + 
+        (uint64_t)group * ext2->superblk.blocks_per_group / 8;
+    uint32_t first = 0, end = CEIL(get_group_block_count(ext2, group), 8);
+    uint32_t freed = 0;
+    ext2_bgd_t bgd;
+
+    while (first < end && atomic_load_explicit(&map[first], memory_order_relaxed) == 0)
+        first++;
+    while (end > first && atomic_load_explicit(&map[end - 1], memory_order_relaxed) == 0)
+        end--;
+
+    if (first == end)
+        return 0;
+
+    take_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+    ext2_error_t err = read_bgd(ext2, group, &bgd);
+    if (!err)
+        err = init_block_bitmap(ext2, group, &bgd);
+
+    uint64_t addr = BLOCK_ADDR(ext2, bgd.block_bitmap) + first;
+    if (!err)
+        err = dev_read(ext2, addr, end - first, bitmap);
+
+    if (!err) {
+        for (uint32_t i = 0; i < end - first; i++) {
+            // blocks that were free already aren't counted twice
+            uint8_t bits = bitmap[i] & 
+                atomic_load_explicit(&map[first + i], memory_order_relaxed);
+
+            bitmap[i] &= ~bits;
+            for (; bits != 0; bits &= bits - 1)
+                freed++;
+        }
+
+        err = dev_write(ext2, addr, end - first, bitmap);
+    }
+
+    if (!err) {
+        bgd.free_blocks_count += freed;
+        err = write_bgd(ext2, group, &bgd);
+    }
+
+    release_lock(ext2, EXT2_LOCK_GROUP, group, true);
+
+    atomic_fetch_add_explicit(&st->freed_blocks, freed, memory_order_relaxed);
+    return err;
+}
+
+void rm_tree_task(uint32_t index, void* arg) {
+    rm_tree_state_t* st = arg;
+    STAT_JOIN(EXT2_OP_RM_TREE);
+
+    while (atomic_load_explicit(&st->error, memory_order_relaxed) == 0) {
+        uint32_t group = atomic_fetch_add_explicit(&st->next_group, 1, 
+                memory_order_relaxed);
+        if (group >= st->ext2->block_group_count)
+            break;
+
+        ext2_error_t err = (st->pass == 1) ? rm_tree_group_inodes(st, group) :
+            rm_tree_group_blocks(st, group);
+        if (err)
+            atomic_store_explicit(&st->error, err, memory_order_relaxed);
+    }
+}
+
+// The tree is listed and detached first. Then workers free the inodes group
+// by group, marking their blocks in a map, and once they're all done the map
+// is merged into the block bitmaps, again group by group. The superblock is
+// written once at the end
+ext2_error_t rm_tree(ext2_t* ext2, const char* path, 
+        const ext2_rm_tree_params_t* params, uint32_t* inode) {
+    rm_tree_state_t st;
+    uint8_t* ws = params->workspace;
+    uint32_t workers = rm_tree_workers(params);
+    uint64_t map_size = rm_tree_map_size(ext2);
+
+    if (params->workspace_size < map_size)
+        return EXT2_ERR_BUFFER_TOO_SMALL;
+
+    st.ext2 = ext2;
+    st.map = (_Atomic uint8_t*)ws;
+    st.inodes = (uint32_t*)(ws + map_size);
+    st.count = 0;
+    st.capacity = MIN((params->workspace_size - map_size) / sizeof(uint32_t), 
+            UINT32_MAX);
+    atomic_init(&st.freed_blocks, 0);
+    atomic_init(&st.freed_inodes, 0);
+    atomic_init(&st.error, 0);
+
+    ext2_error_t err = remove_path(ext2, path, inode, &st);
+    if (err)
+        return err;
+
+    // the names under the tree, which can't be told apart from the others
+    cache_drop_names(ext2);
+    memset(ws, 0, map_size);
+    sort_uint32(st.inodes, st.count);
+
+    for (st.pass = 1; st.pass <= 2; st.pass++) {
+        atomic_store_explicit(&st.next_group, 0, memory_order_relaxed);
+
+        if (params->parallel_for)
+            params->parallel_for(rm_tree_task, &st, workers, 
+                    params->parallel_context);
+        else
+            rm_tree_task(0, &st);
+
+        err = atomic_load_explicit(&st.error, memory_order_relaxed);
+        if (err)
+            return err;
+    }
+
+    return update_free_counts(ext2, st.freed_blocks, st.freed_inodes);
+}
+
+ext2_error_t ext2_rm_tree(ext2_t* ext2, const char* path, 
+        const ext2_rm_tree_params_t* params) {
+    uint32_t inode = 0;
+
+    uint64_t t = op_begin(ext2, EXT2_OP_RM_TREE);
+    ext2_error_t error = rm_tree(ext2, path, params, &inode);
+    op_end(ext2, EXT2_OP_RM_TREE, t, inode, 0, 0, error);
+
+    return error;
+}
+
+ext2_error_t txn_begin(ext2_t* ext2, void* buffer, uint64_t size) {
+    ext2_txn_t* txn = &ext2->txn;
+    uint32_t bs = ext2->block_size;
+
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    if (txn_is_open(txn))
+        return EXT2_ERR_TXN_STATE;
+
+    // as many blocks as fit in the buffer and the log. Commits write the log
+    // with a single call, so it must stay under 4 GiB
+    uint64_t log_max = ext2->log_size > 0 ? 
+        MIN(ext2->log_size, UINT32_MAX) : UINT32_MAX;
+    uint64_t capacity = MIN(size, log_max) / bs;
+
+    while (capacity > 0 && (ext2_txn_buffer_size(bs, capacity) > size ||
+                (txn_head_blocks(bs, capacity) + capacity) * bs > log_max))
+        capacity--;
+
+    if (capacity == 0)
+        return EXT2_ERR_BUFFER_TOO_SMALL;
+
+    spin_lock(&txn->lock);
+    if (txn->open) {
+        spin_unlock(&txn->lock);
+        return EXT2_ERR_TXN_STATE;
+    }
+
+    txn_layout(txn, buffer, bs, capacity);
+    txn_set_open(txn, true);
+    spin_unlock(&txn->lock);
+
+    return 0;
+}
+
+ext2_error_t ext2_txn_begin(ext2_t* ext2, void* buffer, uint64_t size) {
+    uint64_t t = op_begin(ext2, EXT2_OP_TXN_BEGIN);
+    ext2_error_t error = txn_begin(ext2, buffer, size);
+    op_end(ext2, EXT2_OP_TXN_BEGIN, t, 0, 0, size, error);
+
+    return error;
+}
+
+ext2_error_t txn_commit(ext2_t* ext2) {
+    ext2_txn_t* txn = &ext2->txn;
+
+    spin_lock(&txn->lock);
+    txn_wait(txn);
+    if (!txn->open) {
+        spin_unlock(&txn->lock);
+        return EXT2_ERR_TXN_STATE;
+    }
+
+    ext2_error_t err = txn_flush(ext2);
+    txn_set_open(txn, false);
+    spin_unlock(&txn->lock);
+
+    return err;
+}
+
+ext2_error_t ext2_txn_commit(ext2_t* ext2) {
+    uint64_t t = op_begin(ext2, EXT2_OP_TXN_COMMIT);
+    ext2_error_t error = txn_commit(ext2);
+    op_end(ext2, EXT2_OP_TXN_COMMIT, t, 0, 0, 0, error);
+
+    return error;
+}
+
+// Bulk import (see ext2_import_tree). Each host directory is listed whole
+// into the workspace, where its blocks are built along with a record for
+// every child, and then written in a single run. Its files get their blocks
+// next, and their data goes through a pipeline of two batches: while one is
+// read from the host, the other is written to the device
+
+// a child of a directory being imported
+typedef struct {
+    uint32_t inode;
+    uint32_t entry;  // offset of its dir entry in the workspace
+    uint64_t size;
+    uint32_t mtime;
+    uint16_t mode;
+    uint16_t uid;
+    uint16_t gid;
+} import_record_t;
+
+// file data that goes from the host to a run of blocks
+typedef struct {
+    const ext2_directory_entry_t* entry; // the file, in the current directory
+    uint64_t offset; // in the file
+    uint32_t size;   // bytes read from the host
+    uint32_t len;    // bytes written, size rounded up to whole blocks
+    uint32_t pos;    // in the buffer half of the batch
+    uint64_t addr;
+} import_job_t;
+
+#define IMPORT_BATCH_JOBS 64
+#define IMPORT_MAX_PATH 4096
+
+typedef struct {
+    import_job_t jobs[IMPORT_BATCH_JOBS];
+    uint32_t count;
+    uint32_t used; // bytes of the buffer half taken by the jobs
+    ext2_error_t error;
+} import_batch_t;
+
+typedef struct {
+    ext2_t* ext2;
+    const ext2_import_params_t* params;
+    ext2_alloc_ctx_t ctx; // every block is allocated from here, in order
+
+    // The workspace is used from both ends: the blocks of the directories 
+    // being imported go below 'top', their records from 'low' to the end
+    uint8_t* ws;
+    uint32_t top;
+    uint32_t low;
+
+    // directory being listed
+    uint32_t dir_inode;
+    uint32_t dir_start;  // workspace offset of its first block
+    uint32_t block_used; // bytes taken in its last block
+    uint32_t last_entry; // workspace offset of its last entry
+    uint32_t subdirs;
+    bool fresh;          // built here, rather than an existing directory
+
+    char path[IMPORT_MAX_PATH]; // host path of the current directory
+    uint32_t path_len;
+    char read_path[IMPORT_MAX_PATH]; // used by the reading task
+
+    uint8_t* buf;
+    uint32_t half;   // size of each buffer half, in whole blocks
+    import_batch_t batches[2];
+    uint32_t filling; // batch that takes new jobs
+    bool pending;     // the other batch was read and waits to be written
+} import_state_t;
+
+// Appends an entry to the directory being listed. Entries don't cross 
+// blocks, the last one of a block takes the rest of it
+ext2_error_t import_add_entry(import_state_t* st, uint32_t inode, uint16_t mode,
+        const char* name, uint32_t name_len) {
+    const uint32_t bs = st->ext2->block_size;
+    uint32_t rec_len = DIR_REC_LEN(name_len);
+
+    if (st->top == st->dir_start || st->block_used + rec_len > bs) {
+        if (st->top != st->dir_start) {
+            ext2_directory_entry_t* last = (void*)(st->ws + st->last_entry);
+            last->rec_len += bs - st->block_used;
+        }
+
+        if (st->top + bs > st->low)
+            return EXT2_ERR_BUFFER_TOO_SMALL;
+
+        memset(st->ws + st->top, 0, bs);
+        st->top += bs;
+        st->block_used = 0;
+    }
+
+    st->last_entry = st->top - bs + st->block_used;
+    st->block_used += rec_len;
+
+    ext2_directory_entry_t* entry = (void*)(st->ws + st->last_entry);
+    entry->inode = inode;
+    entry->rec_len = rec_len;
+    entry->name_len = name_len;
+    entry->file_type = get_dir_entry_type(st->ext2, mode);
+    memcpy(entry->name, name, name_len);
+
+    return 0;
+}
+
+// called by list_dir for every child of the directory being listed
+int import_emit(const ext2_import_entry_t* host, void* arg) {
+    import_state_t* st = arg;
+    ext2_t* ext2 = st->ext2;
+    uint32_t fmt = GET_FILE_FMT(host->mode);
+    uint32_t name_len = strlen(host->name);
+    uint32_t inode;
+    ext2_error_t err;
+
+    if (fmt != EXT2_FMT_REG && fmt != EXT2_FMT_DIR)
+        return 0;
+
+    if (name_len > EXT2_MAX_FILE_NAME)
+        return EXT2_ERR_FILENAME_TOO_BIG;
+
+    if (name_len == 0 || strchr(host->name, '/'))
+        return EXT2_ERR_BAD_PATH;
+
+    if (!st->fresh) {
+        err = locate_inode_in_dir(ext2, st->dir_inode, host->name, &inode, 
+                NULL);
+        if (err == 0)
+            return EXT2_ERR_FILE_EXISTS;
+        if (err != EXT2_ERR_FILE_NOT_FOUND)
+            return err;
+    }
+
+    // room for the record and, at worst, a new block for the entry
+    if (st->low - st->top < sizeof(import_record_t) + ext2->block_size)
+        return EXT2_ERR_BUFFER_TOO_SMALL;
+    st->low -= sizeof(import_record_t);
+
+    // inodes go to the group where the data is being written
+    err = get_free_inode(ext2, get_block_group(ext2, st->ctx.goal), &inode);
+    if (!err)
+        err = import_add_entry(st, inode, host->mode, host->name, name_len);
+    if (!err && fmt == EXT2_FMT_DIR) {
+        err = add_used_dir(ext2, get_inode_group(ext2, inode));
+        st->subdirs++;
+    }
+    if (err)
+        return err;
+
+    import_record_t* rec = (void*)(st->ws + st->low);
+    rec->inode = inode;
+    rec->entry = st->last_entry;
+    rec->size = host->size;
+    rec->mtime = host->mtime;
+    rec->mode = host->mode;
+    rec->uid = host->uid;
+    rec->gid = host->gid;
+
+    return 0;
+}
+
+void import_init_inode(const import_record_t* rec, ext2_inode_t* inode_struct) {
+    memset(inode_struct, 0, sizeof(*inode_struct));
+    inode_struct->mode = rec->mode;
+    inode_struct->uid = rec->uid;
+    inode_struct->gid = rec->gid;
+    inode_struct->atime = rec->mtime;
+    inode_struct->ctime = rec->mtime;
+    inode_struct->mtime = rec->mtime;
+}
+
+// allocates the next run of blocks of a new file, right after the last one
+ext2_error_t import_alloc_run(import_state_t* st, ext2_inode_t* inode_struct,
+        uint32_t blk_index, uint32_t want, uint32_t* first, uint32_t* count) {
+    ext2_t* ext2 = st->ext2;
+    ext2_error_t err = alloc_blocks(ext2, &st->ctx, st->ctx.goal, want, first,
+            count);
+    if (err)
+        return err;
+
+    inode_struct->blocks += *count * (ext2->block_size / 512);
+
+    return set_data_blocks(ext2, &st->ctx, inode_struct, blk_index, *first, 
+            *count, *first + *count);
+}
+
+// reads the host data of the batch being filled
+ext2_error_t import_read_batch(import_state_t* st, import_batch_t* batch, 
+        uint8_t* buf) {
+    const ext2_import_params_t* params = st->params;
+
+    memcpy(st->read_path, st->path, st->path_len);
+    st->read_path[st->path_len] = '/';
+    char* name = st->read_path + st->path_len + 1;
+
+    for (uint32_t i = 0; i < batch->count; i++) {
+        const import_job_t* job = &batch->jobs[i];
+
+        memcpy(name, job->entry->name, job->entry->name_len);
+        name[job->entry->name_len] = '\0';
+
+        ext2_error_t err = params->read_file(st->read_path, job->offset, 
+                job->size, buf + job->pos, params->context);
+        if (err)
+            return err;
+
+        memset(buf + job->pos + job->size, 0, job->len - job->size);
+    }
+
+    return 0;
+}
+
+// writes a batch, jobs that land on consecutive blocks in a single call
+ext2_error_t import_write_batch(import_state_t* st, import_batch_t* batch, 
+        const uint8_t* buf) {
+    uint32_t i = 0;
+
+    while (i < batch->count) {
+        const import_job_t* job = &batch->jobs[i];
+        uint32_t len = job->len;
+
+        for (i++; i < batch->count && batch->jobs[i].addr == job->addr + len; i++)
+            len += batch->jobs[i].len;
+
+        ext2_error_t err = dev_write(st->ext2, job->addr, len, buf + job->pos);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+// task 0 reads the batch being filled, task 1 writes the other one
+void import_task(uint32_t index, void* arg) {
+    import_state_t* st = arg;
+    uint32_t b = (index == 0) ? st->filling : !st->filling;
+
+    STAT_JOIN(EXT2_OP_IMPORT_TREE);
+
+    if (index == 0)
+        st->batches[b].error = import_read_batch(st, &st->batches[b], 
+                st->buf + b * st->half);
+    else
+        st->batches[b].error = import_write_batch(st, &st->batches[b], 
+                st->buf + b * st->half);
+}
+
+// moves the pipeline one step: the batch being filled is read while the 
+// other is written, then they swap
+ext2_error_t import_step(import_state_t* st) {
+    import_batch_t* reading = &st->batches[st->filling];
+    import_batch_t* writing = &st->batches[!st->filling];
+    bool read = (reading->count > 0);
+    bool write = st->pending;
+
+    reading->error = 0;
+    writing->error = 0;
+
+    if (read && write && st->params->parallel_for) {
+        st->params->parallel_for(import_task, st, 2, 
+                st->params->parallel_context);
+    } else {
+        if (read)
+            import_task(0, st);
+        if (write)
+            import_task(1, st);
+    }
+
+    if (reading->error)
+        return reading->error;
+    if (writing->error)
+        return writing->error;
+
+    writing->count = 0;
+    writing->used = 0;
+    st->pending = read;
+    st->filling = !st->filling;
+    return 0;
+}
+
+// writes everything the pipeline holds
+ext2_error_t import_drain(import_state_t* st) {
+    while (st->batches[st->filling].count > 0 || st->pending) {
+        ext2_error_t err = import_step(st);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+// queues the data of a file that goes to 'count' blocks starting at 'block'
+ext2_error_t import_queue(import_state_t* st, const import_record_t* rec, 
+        uint64_t offset, uint32_t block, uint32_t count) {
+    const uint32_t bs = st->ext2->block_size;
+    const uint64_t end = offset + (uint64_t)count * bs;
+    uint64_t addr = BLOCK_ADDR(st->ext2, block);
+
+    while (offset < end) {
+        import_batch_t* batch = &st->batches[st->filling];
+
+        if (batch->count == IMPORT_BATCH_JOBS || batch->used == st->half) {
+            ext2_error_t err = import_step(st);
+            if (err)
+                return err;
+            continue;
+        }
+
+        uint32_t len = MIN(end - offset, st->half - batch->used);
+        import_job_t* job = &batch->jobs[batch->count++];
+
+        job->entry = (const void*)(st->ws + rec->entry);
+        job->offset = offset;
+        job->len = len;
+        job->size = MIN(len, rec->size - offset);
+        job->pos = batch->used;
+        job->addr = addr;
+
+        batch->used += len;
+        offset += len;
+        addr += len;
+    }
+
+    return 0;
+}
+
+// allocates the blocks of a file and queues its data
+ext2_error_t import_file(import_state_t* st, const import_record_t* rec) {
+    ext2_t* ext2 = st->ext2;
+    ext2_inode_t inode_struct;
+
+    import_init_inode(rec, &inode_struct);
+    inode_struct.links_count = 1;
+
+    ext2_error_t err = set_inode_size(ext2, &inode_struct, rec->size);
+    if (err)
+        return err;
+
+    uint32_t blocks = CEIL(rec->size, ext2->block_size);
+    uint32_t first, count;
+
+    for (uint32_t blk = 0; blk < blocks; blk += count) {
+        err = import_alloc_run(st, &inode_struct, blk, blocks - blk, &first,
+                &count);
+        if (!err)
+            err = import_queue(st, rec, (uint64_t)blk * ext2->block_size, first,
+                    count);
+        if (err)
+            return err;
+    }
+
+    return write_inode(ext2, rec->inode, &inode_struct);
+}
+
+// writes the blocks built for a new directory, and its inode
+ext2_error_t import_write_dir(import_state_t* st, const import_record_t* rec) {
+    ext2_t* ext2 = st->ext2;
+    ext2_directory_entry_t* last = (void*)(st->ws + st->last_entry);
+    ext2_inode_t inode_struct;
+
+    last->rec_len += ext2->block_size - st->block_used;
+
+    import_init_inode(rec, &inode_struct);
+    inode_struct.links_count = 2 + st->subdirs;
+
+    uint32_t blocks = (st->top - st->dir_start) / ext2->block_size;
+    uint32_t first, count;
+    ext2_error_t err;
+
+    for (uint32_t blk = 0; blk < blocks; blk += count) {
+        err = import_alloc_run(st, &inode_struct, blk, blocks - blk, &first, 
+                &count);
+        if (!err)
+            err = dev_write(ext2, BLOCK_ADDR(ext2, first), 
+                    count * ext2->block_size, 
+                    st->ws + st->dir_start + BLOCK_ADDR(ext2, blk));
+        if (err)
+            return err;
+    }
+
+    inode_struct.size = BLOCK_ADDR(ext2, blocks);
+    return write_inode(ext2, st->dir_inode, &inode_struct);
+}
+
+// adds the listed children to an existing directory
+ext2_error_t import_link_all(import_state_t* st, uint32_t rec_end) {
+    ext2_t* ext2 = st->ext2;
+    ext2_inode_t inode_struct;
+    ext2_error_t err;
+
+    for (uint32_t r = rec_end; r > st->low; ) {
+        r -= sizeof(import_record_t);
+        const import_record_t* rec = (void*)(st->ws + r);
+        const ext2_directory_entry_t* listed = (void*)(st->ws + rec->entry);
+        ext2_directory_entry_t entry;
+
+        entry.inode = rec->inode;
+        entry.name_len = listed->name_len;
+        entry.file_type = listed->file_type;
+        memcpy(entry.name, listed->name, listed->name_len);
+        entry.name[listed->name_len] = '\0';
+
+        err = add_dir_entry(ext2, st->dir_inode, &entry);
+        if (err)
+            return err;
+    }
+
+    if (st->subdirs == 0)
+        return 0;
+
+    err = read_inode(ext2, st->dir_inode, &inode_struct);
+    if (err)
+        return err;
+
+    inode_struct.links_count += st->subdirs;
+    return write_inode(ext2, st->dir_inode, &inode_struct);
+}
+
+// Imports the host directory st->path into 'dir_inode'. 'rec' is the record
+// of a new directory in its parent's listing, or NULL for the destination
+ext2_error_t import_dir(import_state_t* st, const import_record_t* rec, 
+        uint32_t dir_inode, uint32_t parent) {
+    const ext2_import_params_t* params = st->params;
+    const uint32_t top = st->top, low = st->low;
+    ext2_error_t err = 0;
+
+    if (st->path_len + EXT2_MAX_FILE_NAME + 2 > IMPORT_MAX_PATH)
+        return EXT2_ERR_BAD_PATH;
+
+    st->dir_inode = dir_inode;
+    st->dir_start = top;
+    st->block_used = 0;
+    st->subdirs = 0;
+    st->fresh = (rec != NULL);
+
+    if (rec) {
+        err = import_add_entry(st, dir_inode, EXT2_FMT_DIR, ".", 1);
+        if (!err)
+            err = import_add_entry(st, parent, EXT2_FMT_DIR, "..", 2);
+    }
+    if (!err)
+        err = params->list_dir(st->path, import_emit, st, params->context);
+    if (!err)
+        err = rec ? import_write_dir(st, rec) : import_link_all(st, low);
+    if (err)
+        return err;
+
+    // the children come in listing order, records grow down from 'low'
+    const uint32_t dir_end = st->top, rec_low = st->low;
+
+    for (uint32_t r = low; r > rec_low && !err; ) {
+        r -= sizeof(import_record_t);
+        const import_record_t* child = (void*)(st->ws + r);
+
+        if (GET_FILE_FMT(child->mode) == EXT2_FMT_REG) {
+            err = import_file(st, child);
+            continue;
+        }
+
+        // the reading task uses the path of this directory
+        err = import_drain(st);
+        if (err)
+            break;
+
+        const ext2_directory_entry_t* entry = (void*)(st->ws + child->entry);
+        uint32_t path_len = st->path_len;
+
+        st->path[path_len] = '/';
+        memcpy(st->path + path_len + 1, entry->name, entry->name_len);
+        st->path_len += 1 + entry->name_len;
+        st->path[st->path_len] = '\0';
+        st->top = dir_end;
+        st->low = rec_low;
+
+        err = import_dir(st, child, child->inode, dir_inode);
+
+        st->path_len = path_len;
+        st->path[path_len] = '\0';
+    }
+
+    if (!err)
+        err = import_drain(st);
+
+    st->top = top;
+    st->low = low;
+    return err;
+}
+
+ext2_error_t import_tree(ext2_t* ext2, const char* host_path, 
+        const char* dest_path, const ext2_import_params_t* params) {
+    import_state_t st;
+    ext2_inode_t inode_struct;
+    uint32_t dest;
+
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    ext2_error_t err = locate_inode(ext2, dest_path, &dest);
+    if (err)
+        return err;
+
+    uint32_t path_len = strlen(host_path);
+    if (path_len >= IMPORT_MAX_PATH)
+        return EXT2_ERR_BAD_PATH;
+
+    if (params->buffer_size / 2 < ext2->block_size)
+        return EXT2_ERR_BUFFER_TOO_SMALL;
+
+    st.ext2 = ext2;
+    st.params = params;
+    st.ws = params->workspace;
+    st.top = 0;
+    st.low = params->workspace_size & ~7;
+    memcpy(st.path, host_path, path_len + 1);
+    st.path_len = path_len;
+    st.buf = params->buffer;
+    st.half = params->buffer_size / 2 / ext2->block_size * ext2->block_size;
+    st.batches[0].count = st.batches[1].count = 0;
+    st.batches[0].used = st.batches[1].used = 0;
+    st.filling = 0;
+    st.pending = false;
+
+    // the tree starts at the group of the destination
+    ext2_alloc_ctx_init(ext2, &st.ctx, 0, 1);
+    st.ctx.goal = get_group_first_block(ext2, get_inode_group(ext2, dest));
+
+    take_lock(ext2, EXT2_LOCK_INODE, dest, true);
+
+    err = read_inode(ext2, dest, &inode_struct);
+    if (!err && GET_FILE_FMT(inode_struct.mode) != EXT2_FMT_DIR)
+        err = EXT2_ERR_NOT_A_DIR;
+    if (!err)
+        err = import_dir(&st, NULL, dest, 0);
+
+    release_lock(ext2, EXT2_LOCK_INODE, dest, true);
+
+    ext2_error_t flush_err = flush_alloc_ctx(ext2, &st.ctx);
+    return err ? err : flush_err;
+}
+
+ext2_error_t ext2_import_tree(ext2_t* ext2, const char* host_path, 
+        const char* dest_path, const ext2_import_params_t* params) {
+    uint64_t t = op_begin(ext2, EXT2_OP_IMPORT_TREE);
+    ext2_error_t error = import_tree(ext2, host_path, dest_path, params);
+    op_end(ext2, EXT2_OP_IMPORT_TREE, t, 0, 0, 0, error);
+
+    return error;
+}
+
+uint64_t ext2_check_workspace_size(ext2_t* ext2) {
+    return check_groups_size(ext2) + 2 * check_inodes_size(ext2) + 
+        check_blocks_size(ext2);
+}
+
+ext2_error_t check_fs(ext2_t* ext2, const ext2_check_params_t* params,
+        ext2_check_report_t* report) {
+    check_state_t st;
+    uint8_t* ws = params->workspace;
+
+    if (params->repair && ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    st.ext2 = ext2;
+    st.params = params;
+    st.first_ino = (ext2->superblk.rev_level == EXT2_GOOD_OLD_REV) ? 
+        EXT2_GOOD_OLD_FIRST_INO : ext2->superblk.first_ino;
+    st.groups = (check_group_t*)ws;
+    st.links = (uint16_t*)(ws + check_groups_size(ext2));
+    st.refs = (_Atomic uint16_t*)(ws + check_groups_size(ext2) + 
+            check_inodes_size(ext2));
+    st.used = (_Atomic uint8_t*)(ws + check_groups_size(ext2) + 
+            2 * check_inodes_size(ext2));
+
+    memset(ws, 0, ext2_check_workspace_size(ext2));
+
+    check_run(&st, check_pass1_task);
+    check_run(&st, check_pass2_task);
+
+    memset(report, 0, sizeof(*report));
+    uint32_t free_blocks = 0, free_inodes = 0;
+
+    for (uint32_t group = 0; group < ext2->block_group_count; group++) {
+        check_group_t* res = &st.groups[group];
+
+        if (res->error)
+            return res->error;
+
+        report->block_bitmap_errors += res->report.block_bitmap_errors;
+        report->inode_bitmap_errors += res->report.inode_bitmap_errors;
+        report->bad_blocks += res->report.bad_blocks;
+        report->dup_blocks += res->report.dup_blocks;
+        report->bad_block_counts += res->report.bad_block_counts;
+        report->bad_dir_blocks += res->report.bad_dir_blocks;
+        report->bad_link_counts += res->report.bad_link_counts;
+        report->bad_group_counts += res->report.bad_group_counts;
+        report->repaired += res->report.repaired;
+
+        free_blocks += res->free_blocks;
+        free_inodes += res->free_inodes;
+    }
+
+    ext2_superblock_t superblk;
+    ext2_error_t err = read_superblock(ext2, &superblk);
+    if (err)
+        return err;
+
+    if (superblk.free_blocks_count == free_blocks && 
+            superblk.free_inodes_count == free_inodes)
+        return 0;
+
+    report->bad_super_counts = 1;
+
+    if (!params->repair)
+        return 0;
+
+    take_lock(ext2, EXT2_LOCK_SHARED, 0, true);
+    ext2->superblk.free_blocks_count = free_blocks;
+    ext2->superblk.free_inodes_count = free_inodes;
+    err = write_superblock(ext2, &ext2->superblk);
+    release_lock(ext2, EXT2_LOCK_SHARED, 0, true);
+
+    if (!err)
+        report->repaired++;
+
+    return err;
+}
+
+ext2_error_t ext2_check(ext2_t* ext2, const ext2_check_params_t* params,
+        ext2_check_report_t* report) {
+    uint64_t t = op_begin(ext2, EXT2_OP_CHECK);
+    ext2_error_t error = check_fs(ext2, params, report);
+    op_end(ext2, EXT2_OP_CHECK, t, 0, 0, 0, error);
+
+    return error;
+}
+
+// Defragmenter (see ext2_defrag). The block pointers of each file are walked
+// in order, reading every indirect block once, to find how many runs its 
+// data is in. Files worth moving get new runs first, their data is copied 
+// there by a second walk, and the inode is switched to a fresh set of 
+// indirect blocks before the old blocks are freed
+
+// most runs a moved file may end up in
+#define DEFRAG_MAX_RUNS 16
+
+typedef struct {
+    ext2_t* ext2;
+    uint64_t io;       // bytes read and written, for the budget
+    bool copy;         // second walk: data is copied to the new runs
+
+    uint32_t count;    // data blocks of the file, from its size
+    uint32_t index;    // next block of the file
+    uint32_t runs;     // runs the data is in
+    uint32_t first;    // first data block
+    uint32_t last;     // last data block seen
+    bool sparse;       // has holes, or blocks past its size
+
+    blk_run new_runs[DEFRAG_MAX_RUNS];
+    uint32_t new_count;
+    uint32_t cur_run;  // new run that gets the next block
+    uint32_t cur_off;
+    blk_run src;       // copy waiting to be made
+    uint32_t dst;
+} defrag_state_t;
+
+ext2_error_t defrag_flush_copy(defrag_state_t* st) {
+    if (st->src.count == 0)
+        return 0;
+
+    st->io += 2 * BLOCK_ADDR(st->ext2, st->src.count);
+    ext2_error_t err = copy_blocks(st->ext2, st->src.start, st->dst, 
+            st->src.count);
+    st->src.count = 0;
+    return err;
+}
+
+// called for every data pointer of a file, in order
+ext2_error_t defrag_visit(defrag_state_t* st, uint32_t block) {
+    if (st->index >= st->count || block == 0) {
+        st->sparse |= (block != 0) || (st->index < st->count);
+        st->index++;
+        return 0;
+    }
+
+    if (!st->copy) {
+        if (st->index == 0 || block != st->last + 1)
+            st->runs++;
+        if (st->index == 0)
+            st->first = block;
+        st->last = block;
+        st->index++;
+        return 0;
+    }
+
+    const blk_run* run = &st->new_runs[st->cur_run];
+    uint32_t dst = run->start + st->cur_off;
+
+    if (++st->cur_off == run->count) {
+        st->cur_run++;
+        st->cur_off = 0;
+    }
+
+    st->index++;
+
+    // consecutive blocks that go to consecutive blocks are copied together
+    if (st->src.count > 0 && block == st->src.start + st->src.count && 
+            dst == st->dst + st->src.count) {
+        st->src.count++;
+        return 0;
+    }
+
+    ext2_error_t err = defrag_flush_copy(st);
+    st->src.start = block;
+    st->src.count = 1;
+    st->dst = dst;
+    return err;
+}
+
+ext2_error_t defrag_walk_tree(defrag_state_t* st, uint32_t block, int level) {
+    uint32_t ptrs[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    const uint32_t bpb = st->ext2->block_size / sizeof(uint32_t);
+
+    // a missing indirect block is a hole, the file won't be moved
+    if (block == 0) {
+        st->sparse |= (st->index < st->count);
+        return 0;
+    }
+
+    st->io += st->ext2->block_size;
+    ext2_error_t err = dev_read(st->ext2, BLOCK_ADDR(st->ext2, block), 
+            st->ext2->block_size, ptrs);
+
+    for (uint32_t i = 0; i < bpb && !err && !st->sparse; i++)
+        err = (level == 1) ? defrag_visit(st, ptrs[i]) : 
+            defrag_walk_tree(st, ptrs[i], level - 1);
+
+    return err;
+}
+
+ext2_error_t defrag_walk(defrag_state_t* st, const ext2_inode_t* inode_struct) {
+    ext2_error_t err = 0;
+
+    st->index = 0;
+    st->runs = 0;
+    st->sparse = false;
+    st->cur_run = 0;
+    st->cur_off = 0;
+    st->src.count = 0;
+
+    for (uint32_t i = 0; i < 12 && !err; i++)
+        err = defrag_visit(st, inode_struct->block[i]);
+
+    for (int level = 1; level <= 3 && !err && !st->sparse; level++) {
+        if (st->index < st->count || inode_struct->block[11 + level] != 0)
+            err = defrag_walk_tree(st, inode_struct->block[11 + level], level);
+    }
+
+    if (!err && st->copy)
+        err = defrag_flush_copy(st);
+
+    return err;
+}
+
+// gives back the blocks reserved for a move that didn't happen
+ext2_error_t defrag_release(defrag_state_t* st) {
+    for (uint32_t i = 0; i < st->new_count; i++) {
+        blk_run run = st->new_runs[i];
+        ext2_error_t err = flush_blk_run(st->ext2, &run);
+        if (err)
+            return err;
+    }
+
+    st->new_count = 0;
+    return 0;
+}
+
+// adds the indirect blocks of a tree to a batch, but not the data blocks
+ext2_error_t free_indirect_tree(ext2_t* ext2, uint32_t block, int level, 
+        blk_batch* batch) {
+    uint32_t ptrs[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    const uint32_t bpb = ext2->block_size / sizeof(uint32_t);
+    ext2_error_t err = 0;
+
+    if (level > 1) {
+        err = dev_read(ext2, BLOCK_ADDR(ext2, block), ext2->block_size, ptrs);
+
+        for (uint32_t i = 0; i < bpb && !err; i++) {
+            if (ptrs[i] != 0)
+                err = free_indirect_tree(ext2, ptrs[i], level - 1, batch);
+        }
+    }
+
+    if (!err)
+        err = free_block(ext2, batch, block);
+
+    return err;
+}
+
+// Undoes a move that failed before the inode was switched to its new blocks:
+// the new runs are given back, along with the indirect blocks already made 
+// for them in 'moved'. The caller returns the error that made it fail
+void defrag_abort(defrag_state_t* st, const ext2_inode_t* moved) {
+    blk_batch batch = { .count = 0, .freed = 0 };
+    ext2_error_t err = 0;
+
+    for (int level = 1; level <= 3 && !err && moved != NULL; level++) {
+        if (moved->block[11 + level] != 0)
+            err = free_indirect_tree(st->ext2, moved->block[11 + level], level,
+                    &batch);
+    }
+
+    if (!err)
+        finish_blk_batch(st->ext2, &batch, 0);
+
+    defrag_release(st);
+}
+
+// frees the data and indirect blocks an inode pointed to before it moved
+ext2_error_t defrag_free_old(ext2_t* ext2, ext2_inode_t* old) {
+    blk_batch batch = { .count = 0, .freed = 0 };
+
+    ext2_error_t err = free_inode_blocks(ext2, old, &batch);
+    if (!err)
+        err = finish_blk_batch(ext2, &batch, 0);
+
+    return err;
+}
+
+// Moves a file if it's fragmented or, when compacting, if there's room for 
+// it earlier in its group. 'stop' is set if the budget can't pay for it
+ext2_error_t defrag_file(defrag_state_t* st, const ext2_defrag_params_t* params,
+        uint32_t inode, ext2_inode_t* inode_struct, 
+        ext2_defrag_report_t* report, bool* stop) {
+    ext2_t* ext2 = st->ext2;
+    const uint32_t bpb = ext2->block_size / sizeof(uint32_t);
+
+    st->copy = false;
+    st->new_count = 0;
+    st->count = CEIL(get_inode_size(inode_struct), ext2->block_size);
+
+    ext2_error_t err = defrag_walk(st, inode_struct);
+    if (err || st->sparse || st->count == 0)
+        return err;
+
+    uint32_t group_start = get_group_first_block(ext2, 
+            get_block_group(ext2, st->first));
+    bool fragmented = (st->runs > 1);
+
+    report->files_fragmented += fragmented;
+
+    if (!fragmented && !(params->compact && st->first > group_start))
+        return 0;
+
+    // data is read and written once, and so are the indirect blocks
+    uint64_t cost = 2 * BLOCK_ADDR(ext2, st->count + CEIL(st->count, bpb));
+
+    if (params->io_budget && cost > params->io_budget) {
+        report->files_skipped++;
+        return 0;
+    }
+
+    if (params->io_budget && st->io + cost > params->io_budget) {
+        *stop = true;
+        return 0;
+    }
+
+    // a fragmented file must end up in fewer runs, a compacted one in a 
+    // single run earlier in its group
+    uint32_t max_runs = fragmented ? MIN(st->runs - 1, DEFRAG_MAX_RUNS) : 1;
+    uint32_t goal = params->compact ? group_start : st->first;
+    uint32_t remaining = st->count;
+
+    while (remaining > 0 && st->new_count < max_runs) {
+        blk_run* run = &st->new_runs[st->new_count];
+        err = alloc_blocks(ext2, NULL, goal, remaining, &run->start, &run->count);
+        if (err == EXT2_ERR_DISK_FULL)
+            break;
+        if (err) {
+            defrag_abort(st, NULL);
+            return err;
+        }
+
+        st->new_count++;
+        remaining -= run->count;
+        goal = run->start + run->count;
+    }
+
+    if (remaining > 0 || (!fragmented && (st->new_runs[0].start > st->first ||
+                get_block_group(ext2, st->new_runs[0].start) != 
+                get_block_group(ext2, st->first)))) {
+        report->files_skipped++;
+        return defrag_release(st);
+    }
+
+    st->copy = true;
+    err = defrag_walk(st, inode_struct);
+    if (err) {
+        defrag_abort(st, NULL);
+        return err;
+    }
+
+    // the new indirect blocks go right after each run
+    ext2_inode_t moved = *inode_struct;
+    uint32_t index = 0;
+
+    memset(moved.block, 0, sizeof(moved.block));
+    moved.blocks = st->count * (ext2->block_size / 512);
+
+    for (uint32_t i = 0; i < st->new_count && !err; i++) {
+        const blk_run* run = &st->new_runs[i];
+        err = set_data_blocks(ext2, NULL, &moved, index, run->start, run->count,
+                run->start + run->count);
+        index += run->count;
+    }
+
+    if (!err)
+        err = write_inode(ext2, inode, &moved);
+    if (err) {
+        defrag_abort(st, &moved);
+        return err;
+    }
+
+    // the inode has moved, so from here the old blocks are the ones to free
+    err = defrag_free_old(ext2, inode_struct);
+    if (err)
+        return err;
+
+    st->io += BLOCK_ADDR(ext2, CEIL(st->count, bpb));
+    report->files_moved++;
+    report->blocks_moved += st->count;
+    return 0;
+}
+
+ext2_error_t defrag_fs(ext2_t* ext2, const ext2_defrag_params_t* params,
+        ext2_defrag_report_t* report) {
+    const uint32_t ipg = ext2->superblk.inodes_per_group;
+    const uint32_t first_ino = (ext2->superblk.rev_level == EXT2_GOOD_OLD_REV) ?
+        EXT2_GOOD_OLD_FIRST_INO : ext2->superblk.first_ino;
+    defrag_state_t st;
+    ext2_error_t err = 0;
+    bool stop = false;
+
+    memset(report, 0, sizeof(*report));
+    if (ext2->read_only)
+        return EXT2_ERR_READ_ONLY;
+
+    st.ext2 = ext2;
+    st.io = 0;
+
+    uint32_t inode = MAX(params->start_inode, 1);
+
+    while (inode <= ext2->superblk.inodes_count) {
+        uint32_t group = get_inode_group(ext2, inode);
+        ext2_bgd_t bgd;
+
+        err = read_bgd(ext2, group, &bgd);
+        if (err)
+            break;
+
+        // inodes that were never used are skipped
+        uint32_t used = ipg;
+        if (bgd_flag(ext2, &bgd, EXT2_BG_INODE_UNINIT))
+            used = 0;
+        else if (ext2->superblk.feature_ro_compat & EXT2_FEATURE_RO_COMPAT_GDT_CSUM)
+            used = ipg - bgd.itable_unused;
+
+        for (; inode <= group * ipg + used; inode++) {
+            ext2_inode_t inode_struct;
+
+            if (params->io_budget && st.io >= params->io_budget)
+                stop = true;
+            if (stop)
+                break;
+
+            if (inode < first_ino && inode != EXT2_ROOT_INODE)
+                continue;
+
+            take_lock(ext2, EXT2_LOCK_INODE, inode, true);
+
+            st.io += ext2->inode_size;
+            err = read_inode(ext2, inode, &inode_struct);
+
+            uint32_t fmt = GET_FILE_FMT(inode_struct.mode);
+            if (!err && inode_struct.links_count > 0 && 
+                    (fmt == EXT2_FMT_REG || fmt == EXT2_FMT_DIR)) {
+                report->files_scanned++;
+                err = defrag_file(&st, params, inode, &inode_struct, report,
+                        &stop);
+            }
+
+            release_lock(ext2, EXT2_LOCK_INODE, inode, true);
+
+            if (err || stop)
+                break;
+        }
+
+        if (err || stop)
+            break;
+
+        inode = (group + 1) * ipg + 1;
+    }
+
+    report->io_bytes = st.io;
+
+    if (stop)
+        report->next_inode = inode;
+
+    return err;
+}
+
+ext2_error_t ext2_defrag(ext2_t* ext2, const ext2_defrag_params_t* params,
+        ext2_defrag_report_t* report) {
+    uint64_t t = op_begin(ext2, EXT2_OP_DEFRAG);
+    ext2_error_t error = defrag_fs(ext2, params, report);
+    op_end(ext2, EXT2_OP_DEFRAG, t, 0, 0, 0, error);
+
+    return error;
+}
+
+// Scrubber (see ext2_scrub). Runs in three passes over the block groups, 
+// each shared by the workers, which take groups in order. The first marks 
+// the last block of every file whose size isn't a multiple of the block 
+// size, by storing the length of its used part in the crc map. The second
+// reads the allocated blocks of each group in physical order and replaces
+// those entries with the CRC32C of every block (of its used part for the 
+// last blocks of files). The third walks the block pointers of every file
+// and combines the crcs of its blocks into the crc of the whole file
+
+// free blocks between two allocated ones that are read along with them,
+// rather than ending the chunk
+#define SCRUB_MAX_GAP 16
+
+#define SCRUB_DEFAULT_CHUNK (1 << 20)
+
+typedef struct {
+    uint8_t* buf;        // chunk_size bytes
+    ext2_scrub_report_t report;
+    ext2_error_t error;
+} scrub_worker_t;
+
+typedef struct {
+    ext2_t* ext2;
+    const ext2_scrub_params_t* params;
+    uint32_t chunk_blocks;
+    uint32_t pass;
+    _Atomic uint32_t next_group;
+    scrub_worker_t* workers;
+    uint32_t* crcs;      // crc of each block (index 0 is first_data_block)
+    _Atomic uint8_t* bad; // blocks that couldn't be read
+    uint32_t block_shift; // crc32c_shift of the block size
+} scrub_state_t;
+
+uint32_t scrub_workers(const ext2_scrub_params_t* params) {
+    return (params->parallel_for && params->workers > 0) ? params->workers : 1;
+}
+
+uint32_t scrub_chunk_size(ext2_t* ext2, const ext2_scrub_params_t* params) {
+    uint32_t size = params->chunk_size ? params->chunk_size : SCRUB_DEFAULT_CHUNK;
+    return size / ext2->block_size * ext2->block_size;
+}
+
+uint64_t scrub_map_blocks(ext2_t* ext2) {
+    return (uint64_t)ext2->superblk.blocks_count - ext2->superblk.first_data_block;
+}
+
+uint64_t ext2_scrub_workspace_size(ext2_t* ext2, const ext2_scrub_params_t* params) {
+    uint64_t workers = scrub_workers(params);
+
+    return ALIGN8(workers * sizeof(scrub_worker_t)) + 
+        ALIGN8(scrub_map_blocks(ext2) * sizeof(uint32_t)) + 
+        ALIGN8(CEIL(scrub_map_blocks(ext2), 8)) + 
+        workers * scrub_chunk_size(ext2, params);
+}
+
+bool scrub_is_bad(scrub_state_t* st, uint32_t block) {
+    uint32_t bit = block - st->ext2->superblk.first_data_block;
+    return (atomic_load_explicit(&st->bad[bit / 8], memory_order_relaxed) >> 
+            (bit % 8)) & 1;
+}
+
+// Reads 'count' blocks of a group starting at bit 'start' of its bitmap, and
+// stores the crc of those that are allocated. If the chunk can't be read, 
+// its allocated blocks are read one by one to find the bad ones
+void scrub_chunk(scrub_state_t* st, scrub_worker_t* w, const uint8_t* bitmap,
+        uint32_t group_first, uint32_t start, uint32_t count) {
+    ext2_t* ext2 = st->ext2;
+    uint32_t first_data = ext2->superblk.first_data_block;
+    uint32_t block = group_first + start;
+
+    bool whole = !dev_read(ext2, BLOCK_ADDR(ext2, block), 
+            count * ext2->block_size, w->buf);
+    w->report.bytes_read += (uint64_t)count * ext2->block_size;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!BIT_IS_SET(bitmap, start + i))
+            continue;
+
+        uint8_t* data = w->buf + (uint64_t)i * ext2->block_size;
+        uint32_t index = block + i - first_data;
+
+        if (!whole && dev_read(ext2, BLOCK_ADDR(ext2, block + i), 
+                    ext2->block_size, data)) {
+            atomic_fetch_or_explicit(&st->bad[index / 8], 1 << (index % 8), 
+                    memory_order_relaxed);
+            w->report.bad_blocks++;
+            continue;
+        }
+
+        // the first pass left the used length of the last blocks of files
+        uint32_t len = st->crcs[index] ? st->crcs[index] : ext2->block_size;
+        st->crcs[index] = ext2_crc32c(0, data, len);
+        w->report.blocks_read++;
+    }
+}
+
+// second pass over a group: its allocated blocks, in order
+ext2_error_t scrub_group_blocks(scrub_state_t* st, scrub_worker_t* w, 
+        uint32_t group) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    ext2_t* ext2 = st->ext2;
+    ext2_bgd_t bgd;
+
+    ext2_error_t err = read_bgd(ext2, group, &bgd);
+    if (err)
+        return err;
+
+    uint32_t nbits = get_group_block_count(ext2, group);
+    uint32_t group_first = get_group_first_block(ext2, group);
+
+    if (bgd_flag(ext2, &bgd, EXT2_BG_BLOCK_UNINIT))
+        build_block_bitmap(ext2, group, &bgd, bitmap);
+    else
+        err = dev_read(ext2, BLOCK_ADDR(ext2, bgd.block_bitmap), CEIL(nbits, 8),
+                bitmap);
+    if (err)
+        return err;
+
+    uint32_t i = 0;
+    while (i < nbits) {
+        if (i % 8 == 0 && bitmap[i / 8] == 0) {
+            i += 8;
+            continue;
+        }
+        if (!BIT_IS_SET(bitmap, i)) {
+            i++;
+            continue;
+        }
+
+        // the chunk ends at a long enough gap or when it's full
+        uint32_t end = i + 1;
+        for (uint32_t j = end; j < nbits && j - i < st->chunk_blocks; j++) {
+            if (BIT_IS_SET(bitmap, j))
+                end = j + 1;
+            else if (j - end >= SCRUB_MAX_GAP)
+                break;
+        }
+
+        scrub_chunk(st, w, bitmap, group_first, i, end - i);
+        i = end;
+    }
+
+    return 0;
+}
+
+// Adds the blocks under a block pointer to the crc of a file. 'index' is 
+// the file block the pointer starts at, 'zeros' the bytes of holes not 
+// added yet
+void scrub_walk(scrub_state_t* st, ext2_scrub_file_t* file, uint32_t block,
+        int level, uint32_t* index, uint32_t count, uint64_t* zeros) {
+    uint32_t ptrs[EXT2_MAX_BLOCK_SIZE / sizeof(uint32_t)];
+    ext2_t* ext2 = st->ext2;
+    uint32_t per_block = ext2->block_size / sizeof(uint32_t);
+    uint64_t span = 1;
+
+    for (int i = 0; i < level; i++)
+        span *= per_block;
+
+    if (*index >= count)
+        return;
+
+    uint32_t first_data = ext2->superblk.first_data_block;
+    bool valid = block >= first_data && block < ext2->superblk.blocks_count;
+    bool bad = block != 0 && (!valid || scrub_is_bad(st, block));
+
+    if (level > 0 && !bad && block != 0)
+        bad = dev_read(ext2, BLOCK_ADDR(ext2, block), ext2->block_size, ptrs) != 0;
+
+    // a hole, or blocks that can't be known: all of them count as zeros
+    if (block == 0 || bad) {
+        uint64_t n = MIN(span, (uint64_t)count - *index);
+        uint64_t tail = file->size % ext2->block_size;
+
+        *zeros += n * ext2->block_size;
+        if (*index + n == count && tail != 0)
+            *zeros -= ext2->block_size - tail;
+        if (bad)
+            file->bad_blocks += n;
+
+        *index += n;
+        return;
+    }
+
+    if (level > 0) {
+        for (uint32_t i = 0; i < per_block && *index < count; i++)
+            scrub_walk(st, file, ptrs[i], level - 1, index, count, zeros);
+        return;
+    }
+
+    if (*zeros) {
+        file->crc32c = crc32c_combine(file->crc32c, crc32c_zeros(*zeros), 
+                crc32c_shift(*zeros));
+        *zeros = 0;
+    }
+
+    uint32_t len = ext2->block_size;
+    if (*index + 1 == count && file->size % ext2->block_size != 0)
+        len = file->size % ext2->block_size;
+
+    uint32_t shift = (len == ext2->block_size) ? st->block_shift : 
+        crc32c_shift(len);
+    file->crc32c = crc32c_combine(file->crc32c, 
+            st->crcs[block - first_data], shift);
+    (*index)++;
+}
+
+// third pass, for a file: puts its crc together and hands it to the caller
+void scrub_digest(scrub_state_t* st, scrub_worker_t* w, uint32_t ino,
+        const ext2_inode_t* inode) {
+    ext2_t* ext2 = st->ext2;
+    ext2_scrub_file_t file = { ino, get_inode_size(inode), 0, 0 };
+    uint32_t count = CEIL(file.size, ext2->block_size);
+    uint32_t index = 0;
+    uint64_t zeros = 0;
+
+    for (int i = 0; i < 15 && index < count; i++)
+        scrub_walk(st, &file, inode->block[i], (i < 12) ? 0 : i - 11, &index,
+                count, &zeros);
+
+    if (zeros)
+        file.crc32c = crc32c_combine(file.crc32c, crc32c_zeros(zeros), 
+                crc32c_shift(zeros));
+
+    w->report.files++;
+    if (file.bad_blocks)
+        w->report.bad_files++;
+
+    if (st->params->on_file)
+        st->params->on_file(&file, st->params->context);
+}
+
+// first pass, for a file: marks its last block if it's only partly used
+ext2_error_t scrub_mark_tail(scrub_state_t* st, const ext2_inode_t* inode) {
+    ext2_t* ext2 = st->ext2;
+    uint64_t size = get_inode_size(inode);
+    uint32_t block;
+
+    if (size % ext2->block_size == 0)
+        return 0;
+
+    // a pointer block that can't be read is found again by the other passes
+    if (get_data_block(ext2, inode, size / ext2->block_size, &block))
+        return 0;
+
+    if (block >= ext2->superblk.first_data_block && 
+            block < ext2->superblk.blocks_count)
+        st->crcs[block - ext2->superblk.first_data_block] = 
+            size % ext2->block_size;
+
+    return 0;
+}
+
+// first and third passes over a group: its regular files
+ext2_error_t scrub_group_files(scrub_state_t* st, scrub_worker_t* w, 
+        uint32_t group) {
+    uint8_t bitmap[EXT2_MAX_BLOCK_SIZE];
+    ext2_t* ext2 = st->ext2;
+    ext2_bgd_t bgd;
+
+    ext2_error_t err = read_bgd(ext2, group, &bgd);
+    if (err)
+        return err;
+
+    if (bgd_flag(ext2, &bgd, EXT2_BG_INODE_UNINIT))
+        return 0;
+
+    uint32_t ipg = ext2->superblk.inodes_per_group;
+    err = dev_read(ext2, BLOCK_ADDR(ext2, bgd.inode_bitmap), CEIL(ipg, 8), bitmap);
+    if (err)
+        return err;
+
+    uint32_t used_ipg = ipg;
+    if (ext2->superblk.feature_ro_compat & EXT2_FEATURE_RO_COMPAT_GDT_CSUM)
+        used_ipg = ipg - bgd.itable_unused;
+
+    uint32_t per_chunk = st->chunk_blocks * ext2->block_size / ext2->inode_size;
+
+    for (uint32_t first = 0; first < used_ipg; first += per_chunk) {
+        uint32_t n = MIN(used_ipg - first, per_chunk);
+
+        err = dev_read(ext2, BLOCK_ADDR(ext2, bgd.inode_table) + 
+                (uint64_t)first * ext2->inode_size, n * ext2->inode_size, w->buf);
+        if (err)
+            return err;
+
+        for (uint32_t i = first; i < first + n; i++) {
+            ext2_inode_t inode;
+            memcpy(&inode, w->buf + (i - first) * ext2->inode_size, sizeof(inode));
+
+            if (!BIT_IS_SET(bitmap, i) || inode.links_count == 0 ||
+                    GET_FILE_FMT(inode.mode) != EXT2_FMT_REG)
+                continue;
+
+            if (st->pass == 0)
+                err = scrub_mark_tail(st, &inode);
+            else
+                scrub_digest(st, w, group * ipg + i + 1, &inode);
+            if (err)
+                return err;
+        }
+    }
+
+    return 0;
+}
+
+void scrub_task(uint32_t index, void* arg) {
+    scrub_state_t* st = arg;
+    scrub_worker_t* w = &st->workers[index];
+    STAT_JOIN(EXT2_OP_SCRUB);
+
+    while (!w->error) {
+        uint32_t group = atomic_fetch_add_explicit(&st->next_group, 1, 
+                memory_order_relaxed);
+        if (group >= st->ext2->block_group_count)
+            break;
+
+        w->error = (st->pass == 1) ? scrub_group_blocks(st, w, group) :
+            scrub_group_files(st, w, group);
+    }
+}
+
+ext2_error_t scrub_fs(ext2_t* ext2, const ext2_scrub_params_t* params,
+        ext2_scrub_report_t* report) {
+    scrub_state_t st;
+    uint8_t* ws = params->workspace;
+    uint32_t workers = scrub_workers(params);
+    uint64_t workers_size = ALIGN8(workers * sizeof(scrub_worker_t));
+    uint64_t crcs_size = ALIGN8(scrub_map_blocks(ext2) * sizeof(uint32_t));
+    uint64_t bad_size = ALIGN8(CEIL(scrub_map_blocks(ext2), 8));
+    uint32_t chunk_size = scrub_chunk_size(ext2, params);
+
+    if (chunk_size == 0)
+        return EXT2_ERR_BUFFER_TOO_SMALL;
+
+    crc32c_init();
+
+    st.ext2 = ext2;
+    st.params = params;
+    st.chunk_blocks = chunk_size / ext2->block_size;
+    st.workers = (scrub_worker_t*)ws;
+    st.crcs = (uint32_t*)(ws + workers_size);
+    st.bad = (_Atomic uint8_t*)(ws + workers_size + crcs_size);
+    st.block_shift = crc32c_shift(ext2->block_size);
+
+    memset(ws, 0, workers_size + crcs_size + bad_size);
+    for (uint32_t i = 0; i < workers; i++)
+        st.workers[i].buf = ws + workers_size + crcs_size + bad_size + 
+            (uint64_t)i * chunk_size;
+
+    memset(report, 0, sizeof(*report));
+
+    for (st.pass = 0; st.pass < 3; st.pass++) {
+        atomic_store_explicit(&st.next_group, 0, memory_order_relaxed);
+
+        if (params->parallel_for)
+            params->parallel_for(scrub_task, &st, workers, 
+                    params->parallel_context);
+        else
+            scrub_task(0, &st);
+
+        for (uint32_t i = 0; i < workers; i++)
+            if (st.workers[i].error)
+                return st.workers[i].error;
+    }
+
+    for (uint32_t i = 0; i < workers; i++) {
+        scrub_worker_t* w = &st.workers[i];
+
+        report->blocks_read += w->report.blocks_read;
+        report->bytes_read += w->report.bytes_read;
+        report->bad_blocks += w->report.bad_blocks;
+        report->files += w->report.files;
+        report->bad_files += w->report.bad_files;
+    }
+
+    return 0;
+}
+
+ext2_error_t ext2_scrub(ext2_t* ext2, const ext2_scrub_params_t* params,
+        ext2_scrub_report_t* report) {
+    uint64_t t = op_begin(ext2, EXT2_OP_SCRUB);
+    ext2_error_t error = scrub_fs(ext2, params, report);
+    op_end(ext2, EXT2_OP_SCRUB, t, 0, 0, 0, error);
+
+    return error;
+}
+
+ext2_error_t ext2_get_memory_stats(ext2_t* ext2, ext2_memory_stats_t* stats) {
+    ext2_cache_t* cache = ext2->cache;
+    cache_volume_t vol = {0};
+
+    cache_lock(cache);
+    if (ext2->cache_volume < cache->volume_count)
+        vol = ((cache_volume_t*)cache->volumes)[ext2->cache_volume];
+
+    stats->arena_used = cache->arena_used;
+    stats->blocks = cache->block_count;
+    stats->blocks_used = cache->blocks_used;
+    stats->blocks_high = cache->blocks_high;
+    stats->names = cache->name_count;
+    stats->names_used = cache->names_used;
+    stats->names_high = cache->names_high;
+    stats->block_hits = cache->block_hits;
+    stats->block_misses = cache->block_misses;
+    stats->name_hits = cache->name_hits;
+    stats->name_misses = cache->name_misses;
+    cache_unlock(cache);
+
+    stats->volume_blocks = vol.blocks;
+    stats->volume_names = vol.names;
+    stats->volume_block_hits = vol.block_hits;
+    stats->volume_block_misses = vol.block_misses;
+    stats->volume_name_hits = vol.name_hits;
+    stats->volume_name_misses = vol.name_misses;
+
+    return 0;
+}
+
+ext2_error_t ext2_get_stats(ext2_t* ext2, ext2_stats_t* stats, bool reset) {
+#if EXT2_STATS
+    const uint32_t fields = sizeof(ext2_op_stats_t) / sizeof(uint64_t);
+    uint64_t* total = (uint64_t*)&stats->total;
+
+    memset(total, 0, sizeof(ext2_op_stats_t));
+
+    for (uint32_t op = 0; op < EXT2_OP_COUNT; op++) {
+        _Atomic uint64_t* src = (_Atomic uint64_t*)&ext2->stats.ops[op];
+        uint64_t* dst = (uint64_t*)&stats->ops[op];
+
+        // every counter is read on its own, so the ones of an operation 
+        // that is still running might not match each other
+        for (uint32_t i = 0; i < fields; i++) {
+            dst[i] = reset ? 
+                atomic_exchange_explicit(&src[i], 0, memory_order_relaxed) :
+                atomic_load_explicit(&src[i], memory_order_relaxed);
+            total[i] += dst[i];
+        }
+    }
+
+    _Atomic uint64_t* src = (_Atomic uint64_t*)ext2->stats.dev_latency;
+    uint64_t* dst = (uint64_t*)stats->dev_latency;
+
+    for (uint32_t i = 0; i < EXT2_DEV_COUNT * EXT2_LATENCY_BUCKETS; i++)
+        dst[i] = reset ? 
+            atomic_exchange_explicit(&src[i], 0, memory_order_relaxed) :
+            atomic_load_explicit(&src[i], memory_order_relaxed);
+
+    return 0;
+#else
+    return EXT2_ERR_NO_STATS;
+#endif
+}
+
+uint32_t ext2_trace_dump(ext2_t* ext2, ext2_trace_event_t* events, uint32_t max) {
+#if EXT2_STATS
+    if (ext2->trace_size == 0)
+        return 0;
+
+    uint64_t head = atomic_load_explicit((_Atomic uint64_t*)&ext2->trace_head,
+            memory_order_relaxed);
+    uint64_t count = (head < ext2->trace_size) ? head : ext2->trace_size;
+
+    if (count > max)
+        count = max;
+
+    // the newest 'count' events, oldest first
+    for (uint64_t i = 0; i < count; i++)
+        events[i] = ext2->trace[(head - count + i) % ext2->trace_size];
+
+    return count;
+#else
+    return 0;
+#endif
 }
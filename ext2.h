@@ -9,11 +9,38 @@
 #define EXT2_ROOT_INODE 2
 #define EXT2_MAX_FILE_NAME 255
 #define SUPERBLOCK_ADDR 1024
+#define EXT2_SUPER_MAGIC 0xEF53
+
+// biggest block size that can be mounted. Some operations keep a whole block 
+// on the stack, so this can be lowered on targets with little memory. With 
+// the default, filesystems of 8 KiB to 32 KiB blocks (which mount without 
+// the limit) fail with EXT2_ERR_BIG_BLOCK: build with 32768 to mount them.
+// 64 KiB blocks are never mounted, a directory record can't span them
+#ifndef EXT2_MAX_BLOCK_SIZE
+#define EXT2_MAX_BLOCK_SIZE 4096
+#endif
+
+// size of the stack buffer that copies go through when there's no copy 
+// callback
+#ifndef EXT2_COPY_BUFFER_SIZE
+#define EXT2_COPY_BUFFER_SIZE (4 * EXT2_MAX_BLOCK_SIZE)
+#endif
+
+// set to 0 to compile out the counters of ext2_get_stats. The library and its
+// users must be built with the same value, since it changes ext2_t
+#ifndef EXT2_STATS
+#define EXT2_STATS 1
+#endif
+
+// number of buckets of the latency histograms (see ext2_op_stats_t)
+#ifndef EXT2_LATENCY_BUCKETS
+#define EXT2_LATENCY_BUCKETS 32
+#endif
 
 // trext2-specific errors. All user-defined errors should be negative (see the
 // ext2_config_t struct below)
 typedef enum {
-    EXT2_ERR_BIG_BLOCK = 1,       // filesystem block size is too big
+    EXT2_ERR_BIG_BLOCK = 1,       // filesystem block size is bigger than EXT2_MAX_BLOCK_SIZE (4096 unless defined)
     EXT2_ERR_INODE_NOT_FOUND,     // attempted to find inode with invalid number
     EXT2_ERR_BGD_NOT_FOUND,       // attempted to find group with invalid number
     EXT2_ERR_FILENAME_TOO_BIG,    // filename is greater than EXT2_MAX_FILE_NAME
@@ -25,6 +52,18 @@ typedef enum {
     EXT2_ERR_NOT_A_FILE,          // called ext2_file_open on a path that does not point to a file
     EXT2_ERR_NOT_A_DIR,           // called ext2_dir_open on a path that does not point to a dir
     EXT2_ERR_INODES_DEPLETED,     // no more inodes left. Cannot create more files or directories.
+    EXT2_ERR_UNSUPPORTED_FEATURE, // filesystem uses an incompatible feature that t-rext2 doesn't know
+    EXT2_ERR_BIG_ADDRESS,         // device address is past 4 GiB and no 64-bit callback was given
+    EXT2_ERR_FILE_TOO_BIG,        // file would be bigger than the filesystem allows
+    EXT2_ERR_RANGES_OVERLAP,      // source and destination of a copy inside the same file overlap
+    EXT2_ERR_BUFFER_TOO_SMALL,    // a buffer, workspace or arena given to the library is too small
+    EXT2_ERR_FILE_EXISTS,         // called ext2_mkdir on a path that already exists
+    EXT2_ERR_NO_STATS,            // called ext2_get_stats with EXT2_STATS set to 0
+    EXT2_ERR_BAD_FORMAT,          // ext2_format parameters are invalid or the device is too small
+    EXT2_ERR_TXN_STATE,           // ext2_txn_begin with a transaction open, or ext2_txn_commit without one
+    EXT2_ERR_READ_ONLY,           // attempted to change a filesystem mounted with EXT2_MOUNT_RDONLY
+    EXT2_ERR_DIR_NOT_EMPTY,       // attempted to remove a directory that still has entries
+    EXT2_ERR_LOG_PENDING,         // mounted with EXT2_MOUNT_RDONLY while the log holds a commit to replay
 } ext2_error_t;
 
 // ext2 disk structures //
@@ -35,6 +74,28 @@ typedef enum {
 // Extracts the 'file format' part of the 'mode' field of an inode
 #define GET_FILE_FMT(mode) (0xF000 & (mode))
 
+// superblock revisions
+#define EXT2_GOOD_OLD_REV 0
+#define EXT2_DYNAMIC_REV 1
+
+// revision 0 filesystems have fixed values for these
+#define EXT2_GOOD_OLD_FIRST_INO 11
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+
+// feature flags (only present in EXT2_DYNAMIC_REV filesystems)
+#define EXT2_FEATURE_INCOMPAT_FILETYPE   0x0002
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+#define EXT2_FEATURE_RO_COMPAT_GDT_CSUM 0x0010 // a.k.a. uninit_bg
+
+// flags of the block group descriptors
+#define EXT2_BG_INODE_UNINIT 0x0001 // inode bitmap was never written
+#define EXT2_BG_BLOCK_UNINIT 0x0002 // block bitmap was never written
+#define EXT2_BG_INODE_ZEROED 0x0004 // whole inode table was zeroed
+
+// incompatible features that t-rext2 can deal with
+#define EXT2_FEATURE_INCOMPAT_SUPP EXT2_FEATURE_INCOMPAT_FILETYPE
+
 // file formats present in the upper nibble of inode.mode
 typedef enum {
     EXT2_FMT_SOCK = 0xC000,
@@ -84,6 +145,21 @@ typedef struct {
     uint32_t rev_level;
     uint16_t def_resuid;
     uint16_t def_resgid;
+
+    // only meaningful if rev_level is EXT2_DYNAMIC_REV
+    uint32_t first_ino;
+    uint16_t inode_size;
+    uint16_t block_group_nr;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+    uint8_t uuid[16];
+    char volume_name[16];
+    char last_mounted[64];
+    uint32_t algo_bitmap;
+    uint8_t prealloc_blocks;
+    uint8_t prealloc_dir_blocks;
+    uint16_t reserved_gdt_blocks; // kept after the GDT for resizing
 } ext2_superblock_t;
 
 typedef struct {
@@ -93,8 +169,14 @@ typedef struct {
     uint16_t free_blocks_count;
     uint16_t free_inodes_count;
     uint16_t used_dirs_count;
-    uint16_t pad;
-    uint32_t reserved[3];
+
+    // only meaningful with EXT2_FEATURE_RO_COMPAT_GDT_CSUM
+    uint16_t flags;               // EXT2_BG_* 
+    uint32_t exclude_bitmap;
+    uint16_t block_bitmap_csum;
+    uint16_t inode_bitmap_csum;
+    uint16_t itable_unused;       // inodes at the end of the table never used
+    uint16_t checksum;            // crc16 of the uuid, group number and descriptor
 } ext2_bgd_t; // block group descriptor
 
 typedef struct {
@@ -136,6 +218,146 @@ typedef enum {
     EXT2_FT_REGULAR_FILE,
 } ext2_file_type_t ;
 
+// things that can be locked when the filesystem is shared by several threads
+// (see the lock callback of ext2_config_t)
+typedef enum {
+    EXT2_LOCK_INODE,  // an inode and its data. id is the inode number
+    EXT2_LOCK_GROUP,  // bitmaps and descriptor of a block group. id is the group
+    EXT2_LOCK_SHARED, // state kept in ext2_t (the superblock copy). id is 0
+} ext2_lock_kind_t;
+
+// flags of ext2_config_t
+#define EXT2_MOUNT_RDONLY   0x0001 // nothing is ever written (see ext2_config_t)
+#define EXT2_MOUNT_DELALLOC 0x0002 // blocks are allocated when buffers are flushed
+
+// public functions that statistics are attributed to (see ext2_get_stats)
+typedef enum {
+    EXT2_OP_MOUNT,
+    EXT2_OP_FILE_OPEN,
+    EXT2_OP_FILE_READ,
+    EXT2_OP_FILE_WRITE,
+    EXT2_OP_FILE_SEEK,
+    EXT2_OP_FILE_TRUNCATE,
+    EXT2_OP_FILE_FALLOCATE,
+    EXT2_OP_FILE_SET_BUFFER,
+    EXT2_OP_FILE_SET_ALLOC_CTX,
+    EXT2_OP_FILE_FLUSH,
+    EXT2_OP_FILE_CLOSE,
+    EXT2_OP_ALLOC_CTX_FLUSH,
+    EXT2_OP_COPY_FILE_RANGE,
+    EXT2_OP_DIR_OPEN,
+    EXT2_OP_DIR_READ,
+    EXT2_OP_DIR_SEEK,
+    EXT2_OP_MKDIR,
+    EXT2_OP_CHECK,
+    EXT2_OP_IMPORT_TREE,
+    EXT2_OP_DEFRAG,
+    EXT2_OP_SCRUB,
+    EXT2_OP_TXN_BEGIN,
+    EXT2_OP_TXN_COMMIT,
+    EXT2_OP_STAT,
+    EXT2_OP_STAT_MANY,
+    EXT2_OP_RM,
+    EXT2_OP_RM_TREE,
+    EXT2_OP_COUNT, // number of operations, not an operation
+} ext2_op_t;
+
+// device callbacks that are timed (see ext2_stats_t)
+typedef enum {
+    EXT2_DEV_READ,  // read or read64
+    EXT2_DEV_WRITE, // write or write64
+    EXT2_DEV_COPY,
+    EXT2_DEV_COUNT, // number of callbacks, not a callback
+} ext2_dev_op_t;
+
+/**
+ * counters of the work done by a public function
+ */
+typedef struct {
+    uint64_t calls;               // times the function was called
+    uint64_t dev_reads;           // calls to the read callback
+    uint64_t dev_read_bytes;      // bytes asked from the read callback
+    uint64_t dev_writes;          // calls to the write callback
+    uint64_t dev_write_bytes;     // bytes given to the write callback
+    uint64_t inode_reads;         // inodes read from the inode table
+    uint64_t inode_writes;        // inodes written to the inode table
+    uint64_t bgd_writes;          // block group descriptors written
+    uint64_t sb_writes;           // superblocks written
+    uint64_t bitmap_scans;        // bitmaps read to look for free blocks/inodes
+    uint64_t blocks_allocated;    // blocks taken from the free space
+    uint64_t dir_entries_scanned; // directory entries read
+
+    // number of calls that took d units of time (see the clock callback of
+    // ext2_config_t), with 2^(i-1) <= d < 2^i for bucket i. Bucket 0 is for 
+    // d = 0 and the last one also holds everything longer
+    uint64_t latency[EXT2_LATENCY_BUCKETS];
+} ext2_op_stats_t;
+
+/**
+ * statistics of a filesystem (see ext2_get_stats)
+ */
+typedef struct {
+    ext2_op_stats_t ops[EXT2_OP_COUNT]; // indexed by ext2_op_t
+    ext2_op_stats_t total;              // sum of all operations
+
+    // latency of the device callbacks, indexed by ext2_dev_op_t (same 
+    // buckets as ext2_op_stats_t.latency)
+    uint64_t dev_latency[EXT2_DEV_COUNT][EXT2_LATENCY_BUCKETS];
+} ext2_stats_t;
+
+/**
+ * memory use of the caches (see ext2_get_memory_stats). With a shared cache
+ * the numbers are for all its mounts, except the volume_ ones
+ */
+typedef struct {
+    uint64_t arena_used;  // bytes of the arena the pools take
+    uint32_t blocks;      // block buffers in the pool
+    uint32_t blocks_used; // holding a block now
+    uint32_t blocks_high; // most ever held at once
+    uint32_t names;       // directory entry slots in the pool
+    uint32_t names_used;
+    uint32_t names_high;
+    uint64_t block_hits;  // small reads served from memory
+    uint64_t block_misses;
+    uint64_t name_hits;   // path components found in memory
+    uint64_t name_misses;
+
+    // part of the numbers above that belongs to this mount
+    uint32_t volume_blocks;
+    uint32_t volume_names;
+    uint64_t volume_block_hits;
+    uint64_t volume_block_misses;
+    uint64_t volume_name_hits;
+    uint64_t volume_name_misses;
+} ext2_memory_stats_t;
+
+/**
+ * memory of a cache shared by several mounts (see ext2_cache_init)
+ */
+typedef struct {
+    void* arena;
+    uint64_t arena_size;
+    uint32_t arena_align;  // alignment of the block buffers, a power of 2. 0 means 8
+    uint32_t block_size;   // biggest block size of the filesystems that attach
+    uint32_t cache_blocks; // block buffers, for all the mounts
+    uint32_t cache_names;  // directory entries, for all the mounts
+    uint32_t volumes;      // mounts that can attach (see ext2_config_t.cache_volume)
+} ext2_cache_params_t;
+
+/**
+ * a public function call kept by the trace (see ext2_trace_dump)
+ */
+typedef struct {
+    uint32_t op;       // ext2_op_t
+    uint32_t inode;    // file or dir the call worked on, 0 if none
+    uint64_t offset;   // where the call started inside the file or dir
+    uint64_t size;     // bytes read, written, copied or reserved
+    uint64_t start;    // clock value when the call started
+    uint64_t duration; // clock units the call took
+    int32_t error;     // value returned by the call
+} ext2_trace_event_t;
+
+
 /**
  * configuration used to mount a filesystem
  */
@@ -148,30 +370,232 @@ typedef struct {
     // to the caller
     int (*write)(uint32_t start, uint32_t size, const void* buffer, void* context);
 
+    // optional versions of read/write that take 64-bit addresses. If given,
+    // they are used instead of read/write. They are needed for devices bigger
+    // than 4 GiB
+    int (*read64)(uint64_t start, uint32_t size, void* buffer, void* context);
+    int (*write64)(uint64_t start, uint32_t size, const void* buffer, void* context);
+
+    // optional. Copies 'size' bytes from 'src' to 'dst' inside the device. If
+    // not given, copies are made with read and write through a buffer
+    int (*copy)(uint64_t dst, uint64_t src, uint32_t size, void* context);
+
     // this will be passed to the user defined read/write functions, you can
     // put whatever you want here
     void* context;
+
+    // optional. If given, the filesystem can be used by several threads at 
+    // once. lock must block until the lock identified by (kind, id) is taken:
+    // shared (exclusive == false) locks can be held by many threads, 
+    // exclusive ones by a single thread. Locks are never taken recursively.
+    // The read/write/copy callbacks must be thread-safe as well, and a file
+    // or dir handle must only be used by one thread at a time
+    void (*lock)(ext2_lock_kind_t kind, uint32_t id, bool exclusive, void* context);
+    void (*unlock)(ext2_lock_kind_t kind, uint32_t id, bool exclusive, void* context);
+
+    // this will be passed to lock/unlock
+    void* lock_context;
+
+    // optional. Returns the current time, in any unit (nanoseconds are a good
+    // choice). If given, public functions and device calls are timed, for the
+    // histograms of ext2_get_stats and for the trace. Must be thread-safe
+    uint64_t (*clock)(void* context);
+
+    // optional. Memory for the trace, which keeps the last trace_size public
+    // function calls (see ext2_trace_dump). Only used if clock is given
+    ext2_trace_event_t* trace;
+    uint32_t trace_size;
+
+    // optional. Called after every public function call that took 
+    // slow_threshold clock units or more, for example to save the trace
+    void (*on_slow)(const ext2_trace_event_t* event, void* context);
+    uint64_t slow_threshold;
+
+    // this will be passed to clock and on_slow
+    void* trace_context;
+
+    // optional. Memory for the caches, carved by ext2_mount into fixed pools
+    // of cache_blocks block buffers and cache_names directory entries. The
+    // library allocates nothing else. ext2_arena_size tells how big it must 
+    // be, and should be aligned to arena_align
+    void* arena;
+    uint64_t arena_size;
+    uint32_t arena_align;  // alignment of the block buffers (for DMA), a power of 2. 0 means 8
+    uint32_t cache_blocks; // blocks kept in memory (metadata and small reads)
+    uint32_t cache_names;  // directory entries kept in memory, for path lookups
+
+    // optional. Cache shared with other mounts (see ext2_cache_init), used
+    // instead of an arena. cache_volume tells this mount apart from the 
+    // others attached to it, and must be below its number of volumes. 
+    // Mounting again with the same volume drops what the cache held for it
+    struct ext2_cache* shared_cache;
+    uint32_t cache_volume;
+
+    // optional. Region of the device, outside the filesystem, used as the 
+    // write-ahead log of transactions (see ext2_txn_begin). ext2_mount 
+    // finishes a transaction that reached the log but not its home blocks
+    uint64_t log_start; // byte address
+    uint64_t log_size;  // bytes
+
+    // EXT2_MOUNT_* flags. With EXT2_MOUNT_RDONLY every function that would
+    // change the filesystem fails with EXT2_ERR_READ_ONLY, ext2_file_open 
+    // doesn't create missing files and the device is never written. A commit
+    // left in the log can't be replayed, so ext2_mount fails with 
+    // EXT2_ERR_LOG_PENDING instead of showing the filesystem without it. 
+    // Since nothing changes, the caches also keep the names that don't 
+    // exist, and the lock callbacks aren't needed (nor called): any number 
+    // of threads can use the filesystem at once.
+    // With EXT2_MOUNT_DELALLOC, data kept in the write buffer of a handle 
+    // (see ext2_file_set_buffer) gets its blocks only when the buffer is 
+    // flushed: reads and seeks on the handle see the buffered data instead of
+    // flushing it, and a truncate drops what falls past the new end. Each 
+    // flush gets one run of blocks, so a file bigger than the buffer gets a
+    // run per buffer-full, not a single one
+    uint32_t flags;
 } ext2_config_t;
 
 /**
- * holds state and information about a mounted filesystem
+ * caches carved from the arena given to ext2_mount or ext2_cache_init. 
+ * Internal, see ext2_get_memory_stats for the numbers
+ */
+typedef struct ext2_cache {
+    uint32_t lock;            // spinlock, only touched through atomic operations
+    uint32_t block_size;      // biggest block the buffers hold
+
+    uint8_t* data;            // the block buffers
+    uint32_t stride;          // bytes between two buffers
+    void* block_slots;        // what each buffer holds
+    uint32_t* block_buckets;  // hash chains of the slots
+    uint32_t* block_gens;     // bumped by every write to a bucket
+    uint32_t block_count;
+    uint32_t block_mask;      // buckets - 1
+    uint32_t block_hand;      // next slot the clock looks at
+    uint32_t blocks_used;
+    uint32_t blocks_high;
+
+    void* name_slots;
+    uint32_t* name_buckets;
+    uint32_t name_count;
+    uint32_t name_mask;
+    uint32_t name_hand;
+    uint32_t names_used;
+    uint32_t names_high;
+
+    void* volumes;            // what each mount holds
+    uint32_t volume_count;
+
+    uint64_t arena_used;
+    uint64_t block_hits, block_misses;
+    uint64_t name_hits, name_misses;
+} ext2_cache_t;
+
+/**
+ * open transaction (see ext2_txn_begin). Internal
  */
 typedef struct {
+    uint32_t lock;      // spinlock, only touched through atomic operations
+    bool open;          // read without the lock only through atomic loads
+
+    uint8_t* data;      // staged blocks, right after room for the log header
+    uint32_t* keys;     // block held by each slot
+    uint32_t* next;     // hash chains of the slots
+    uint32_t* buckets;
+    uint32_t mask;      // buckets - 1
+    uint32_t capacity;  // slots
+    uint32_t count;     // slots used
+    uint32_t gen;       // bumped by every commit and by writes that skip the buffer
+    uint32_t writing;   // writes that skip the buffer and haven't finished
+    bool flushing;      // a commit is writing the staged blocks. Same as open
+} ext2_txn_t;
+
+/**
+ * holds state and information about a mounted filesystem
+ */
+typedef struct ext2 {
     int (*read)(uint32_t start, uint32_t size, void* buffer, void* context);
     int (*write)(uint32_t start, uint32_t size, const void* buffer, void* context);
+    int (*read64)(uint64_t start, uint32_t size, void* buffer, void* context);
+    int (*write64)(uint64_t start, uint32_t size, const void* buffer, void* context);
+    int (*copy)(uint64_t dst, uint64_t src, uint32_t size, void* context);
 
     uint32_t block_size;
+    uint32_t block_shift; // log2 of block_size
+
+    // finds the block that holds a block of a file, with code specialized 
+    // for the block size (set by ext2_mount)
+    ext2_error_t (*get_data_block)(struct ext2* ext2, const ext2_inode_t* inode,
+            uint32_t blk_index, uint32_t* block);
+
+    uint32_t inode_size; // size of an inode inside the inode table
+
+    uint64_t max_file_size;
 
     uint32_t block_group_count; // total number of block groups
 
     void* context;
 
+    void (*lock)(ext2_lock_kind_t kind, uint32_t id, bool exclusive, void* context);
+    void (*unlock)(ext2_lock_kind_t kind, uint32_t id, bool exclusive, void* context);
+    void* lock_context;
+
     ext2_superblock_t superblk;
+
+    ext2_cache_t* cache;   // own_cache, or one shared with other mounts
+    ext2_cache_t own_cache;
+    uint32_t cache_volume; // this mount inside the cache
+
+    ext2_txn_t txn;
+    uint64_t log_start; // write-ahead log, log_size is 0 if there's none
+    uint64_t log_size;
+
+    bool read_only; // mounted with EXT2_MOUNT_RDONLY
+    bool delalloc;  // mounted with EXT2_MOUNT_DELALLOC
+
+    // handles with a write buffer attached, so ext2_stat sees the size of 
+    // data that's still buffered. The head is also read without the lock 
+    // through atomic loads
+    uint32_t buffered_lock;
+    struct ext2_file* buffered;
+
+#if EXT2_STATS
+    ext2_stats_t stats; // only touched through atomic operations (total unused)
+
+    uint64_t (*clock)(void* context);
+    ext2_trace_event_t* trace;
+    uint32_t trace_size;
+    uint64_t trace_head; // number of events ever traced. Atomic
+    void (*on_slow)(const ext2_trace_event_t* event, void* context);
+    uint64_t slow_threshold;
+    void* trace_context;
+#endif
 } ext2_t;
 
+/**
+ * allocation context (see ext2_alloc_ctx_init)
+ */
 typedef struct {
+    uint32_t first_group; // first home group
+    uint32_t group_count; // number of home groups
+    uint32_t goal;        // where the next new file starts looking for blocks
+    int32_t free_blocks;  // change to the superblock free block count that 
+                          // wasn't written yet (see ext2_alloc_ctx_flush)
+} ext2_alloc_ctx_t;
+
+typedef struct ext2_file {
     uint32_t inode;
-    uint32_t offset;
+    uint64_t offset;
+
+    // optional allocation context (see ext2_file_set_alloc_ctx)
+    ext2_alloc_ctx_t* alloc_ctx;
+
+    // optional write buffer (see ext2_file_set_buffer)
+    uint8_t* buf;
+    uint32_t buf_size;   // usable size of buf (a multiple of the block size)
+    uint32_t buf_len;    // amount of data waiting in buf
+    uint64_t buf_offset; // file offset of the first byte in buf
+    uint64_t buf_end;    // end of the buffered data, 0 if there's none. Read
+                         // by other threads through atomic loads
+    struct ext2_file* next_buffered; // next handle with a buffer (see ext2_t)
 } ext2_file_t;
 
 typedef struct {
@@ -179,23 +603,259 @@ typedef struct {
     uint32_t offset;
 } ext2_dir_t;
 
+// Runs task(index, arg) for every index in [0, count) and returns once all of
+// them have finished. Tasks can run in parallel, on as many threads as the 
+// implementation wants
+typedef void (*ext2_parallel_for_t)(void (*task)(uint32_t index, void* arg),
+        void* arg, uint32_t count, void* context);
+
+/**
+ * options of ext2_check
+ */
+typedef struct {
+    // optional. Used to check block groups in parallel. If not given, groups
+    // are checked one after the other
+    ext2_parallel_for_t parallel_for;
+    void* parallel_context; // passed to parallel_for
+
+    // memory used by the checker, ext2_check_workspace_size bytes long and 
+    // 8-byte aligned
+    void* workspace;
+
+    // fix wrong counters (free counts of groups and superblock, directory
+    // counts of groups and link counts of inodes)
+    bool repair;
+} ext2_check_params_t;
+
+/**
+ * problems found by ext2_check. All zeros means the filesystem is consistent
+ */
+typedef struct {
+    uint32_t block_bitmap_errors; // blocks whose bitmap bit disagrees with their use
+    uint32_t inode_bitmap_errors; // same for inodes
+    uint32_t bad_blocks;          // block pointers outside the filesystem
+    uint32_t dup_blocks;          // blocks used more than once
+    uint32_t bad_block_counts;    // inodes whose 'blocks' field is wrong
+    uint32_t bad_dir_blocks;      // directory blocks with a broken rec_len chain
+    uint32_t bad_link_counts;     // inodes whose link count is wrong
+    uint32_t bad_group_counts;    // group descriptors with wrong counters
+    uint32_t bad_super_counts;    // 1 if the superblock free counts are wrong
+    uint32_t repaired;            // counters that were fixed
+} ext2_check_report_t;
+
+/**
+ * options of ext2_defrag
+ */
+typedef struct {
+    // also move files that are in one piece to the lowest free run of their
+    // group that holds them, so the free space gathers at the end of groups
+    bool compact;
+
+    // stop before the device I/O of the call (roughly, in bytes) goes past 
+    // this. 0 means no limit. Files that alone need more are skipped
+    uint64_t io_budget;
+
+    // first inode to look at. 0 starts from the beginning, the next_inode 
+    // of the last report continues where it stopped
+    uint32_t start_inode;
+} ext2_defrag_params_t;
+
+/**
+ * what ext2_defrag did
+ */
+typedef struct {
+    uint32_t files_scanned;    // files and directories looked at
+    uint32_t files_fragmented; // those whose data wasn't in a single run
+    uint32_t files_moved;
+    uint32_t files_skipped;    // too big for the budget or for the free space
+    uint64_t blocks_moved;     // data blocks copied
+    uint64_t io_bytes;         // device I/O done, as counted for the budget
+    uint32_t next_inode;       // where to continue, 0 if every inode was seen
+} ext2_defrag_report_t;
+
+/**
+ * a file seen by ext2_scrub
+ */
+typedef struct {
+    uint32_t inode;
+    uint64_t size;
+    uint32_t crc32c;     // of the file contents, as ext2_crc32c computes it
+    uint32_t bad_blocks; // data blocks that couldn't be read (taken as zeros)
+} ext2_scrub_file_t;
+
+/**
+ * options of ext2_scrub
+ */
+typedef struct {
+    // optional. Used to run the workers in parallel. If not given, a single
+    // worker does everything
+    ext2_parallel_for_t parallel_for;
+    void* parallel_context; // passed to parallel_for
+
+    // workers given to parallel_for, each with its own read buffer. They take
+    // block groups in order. 0 means 1
+    uint32_t workers;
+
+    // bytes each device read may take, rounded down to a multiple of the 
+    // block size. 0 means 1 MiB
+    uint32_t chunk_size;
+
+    // memory used by the scrub, ext2_scrub_workspace_size bytes long and 
+    // 8-byte aligned
+    void* workspace;
+
+    // optional. Called for every regular file once its digest is known. With
+    // parallel_for it may be called from several workers at once
+    void (*on_file)(const ext2_scrub_file_t* file, void* context);
+    void* context; // passed to on_file
+} ext2_scrub_params_t;
+
+/**
+ * what ext2_scrub found
+ */
+typedef struct {
+    uint64_t blocks_read; // allocated blocks that were read
+    uint64_t bytes_read;  // bytes read from the device, short free gaps included
+    uint32_t bad_blocks;  // allocated blocks that couldn't be read
+    uint32_t files;       // regular files digested
+    uint32_t bad_files;   // those with data that couldn't be read
+} ext2_scrub_report_t;
+
+/**
+ * options of ext2_format
+ */
+typedef struct {
+    uint64_t size;            // bytes of the device the filesystem takes
+    uint32_t block_size;      // 1024, 2048 or 4096. 0 means 4096
+    uint32_t inode_size;      // 128 or 256. 0 means 128
+    uint32_t bytes_per_inode; // one inode for this many bytes. 0 means 16384
+
+    // only write the metadata of the first and last block groups. The others
+    // are flagged as uninitialized, and their bitmaps and inodes are written
+    // the first time they are used. This sets the uninit_bg feature, with
+    // which the Linux ext2 driver only mounts the filesystem read-only
+    bool lazy_init;
+
+    uint8_t uuid[16];
+    char volume_name[16];
+} ext2_format_params_t;
+
+/**
+ * a host file or directory, given to ext2_import_tree by the list_dir 
+ * callback
+ */
+typedef struct {
+    const char* name; // name inside its directory
+    uint16_t mode;    // format and permissions, as in ext2_inode_t
+    uint16_t uid;
+    uint16_t gid;
+    uint64_t size;    // size of a regular file
+    uint32_t mtime;
+} ext2_import_entry_t;
+
+/**
+ * options of ext2_import_tree
+ */
+typedef struct {
+    // Calls emit(entry, arg) for every entry of the host directory 'path', 
+    // except "." and "..". If emit returns something other than 0, listing
+    // stops and list_dir returns that value. Otherwise returns 0, or a 
+    // user-defined error
+    int (*list_dir)(const char* path, 
+            int (*emit)(const ext2_import_entry_t* entry, void* arg), 
+            void* arg, void* context);
+
+    // Reads 'size' bytes at 'offset' of the host file 'path'. Returns 0 or a
+    // user-defined error
+    int (*read_file)(const char* path, uint64_t offset, uint32_t size, 
+            void* buffer, void* context);
+
+    void* context; // passed to list_dir and read_file
+
+    // Memory for the directories being imported, 8-byte aligned. Each one 
+    // takes its size on disk plus 32 bytes per entry, and keeps it while its
+    // subdirectories are imported
+    void* workspace;
+    uint32_t workspace_size;
+
+    // memory for file data, at least two blocks. One half is filled from the
+    // host while the other is written to the device
+    void* buffer;
+    uint32_t buffer_size;
+
+    // optional. Used to read from the host and write to the device at the 
+    // same time (with two tasks). If not given, they take turns
+    ext2_parallel_for_t parallel_for;
+    void* parallel_context; // passed to parallel_for
+} ext2_import_params_t;
+
+/**
+ * options of ext2_rm_tree
+ */
+typedef struct {
+    // optional. Used to free block groups in parallel. If not given, a single
+    // worker does everything
+    ext2_parallel_for_t parallel_for;
+    void* parallel_context; // passed to parallel_for
+
+    // workers given to parallel_for. They take block groups in order. 0 
+    // means 1
+    uint32_t workers;
+
+    // memory for the list of the tree and the map of freed blocks, 8-byte 
+    // aligned (see ext2_rm_tree_workspace_size)
+    void* workspace;
+    uint64_t workspace_size;
+} ext2_rm_tree_params_t;
+
 /**
  * Contains information about a file/directory
  */
 typedef struct {
-    uint32_t inode; // inode number of the file/dir (not useful for now)
+    uint32_t inode; // inode number of the file/dir (see ext2_stat_many)
+    ext2_dir_ftype_t type; // EXT2_ET_UNKNOWN without the filetype feature
     char name[EXT2_MAX_FILE_NAME + 1]; // name of the file/dir
 } ext2_dir_record_t;
 
+/**
+ * what ext2_stat tells about a file or directory
+ */
+typedef struct {
+    uint32_t inode;
+    uint16_t mode;        // format (see GET_FILE_FMT) and permissions
+    uint16_t links_count;
+    uint16_t uid;
+    uint16_t gid;
+    uint64_t size;
+    uint32_t blocks;      // 512-byte sectors taken, indirect blocks included
+    uint32_t atime;       // times are in seconds since 1970
+    uint32_t ctime;
+    uint32_t mtime;
+} ext2_stat_t;
+
 // t-rext2 functions       //
 
+/**
+ * Creates an empty filesystem on a device
+ *
+ * The superblock, its backups, the group descriptors, the bitmaps and the 
+ * inode tables are written through the callbacks of 'cfg', then the root
+ * directory and lost+found are created. Only the device callbacks and context
+ * of 'cfg' are used. The filesystem can then be mounted with ext2_mount
+ *
+ * @param cfg    configuration of the device
+ * @param params options of the new filesystem
+ */
+ext2_error_t ext2_format(ext2_config_t* cfg, const ext2_format_params_t* params);
+
 /**
  * Mounts a filesystem based on a configuration
  */
 ext2_error_t ext2_mount(ext2_t* ext2, ext2_config_t* cfg);
 
 /**
- * Opens a file, creating it if it doesn't exist
+ * Opens a file, creating it if it doesn't exist. With EXT2_MOUNT_RDONLY
+ * nothing is created, and a missing file fails with EXT2_ERR_FILE_NOT_FOUND
  *
  * @param ext2 pointer to the filesystem struct
  * @param path the path to the file (always begins with a '/')
@@ -226,7 +886,7 @@ ext2_error_t ext2_file_read(ext2_t* ext2, ext2_file_t* file, uint32_t size, void
  * @param file   file handle pointer
  * @param offset the new offset (should not be greater than size of file)
  */
-ext2_error_t ext2_file_seek(ext2_t* ext2, ext2_file_t* file, uint32_t offset);
+ext2_error_t ext2_file_seek(ext2_t* ext2, ext2_file_t* file, uint64_t offset);
 
 /**
  * Returns the current read/write offset of the file
@@ -234,7 +894,7 @@ ext2_error_t ext2_file_seek(ext2_t* ext2, ext2_file_t* file, uint32_t offset);
  * @param ext2 pointer to the filesystem struct
  * @param file file handle pointer
  */
-uint32_t ext2_file_tell(ext2_t* ext2, const ext2_file_t* file);
+uint64_t ext2_file_tell(ext2_t* ext2, const ext2_file_t* file);
 
 /**
  * Writes data to a file
@@ -249,6 +909,134 @@ uint32_t ext2_file_tell(ext2_t* ext2, const ext2_file_t* file);
  */
 ext2_error_t ext2_file_write(ext2_t* ext2, ext2_file_t* file, uint32_t size, const void* buf);
 
+/**
+ * Changes the size of a file
+ *
+ * Shrinking a file frees every block past the new end of file. Growing it
+ * leaves a hole, which reads back as zeros and takes no space on disk. If the
+ * read/write offset is past the new end of file, it's moved to the end.
+ *
+ * @param ext2 pointer to the filesystem struct
+ * @param file file handle pointer
+ * @param size new size of the file in bytes
+ */
+ext2_error_t ext2_file_truncate(ext2_t* ext2, ext2_file_t* file, uint64_t size);
+
+/**
+ * Reserves disk space for a part of a file
+ *
+ * Every block in [offset, offset + size) that isn't allocated yet is allocated
+ * and filled with zeros. Blocks are reserved as one contiguous run whenever
+ * possible, so later writes to that range don't need to allocate anything. The
+ * file grows if offset + size is past its end.
+ *
+ * @param ext2   pointer to the filesystem struct
+ * @param file   file handle pointer
+ * @param offset start of the range in bytes
+ * @param size   size of the range in bytes
+ */
+ext2_error_t ext2_file_fallocate(ext2_t* ext2, ext2_file_t* file, 
+        uint64_t offset, uint64_t size);
+
+/**
+ * Copies part of a file into another file (or another part of the same file)
+ *
+ * Data is moved inside the device, without going through the caller. When
+ * src_off and dst_off are at the same position inside a block, whole blocks 
+ * are copied in runs of consecutive blocks, new destination blocks are 
+ * allocated contiguously and holes in the source stay holes. The offsets 
+ * stored in the handles are not used nor changed.
+ *
+ * @param ext2    pointer to the filesystem struct
+ * @param src     handle of the file to copy from
+ * @param src_off where to start reading (src_off + len must be inside src)
+ * @param dst     handle of the file to copy to
+ * @param dst_off where to start writing (must not be past the end of dst)
+ * @param len     amount of bytes to copy
+ */
+ext2_error_t ext2_copy_file_range(ext2_t* ext2, ext2_file_t* src,
+        uint64_t src_off, ext2_file_t* dst, uint64_t dst_off, 
+        uint64_t len);
+
+/**
+ * Attaches a write buffer to a file handle
+ *
+ * Small sequential writes are gathered in the buffer and written together
+ * once it's full (the data always ends at a block boundary), on seek, read,
+ * ext2_file_flush or ext2_file_close (with EXT2_MOUNT_DELALLOC, seeks and 
+ * reads keep the buffer). The size of the file on disk is updated
+ * once per flush. Other handles to the same file don't see buffered data,
+ * but ext2_stat and ext2_stat_many on the same mount report the size the file
+ * will have once it's flushed. Passing a NULL buffer flushes and detaches the
+ * current one. A handle with a buffer attached must be closed (or have the 
+ * buffer detached) before its memory is reused.
+ *
+ * @param ext2 pointer to the filesystem struct
+ * @param file file handle pointer
+ * @param buf  memory for the buffer. Must stay valid until it's detached
+ * @param size size of buf in bytes (at least one block, only whole blocks are
+ *             used)
+ */
+ext2_error_t ext2_file_set_buffer(ext2_t* ext2, ext2_file_t* file, void* buf,
+        uint32_t size);
+
+/**
+ * Writes the data waiting in the write buffer of a file handle
+ *
+ * @param ext2 pointer to the filesystem struct
+ * @param file file handle pointer
+ */
+ext2_error_t ext2_file_flush(ext2_t* ext2, ext2_file_t* file);
+
+/**
+ * Closes a file handle, flushing and detaching its write buffer
+ *
+ * @param ext2 pointer to the filesystem struct
+ * @param file file handle pointer
+ */
+ext2_error_t ext2_file_close(ext2_t* ext2, ext2_file_t* file);
+
+/**
+ * Sets up an allocation context
+ *
+ * An allocation context makes the blocks of the files written through it come
+ * from a few "home" groups. Each thread that writes can have its own context,
+ * so threads allocate from different groups and don't wait for each other's
+ * group locks. Only when the home groups are full, free space is taken from 
+ * the other groups. The groups are split in 'count' slices and the context
+ * gets the index'th one. Changes to the free block count of the superblock
+ * are kept in the context until ext2_alloc_ctx_flush. A context must only be 
+ * used by one thread at a time
+ *
+ * @param ext2  pointer to the filesystem struct
+ * @param ctx   context to set up
+ * @param index which slice of the groups is home to the context
+ * @param count number of slices (usually the number of threads)
+ */
+ext2_error_t ext2_alloc_ctx_init(ext2_t* ext2, ext2_alloc_ctx_t* ctx, 
+        uint32_t index, uint32_t count);
+
+/**
+ * Writes the changes that an allocation context made to the free block count
+ * of the superblock. Must be called before the context is discarded. The 
+ * context can still be used afterwards
+ *
+ * @param ext2 pointer to the filesystem struct
+ * @param ctx  allocation context
+ */
+ext2_error_t ext2_alloc_ctx_flush(ext2_t* ext2, ext2_alloc_ctx_t* ctx);
+
+/**
+ * Makes new blocks of a file handle be allocated through a context (see
+ * ext2_alloc_ctx_init). Passing NULL goes back to the default allocator
+ *
+ * @param ext2 pointer to the filesystem struct
+ * @param file file handle pointer
+ * @param ctx  allocation context. Must stay valid while it's attached
+ */
+ext2_error_t ext2_file_set_alloc_ctx(ext2_t* ext2, ext2_file_t* file, 
+        ext2_alloc_ctx_t* ctx);
+
 /**
  * Opens a directory
  *
@@ -261,7 +1049,9 @@ ext2_error_t ext2_dir_open(ext2_t* ext2, const char* path, ext2_dir_t* dir);
 /**
  * Reads an entry from a directory
  *
- * The next read to this directory will read the subsequent entry
+ * The next read to this directory will read the subsequent entry. Unused
+ * entries are skipped, so inode 0 (with an empty name) means all entries 
+ * were read
  *
  * @param ext2    pointer to the filesystem struct
  * @param dir     pointer to directory handle
@@ -297,9 +1087,298 @@ uint32_t ext2_dir_tell(ext2_t* ext2, const ext2_dir_t* dir);
 /**
  * Creates a directory
  *
+ * Fails with EXT2_ERR_FILE_EXISTS if something already exists at path
+ *
  * @param ext2   pointer to the filesystem struct
  * @param path   path of the directory
  */
 ext2_error_t ext2_mkdir(ext2_t* ext2, const char* path);
 
+/**
+ * Tells the size, type and times of a file or directory
+ *
+ * Unlike ext2_file_open, nothing is created if the path doesn't exist
+ *
+ * @param ext2 pointer to the filesystem struct
+ * @param path path of the file or directory
+ * @param st   where the information is copied to
+ */
+ext2_error_t ext2_stat(ext2_t* ext2, const char* path, ext2_stat_t* st);
+
+/**
+ * Tells the size, type and times of many inodes at once
+ *
+ * The inodes are read in increasing order, so inodes that share a block of
+ * the inode table are read together, and nearby blocks are read in a single
+ * call. Each block is read once
+ *
+ * @param ext2      pointer to the filesystem struct
+ * @param inodes    inode numbers, in any order. They aren't changed
+ * @param count     number of inodes
+ * @param out       'count' entries. out[i] is about inodes[i]
+ * @param workspace 'count' entries, where the order they're read in is kept
+ */
+ext2_error_t ext2_stat_many(ext2_t* ext2, const uint32_t* inodes, 
+        uint32_t count, ext2_stat_t* out, uint32_t* workspace);
+
+/**
+ * Removes a file or an empty directory
+ *
+ * The entry is taken out of its directory and, once nothing else links to 
+ * the file, its inode and blocks are freed. Blocks are freed group by group,
+ * with one bitmap write per group, and the superblock is written once. Fails
+ * with EXT2_ERR_DIR_NOT_EMPTY if a directory still has entries
+ *
+ * @param ext2 pointer to the filesystem struct
+ * @param path path of the file or directory
+ */
+ext2_error_t ext2_rm(ext2_t* ext2, const char* path);
+
+/**
+ * Returns the size of the workspace ext2_rm_tree needs for a tree of 'files'
+ * files and directories
+ *
+ * A bit per block plus four bytes per file
+ *
+ * @param ext2  pointer to the filesystem struct
+ * @param files files and directories of the tree, the top one included
+ */
+uint64_t ext2_rm_tree_workspace_size(ext2_t* ext2, uint32_t files);
+
+/**
+ * Removes a directory and everything under it
+ *
+ * The tree is listed into the workspace and taken out of its directory, then
+ * the inodes are freed block group by block group, in parallel if 
+ * params->parallel_for is given. Freed blocks are gathered in a map, which is
+ * merged into each block bitmap with a single write, and the superblock is 
+ * written once. Files with links outside the tree only lose the links from 
+ * inside it. Fails with EXT2_ERR_BUFFER_TOO_SMALL, leaving the tree in place,
+ * if its list doesn't fit. Nothing else should use the tree meanwhile
+ *
+ * @param ext2   pointer to the filesystem struct
+ * @param path   path of the directory (or of a single file)
+ * @param params workers and memory of the removal
+ */
+ext2_error_t ext2_rm_tree(ext2_t* ext2, const char* path, 
+        const ext2_rm_tree_params_t* params);
+
+/**
+ * Returns the size of the buffer ext2_txn_begin needs to stage 'blocks' 
+ * blocks
+ *
+ * @param block_size block size of the filesystem
+ * @param blocks     blocks the transaction can hold
+ */
+uint64_t ext2_txn_buffer_size(uint32_t block_size, uint32_t blocks);
+
+/**
+ * Opens a transaction
+ *
+ * Until ext2_txn_commit, every write that fits in a block (inodes, bitmaps,
+ * descriptors, the superblock, directory blocks and small file writes) is 
+ * kept in 'buffer' instead of going to the device, so a block changed many
+ * times is written once. Bigger writes (file data) still go to the device 
+ * right away. Reads, from any thread, see the kept blocks. If the buffer 
+ * fills up, what it holds is committed early and the transaction goes on
+ *
+ * @param ext2   pointer to the filesystem struct
+ * @param buffer memory for the transaction, 8-aligned (see 
+ *               ext2_txn_buffer_size). Fails with EXT2_ERR_BUFFER_TOO_SMALL
+ *               if not even a block fits
+ * @param size   size of buffer
+ */
+ext2_error_t ext2_txn_begin(ext2_t* ext2, void* buffer, uint64_t size);
+
+/**
+ * Writes the blocks of the open transaction and closes it
+ *
+ * The blocks go out sorted by address, with runs of consecutive blocks in
+ * a single write. If the filesystem was mounted with a log, they're first 
+ * written to the log in a single write, with a checksum, so after a crash 
+ * ext2_mount either finishes the whole transaction or ignores it
+ *
+ * @param ext2 pointer to the filesystem struct
+ */
+ext2_error_t ext2_txn_commit(ext2_t* ext2);
+
+/**
+ * Copies a host directory tree into a directory of the filesystem
+ *
+ * The contents of the host directory 'host_path' (regular files and 
+ * directories, other files are skipped) are created inside the existing
+ * directory 'dest_path'. Inodes and blocks are allocated in traversal order,
+ * every directory is built in the workspace and written whole, and file data
+ * is written in runs of consecutive blocks. If the call fails, the tree may
+ * be left half imported. The destination stays locked during the call
+ *
+ * @param ext2      pointer to the filesystem struct
+ * @param host_path host directory to import, as understood by the callbacks
+ * @param dest_path directory where its contents go
+ * @param params    host callbacks and memory
+ */
+ext2_error_t ext2_import_tree(ext2_t* ext2, const char* host_path, 
+        const char* dest_path, const ext2_import_params_t* params);
+
+/**
+ * Returns the size of the workspace ext2_check needs
+ *
+ * About one bit per block plus four bytes per inode
+ *
+ * @param ext2 pointer to the filesystem struct
+ */
+uint64_t ext2_check_workspace_size(ext2_t* ext2);
+
+/**
+ * Checks the consistency of the filesystem
+ *
+ * Bitmaps are compared with the blocks and inodes that are really in use,
+ * every block pointer, directory block and link count is checked, and so are
+ * the counters of the group descriptors and superblock. Block groups are 
+ * checked in parallel if params->parallel_for is given, each with its own
+ * big reads of the inode table. Nothing else must use the filesystem during
+ * the check. The return value only reports errors from the device, problems
+ * with the filesystem go in 'report'
+ *
+ * @param ext2   pointer to the filesystem struct
+ * @param params options of the check
+ * @param report where the problems found are counted
+ */
+ext2_error_t ext2_check(ext2_t* ext2, const ext2_check_params_t* params,
+        ext2_check_report_t* report);
+
+/**
+ * Defragments files and, optionally, compacts the free space
+ *
+ * Files and directories are visited in inode order. One whose data blocks 
+ * are in several runs is copied to a place with fewer runs (a single one if
+ * there's enough contiguous free space), new indirect blocks are written and
+ * the inode is switched to them. Only then the old blocks are freed. Sparse
+ * files are left alone. Nothing else should use the filesystem meanwhile
+ *
+ * @param ext2   pointer to the filesystem struct
+ * @param params options (compaction, I/O budget and where to start)
+ * @param report filled with what was done and where to continue
+ */
+ext2_error_t ext2_defrag(ext2_t* ext2, const ext2_defrag_params_t* params,
+        ext2_defrag_report_t* report);
+
+/**
+ * Returns the size of the workspace ext2_scrub needs with these options
+ *
+ * Four bytes and a bit per block plus a read buffer per worker
+ *
+ * @param ext2   pointer to the filesystem struct
+ * @param params options of the scrub (workers, chunk_size and parallel_for)
+ */
+uint64_t ext2_scrub_workspace_size(ext2_t* ext2, const ext2_scrub_params_t* params);
+
+/**
+ * Reads every allocated block and computes the CRC32C of every regular file
+ *
+ * The block bitmaps are followed in physical order, and allocated blocks 
+ * (with the short free gaps between them) are read in chunks of 
+ * params->chunk_size. The CRC32C of every block is kept in the workspace, 
+ * and the digest of each file is then put together from those by walking 
+ * its block pointers, without reading its data again. Blocks that can't be
+ * read are counted instead of failing the call. Nothing else must use the 
+ * filesystem during the scrub. The return value only reports errors reading
+ * metadata (descriptors, bitmaps and inode tables)
+ *
+ * @param ext2   pointer to the filesystem struct
+ * @param params options and memory of the scrub
+ * @param report filled with what was read
+ */
+ext2_error_t ext2_scrub(ext2_t* ext2, const ext2_scrub_params_t* params,
+        ext2_scrub_report_t* report);
+
+/**
+ * Computes the CRC32C (Castagnoli) of a buffer, the same one ext2_scrub 
+ * gives for files
+ *
+ * Uses the CPU's crc32 instruction if the library is built for one (SSE 4.2
+ * or ARMv8 CRC)
+ *
+ * @param crc  0 for the first piece, the last result to continue with more
+ * @param data bytes to add
+ * @param size number of bytes
+ */
+uint32_t ext2_crc32c(uint32_t crc, const void* data, uint32_t size);
+
+/**
+ * Returns the size of the arena that ext2_mount needs for these pools
+ *
+ * The arena must be aligned to arena_align. Pass the block size of the 
+ * filesystem (or the biggest one it may have)
+ *
+ * @param block_size   block size of the filesystem
+ * @param cache_blocks block buffers
+ * @param cache_names  directory entry slots
+ * @param arena_align  alignment of the block buffers, 0 means 8
+ */
+uint64_t ext2_arena_size(uint32_t block_size, uint32_t cache_blocks, 
+        uint32_t cache_names, uint32_t arena_align);
+
+/**
+ * Returns the size of the arena that ext2_cache_init needs
+ *
+ * @param params sizes of the pools (the arena itself isn't looked at)
+ */
+uint64_t ext2_cache_arena_size(const ext2_cache_params_t* params);
+
+/**
+ * Creates a cache that several mounts share (see ext2_config_t.shared_cache)
+ *
+ * The arena is the memory budget of all the mounts together. Buffers aren't
+ * split between them: the least recently used ones go to whichever mount 
+ * needs one, so busy filesystems end up with most of the memory. Fails with
+ * EXT2_ERR_BUFFER_TOO_SMALL if the pools don't fit in the arena
+ *
+ * @param cache  the cache to create, must outlive the mounts
+ * @param params arena and sizes of the pools
+ */
+ext2_error_t ext2_cache_init(ext2_cache_t* cache, const ext2_cache_params_t* params);
+
+/**
+ * Copies the memory use of the caches into 'stats'
+ *
+ * The high-water marks show how much of each pool was ever needed at once,
+ * so the arena can be sized to fit
+ *
+ * @param ext2  pointer to the filesystem struct
+ * @param stats where the numbers are copied to
+ */
+ext2_error_t ext2_get_memory_stats(ext2_t* ext2, ext2_memory_stats_t* stats);
+
+/**
+ * Copies the statistics of the filesystem into 'stats'
+ *
+ * Every counter is attributed to the public function that did the work. They
+ * start at zero on ext2_mount and are updated without locks, so this can be 
+ * called while other threads use the filesystem. The latency histograms stay
+ * empty if no clock was given to ext2_mount. Fails with EXT2_ERR_NO_STATS if
+ * the library was built with EXT2_STATS set to 0
+ *
+ * @param ext2  pointer to the filesystem struct
+ * @param stats where the statistics are copied to
+ * @param reset if true, the counters go back to zero after being copied
+ */
+ext2_error_t ext2_get_stats(ext2_t* ext2, ext2_stats_t* stats, bool reset);
+
+/**
+ * Copies the trace, from the oldest call to the newest
+ *
+ * The trace keeps the last calls to public functions (except ext2_get_stats
+ * and ext2_trace_dump). It's only recorded if a clock and trace memory were 
+ * given to ext2_mount. Calls that are still being recorded by other threads
+ * may come out partially written
+ *
+ * @param ext2   pointer to the filesystem struct
+ * @param events where the calls are copied to
+ * @param max    size of 'events'
+ *
+ * @return number of calls copied
+ */
+uint32_t ext2_trace_dump(ext2_t* ext2, ext2_trace_event_t* events, uint32_t max);
+
 #endif
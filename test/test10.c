@@ -0,0 +1,180 @@
+#include "utils.h"
+#include <pthread.h>
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define BLOCKS_PER_GROUP 1024
+#define INODES 1024
+
+#define NTHREADS 4
+#define FILES_PER_THREAD 10
+#define FILE_SIZE (20 * BLOCKSZ)
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block);
+
+/*************************************
+ * Locks                             *
+ *************************************/
+pthread_rwlock_t inode_locks[INODES + 1];
+pthread_rwlock_t group_locks[16];
+pthread_rwlock_t shared_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// home groups of the calling thread while it writes (group_count is 0 
+// otherwise)
+__thread ext2_alloc_ctx_t* writing_ctx = NULL;
+int foreign_group_locks = 0;
+int shared_locks = 0;
+
+pthread_rwlock_t* get_lock(ext2_lock_kind_t kind, uint32_t id) {
+    if (kind == EXT2_LOCK_INODE)
+        return &inode_locks[id];
+    if (kind == EXT2_LOCK_GROUP)
+        return &group_locks[id];
+    return &shared_lock;
+}
+
+void lock(ext2_lock_kind_t kind, uint32_t id, bool exclusive, void* context) {
+    if (writing_ctx && kind == EXT2_LOCK_GROUP && 
+            (id < writing_ctx->first_group || 
+             id >= writing_ctx->first_group + writing_ctx->group_count))
+        __atomic_fetch_add(&foreign_group_locks, 1, __ATOMIC_RELAXED);
+
+    if (writing_ctx && kind == EXT2_LOCK_SHARED)
+        __atomic_fetch_add(&shared_locks, 1, __ATOMIC_RELAXED);
+
+    if (exclusive)
+        pthread_rwlock_wrlock(get_lock(kind, id));
+    else
+        pthread_rwlock_rdlock(get_lock(kind, id));
+}
+
+void unlock(ext2_lock_kind_t kind, uint32_t id, bool exclusive, void* context) {
+    pthread_rwlock_unlock(get_lock(kind, id));
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+    .lock = lock,
+    .unlock = unlock,
+};
+
+ext2_alloc_ctx_t ctxs[NTHREADS];
+int errors = 0;
+int outside_home = 0;
+
+bool is_home(ext2_alloc_ctx_t* ctx, uint32_t block) {
+    uint32_t group = (block - ext2.superblk.first_data_block) / BLOCKS_PER_GROUP;
+    return group >= ctx->first_group && group < ctx->first_group + ctx->group_count;
+}
+
+void* worker(void* arg) {
+    int id = (int)(intptr_t)arg;
+    ext2_alloc_ctx_t* ctx = &ctxs[id];
+    static uint8_t bufs[NTHREADS][FILE_SIZE];
+    uint8_t* buf = bufs[id];
+    char path[64];
+    ext2_file_t file;
+
+    memset(buf, 'a' + id, FILE_SIZE);
+    ext2_alloc_ctx_init(&ext2, ctx, id, NTHREADS);
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        sprintf(path, "/t%d-%d", id, i);
+        if (ext2_file_open(&ext2, path, &file) != 0) {
+            __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        ext2_file_set_alloc_ctx(&ext2, &file, ctx);
+
+        writing_ctx = ctx;
+        if (ext2_file_write(&ext2, &file, FILE_SIZE, buf) != 0)
+            __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+        writing_ctx = NULL;
+
+        for (uint32_t off = 0; off < FILE_SIZE; off += BLOCKSZ) {
+            uint32_t block;
+            block_map(&ext2, file.inode, off, &block);
+            if (!is_home(ctx, block))
+                __atomic_fetch_add(&outside_home, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (ext2_alloc_ctx_flush(&ext2, ctx) != 0)
+        __atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+// sum of the free blocks of every group descriptor
+uint32_t bgd_free_blocks() {
+    uint32_t total = 0;
+    for (uint32_t g = 0; g < ext2.block_group_count; g++) {
+        uint16_t free;
+        readblock(2 * BLOCKSZ + g * 32 + 12, sizeof(free), &free, DISKIMG_FILE);
+        total += free;
+    }
+    return total;
+}
+
+int main(void) {
+    testsuite("allocation contexts");
+
+    for (int i = 0; i <= INODES; i++)
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    for (int i = 0; i < 16; i++)
+        pthread_rwlock_init(&group_locks[i], NULL);
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=1k count=8192", DISKIMG_FILE);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d -g %d -N %d %s", BLOCKSZ, 
+            BLOCKS_PER_GROUP, INODES, DISKIMG_FILE);
+
+    ext2_mount(&ext2, &cfg);
+
+    pthread_t threads[NTHREADS];
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, worker, (void*)(intptr_t)i);
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    bool disjoint = true;
+    for (int i = 1; i < NTHREADS; i++)
+        disjoint = disjoint && ctxs[i].first_group >= 
+            ctxs[i - 1].first_group + ctxs[i - 1].group_count;
+
+    test("writes ok", errors == 0);
+    test("home groups don't overlap", disjoint);
+    test("blocks come from the home groups", outside_home == 0);
+    test("writers only lock their home groups", foreign_group_locks == 0);
+    test("writers don't take the shared lock", shared_locks == 0);
+    test("superblock count is right after flush",
+            ext2.superblk.free_blocks_count == bgd_free_blocks());
+    test("e2fsck is happy", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // a context with a single home group that can't hold the whole file
+    ext2_alloc_ctx_t ctx;
+    ext2_file_t file;
+    ext2_alloc_ctx_init(&ext2, &ctx, 7, 8);
+    ext2_file_open(&ext2, "/big", &file);
+    ext2_file_set_alloc_ctx(&ext2, &file, &ctx);
+
+    static uint8_t big[1500 * BLOCKSZ];
+    ext2_error_t err = ext2_file_write(&ext2, &file, sizeof(big), big);
+
+    uint32_t first, last;
+    block_map(&ext2, file.inode, 0, &first);
+    block_map(&ext2, file.inode, sizeof(big) - 1, &last);
+    ext2_alloc_ctx_flush(&ext2, &ctx);
+
+    test("full home steals from other groups", err == 0 && 
+            is_home(&ctx, first) && !is_home(&ctx, last));
+    test("e2fsck is happy after stealing", 
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    return 0;
+}
@@ -0,0 +1,176 @@
+#include "utils.h"
+#include <pthread.h>
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define BLOCKS_PER_GROUP 1024
+#define DUMMY_FILE_PATH "/tmp/hello"
+
+#define NTHREADS 4
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block);
+
+/*************************************
+ * Thread pool                       *
+ *************************************/
+typedef struct {
+    void (*task)(uint32_t index, void* arg);
+    void* arg;
+    uint32_t count;
+    uint32_t next;
+} job_t;
+
+void* pool_worker(void* p) {
+    job_t* job = p;
+    uint32_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+        job->task(i, job->arg);
+    return NULL;
+}
+
+int parallel_calls = 0;
+
+void parallel_for(void (*task)(uint32_t, void*), void* arg, uint32_t count,
+        void* context) {
+    job_t job = { task, arg, count, 0 };
+    pthread_t threads[NTHREADS];
+
+    parallel_calls++;
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, pool_worker, &job);
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+};
+
+void prepare_file() {
+    FILE *file = fopen(DUMMY_FILE_PATH, "w");
+    if (file == NULL) {
+        perror("Failed to open file");
+        exit(1);
+    }
+
+    // big enough to need a doubly-indirect block
+    for (uint32_t i = 0; i < 300 * BLOCKSZ; i++)
+        fputc('a' + i % 26, file);
+
+    fclose(file);
+}
+
+uint32_t problems(const ext2_check_report_t* r) {
+    return r->block_bitmap_errors + r->inode_bitmap_errors + r->bad_blocks +
+        r->dup_blocks + r->bad_block_counts + r->bad_dir_blocks + 
+        r->bad_link_counts + r->bad_group_counts + r->bad_super_counts;
+}
+
+ext2_check_report_t check(bool parallel, bool repair) {
+    ext2_check_report_t report;
+    ext2_check_params_t params = {
+        .parallel_for = parallel ? parallel_for : NULL,
+        .workspace = malloc(ext2_check_workspace_size(&ext2)),
+        .repair = repair,
+    };
+
+    if (ext2_check(&ext2, &params, &report) != 0)
+        report.bad_super_counts = 1000;
+
+    free(params.workspace);
+    return report;
+}
+
+int main(void) {
+    testsuite("consistency check");
+
+    prepare_file();
+
+    // revision 0, no features
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=1k count=8192", DISKIMG_FILE);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d -g %d %s", BLOCKSZ, BLOCKS_PER_GROUP,
+            DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"mkdir foo\"", DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/hello\"",
+            DISKIMG_FILE, DUMMY_FILE_PATH);
+
+    ext2_mount(&ext2, &cfg);
+
+    ext2_file_t file;
+    char buf[5000];
+    memset(buf, 'x', sizeof(buf));
+    ext2_mkdir(&ext2, "/bar");
+    ext2_file_open(&ext2, "/bar/mine", &file);
+    ext2_file_write(&ext2, &file, sizeof(buf), buf);
+
+    ext2_check_report_t report = check(false, false);
+
+    test("fresh filesystem is clean", problems(&report) == 0);
+
+    report = check(true, false);
+
+    test("parallel check is clean too", problems(&report) == 0 && 
+            parallel_calls == 2);
+
+    // default features: sparse_super, resize_inode, filetype...
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=1k count=16384", DISKIMG_FILE);
+    exec_cmd_fail("mkfs.ext2 -q -b %d -g %d %s", BLOCKSZ, BLOCKS_PER_GROUP,
+            DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"mkdir foo\"", DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/hello\"",
+            DISKIMG_FILE, DUMMY_FILE_PATH);
+
+    ext2_mount(&ext2, &cfg);
+    report = check(true, false);
+
+    test("filesystem with default features is clean", problems(&report) == 0);
+
+    // now break it in a few ways
+    uint32_t hello, block;
+    ext2_file_open(&ext2, "/foo/hello", &file);
+    hello = file.inode;
+    block_map(&ext2, hello, 0, &block);
+
+    exec_cmd_fail("debugfs -w %s -R \"sif foo/hello links_count 5\"", DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"set_bg 3 free_blocks_count 7\"", DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"ssv free_inodes_count 3\"", DISKIMG_FILE);
+    // only clears the bit, the counters stay right
+    exec_cmd_fail("debugfs -w %s -R \"freeb %d\"", DISKIMG_FILE, block);
+
+    ext2_mount(&ext2, &cfg);
+    report = check(true, false);
+
+    test("wrong link count is found", report.bad_link_counts == 1);
+    test("wrong group counters are found", report.bad_group_counts == 1);
+    test("wrong superblock counters are found", report.bad_super_counts == 1);
+    test("wrong block bitmap is found", report.block_bitmap_errors == 1);
+    test("nothing else is reported", problems(&report) == 4);
+
+    report = check(true, true);
+
+    test("counters are repaired", report.repaired == 3);
+
+    report = check(true, false);
+
+    test("only the bitmap problem is left", problems(&report) == 1 && 
+            report.block_bitmap_errors == 1);
+
+    // a directory entry that runs past its block
+    ext2_dir_t dir;
+    ext2_dir_open(&ext2, "/foo", &dir);
+    block_map(&ext2, dir.inode, 0, &block);
+
+    uint16_t rec_len = 2000;
+    writeblock(block * BLOCKSZ + 4, sizeof(rec_len), &rec_len, DISKIMG_FILE);
+
+    report = check(true, false);
+
+    test("broken dir block is found", report.bad_dir_blocks == 1);
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+
+/*************************************
+ * Disk that counts its calls        *
+ *************************************/
+uint64_t reads, writes, read_bytes, write_bytes;
+
+int counting_read(uint32_t start, uint32_t size, void* buffer, void* context) {
+    reads++;
+    read_bytes += size;
+    return readblock(start, size, buffer, context);
+}
+
+int counting_write(uint32_t start, uint32_t size, const void* buffer,
+        void* context) {
+    writes++;
+    write_bytes += size;
+    return writeblock(start, size, buffer, context);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = counting_read,
+    .write = counting_write,
+    .context = DISKIMG_FILE,
+};
+
+int main(void) {
+    testsuite("statistics");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=4096", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"mkdir foo\"", DISKIMG_FILE);
+
+    ext2_stats_t stats;
+    ext2_mount(&ext2, &cfg);
+    ext2_error_t err = ext2_get_stats(&ext2, &stats, false);
+
+    test("get stats ok", err == 0);
+    test("mount is counted", stats.ops[EXT2_OP_MOUNT].calls == 1 &&
+            stats.ops[EXT2_OP_MOUNT].dev_reads == reads);
+
+    ext2_get_stats(&ext2, &stats, true);
+    ext2_get_stats(&ext2, &stats, false);
+
+    test("reset clears the counters", stats.total.calls == 0 &&
+            stats.total.dev_reads == 0);
+
+    reads = writes = read_bytes = write_bytes = 0;
+
+    ext2_file_t file;
+    ext2_file_open(&ext2, "/foo/file", &file);
+    ext2_get_stats(&ext2, &stats, false);
+
+    ext2_op_stats_t* open = &stats.ops[EXT2_OP_FILE_OPEN];
+    test("open that creates a file is counted", open->calls == 1 &&
+            open->inode_writes > 0 && open->bgd_writes > 0 &&
+            open->sb_writes > 0 && open->bitmap_scans > 0);
+    test("lookups scan dir entries", open->dir_entries_scanned >= 3);
+
+    char buf[10 * BLOCKSZ];
+    memset(buf, 'a', sizeof(buf));
+    ext2_file_write(&ext2, &file, sizeof(buf), buf);
+    ext2_file_seek(&ext2, &file, 0);
+    ext2_file_read(&ext2, &file, sizeof(buf), buf);
+    ext2_get_stats(&ext2, &stats, false);
+
+    ext2_op_stats_t* write = &stats.ops[EXT2_OP_FILE_WRITE];
+    ext2_op_stats_t* read = &stats.ops[EXT2_OP_FILE_READ];
+
+    test("write allocates its blocks", write->blocks_allocated == 10);
+    test("write writes the data", write->dev_write_bytes >= sizeof(buf));
+    test("read doesn't write", read->calls == 1 && read->dev_writes == 0 &&
+            read->dev_read_bytes >= sizeof(buf));
+    test("read allocates nothing", read->blocks_allocated == 0);
+    test("seek reads the inode", stats.ops[EXT2_OP_FILE_SEEK].inode_reads == 1);
+
+    test("device calls match the callbacks", stats.total.dev_reads == reads &&
+            stats.total.dev_writes == writes);
+    test("device bytes match the callbacks",
+            stats.total.dev_read_bytes == read_bytes &&
+            stats.total.dev_write_bytes == write_bytes);
+
+    // data written through the buffer belongs to the call that flushes it
+    char wbuf[4 * BLOCKSZ];
+    ext2_get_stats(&ext2, &stats, true);
+    ext2_file_set_buffer(&ext2, &file, wbuf, sizeof(wbuf));
+    ext2_file_write(&ext2, &file, 100, buf);
+    ext2_file_close(&ext2, &file);
+    ext2_get_stats(&ext2, &stats, false);
+
+    test("buffered write doesn't touch the disk",
+            stats.ops[EXT2_OP_FILE_WRITE].calls == 1 &&
+            stats.ops[EXT2_OP_FILE_WRITE].dev_writes == 0);
+    test("close writes the buffered data",
+            stats.ops[EXT2_OP_FILE_CLOSE].dev_writes > 0 &&
+            stats.ops[EXT2_OP_FILE_FLUSH].calls == 0);
+
+    ext2_dir_t dir;
+    ext2_dir_record_t entry;
+    ext2_get_stats(&ext2, &stats, true);
+    ext2_mkdir(&ext2, "/foo/bar");
+    ext2_dir_open(&ext2, "/foo", &dir);
+    ext2_dir_read(&ext2, &dir, &entry);
+    ext2_get_stats(&ext2, &stats, false);
+
+    test("mkdir allocates a block",
+            stats.ops[EXT2_OP_MKDIR].blocks_allocated == 1);
+    test("dir read scans one entry",
+            stats.ops[EXT2_OP_DIR_READ].dir_entries_scanned == 1);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define TRACE_FILE "test/trace.txt"
+#define BLOCKSZ 1024
+#define TRACE_SIZE 8
+
+/*************************************
+ * Clock and slow disk               *
+ *************************************/
+// every call to the clock advances it by one, and slow reads by a lot more
+uint64_t now = 0;
+bool slow_disk = false;
+
+uint64_t fake_clock(void* context) {
+    return now++;
+}
+
+int slow_read(uint32_t start, uint32_t size, void* buffer, void* context) {
+    if (slow_disk)
+        now += 1000;
+    return readblock(start, size, buffer, context);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_trace_event_t trace[TRACE_SIZE];
+
+// saves the trace to a file when an operation is slow
+int slow_calls = 0;
+
+void on_slow(const ext2_trace_event_t* event, void* context) {
+    ext2_trace_event_t events[TRACE_SIZE];
+    uint32_t n = ext2_trace_dump(&ext2, events, TRACE_SIZE);
+    FILE* f = fopen(TRACE_FILE, "w");
+
+    for (uint32_t i = 0; i < n; i++)
+        fprintf(f, "%u %u %lu %lu %lu\n", events[i].op, events[i].inode,
+                events[i].offset, events[i].size, events[i].duration);
+
+    fprintf(f, "slow %u %lu\n", event->op, event->duration);
+    fclose(f);
+    slow_calls++;
+}
+
+ext2_config_t cfg = {
+    .read = slow_read,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+    .clock = fake_clock,
+    .trace = trace,
+    .trace_size = TRACE_SIZE,
+    .on_slow = on_slow,
+    .slow_threshold = 1000,
+};
+
+uint64_t histogram_sum(const uint64_t* histogram) {
+    uint64_t sum = 0;
+    for (int i = 0; i < EXT2_LATENCY_BUCKETS; i++)
+        sum += histogram[i];
+    return sum;
+}
+
+int main(void) {
+    testsuite("latency histograms and trace");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=4096", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+
+    ext2_mount(&ext2, &cfg);
+
+    ext2_file_t file;
+    char buf[3 * BLOCKSZ] = "hello";
+    ext2_file_open(&ext2, "/file", &file);
+    ext2_file_write(&ext2, &file, sizeof(buf), buf);
+    ext2_file_seek(&ext2, &file, 100);
+    ext2_file_read(&ext2, &file, 50, buf);
+
+    ext2_stats_t stats;
+    ext2_get_stats(&ext2, &stats, false);
+
+    test("every call is in a histogram",
+            histogram_sum(stats.ops[EXT2_OP_FILE_WRITE].latency) == 1 &&
+            histogram_sum(stats.ops[EXT2_OP_FILE_READ].latency) == 1 &&
+            histogram_sum(stats.total.latency) == stats.total.calls);
+    test("every device call is in a histogram",
+            histogram_sum(stats.dev_latency[EXT2_DEV_READ]) == stats.total.dev_reads &&
+            histogram_sum(stats.dev_latency[EXT2_DEV_WRITE]) == stats.total.dev_writes);
+
+    // reading an inode calls the clock twice in the device callback, so it
+    // takes at least 2 units
+    test("seek falls in a log bucket",
+            stats.ops[EXT2_OP_FILE_SEEK].latency[0] == 0 &&
+            stats.ops[EXT2_OP_FILE_SEEK].latency[1] == 0);
+
+    ext2_trace_event_t events[TRACE_SIZE];
+    uint32_t n = ext2_trace_dump(&ext2, events, TRACE_SIZE);
+
+    test("trace has every call", n == 5);
+    test("trace is in order", events[0].op == EXT2_OP_MOUNT &&
+            events[1].op == EXT2_OP_FILE_OPEN &&
+            events[2].op == EXT2_OP_FILE_WRITE &&
+            events[3].op == EXT2_OP_FILE_SEEK &&
+            events[4].op == EXT2_OP_FILE_READ);
+    test("trace has the arguments", events[2].inode == file.inode &&
+            events[2].offset == 0 && events[2].size == sizeof(buf) &&
+            events[4].offset == 100 && events[4].size == 50);
+    test("trace has the durations", events[4].duration > 0 &&
+            events[4].start >= events[3].start + events[3].duration);
+    test("nothing was slow", slow_calls == 0);
+
+    for (int i = 0; i < 10; i++)
+        ext2_file_seek(&ext2, &file, i);
+
+    n = ext2_trace_dump(&ext2, events, TRACE_SIZE);
+
+    test("trace keeps the newest calls", n == TRACE_SIZE &&
+            events[0].op == EXT2_OP_FILE_SEEK && events[0].offset == 2 &&
+            events[TRACE_SIZE - 1].offset == 9);
+
+    n = ext2_trace_dump(&ext2, events, 3);
+
+    test("dump stops at max", n == 3 && events[2].offset == 9);
+
+    slow_disk = true;
+    ext2_file_seek(&ext2, &file, 0);
+    ext2_file_read(&ext2, &file, 10, buf);
+    slow_disk = false;
+
+    test("slow calls are reported", slow_calls == 2);
+    test("trace was saved",
+            exec_cmd("grep -q \"slow %d\" %s", EXT2_OP_FILE_READ, TRACE_FILE) == 0);
+
+    ext2_get_stats(&ext2, &stats, true);
+    ext2_get_stats(&ext2, &stats, false);
+
+    test("reset clears the histograms", histogram_sum(stats.total.latency) == 0 &&
+            histogram_sum(stats.dev_latency[EXT2_DEV_READ]) == 0);
+
+    exec_cmd("rm -f %s %s", DISKIMG_FILE, TRACE_FILE);
+    return 0;
+}
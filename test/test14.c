@@ -0,0 +1,167 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+
+/*************************************
+ * Disk that counts its writes       *
+ *************************************/
+uint64_t writes;
+
+int counting_write(uint32_t start, uint32_t size, const void* buffer,
+        void* context) {
+    writes++;
+    return writeblock(start, size, buffer, context);
+}
+
+int counting_write64(uint64_t start, uint32_t size, const void* buffer,
+        void* context) {
+    writes++;
+    return writeblock64(start, size, buffer, context);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = counting_write,
+    .read64 = readblock64,
+    .write64 = counting_write64,
+    .context = DISKIMG_FILE,
+};
+
+// creates an empty image of 'size' bytes, without writing its blocks
+void new_image(uint64_t size) {
+    exec_cmd_fail("rm -f %s", DISKIMG_FILE);
+    exec_cmd_fail("truncate -s %lu %s", size, DISKIMG_FILE);
+    writes = 0;
+}
+
+int main(void) {
+    testsuite("format");
+
+    ext2_format_params_t params = {
+        .size = 8 << 20,
+        .block_size = 1024,
+        .volume_name = "trext2",
+    };
+
+    new_image(params.size);
+    ext2_error_t err = ext2_format(&cfg, &params);
+
+    test("format ok", err == 0);
+    test("filesystem is consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+    test("lost+found exists",
+            exec_cmd("debugfs %s -R \"stat lost+found\" 2>&1 | grep -q directory",
+                DISKIMG_FILE) == 0);
+    test("volume name is set",
+            exec_cmd("dumpe2fs -h %s 2>&1 | grep -q \"volume name: *trext2\"",
+                DISKIMG_FILE) == 0);
+
+    ext2_file_t file;
+    char buf[5000];
+    memset(buf, 'x', sizeof(buf));
+
+    err = ext2_mount(&ext2, &cfg);
+    ext2_mkdir(&ext2, "/dir");
+    ext2_file_open(&ext2, "/dir/file", &file);
+    ext2_file_write(&ext2, &file, sizeof(buf), buf);
+
+    test("formatted image mounts", err == 0);
+    test("files can be created", file.inode != 0);
+    test("still consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // 2 KiB blocks go through the code that isn't specialized for a block 
+    // size. The file reaches the doubly-indirect blocks
+    params.block_size = 2048;
+    new_image(params.size);
+    ext2_format(&cfg, &params);
+    ext2_mount(&ext2, &cfg);
+    ext2_file_open(&ext2, "/file", &file);
+    for (int i = 0; i < 300; i++) {
+        memset(buf, i, sizeof(buf));
+        ext2_file_write(&ext2, &file, sizeof(buf), buf);
+    }
+
+    bool same = true;
+    ext2_file_seek(&ext2, &file, 0);
+    for (int i = 0; i < 300 && same; i++) {
+        ext2_file_read(&ext2, &file, sizeof(buf), buf);
+        for (int j = 0; j < sizeof(buf); j++)
+            same = same && buf[j] == (char)i;
+    }
+
+    test("2 KiB blocks read back", same);
+    test("2 KiB blocks are consistent", 
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    params.block_size = 3000;
+    test("bad block size", ext2_format(&cfg, &params) == EXT2_ERR_BAD_FORMAT);
+
+    params.block_size = 4096;
+    params.size = 4096;
+    test("too small", ext2_format(&cfg, &params) == EXT2_ERR_BAD_FORMAT);
+
+    // lazy init: only the first and last groups are written, the rest are
+    // initialized as they get used
+    params.size = 64 << 20;
+    params.block_size = 1024;
+    params.bytes_per_inode = 65536;
+    params.lazy_init = true;
+
+    new_image(params.size);
+    err = ext2_format(&cfg, &params);
+
+    test("lazy format ok", err == 0);
+    test("lazy filesystem is consistent",
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    ext2_mount(&ext2, &cfg);
+
+    // 20 MiB spill into block groups that weren't initialized
+    char big[64 * 1024];
+    memset(big, 'y', sizeof(big));
+    ext2_file_open(&ext2, "/big", &file);
+    for (int i = 0; i < 320; i++)
+        ext2_file_write(&ext2, &file, sizeof(big), big);
+    ext2_file_close(&ext2, &file);
+
+    // each group has 128 inodes
+    char path[32];
+    for (int i = 0; i < 300; i++) {
+        sprintf(path, "/f%d", i);
+        err |= ext2_file_open(&ext2, path, &file);
+    }
+
+    test("files created in uninitialized groups", err == 0 &&
+            file.inode > 256);
+
+    ext2_check_report_t report;
+    ext2_check_params_t check_params = {
+        .workspace = malloc(ext2_check_workspace_size(&ext2)),
+    };
+    err = ext2_check(&ext2, &check_params, &report);
+    free(check_params.workspace);
+
+    test("checker finds no errors", err == 0 &&
+            report.block_bitmap_errors == 0 && report.inode_bitmap_errors == 0 &&
+            report.bad_group_counts == 0 && report.bad_super_counts == 0 &&
+            report.bad_link_counts == 0 && report.bad_block_counts == 0);
+    test("e2fsck finds no errors", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // a big image is formatted with few writes
+    params.size = 16ULL << 30;
+    params.block_size = 4096;
+    params.bytes_per_inode = 0;
+
+    new_image(params.size);
+    err = ext2_format(&cfg, &params);
+
+    test("big lazy format ok", err == 0);
+    test("big lazy format makes few writes", writes < 200);
+    test("big filesystem is consistent",
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
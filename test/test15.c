@@ -0,0 +1,215 @@
+#include "utils.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define DISKIMG_FILE "test/disk1.img"
+#define TREE_DIR "test/tree"
+#define OUT_DIR "test/out"
+#define BLOCKSZ 4096
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block);
+
+/*************************************
+ * Host tree                         *
+ *************************************/
+int host_list_dir(const char* path, int (*emit)(const ext2_import_entry_t*, void*),
+        void* arg, void* context) {
+    DIR* dir = opendir(path);
+    struct dirent* d;
+    char child[4096];
+    int err = 0;
+
+    if (dir == NULL)
+        return -1;
+
+    while (!err && (d = readdir(dir)) != NULL) {
+        struct stat st;
+
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+
+        snprintf(child, sizeof(child), "%s/%s", path, d->d_name);
+        if (lstat(child, &st)) {
+            err = -1;
+            break;
+        }
+
+        ext2_import_entry_t entry = {
+            .name = d->d_name,
+            .mode = st.st_mode,
+            .uid = st.st_uid,
+            .gid = st.st_gid,
+            .size = st.st_size,
+            .mtime = st.st_mtime,
+        };
+        err = emit(&entry, arg);
+    }
+
+    closedir(dir);
+    return err;
+}
+
+int host_read_file(const char* path, uint64_t offset, uint32_t size, void* buffer,
+        void* context) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    ssize_t n = pread(fd, buffer, size, offset);
+    close(fd);
+
+    return (n == size) ? 0 : -1;
+}
+
+// runs every task on its own thread
+int parallel_calls = 0;
+
+typedef struct {
+    void (*task)(uint32_t, void*);
+    void* arg;
+    uint32_t index;
+} thread_arg_t;
+
+void* run_task(void* p) {
+    thread_arg_t* t = p;
+    t->task(t->index, t->arg);
+    return NULL;
+}
+
+void parallel_for(void (*task)(uint32_t, void*), void* arg, uint32_t count,
+        void* context) {
+    pthread_t threads[count];
+    thread_arg_t args[count];
+
+    parallel_calls++;
+    for (uint32_t i = 0; i < count; i++) {
+        args[i] = (thread_arg_t){ task, arg, i };
+        pthread_create(&threads[i], NULL, run_task, &args[i]);
+    }
+    for (uint32_t i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+}
+
+void make_host_file(const char* name, uint32_t size) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", TREE_DIR, name);
+
+    FILE* f = fopen(path, "w");
+    for (uint32_t i = 0; i < size; i++)
+        fputc(rand(), f);
+    fclose(f);
+}
+
+void make_tree(void) {
+    char name[64];
+
+
+    exec_cmd_fail("rm -rf %s && mkdir -p %s/a/b/c/d/e %s/empty %s/big",
+            TREE_DIR, TREE_DIR, TREE_DIR, TREE_DIR);
+
+    for (int i = 0; i < 40; i++) {
+        sprintf(name, "a/small%d", i);
+        make_host_file(name, i * 300);
+    }
+
+    // enough entries for a directory of several blocks
+    for (int i = 0; i < 300; i++) {
+        sprintf(name, "big/file_with_a_long_name_%d", i);
+        make_host_file(name, i);
+    }
+
+    make_host_file("a/b/c/d/e/large", 3000000);
+    exec_cmd_fail("ln -s small1 %s/a/link", TREE_DIR);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+};
+
+uint64_t workspace[64 * 1024];
+uint8_t buffer[256 * 1024];
+
+ext2_import_params_t params = {
+    .list_dir = host_list_dir,
+    .read_file = host_read_file,
+    .workspace = workspace,
+    .workspace_size = sizeof(workspace),
+    .buffer = buffer,
+    .buffer_size = sizeof(buffer),
+    .parallel_for = parallel_for,
+};
+
+int main(void) {
+    testsuite("import tree");
+
+    make_tree();
+
+    ext2_format_params_t format = { .size = 64 << 20, .block_size = BLOCKSZ };
+    exec_cmd_fail("rm -f %s && truncate -s %lu %s", DISKIMG_FILE, format.size,
+            DISKIMG_FILE);
+    ext2_format(&cfg, &format);
+    ext2_mount(&ext2, &cfg);
+    ext2_mkdir(&ext2, "/imp");
+
+    ext2_error_t err = ext2_import_tree(&ext2, TREE_DIR, "/imp", &params);
+
+    test("import ok", err == 0);
+    test("reads and writes overlapped", parallel_calls > 0);
+    test("filesystem is consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    exec_cmd_fail("rm -rf %s && mkdir %s", OUT_DIR, OUT_DIR);
+    exec_cmd_fail("debugfs %s -R \"rdump /imp %s\" 2>/dev/null", DISKIMG_FILE,
+            OUT_DIR);
+
+    test("files have the host contents", exec_cmd("diff -r --no-dereference "
+                "-x link %s %s/imp", TREE_DIR, OUT_DIR) == 0);
+    test("other files are skipped",
+            exec_cmd("test -e %s/imp/a/link", OUT_DIR) != 0);
+
+    ext2_file_t file;
+    uint32_t first, last;
+    ext2_file_open(&ext2, "/imp/a/b/c/d/e/large", &file);
+    block_map(&ext2, file.inode, 0, &first);
+    block_map(&ext2, file.inode, 3000000 - 1, &last);
+
+    test("file data is a single run", last - first == 3000000 / BLOCKSZ);
+
+    // without parallel_for, into the root directory
+    params.parallel_for = NULL;
+    parallel_calls = 0;
+    err = ext2_import_tree(&ext2, TREE_DIR "/a", "/", &params);
+
+    test("sequential import ok", err == 0 && parallel_calls == 0);
+    test("still consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    ext2_dir_t dir;
+    test("imported into the root",
+            ext2_dir_open(&ext2, "/b/c/d/e", &dir) == 0);
+
+    err = ext2_import_tree(&ext2, TREE_DIR, "/imp", &params);
+    test("names that exist are refused", err == EXT2_ERR_FILE_EXISTS);
+
+    ext2_mkdir(&ext2, "/small");
+    params.workspace_size = 4 * BLOCKSZ;
+    err = ext2_import_tree(&ext2, TREE_DIR, "/small", &params);
+    test("small workspace is refused", err == EXT2_ERR_BUFFER_TOO_SMALL);
+
+    params.workspace_size = sizeof(workspace);
+    test("destination must be a dir", ext2_import_tree(&ext2, TREE_DIR,
+                "/imp/a/small1", &params) == EXT2_ERR_NOT_A_DIR);
+
+    params.buffer_size = BLOCKSZ;
+    err = ext2_import_tree(&ext2, TREE_DIR, "/small", &params);
+    test("small buffer is refused", err == EXT2_ERR_BUFFER_TOO_SMALL);
+
+    exec_cmd("rm -rf %s %s %s", DISKIMG_FILE, TREE_DIR, OUT_DIR);
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define FILE_BLOCKS 300
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block);
+ext2_error_t get_inode_address(ext2_t* ext2, uint32_t inode, uint64_t* addr);
+
+// writes that cover this address fail, if it's set
+uint64_t fail_addr;
+
+int failing_write(uint32_t start, uint32_t size, const void* buffer,
+        void* context) {
+    if (fail_addr && start <= fail_addr && fail_addr < (uint64_t)start + size)
+        return -1;
+
+    return writeblock(start, size, buffer, context);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = failing_write,
+    .context = DISKIMG_FILE,
+};
+
+// Writes two files a block at a time, taking turns, so their blocks end up
+// interleaved. Block i of a file is filled with 'tag' + i
+void write_interleaved(const char* path1, const char* path2,
+        ext2_file_t* f1, ext2_file_t* f2) {
+    char block[BLOCKSZ];
+
+    ext2_file_open(&ext2, path1, f1);
+    ext2_file_open(&ext2, path2, f2);
+
+    for (int i = 0; i < FILE_BLOCKS; i++) {
+        memset(block, 'a' + i % 26, sizeof(block));
+        ext2_file_write(&ext2, f1, sizeof(block), block);
+        memset(block, 'A' + i % 26, sizeof(block));
+        ext2_file_write(&ext2, f2, sizeof(block), block);
+    }
+}
+
+bool contents_ok(ext2_file_t* file, char tag) {
+    char block[BLOCKSZ];
+
+    ext2_file_seek(&ext2, file, 0);
+    for (int i = 0; i < FILE_BLOCKS; i++) {
+        ext2_file_read(&ext2, file, sizeof(block), block);
+        for (int j = 0; j < BLOCKSZ; j++)
+            if (block[j] != tag + i % 26)
+                return false;
+    }
+
+    return true;
+}
+
+// the data of the file is in a single run of blocks
+bool is_contiguous(ext2_file_t* file) {
+    uint32_t first, block;
+    block_map(&ext2, file->inode, 0, &first);
+
+    for (int i = 1; i < FILE_BLOCKS; i++) {
+        block_map(&ext2, file->inode, (uint64_t)i * BLOCKSZ, &block);
+        if (block != first + i)
+            return false;
+    }
+
+    return true;
+}
+
+int main(void) {
+    testsuite("defrag");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=8192", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+
+    ext2_mount(&ext2, &cfg);
+
+    ext2_file_t a, b;
+    write_interleaved("/a", "/b", &a, &b);
+
+    test("files start fragmented", !is_contiguous(&a) && !is_contiguous(&b));
+
+    ext2_defrag_params_t params = {0};
+    ext2_defrag_report_t report;
+    ext2_error_t err = ext2_defrag(&ext2, &params, &report);
+
+    test("defrag ok", err == 0 && report.next_inode == 0);
+    test("fragmented files are found", report.files_fragmented == 2);
+    test("fragmented files are moved", report.files_moved == 2 &&
+            report.blocks_moved == 2 * FILE_BLOCKS);
+    test("files are contiguous", is_contiguous(&a) && is_contiguous(&b));
+    test("contents are kept", contents_ok(&a, 'a') && contents_ok(&b, 'A'));
+    test("filesystem is consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    err = ext2_defrag(&ext2, &params, &report);
+    test("nothing left to do", err == 0 && report.files_fragmented == 0 &&
+            report.files_moved == 0);
+
+    // with a budget for about one file, the work is split in several calls
+    ext2_file_t c, d;
+    write_interleaved("/c", "/d", &c, &d);
+
+    params.io_budget = 3 * FILE_BLOCKS * BLOCKSZ;
+    err = ext2_defrag(&ext2, &params, &report);
+
+    test("budget stops the defrag", err == 0 && report.next_inode != 0 &&
+            report.files_moved == 1);
+    test("budget is respected", report.io_bytes <= params.io_budget);
+
+    uint32_t calls = 1;
+    while (report.next_inode != 0 && calls < 10) {
+        params.start_inode = report.next_inode;
+        err |= ext2_defrag(&ext2, &params, &report);
+        calls++;
+    }
+
+    test("later calls continue", err == 0 && report.next_inode == 0 &&
+            is_contiguous(&c) && is_contiguous(&d));
+
+    ext2_file_t e, f;
+    write_interleaved("/e", "/f", &e, &f);
+    params = (ext2_defrag_params_t){ .io_budget = 100 * BLOCKSZ };
+    ext2_defrag(&ext2, &params, &report);
+
+    test("files bigger than the budget are skipped", 
+            report.files_skipped == 2 && report.files_moved == 0);
+
+    // compaction: freeing a file at the start leaves a hole that the files
+    // after it move into
+    params = (ext2_defrag_params_t){0};
+    ext2_defrag(&ext2, &params, &report);
+
+    uint32_t before;
+    block_map(&ext2, d.inode, 0, &before);
+    ext2_file_truncate(&ext2, &a, 0);
+
+    ext2_defrag(&ext2, &params, &report);
+    uint32_t after;
+    block_map(&ext2, d.inode, 0, &after);
+    test("without compact, contiguous files stay", after == before);
+
+    params.compact = true;
+    err = ext2_defrag(&ext2, &params, &report);
+    block_map(&ext2, d.inode, 0, &after);
+
+    test("compact ok", err == 0 && report.files_moved > 0);
+    test("files move toward the start of the group", after < before);
+    test("contents are kept after compacting", contents_ok(&c, 'a') &&
+            contents_ok(&d, 'A') && contents_ok(&b, 'A'));
+    test("still consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // the inode can't be written once the data is copied, so the move is 
+    // undone and its new blocks are given back
+    ext2_file_t g, h;
+    write_interleaved("/g", "/h", &g, &h);
+    get_inode_address(&ext2, g.inode, &fail_addr);
+    uint32_t free_blocks = ext2.superblk.free_blocks_count;
+
+    params = (ext2_defrag_params_t){0};
+    err = ext2_defrag(&ext2, &params, &report);
+    fail_addr = 0;
+
+    test("failed move is reported", err != 0 && report.files_moved == 0);
+    test("its blocks are given back", 
+            ext2.superblk.free_blocks_count == free_blocks);
+    test("file is left where it was", !is_contiguous(&g) && 
+            contents_ok(&g, 'a'));
+    test("consistent after the failure", 
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
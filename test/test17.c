@@ -0,0 +1,175 @@
+#include "utils.h"
+#include <pthread.h>
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define MAX_INODES 4096
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block);
+
+/*************************************
+ * Disk with a block that can't be   *
+ * read                              *
+ *************************************/
+uint32_t bad_block;
+
+int failing_read(uint32_t start, uint32_t size, void* buffer, void* context) {
+    uint64_t bad = (uint64_t)bad_block * BLOCKSZ;
+
+    if (bad_block != 0 && start < bad + BLOCKSZ && bad < (uint64_t)start + size)
+        return -1;
+
+    return readblock(start, size, buffer, context);
+}
+
+// runs every task on its own thread
+typedef struct {
+    void (*task)(uint32_t, void*);
+    void* arg;
+    uint32_t index;
+} thread_arg_t;
+
+void* run_task(void* p) {
+    thread_arg_t* t = p;
+    t->task(t->index, t->arg);
+    return NULL;
+}
+
+void parallel_for(void (*task)(uint32_t, void*), void* arg, uint32_t count,
+        void* context) {
+    pthread_t threads[count];
+    thread_arg_t args[count];
+
+    for (uint32_t i = 0; i < count; i++) {
+        args[i] = (thread_arg_t){ task, arg, i };
+        pthread_create(&threads[i], NULL, run_task, &args[i]);
+    }
+    for (uint32_t i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+}
+
+// digests reported by the scrub, by inode
+ext2_scrub_file_t seen[MAX_INODES];
+
+void on_file(const ext2_scrub_file_t* file, void* context) {
+    if (file->inode < MAX_INODES)
+        seen[file->inode] = *file;
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = failing_read,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+};
+
+// creates a file with 'size' bytes of pseudo-random data and returns its crc
+uint32_t make_file(const char* path, uint32_t size, ext2_file_t* file) {
+    uint8_t* data = malloc(size + 1);
+    for (uint32_t i = 0; i < size; i++)
+        data[i] = rand();
+
+    ext2_file_open(&ext2, path, file);
+    ext2_file_write(&ext2, file, size, data);
+    ext2_file_close(&ext2, file);
+
+    uint32_t crc = ext2_crc32c(0, data, size);
+    free(data);
+    return crc;
+}
+
+ext2_error_t scrub(ext2_scrub_params_t* params, ext2_scrub_report_t* report) {
+    memset(seen, 0, sizeof(seen));
+    params->workspace = malloc(ext2_scrub_workspace_size(&ext2, params));
+    ext2_error_t err = ext2_scrub(&ext2, params, report);
+    free(params->workspace);
+
+    return err;
+}
+
+int main(void) {
+    testsuite("scrub");
+
+    test("crc32c of the check string",
+            ext2_crc32c(0, "123456789", 9) == 0xE3069283);
+    test("crc32c can be computed in pieces",
+            ext2_crc32c(ext2_crc32c(0, "1234", 4), "56789", 5) == 0xE3069283);
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=8192", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+    ext2_mount(&ext2, &cfg);
+
+    ext2_file_t empty, small, exact, big, sparse;
+    uint32_t crc_empty = make_file("/empty", 0, &empty);
+    uint32_t crc_small = make_file("/small", 100, &small);
+    uint32_t crc_exact = make_file("/exact", 3 * BLOCKSZ, &exact);
+    uint32_t crc_big = make_file("/big", 300 * BLOCKSZ + 17, &big);
+
+    // a hole of 100 blocks, then 10 bytes
+    char tail[10] = "0123456789";
+    char zeros[BLOCKSZ] = {0};
+    ext2_file_open(&ext2, "/sparse", &sparse);
+    ext2_file_truncate(&ext2, &sparse, 100 * BLOCKSZ);
+    ext2_file_seek(&ext2, &sparse, 100 * BLOCKSZ);
+    ext2_file_write(&ext2, &sparse, sizeof(tail), tail);
+    ext2_file_close(&ext2, &sparse);
+
+    uint32_t crc_sparse = 0;
+    for (int i = 0; i < 100; i++)
+        crc_sparse = ext2_crc32c(crc_sparse, zeros, BLOCKSZ);
+    crc_sparse = ext2_crc32c(crc_sparse, tail, sizeof(tail));
+
+    ext2_scrub_params_t params = { .on_file = on_file };
+    ext2_scrub_report_t report;
+    ext2_error_t err = scrub(&params, &report);
+
+    uint32_t allocated = ext2.superblk.blocks_count -
+        ext2.superblk.first_data_block - ext2.superblk.free_blocks_count;
+
+    test("scrub ok", err == 0 && report.bad_blocks == 0 && report.bad_files == 0);
+    test("every allocated block is read", report.blocks_read == allocated);
+    test("reads are big", report.bytes_read / BLOCKSZ >= allocated &&
+            ext2.stats.ops[EXT2_OP_SCRUB].dev_reads < allocated / 4);
+    test("every file is seen", report.files == 5);
+    test("digests match the contents",
+            seen[empty.inode].crc32c == crc_empty &&
+            seen[small.inode].crc32c == crc_small &&
+            seen[exact.inode].crc32c == crc_exact &&
+            seen[big.inode].crc32c == crc_big);
+    test("holes are digested as zeros", seen[sparse.inode].crc32c == crc_sparse &&
+            seen[sparse.inode].size == 100 * BLOCKSZ + sizeof(tail));
+
+    params.parallel_for = parallel_for;
+    params.workers = 4;
+    params.chunk_size = 8 * BLOCKSZ;
+    ext2_scrub_report_t parallel;
+    err = scrub(&params, &parallel);
+
+    test("parallel scrub ok", err == 0 && parallel.blocks_read == allocated &&
+            parallel.files == 5);
+    test("parallel digests are the same", seen[big.inode].crc32c == crc_big &&
+            seen[sparse.inode].crc32c == crc_sparse);
+
+    // a block in the middle of a file that can't be read
+    uint32_t block;
+    block_map(&ext2, big.inode, 150 * BLOCKSZ, &block);
+    bad_block = block;
+    err = scrub(&params, &report);
+
+    test("bad block doesn't stop the scrub", err == 0);
+    test("bad block is counted", report.bad_blocks == 1 &&
+            report.blocks_read == allocated - 1);
+    test("file with the bad block is reported", report.bad_files == 1 &&
+            seen[big.inode].bad_blocks == 1 && seen[small.inode].bad_blocks == 0 &&
+            seen[small.inode].crc32c == crc_small);
+    bad_block = 0;
+
+    params.chunk_size = BLOCKSZ / 2;
+    test("chunk smaller than a block is refused",
+            scrub(&params, &report) == EXT2_ERR_BUFFER_TOO_SMALL);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define CACHE_BLOCKS 64
+#define CACHE_NAMES 32
+#define ALIGN 4096
+
+/*************************************
+ * Disk that counts its reads        *
+ *************************************/
+uint64_t reads;
+
+int counting_read(uint32_t start, uint32_t size, void* buffer, void* context) {
+    reads++;
+    return readblock(start, size, buffer, context);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = counting_read,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+    .arena_align = ALIGN,
+    .cache_blocks = CACHE_BLOCKS,
+    .cache_names = CACHE_NAMES,
+};
+
+int main(void) {
+    testsuite("arena and caches");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=8192", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+
+    uint64_t size = ext2_arena_size(BLOCKSZ, CACHE_BLOCKS, CACHE_NAMES, ALIGN);
+    void* arena = aligned_alloc(ALIGN, size);
+    cfg.arena = arena;
+    cfg.arena_size = size - 1;
+
+    test("small arena is refused",
+            ext2_mount(&ext2, &cfg) == EXT2_ERR_BUFFER_TOO_SMALL);
+
+    cfg.arena_size = size;
+    ext2_error_t err = ext2_mount(&ext2, &cfg);
+
+    ext2_memory_stats_t mem;
+    ext2_get_memory_stats(&ext2, &mem);
+
+    test("mount with an arena", err == 0);
+    test("the pools take the whole arena", mem.arena_used == size &&
+            mem.blocks == CACHE_BLOCKS && mem.names == CACHE_NAMES);
+    test("block buffers are aligned", (uintptr_t)ext2.cache->data % ALIGN == 0);
+
+    // a tree that is written and read back through the caches
+    char path[64], buf[3000], back[3000];
+    ext2_file_t file;
+
+    ext2_mkdir(&ext2, "/a");
+    ext2_mkdir(&ext2, "/a/b");
+    for (int i = 0; i < 100; i++) {
+        sprintf(path, "/a/b/file%d", i);
+        memset(buf, i, sizeof(buf));
+        err |= ext2_file_open(&ext2, path, &file);
+        err |= ext2_file_write(&ext2, &file, sizeof(buf), buf);
+        err |= ext2_file_close(&ext2, &file);
+    }
+
+    test("files are written", err == 0);
+    test("filesystem is consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+    exec_cmd("rm -f test/file7 && debugfs %s -R \"dump /a/b/file7 test/file7\"",
+            DISKIMG_FILE);
+    FILE* f = fopen("test/file7", "r");
+    size_t n = f ? fread(back, 1, sizeof(back), f) : 0;
+    memset(buf, 7, sizeof(buf));
+    test("contents reach the disk", n == sizeof(back) && 
+            memcmp(buf, back, sizeof(buf)) == 0);
+    if (f)
+        fclose(f);
+
+    bool same = true;
+    for (int i = 0; i < 100; i++) {
+        sprintf(path, "/a/b/file%d", i);
+        memset(buf, i, sizeof(buf));
+        ext2_file_open(&ext2, path, &file);
+        ext2_file_read(&ext2, &file, sizeof(back), back);
+        same = same && memcmp(buf, back, sizeof(buf)) == 0;
+    }
+
+    test("files read back", same);
+
+    // the same small reads again are served from memory
+    reads = 0;
+    ext2_file_open(&ext2, "/a/b/file1", &file);
+    for (int i = 0; i < 100; i++) {
+        ext2_file_seek(&ext2, &file, 0);
+        ext2_file_read(&ext2, &file, 16, back);
+    }
+
+    ext2_get_memory_stats(&ext2, &mem);
+    test("repeated reads hit the cache", reads < 10 && mem.block_hits > 100);
+    test("paths hit the name cache", mem.name_hits > 0);
+    test("high-water marks stay in the pools", mem.blocks_high <= CACHE_BLOCKS &&
+            mem.blocks_used <= mem.blocks_high && mem.names_high <= CACHE_NAMES &&
+            mem.blocks_high > 0 && mem.names_high > 0);
+
+    // truncating and rewriting replaces what's cached
+    ext2_file_truncate(&ext2, &file, 0);
+    memset(buf, 'z', sizeof(buf));
+    ext2_file_write(&ext2, &file, sizeof(buf), buf);
+    ext2_file_seek(&ext2, &file, 0);
+    ext2_file_read(&ext2, &file, sizeof(back), back);
+
+    test("writes update the cache", memcmp(buf, back, sizeof(buf)) == 0);
+    test("still consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // without an arena nothing is cached
+    cfg.arena = NULL;
+    ext2_mount(&ext2, &cfg);
+    ext2_get_memory_stats(&ext2, &mem);
+    test("no arena, no caches", mem.arena_used == 0 && mem.blocks == 0);
+
+    free(arena);
+    exec_cmd("rm -f %s test/file7", DISKIMG_FILE);
+    return 0;
+}
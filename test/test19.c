@@ -0,0 +1,266 @@
+#include "utils.h"
+#include <pthread.h>
+#include <unistd.h>
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define FS_BLOCKS 8192
+#define LOG_START ((uint64_t)FS_BLOCKS * BLOCKSZ)
+#define LOG_SIZE (256 * BLOCKSZ)
+#define TXN_BLOCKS 128
+#define WRITERS 4
+#define WRITER_BLOCKS 500
+
+/*************************************
+ * Disk that records its writes and  *
+ * can crash                         *
+ *************************************/
+uint64_t addrs[1024];
+_Atomic uint32_t writes;
+bool crash;  // home writes fail, as if the power went out after the log
+bool read_during_write; // the next write waits for a read from another thread
+bool slow;   // writes take a while, so other threads wait for commits
+
+_Atomic bool read_done;
+bool read_ok;
+pthread_t read_thread;
+
+void* read_dir(void* path);
+
+int recording_write(uint32_t start, uint32_t size, const void* buffer,
+        void* context) {
+    if (crash && start < LOG_START)
+        return -1;
+
+    // up to a second, then the write goes on without it
+    if (read_during_write) {
+        read_during_write = false;
+        pthread_create(&read_thread, NULL, read_dir, "/late0");
+        for (int i = 0; i < 1000 && !read_done; i++)
+            usleep(1000);
+    }
+
+    if (slow)
+        usleep(100);
+
+    uint32_t n = writes++;
+    if (n < 1024)
+        addrs[n] = start;
+
+    return writeblock(start, size, buffer, context);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = recording_write,
+    .context = DISKIMG_FILE,
+    .log_start = LOG_START,
+    .log_size = LOG_SIZE,
+};
+
+bool exists(const char* path) {
+    ext2_dir_t dir;
+    return ext2_dir_open(&ext2, path, &dir) == 0;
+}
+
+void* read_dir(void* path) {
+    read_ok = exists(path);
+    read_done = true;
+    return NULL;
+}
+
+// Overwrites the blocks of its file one by one, each with its number, while
+// transactions are committed and begun again
+_Atomic int writers_done;
+_Atomic int write_errors;
+
+void* writer(void* arg) {
+    uint8_t block[BLOCKSZ];
+    ext2_file_t* file = arg;
+
+    for (int b = 0; b < WRITER_BLOCKS; b++) {
+        memset(block, b & 0xFF, sizeof(block));
+        if (ext2_file_seek(&ext2, file, b * BLOCKSZ) != 0 ||
+                ext2_file_write(&ext2, file, BLOCKSZ, block) != 0)
+            write_errors++;
+    }
+
+    writers_done++;
+    return NULL;
+}
+
+// makes /name0 .. /name<count - 1>
+ext2_error_t make_dirs(const char* name, int count) {
+    char path[64];
+    ext2_error_t err = 0;
+
+    for (int i = 0; i < count; i++) {
+        sprintf(path, "/%s%d", name, i);
+        err |= ext2_mkdir(&ext2, path);
+    }
+
+    return err;
+}
+
+int main(void) {
+    testsuite("transactions");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=%d", DISKIMG_FILE, BLOCKSZ,
+            FS_BLOCKS + LOG_SIZE / BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s %d", BLOCKSZ, DISKIMG_FILE, FS_BLOCKS);
+    ext2_mount(&ext2, &cfg);
+
+    uint64_t size = ext2_txn_buffer_size(BLOCKSZ, TXN_BLOCKS);
+    void* buffer = aligned_alloc(8, size);
+
+    test("small buffer is refused",
+            ext2_txn_begin(&ext2, buffer, BLOCKSZ) == EXT2_ERR_BUFFER_TOO_SMALL);
+    test("commit without a transaction",
+            ext2_txn_commit(&ext2) == EXT2_ERR_TXN_STATE);
+
+    ext2_error_t err = ext2_txn_begin(&ext2, buffer, size);
+    test("begin ok", err == 0 && ext2.txn.capacity == TXN_BLOCKS);
+    test("only one transaction at a time",
+            ext2_txn_begin(&ext2, buffer, size) == EXT2_ERR_TXN_STATE);
+
+    writes = 0;
+    err = make_dirs("dir", 20);
+
+    ext2_file_t file;
+    err |= ext2_file_open(&ext2, "/dir3/small", &file);
+    err |= ext2_file_write(&ext2, &file, 5, "hello");
+    err |= ext2_file_close(&ext2, &file);
+
+    char back[5];
+    ext2_file_open(&ext2, "/dir3/small", &file);
+    ext2_file_read(&ext2, &file, sizeof(back), back);
+
+    test("operations ok", err == 0);
+    test("nothing reaches the device", writes == 0);
+    test("changes are seen before the commit", exists("/dir19") &&
+            memcmp(back, "hello", 5) == 0);
+
+    err = ext2_txn_commit(&ext2);
+
+    // the log, the home blocks in order, then the log is cleared
+    bool sorted = writes >= 3 && addrs[0] == LOG_START &&
+        addrs[writes - 1] == LOG_START;
+    for (uint32_t i = 2; i < writes - 1; i++)
+        sorted = sorted && addrs[i] > addrs[i - 1] && addrs[i] < LOG_START;
+
+    test("commit ok", err == 0);
+    test("blocks go out sorted", sorted);
+    test("a block is written once", writes < 40);
+    test("filesystem is consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+    test("changes reach the disk", exec_cmd("debugfs -R \"stat /dir19\" %s 2>&1 "
+                "| grep -q Inode:", DISKIMG_FILE) == 0);
+
+    // the power goes out after the log is written
+    ext2_txn_begin(&ext2, buffer, size);
+    make_dirs("crash", 10);
+    crash = true;
+    err = ext2_txn_commit(&ext2);
+    crash = false;
+
+    test("crashed commit fails", err != 0);
+
+    // a read-only mount can't finish the commit, and the home blocks are
+    // from before it
+    ext2_config_t rdonly = cfg;
+    rdonly.flags = EXT2_MOUNT_RDONLY;
+    writes = 0;
+    test("read-only mount refuses the log",
+            ext2_mount(&ext2, &rdonly) == EXT2_ERR_LOG_PENDING && writes == 0);
+
+    ext2_mount(&ext2, &cfg);
+    test("mount replays the log", exists("/crash9") && exists("/dir0"));
+    test("replayed filesystem is consistent",
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // same, but the log is damaged, so it's ignored
+    ext2_txn_begin(&ext2, buffer, size);
+    make_dirs("torn", 10);
+    crash = true;
+    ext2_txn_commit(&ext2);
+    crash = false;
+
+    FILE* f = fopen(DISKIMG_FILE, "r+");
+    fseek(f, LOG_START + 5 * BLOCKSZ, SEEK_SET);
+    fputc(0x55, f);
+    fclose(f);
+
+    ext2_mount(&ext2, &cfg);
+    test("damaged log is ignored", !exists("/torn0") && exists("/crash0"));
+    test("filesystem is left as before",
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // a buffer of 4 blocks fills up and is committed early
+    ext2_txn_begin(&ext2, buffer, ext2_txn_buffer_size(BLOCKSZ, 4));
+    err = make_dirs("many", 50);
+    err |= ext2_txn_commit(&ext2);
+
+    test("full buffer is committed early", err == 0 && exists("/many49"));
+    test("still consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // commits don't hold the transaction's lock while they write
+    ext2_txn_begin(&ext2, buffer, ext2_txn_buffer_size(BLOCKSZ, TXN_BLOCKS));
+    err = make_dirs("late", 1);
+    read_during_write = true;
+    err |= ext2_txn_commit(&ext2);
+    bool in_time = read_done;
+    pthread_join(read_thread, NULL);
+
+    test("staged blocks are read during the commit", err == 0 && in_time &&
+            read_ok);
+
+    // writers that find a transaction open while it's committed don't stage 
+    // into it afterwards
+    static uint8_t zeros[WRITER_BLOCKS * BLOCKSZ];
+    ext2_file_t files[WRITERS];
+    pthread_t threads[WRITERS];
+    char path[64];
+
+    for (int i = 0; i < WRITERS; i++) {
+        sprintf(path, "/race%d", i);
+        ext2_file_open(&ext2, path, &files[i]);
+        ext2_file_write(&ext2, &files[i], sizeof(zeros), zeros);
+    }
+
+    slow = true;
+    for (int i = 0; i < WRITERS; i++)
+        pthread_create(&threads[i], NULL, writer, &files[i]);
+
+    int commits = 0;
+    err = 0;
+    while (writers_done < WRITERS) {
+        err |= ext2_txn_begin(&ext2, buffer, size);
+        err |= ext2_txn_commit(&ext2);
+        commits++;
+    }
+
+    for (int i = 0; i < WRITERS; i++)
+        pthread_join(threads[i], NULL);
+    slow = false;
+
+    bool right = true;
+    static uint8_t back_blocks[WRITER_BLOCKS * BLOCKSZ];
+    for (int i = 0; i < WRITERS; i++) {
+        ext2_file_seek(&ext2, &files[i], 0);
+        ext2_file_read(&ext2, &files[i], sizeof(back_blocks), back_blocks);
+
+        for (int b = 0; b < WRITER_BLOCKS; b++)
+            for (int j = 0; j < BLOCKSZ; j++)
+                right = right && back_blocks[b * BLOCKSZ + j] == (b & 0xFF);
+    }
+
+    test("commits race with writers", err == 0 && write_errors == 0 &&
+            commits > 1 && right);
+    test("consistent after the race", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    free(buffer);
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include "utils.h"
+#include <pthread.h>
+#define DISKIMG_FILE "test/disk1.img"
+#define COPY_FILE "test/disk1.orig"
+#define BLOCKSZ 1024
+#define FILES 16
+#define THREADS 8
+
+/*************************************
+ * Disk that counts its accesses     *
+ *************************************/
+uint64_t reads, writes, locks;
+
+int counting_read(uint32_t start, uint32_t size, void* buffer, void* context) {
+    __atomic_add_fetch(&reads, 1, __ATOMIC_RELAXED);
+    return readblock(start, size, buffer, context);
+}
+
+int counting_write(uint32_t start, uint32_t size, const void* buffer,
+        void* context) {
+    writes++;
+    return writeblock(start, size, buffer, context);
+}
+
+void counting_lock(ext2_lock_kind_t kind, uint32_t id, bool exclusive,
+        void* context) {
+    locks++;
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = counting_read,
+    .write = counting_write,
+    .context = DISKIMG_FILE,
+    .lock = counting_lock,
+    .unlock = counting_lock,
+};
+
+uint8_t arena[256 * 1024] __attribute__((aligned(64)));
+
+// threads read every file and check its contents
+void* reader(void* arg) {
+    char path[64], buf[2000];
+    bool* ok = arg;
+
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < FILES; i++) {
+            ext2_file_t file;
+            sprintf(path, "/dir/file%d", i);
+
+            if (ext2_file_open(&ext2, path, &file) != 0 ||
+                    ext2_file_read(&ext2, &file, sizeof(buf), buf) != 0) {
+                *ok = false;
+                continue;
+            }
+
+            for (uint32_t j = 0; j < sizeof(buf); j++)
+                if (buf[j] != (char)(i + j))
+                    *ok = false;
+        }
+    }
+
+    return NULL;
+}
+
+int main(void) {
+    testsuite("read-only mount");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=8192", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+
+    // an image with some files, made by a normal mount
+    cfg.lock = cfg.unlock = NULL;
+    ext2_mount(&ext2, &cfg);
+    ext2_mkdir(&ext2, "/dir");
+
+    char path[64], buf[2000];
+    for (int i = 0; i < FILES; i++) {
+        ext2_file_t file;
+        sprintf(path, "/dir/file%d", i);
+        for (uint32_t j = 0; j < sizeof(buf); j++)
+            buf[j] = i + j;
+
+        ext2_file_open(&ext2, path, &file);
+        ext2_file_write(&ext2, &file, sizeof(buf), buf);
+        ext2_file_close(&ext2, &file);
+    }
+
+    exec_cmd_fail("cp %s %s", DISKIMG_FILE, COPY_FILE);
+
+    cfg.lock = cfg.unlock = counting_lock;
+    cfg.flags = EXT2_MOUNT_RDONLY;
+    cfg.arena = arena;
+    cfg.arena_size = sizeof(arena);
+    cfg.arena_align = 64;
+    cfg.cache_blocks = 64;
+    cfg.cache_names = 64;
+    writes = 0;
+
+    ext2_error_t err = ext2_mount(&ext2, &cfg);
+    test("read-only mount ok", err == 0);
+
+    ext2_file_t file, other;
+    err = ext2_file_open(&ext2, "/dir/file3", &file);
+    err |= ext2_file_read(&ext2, &file, sizeof(buf), buf);
+    test("files can be read", err == 0 && buf[0] == 3 && buf[1999] == (char)2002);
+
+    test("missing files aren't created",
+            ext2_file_open(&ext2, "/dir/missing", &other) == EXT2_ERR_FILE_NOT_FOUND &&
+            ext2_file_open(&ext2, "/dir/missing", &other) == EXT2_ERR_FILE_NOT_FOUND);
+
+    ext2_file_open(&ext2, "/dir/file4", &other);
+    ext2_file_seek(&ext2, &file, 0);
+
+    test("writes are refused",
+            ext2_file_write(&ext2, &file, 5, "hello") == EXT2_ERR_READ_ONLY);
+    test("truncate is refused",
+            ext2_file_truncate(&ext2, &file, 0) == EXT2_ERR_READ_ONLY);
+    test("fallocate is refused",
+            ext2_file_fallocate(&ext2, &file, 0, 10000) == EXT2_ERR_READ_ONLY);
+    test("copies are refused", ext2_copy_file_range(&ext2, &file, 0, &other, 0,
+                100) == EXT2_ERR_READ_ONLY);
+    test("mkdir is refused", ext2_mkdir(&ext2, "/new") == EXT2_ERR_READ_ONLY);
+
+    uint8_t txn_buf[8192];
+    test("transactions are refused", ext2_txn_begin(&ext2, txn_buf,
+                sizeof(txn_buf)) == EXT2_ERR_READ_ONLY);
+
+    ext2_defrag_params_t defrag = {0};
+    ext2_defrag_report_t defrag_report;
+    test("defrag is refused",
+            ext2_defrag(&ext2, &defrag, &defrag_report) == EXT2_ERR_READ_ONLY);
+
+    ext2_check_params_t check = { .repair = true };
+    ext2_check_report_t check_report;
+    check.workspace = malloc(ext2_check_workspace_size(&ext2));
+    test("repair is refused",
+            ext2_check(&ext2, &check, &check_report) == EXT2_ERR_READ_ONLY);
+    check.repair = false;
+    test("check still works", ext2_check(&ext2, &check, &check_report) == 0 &&
+            check_report.block_bitmap_errors == 0 && check_report.repaired == 0);
+    free(check.workspace);
+
+    test("format is refused", ext2_format(&cfg, &(ext2_format_params_t){
+                .size = 8192 * BLOCKSZ, .block_size = BLOCKSZ }) == EXT2_ERR_READ_ONLY);
+
+    // misses are cached too, so a missing name needs no device access
+    ext2_memory_stats_t before, after;
+    ext2_get_memory_stats(&ext2, &before);
+    uint64_t reads_before = reads;
+    ext2_file_open(&ext2, "/dir/missing", &other);
+    ext2_get_memory_stats(&ext2, &after);
+
+    test("missing names are cached", reads == reads_before &&
+            after.name_hits > before.name_hits);
+
+    bool ok[THREADS];
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ok[i] = true;
+        pthread_create(&threads[i], NULL, reader, &ok[i]);
+    }
+
+    bool all_ok = true;
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        all_ok = all_ok && ok[i];
+    }
+
+    test("threads read without locks", all_ok && locks == 0);
+    test("device is never written", writes == 0 &&
+            exec_cmd("cmp -s %s %s", DISKIMG_FILE, COPY_FILE) == 0);
+
+    exec_cmd("rm -f %s %s", DISKIMG_FILE, COPY_FILE);
+    return 0;
+}
@@ -0,0 +1,135 @@
+#include "utils.h"
+#define BLOCKSZ 1024
+#define VOLUMES 3
+#define CACHE_BLOCKS 64
+#define CACHE_NAMES 32
+#define FILES 40
+
+/*************************************
+ * Filesystem instances and config   *
+ *************************************/
+const char* images[VOLUMES] = {
+    "test/disk1.img", "test/disk2.img", "test/disk3.img"
+};
+
+ext2_t volumes[VOLUMES];
+ext2_cache_t cache;
+ext2_cache_params_t params = {
+    .arena_align = 64,
+    .block_size = BLOCKSZ,
+    .cache_blocks = CACHE_BLOCKS,
+    .cache_names = CACHE_NAMES,
+    .volumes = VOLUMES,
+};
+
+ext2_error_t mount(int i, uint32_t volume) {
+    ext2_config_t cfg = {
+        .read = readblock,
+        .write = writeblock,
+        .context = (void*)images[i],
+        .shared_cache = &cache,
+        .cache_volume = volume,
+    };
+
+    return ext2_mount(&volumes[i], &cfg);
+}
+
+// reads the first bytes of /fileN
+char first_byte(ext2_t* ext2, int n) {
+    char path[32], c = 0;
+    ext2_file_t file;
+
+    sprintf(path, "/file%d", n);
+    ext2_file_open(ext2, path, &file);
+    ext2_file_read(ext2, &file, 1, &c);
+    return c;
+}
+
+int main(void) {
+    testsuite("shared cache");
+
+    for (int i = 0; i < VOLUMES; i++) {
+        exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=4096", images[i], BLOCKSZ);
+        exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, images[i]);
+    }
+
+    uint64_t size = ext2_cache_arena_size(&params);
+    params.arena = aligned_alloc(64, size);
+    params.arena_size = size - 1;
+
+    test("small arena is refused",
+            ext2_cache_init(&cache, &params) == EXT2_ERR_BUFFER_TOO_SMALL);
+
+    params.arena_size = size;
+    ext2_error_t err = ext2_cache_init(&cache, &params);
+    for (int i = 0; i < VOLUMES; i++)
+        err |= mount(i, i);
+
+    test("volumes attach to the cache", err == 0);
+    test("unknown volume is refused", mount(0, VOLUMES) == EXT2_ERR_BUFFER_TOO_SMALL);
+    mount(0, 0);
+
+    // the same files, with the same block numbers, on every image
+    for (int i = 0; i < VOLUMES; i++) {
+        for (int n = 0; n < FILES; n++) {
+            char path[32], data[BLOCKSZ];
+            ext2_file_t file;
+
+            sprintf(path, "/file%d", n);
+            memset(data, 'a' + i, sizeof(data));
+            err |= ext2_file_open(&volumes[i], path, &file);
+            err |= ext2_file_write(&volumes[i], &file, sizeof(data), data);
+            err |= ext2_file_close(&volumes[i], &file);
+        }
+    }
+
+    bool apart = true;
+    for (int round = 0; round < 2; round++)
+        for (int i = 0; i < VOLUMES; i++)
+            apart = apart && first_byte(&volumes[i], 7) == 'a' + i;
+
+    test("files are written", err == 0);
+    test("volumes don't see each other's blocks", apart);
+
+    // volume 0 is busy, the others read a single file now and then
+    for (int round = 0; round < 20; round++) {
+        for (int n = 0; n < FILES; n++)
+            first_byte(&volumes[0], n);
+        first_byte(&volumes[1], 0);
+        first_byte(&volumes[2], 0);
+    }
+
+    ext2_memory_stats_t stats[VOLUMES];
+    for (int i = 0; i < VOLUMES; i++)
+        ext2_get_memory_stats(&volumes[i], &stats[i]);
+
+    uint32_t held = 0;
+    uint64_t hits = 0;
+    for (int i = 0; i < VOLUMES; i++) {
+        held += stats[i].volume_blocks;
+        hits += stats[i].volume_block_hits;
+    }
+
+    test("one budget for every volume", stats[0].blocks == CACHE_BLOCKS &&
+            stats[1].arena_used == stats[0].arena_used &&
+            held == stats[0].blocks_used);
+    test("per-volume hits add up", hits == stats[0].block_hits);
+    test("busy volume gets most of the memory",
+            stats[0].volume_blocks > 2 * (stats[1].volume_blocks +
+                stats[2].volume_blocks));
+
+    mount(1, 1);
+    ext2_memory_stats_t again;
+    ext2_get_memory_stats(&volumes[1], &again);
+    test("mounting again drops the volume", again.volume_blocks == 0 &&
+            again.volume_names == 0 && first_byte(&volumes[1], 7) == 'b');
+
+    // buffers hold 1 KiB, so 4 KiB filesystems can't attach
+    exec_cmd_fail("mkfs.ext2 -F -r 0 -b 4096 %s", images[2]);
+    test("bigger blocks are refused", mount(2, 2) == EXT2_ERR_BIG_BLOCK);
+
+    free(params.arena);
+    for (int i = 0; i < VOLUMES; i++)
+        exec_cmd("rm -f %s", images[i]);
+    return 0;
+}
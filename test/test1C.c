@@ -0,0 +1,106 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define FILES 200
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+};
+
+uint32_t inodes[FILES];
+uint64_t sizes[FILES]; // size of the file with inodes[i]
+uint32_t workspace[FILES];
+ext2_stat_t out[FILES];
+
+int main(void) {
+    testsuite("stat");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=8192", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+    ext2_mount(&ext2, &cfg);
+
+    char data[3000] = {0};
+    ext2_file_t file;
+
+    ext2_mkdir(&ext2, "/dir");
+    for (int i = 0; i < FILES; i++) {
+        char path[32];
+        sprintf(path, "/dir/file%d", i);
+        sizes[i] = (i * 37) % sizeof(data);
+
+        ext2_file_open(&ext2, path, &file);
+        ext2_file_write(&ext2, &file, sizes[i], data);
+        ext2_file_close(&ext2, &file);
+        inodes[i] = file.inode;
+    }
+
+    ext2_stat_t st;
+    ext2_error_t err = ext2_stat(&ext2, "/dir/file10", &st);
+    test("stat of a file", err == 0 && st.inode == inodes[10] &&
+            st.size == sizes[10] && GET_FILE_FMT(st.mode) == EXT2_FMT_REG &&
+            st.links_count == 1 && st.blocks == 2 * ((sizes[10] + BLOCKSZ - 1) / BLOCKSZ));
+
+    err = ext2_stat(&ext2, "/dir", &st);
+    test("stat of a directory", err == 0 && GET_FILE_FMT(st.mode) == EXT2_FMT_DIR &&
+            st.links_count == 2 && st.size == BLOCKSZ * (st.blocks / 2));
+
+    test("missing files aren't created",
+            ext2_stat(&ext2, "/dir/missing", &st) == EXT2_ERR_FILE_NOT_FOUND &&
+            ext2_stat(&ext2, "/dir/missing", &st) == EXT2_ERR_FILE_NOT_FOUND);
+
+    // the inodes in a scrambled order
+    for (int i = FILES - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        uint32_t ino = inodes[i];
+        uint64_t size = sizes[i];
+        inodes[i] = inodes[j];
+        sizes[i] = sizes[j];
+        inodes[j] = ino;
+        sizes[j] = size;
+    }
+
+    uint64_t expected[FILES + 64] = {0}; // size by inode number
+    uint32_t given[FILES];
+    for (int i = 0; i < FILES; i++) {
+        expected[inodes[i]] = sizes[i];
+        given[i] = inodes[i];
+    }
+
+    // a few repeated inodes
+    inodes[7] = inodes[3];
+    inodes[FILES - 1] = inodes[3];
+    given[7] = given[FILES - 1] = inodes[3];
+
+    ext2_stats_t stats;
+    ext2_get_stats(&ext2, &stats, true);
+    err = ext2_stat_many(&ext2, inodes, FILES, out, workspace);
+    ext2_get_stats(&ext2, &stats, false);
+
+    bool same = memcmp(inodes, given, sizeof(given)) == 0, right = true;
+    for (int i = 0; i < FILES; i++) {
+        right = right && out[i].inode == inodes[i] &&
+            out[i].size == expected[inodes[i]] &&
+            GET_FILE_FMT(out[i].mode) == EXT2_FMT_REG;
+    }
+
+    // 200 inodes of 128 bytes take 25 blocks of the inode table
+    test("batch ok", err == 0);
+    test("inodes are left as given", same);
+    test("every inode is described in order", right);
+    test("inode table is read in a few calls",
+            stats.ops[EXT2_OP_STAT_MANY].dev_reads < 6 &&
+            stats.ops[EXT2_OP_STAT_MANY].inode_reads == FILES);
+
+    uint32_t bad[2] = { inodes[0], 0 };
+    test("inode 0 is refused",
+            ext2_stat_many(&ext2, bad, 2, out, workspace) == EXT2_ERR_INODE_NOT_FOUND);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
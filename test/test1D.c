@@ -0,0 +1,97 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+};
+
+// makes /dir with a file and a subdirectory
+void make_tree(void) {
+    ext2_file_t file;
+
+    ext2_mount(&ext2, &cfg);
+    ext2_mkdir(&ext2, "/dir");
+    ext2_mkdir(&ext2, "/dir/sub");
+    ext2_file_open(&ext2, "/dir/file", &file);
+    ext2_file_write(&ext2, &file, 5, "hello");
+    ext2_file_close(&ext2, &file);
+}
+
+// type of every entry of /dir, in order
+void read_types(ext2_dir_ftype_t* types) {
+    ext2_dir_t dir;
+    ext2_dir_record_t entry;
+
+    ext2_dir_open(&ext2, "/dir", &dir);
+    for (int i = 0; i < 4; i++) {
+        ext2_dir_read(&ext2, &dir, &entry);
+        types[i] = entry.type;
+    }
+}
+
+// inodes read to look a path up
+uint64_t stat_reads(const char* path, ext2_error_t* err) {
+    ext2_stats_t stats;
+    ext2_stat_t st;
+
+    ext2_get_stats(&ext2, &stats, true);
+    *err = ext2_stat(&ext2, path, &st);
+    ext2_get_stats(&ext2, &stats, false);
+
+    return stats.ops[EXT2_OP_STAT].inode_reads;
+}
+
+int main(void) {
+    testsuite("dir entry file types");
+
+    exec_cmd_fail("rm -f %s", DISKIMG_FILE);
+    exec_cmd_fail("truncate -s %d %s", 8192 * BLOCKSZ, DISKIMG_FILE);
+
+    ext2_format_params_t params = { .size = 8192 * BLOCKSZ, .block_size = BLOCKSZ };
+    ext2_error_t err = ext2_format(&cfg, &params);
+    make_tree();
+
+    test("format sets filetype", err == 0 &&
+            (ext2.superblk.feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE));
+    test("entries have their type", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    ext2_dir_ftype_t types[4];
+    read_types(types);
+    test("types are read back", types[0] == EXT2_ET_DIR && types[1] == EXT2_ET_DIR &&
+            types[2] == EXT2_ET_DIR && types[3] == EXT2_ET_REG);
+
+    // the lookup stops at the entry of the file, its inode isn't read
+    uint64_t file_reads = stat_reads("/dir/file", &err);
+    uint64_t past_reads = stat_reads("/dir/file/x", &err);
+    test("files aren't walked into", err == EXT2_ERR_NOT_A_DIR);
+    test("without reading their inode", past_reads == file_reads - 1);
+
+    test("dir open refuses files too",
+            ext2_dir_open(&ext2, "/dir/file/x", &(ext2_dir_t){0}) == EXT2_ERR_NOT_A_DIR);
+
+    // without the feature, entries have no type and the inode tells instead
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=8192", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+    make_tree();
+
+    read_types(types);
+    test("old filesystems have no types", types[0] == EXT2_ET_UNKNOWN &&
+            types[3] == EXT2_ET_UNKNOWN);
+    test("old filesystems are consistent",
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    file_reads = stat_reads("/dir/file", &err);
+    past_reads = stat_reads("/dir/file/x", &err);
+    test("files still aren't walked into", err == EXT2_ERR_NOT_A_DIR &&
+            past_reads > file_reads - 1);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
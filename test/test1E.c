@@ -0,0 +1,150 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define WRITES 200
+#define CHUNK 100
+#define BUF_SIZE (32 * BLOCKSZ)
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block);
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+};
+
+char buf_a[BUF_SIZE], buf_b[BUF_SIZE];
+
+// Two files grow by small appends, taking turns. After each append the data
+// is read back through the handle, so without delayed allocation every read
+// flushes a chunk and the blocks of the files end up interleaved
+bool write_interleaved(const char* path1, const char* path2,
+        ext2_file_t* f1, ext2_file_t* f2) {
+    ext2_file_t* files[2] = { f1, f2 };
+    char chunk[CHUNK], back[CHUNK];
+    bool ok = true;
+
+    ext2_file_open(&ext2, path1, f1);
+    ext2_file_open(&ext2, path2, f2);
+    ext2_file_set_buffer(&ext2, f1, buf_a, sizeof(buf_a));
+    ext2_file_set_buffer(&ext2, f2, buf_b, sizeof(buf_b));
+
+    for (int i = 0; i < WRITES; i++) {
+        for (int f = 0; f < 2; f++) {
+            memset(chunk, (f ? 'A' : 'a') + i % 26, sizeof(chunk));
+            ok = ok && ext2_file_write(&ext2, files[f], CHUNK, chunk) == 0;
+
+            uint64_t end = ext2_file_tell(&ext2, files[f]);
+            ok = ok && ext2_file_seek(&ext2, files[f], end - CHUNK) == 0 &&
+                ext2_file_read(&ext2, files[f], CHUNK, back) == 0 &&
+                memcmp(chunk, back, CHUNK) == 0;
+        }
+    }
+
+    ok = ok && ext2_file_close(&ext2, f1) == 0 && ext2_file_close(&ext2, f2) == 0;
+    return ok;
+}
+
+// the data of the file is in a single run of blocks
+bool is_contiguous(ext2_file_t* file) {
+    uint32_t first, block;
+    block_map(&ext2, file->inode, 0, &first);
+
+    for (uint64_t off = BLOCKSZ; off < WRITES * CHUNK; off += BLOCKSZ) {
+        block_map(&ext2, file->inode, off, &block);
+        if (block != first + off / BLOCKSZ)
+            return false;
+    }
+
+    return true;
+}
+
+int main(void) {
+    testsuite("delayed allocation");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=8192", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+
+    ext2_file_t a, b;
+    ext2_mount(&ext2, &cfg);
+    write_interleaved("/a", "/b", &a, &b);
+    test("files are interleaved without it", !is_contiguous(&a) && !is_contiguous(&b));
+
+    cfg.flags = EXT2_MOUNT_DELALLOC;
+    ext2_mount(&ext2, &cfg);
+
+    test("reads see the buffered data", write_interleaved("/c", "/d", &a, &b));
+    test("each file is a single run", is_contiguous(&a) && is_contiguous(&b));
+    test("filesystem is consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // what's on the disk, read with no buffer
+    char back[CHUNK];
+    bool same = true;
+    ext2_file_open(&ext2, "/d", &b);
+    for (int i = 0; i < WRITES; i++) {
+        ext2_file_read(&ext2, &b, CHUNK, back);
+        for (int j = 0; j < CHUNK; j++)
+            same = same && back[j] == 'A' + i % 26;
+    }
+    test("data reaches the disk", same);
+
+    // a scratch file that's read and then truncated before it's flushed
+    ext2_stats_t stats;
+    ext2_file_t tmp;
+    char data[3 * BLOCKSZ];
+    memset(data, 'x', sizeof(data));
+    ext2_file_open(&ext2, "/tmp", &tmp);
+    ext2_file_set_buffer(&ext2, &tmp, buf_a, sizeof(buf_a));
+
+    ext2_get_stats(&ext2, &stats, true);
+    ext2_error_t err = ext2_file_write(&ext2, &tmp, sizeof(data), data);
+    err |= ext2_file_seek(&ext2, &tmp, 10);
+    err |= ext2_file_read(&ext2, &tmp, 10, back);
+    err |= ext2_file_truncate(&ext2, &tmp, 0);
+    err |= ext2_file_close(&ext2, &tmp);
+    ext2_get_stats(&ext2, &stats, false);
+
+    uint64_t allocated = 0;
+    for (int i = 0; i < EXT2_OP_COUNT; i++)
+        allocated += stats.ops[i].blocks_allocated;
+
+    test("short-lived files never get blocks", err == 0 && back[0] == 'x' &&
+            allocated == 0);
+
+    // only the part before the new end is written
+    ext2_file_set_buffer(&ext2, &tmp, buf_a, sizeof(buf_a));
+    err = ext2_file_write(&ext2, &tmp, sizeof(data), data);
+    err |= ext2_file_truncate(&ext2, &tmp, 20);
+    err |= ext2_file_seek(&ext2, &tmp, 10);
+    err |= ext2_file_read(&ext2, &tmp, 10, back);
+    test("tail past a truncate is dropped", err == 0 && back[9] == 'x' &&
+            ext2_file_read(&ext2, &tmp, 1, back) == EXT2_ERR_DATA_OUT_OF_BOUNDS);
+
+    ext2_file_close(&ext2, &tmp);
+
+    // the size waiting in the buffer is seen by stat, and stays once flushed
+    ext2_stat_t st;
+    ext2_file_open(&ext2, "/tmp", &tmp);
+    ext2_file_set_buffer(&ext2, &tmp, buf_a, sizeof(buf_a));
+    err = ext2_file_write(&ext2, &tmp, sizeof(data), data);
+    err |= ext2_stat(&ext2, "/tmp", &st);
+    uint32_t inode = tmp.inode, order;
+    ext2_stat_t many;
+    err |= ext2_stat_many(&ext2, &inode, 1, &many, &order);
+    test("stat sees buffered sizes", err == 0 && st.size == sizeof(data) &&
+            many.size == sizeof(data));
+
+    err = ext2_file_close(&ext2, &tmp);
+    err |= ext2_stat(&ext2, "/tmp", &st);
+    test("and the size on disk after the close", err == 0 &&
+            st.size == sizeof(data));
+
+    test("still consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define BIG_SIZE (20 << 20)
+#define NAMES 40
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+    .arena_align = 64,
+    .cache_blocks = 64,
+    .cache_names = 64,
+};
+
+uint8_t arena[256 * 1024] __attribute__((aligned(64)));
+
+bool exists(const char* path) {
+    ext2_stat_t st;
+    return ext2_stat(&ext2, path, &st) == 0;
+}
+
+// name of the i'th file of /many, long enough for a few entries per block
+void long_name(char* path, int i) {
+    sprintf(path, "/many/%060d", i);
+}
+
+int main(void) {
+    testsuite("rm");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=65536", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+
+    cfg.arena = arena;
+    cfg.arena_size = sizeof(arena);
+    ext2_mount(&ext2, &cfg);
+
+    uint32_t free_blocks = ext2.superblk.free_blocks_count;
+    uint32_t free_inodes = ext2.superblk.free_inodes_count;
+
+    // a file that spans several groups and needs double indirect blocks
+    static char chunk[1 << 20];
+    ext2_file_t file;
+    ext2_file_open(&ext2, "/big", &file);
+    for (int i = 0; i < BIG_SIZE / (int)sizeof(chunk); i++) {
+        memset(chunk, 'a' + i, sizeof(chunk));
+        ext2_file_write(&ext2, &file, sizeof(chunk), chunk);
+    }
+
+    ext2_stats_t stats;
+    ext2_get_stats(&ext2, &stats, true);
+    ext2_error_t err = ext2_rm(&ext2, "/big");
+    ext2_get_stats(&ext2, &stats, false);
+
+    test("file is removed", err == 0 && !exists("/big"));
+    test("space is given back", ext2.superblk.free_blocks_count == free_blocks &&
+            ext2.superblk.free_inodes_count == free_inodes);
+    test("a few writes for 20 MiB", stats.ops[EXT2_OP_RM].dev_writes < 30);
+    test("filesystem is consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // entries are merged into the ones before them
+    ext2_mkdir(&ext2, "/dir");
+    const char* names[3] = { "/dir/a", "/dir/b", "/dir/c" };
+    for (int i = 0; i < 3; i++) {
+        ext2_file_open(&ext2, names[i], &file);
+        ext2_file_write(&ext2, &file, 5, "hello");
+    }
+
+    test("full directories aren't removed",
+            ext2_rm(&ext2, "/dir") == EXT2_ERR_DIR_NOT_EMPTY);
+
+    err = ext2_rm(&ext2, "/dir/b");
+
+    ext2_dir_t dir;
+    ext2_dir_record_t entry;
+    char listing[64] = "";
+    ext2_dir_open(&ext2, "/dir", &dir);
+    while (ext2_dir_read(&ext2, &dir, &entry) == 0 && entry.inode != 0) {
+        strcat(listing, entry.name);
+        strcat(listing, " ");
+    }
+
+    test("entry is gone", err == 0 && strcmp(listing, ". .. a c ") == 0);
+
+    ext2_stat_t before, after;
+    ext2_stat(&ext2, "/dir", &before);
+    ext2_file_open(&ext2, "/dir/d", &file);
+    ext2_stat(&ext2, "/dir", &after);
+    test("its space is reused", after.size == before.size);
+
+    err = ext2_rm(&ext2, "/dir/a");
+    err |= ext2_rm(&ext2, "/dir/c");
+    err |= ext2_rm(&ext2, "/dir/d");
+    ext2_stat(&ext2, "/", &before);
+    err |= ext2_rm(&ext2, "/dir");
+    ext2_stat(&ext2, "/", &after);
+
+    test("empty directories are removed", err == 0 && !exists("/dir") &&
+            after.links_count == before.links_count - 1);
+    test("still consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // a directory of a few blocks, so some entries are first in their block
+    char path[128];
+    ext2_mkdir(&ext2, "/many");
+    for (int i = 0; i < NAMES; i++) {
+        long_name(path, i);
+        ext2_file_open(&ext2, path, &file);
+    }
+
+    // 14 entries fit in the first block, after the dots, so the 15th starts
+    // the second block and keeps its name on disk when it's removed
+    char first[128];
+    ext2_stat_t st;
+    long_name(first, 14);
+    err = ext2_rm(&ext2, first);
+    test("first entry of a block is removed", err == 0 &&
+            ext2_stat(&ext2, first, &st) == EXT2_ERR_FILE_NOT_FOUND);
+
+    int listed = 0;
+    bool found = false;
+    ext2_dir_open(&ext2, "/many", &dir);
+    while (ext2_dir_read(&ext2, &dir, &entry) == 0 && entry.inode != 0) {
+        listed++;
+        found = found || strcmp(entry.name, first + strlen("/many/")) == 0;
+    }
+    test("it isn't listed", listed == NAMES - 1 + 2 && !found);
+
+    err = ext2_file_open(&ext2, first, &file);
+    test("its name is created again", err == 0 && file.inode != 0 &&
+            exists(first));
+
+    err = 0;
+    for (int i = NAMES - 1; i >= 0; i -= 2) {
+        long_name(path, i);
+        err |= ext2_rm(&ext2, path);
+    }
+
+    bool right = true;
+    for (int i = 0; i < NAMES; i++) {
+        long_name(path, i);
+        right = right && exists(path) == (i % 2 == 0);
+    }
+
+    test("entries of every block are removed", err == 0 && right);
+    test("blocks with holes are consistent",
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    for (int i = 0; i < NAMES; i += 2) {
+        long_name(path, i);
+        err |= ext2_rm(&ext2, path);
+    }
+    err |= ext2_rm(&ext2, "/many");
+    test("everything is removed", err == 0 &&
+            ext2.superblk.free_blocks_count == free_blocks &&
+            ext2.superblk.free_inodes_count == free_inodes);
+
+    test("root can't be removed", ext2_rm(&ext2, "/") == EXT2_ERR_BAD_PATH);
+    test("dots can't be removed", ext2_rm(&ext2, "/lost+found/..") == EXT2_ERR_BAD_PATH);
+    test("missing files", ext2_rm(&ext2, "/missing") == EXT2_ERR_FILE_NOT_FOUND);
+
+    // the name cache forgets removed names
+    ext2_file_open(&ext2, "/cached", &file);
+    exists("/cached");
+    ext2_rm(&ext2, "/cached");
+    test("removed names aren't cached", !exists("/cached") &&
+            ext2_file_open(&ext2, "/cached", &file) == 0 && file.inode != 0);
+
+    ext2_rm(&ext2, "/cached");
+    test("consistent at the end", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include "utils.h"
+#include <pthread.h>
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define DIRS 8
+#define FILES_PER_DIR 300
+#define FILES (DIRS * FILES_PER_DIR)
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+    .arena_align = 64,
+    .cache_blocks = 256,
+    .cache_names = 64,
+};
+
+uint8_t arena[1024 * 1024] __attribute__((aligned(64)));
+uint64_t workspace[(64 * 1024 + FILES * 8) / 8];
+
+// runs every task on its own thread
+int parallel_calls = 0;
+
+typedef struct {
+    void (*task)(uint32_t, void*);
+    void* arg;
+    uint32_t index;
+} thread_arg_t;
+
+void* run_task(void* p) {
+    thread_arg_t* t = p;
+    t->task(t->index, t->arg);
+    return NULL;
+}
+
+void parallel_for(void (*task)(uint32_t, void*), void* arg, uint32_t count,
+        void* context) {
+    pthread_t threads[count];
+    thread_arg_t args[count];
+
+    parallel_calls++;
+    for (uint32_t i = 0; i < count; i++) {
+        args[i] = (thread_arg_t){ task, arg, i };
+        pthread_create(&threads[i], NULL, run_task, &args[i]);
+    }
+    for (uint32_t i = 0; i < count; i++)
+        pthread_join(threads[i], NULL);
+}
+
+bool exists(const char* path) {
+    ext2_stat_t st;
+    return ext2_stat(&ext2, path, &st) == 0;
+}
+
+// Makes 'top' with DIRS directories of small files, enough to fill more than
+// one group of inodes, plus a few big files and a deeper subdirectory
+void make_tree(const char* top) {
+    static char data[300 * BLOCKSZ];
+    char path[128];
+    ext2_file_t file;
+
+    ext2_mkdir(&ext2, top);
+    for (int d = 0; d < DIRS; d++) {
+        sprintf(path, "%s/d%d", top, d);
+        ext2_mkdir(&ext2, path);
+
+        for (int f = 0; f < FILES_PER_DIR; f++) {
+            sprintf(path, "%s/d%d/f%d", top, d, f);
+            ext2_file_open(&ext2, path, &file);
+            ext2_file_write(&ext2, &file, (f % 5) * 700, data);
+        }
+    }
+
+    // past the double indirect blocks
+    sprintf(path, "%s/d0/big", top);
+    ext2_file_open(&ext2, path, &file);
+    ext2_file_write(&ext2, &file, sizeof(data), data);
+
+    sprintf(path, "%s/d1/sub", top);
+    ext2_mkdir(&ext2, path);
+    sprintf(path, "%s/d1/sub/deep", top);
+    ext2_mkdir(&ext2, path);
+    sprintf(path, "%s/d1/sub/deep/file", top);
+    ext2_file_open(&ext2, path, &file);
+    ext2_file_write(&ext2, &file, 5000, data);
+}
+
+int main(void) {
+    testsuite("rm tree");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=%d count=65536", DISKIMG_FILE, BLOCKSZ);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d %s", BLOCKSZ, DISKIMG_FILE);
+
+    cfg.arena = arena;
+    cfg.arena_size = sizeof(arena);
+    ext2_mount(&ext2, &cfg);
+
+    uint32_t free_blocks = ext2.superblk.free_blocks_count;
+    uint32_t free_inodes = ext2.superblk.free_inodes_count;
+    make_tree("/tree");
+
+    // the list doesn't fit, nothing changes
+    ext2_rm_tree_params_t params = {
+        .parallel_for = parallel_for,
+        .workers = 4,
+        .workspace = workspace,
+        .workspace_size = ext2_rm_tree_workspace_size(&ext2, 100),
+    };
+    test("workspace size", params.workspace_size <= sizeof(workspace));
+    test("trees that don't fit are refused",
+            ext2_rm_tree(&ext2, "/tree", &params) == EXT2_ERR_BUFFER_TOO_SMALL &&
+            exists("/tree/d7/f299") && parallel_calls == 0);
+
+    params.workspace_size = sizeof(workspace);
+    ext2_stats_t stats;
+    ext2_get_stats(&ext2, &stats, true);
+    ext2_error_t err = ext2_rm_tree(&ext2, "/tree", &params);
+    ext2_get_stats(&ext2, &stats, false);
+
+    test("tree is removed", err == 0 && !exists("/tree") && !exists("/tree/d0/f0"));
+    test("workers ran in parallel", parallel_calls == 2);
+    test("space is given back", ext2.superblk.free_blocks_count == free_blocks &&
+            ext2.superblk.free_inodes_count == free_inodes);
+    test("fewer writes than files", stats.ops[EXT2_OP_RM_TREE].dev_writes < FILES);
+    test("filesystem is consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // a single worker, inside another directory
+    ext2_stat_t before, after;
+    ext2_mkdir(&ext2, "/top");
+    make_tree("/top/tree");
+    ext2_stat(&ext2, "/top", &before);
+
+    params.parallel_for = NULL;
+    err = ext2_rm_tree(&ext2, "/top/tree", &params);
+    ext2_stat(&ext2, "/top", &after);
+
+    test("sequential removal", err == 0 && !exists("/top/tree") &&
+            after.links_count == before.links_count - 1);
+    test("still consistent", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // the names of the removed tree aren't cached anymore
+    ext2_file_t file;
+    ext2_mkdir(&ext2, "/top/tree");
+    test("names are forgotten", !exists("/top/tree/d0") &&
+            ext2_file_open(&ext2, "/top/tree/file", &file) == 0);
+
+    test("single files too", ext2_rm_tree(&ext2, "/top/tree/file", &params) == 0 &&
+            !exists("/top/tree/file"));
+    test("root can't be removed", ext2_rm_tree(&ext2, "/", &params) == EXT2_ERR_BAD_PATH);
+
+    err = ext2_rm_tree(&ext2, "/top", &params);
+    test("everything is removed", err == 0 &&
+            ext2.superblk.free_blocks_count == free_blocks &&
+            ext2.superblk.free_inodes_count == free_inodes);
+    test("consistent at the end", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
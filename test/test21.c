@@ -0,0 +1,200 @@
+#include "utils.h"
+#include "../chunked.h"
+#include <sys/stat.h>
+#define CONTAINER_FILE "test/disk1.ck"
+#define SMALL_FILE "test/disk2.ck"
+#define DISKIMG_FILE "test/disk1.img"
+#define DISK_SIZE (64 << 20)
+#define CHUNK_SIZE (64 * 1024)
+#define FILE_SIZE (2 << 20)
+#define REWRITTEN 8
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_chunked_t* chunked;
+ext2_chunked_params_t params = { .chunk_size = CHUNK_SIZE, .cache_chunks = 16 };
+
+ext2_config_t cfg = {
+    .read64 = ext2_chunked_read,
+    .write64 = ext2_chunked_write,
+};
+
+static char text[FILE_SIZE], back[FILE_SIZE];
+
+// writes the whole device into a flat image, for e2fsck
+bool export_image(void) {
+    static char buf[CHUNK_SIZE];
+    FILE* f = fopen(DISKIMG_FILE, "w");
+    bool ok = f != NULL;
+
+    for (uint64_t off = 0; ok && off < DISK_SIZE; off += sizeof(buf))
+        ok = ext2_chunked_read(off, sizeof(buf), buf, chunked) == 0 &&
+            fwrite(buf, sizeof(buf), 1, f) == 1;
+
+    if (f)
+        fclose(f);
+    return ok;
+}
+
+int main(void) {
+    testsuite("chunked image");
+
+    int err = ext2_chunked_create(CONTAINER_FILE, DISK_SIZE, &params);
+    err |= ext2_chunked_open(&chunked, CONTAINER_FILE, &params);
+    test("container is created", err == 0);
+
+    char zeros[4096] = {0}, buf[4096];
+    memset(buf, 1, sizeof(buf));
+    ext2_chunked_read(DISK_SIZE - sizeof(buf), sizeof(buf), buf, chunked);
+    test("new devices read as zeros", memcmp(buf, zeros, sizeof(buf)) == 0);
+    test("accesses past the end fail",
+            ext2_chunked_read(DISK_SIZE - 10, 20, buf, chunked) ==
+            EXT2_CHUNKED_ERR_BAD_PARAMS);
+
+    // a filesystem with a compressible file
+    for (int i = 0; i < FILE_SIZE; i++)
+        text[i] = "hello, chunks! "[i % 15] + (i / 4096) % 3;
+
+    cfg.context = chunked;
+    ext2_format_params_t format = { .size = DISK_SIZE, .block_size = 1024 };
+    ext2_error_t error = ext2_format(&cfg, &format);
+    error |= ext2_mount(&ext2, &cfg);
+
+    ext2_file_t file;
+    error |= ext2_file_open(&ext2, "/text", &file);
+    error |= ext2_file_write(&ext2, &file, FILE_SIZE, text);
+    error |= ext2_file_close(&ext2, &file);
+    test("filesystem on top of it", error == 0);
+
+    err = ext2_chunked_close(chunked);
+    struct stat st;
+    stat(CONTAINER_FILE, &st);
+    test("container is a fraction of the device", err == 0 &&
+            st.st_size < DISK_SIZE / 16);
+
+    // everything is back after reopening
+    ext2_chunked_stats_t stats;
+    err = ext2_chunked_open(&chunked, CONTAINER_FILE, &params);
+    cfg.context = chunked;
+    error = ext2_mount(&ext2, &cfg);
+    error |= ext2_file_open(&ext2, "/text", &file);
+    error |= ext2_file_read(&ext2, &file, FILE_SIZE, back);
+    ext2_chunked_get_stats(chunked, &stats);
+
+    test("data survives reopening", err == 0 && error == 0 &&
+            memcmp(text, back, FILE_SIZE) == 0);
+    test("unused chunks aren't stored", stats.stored_chunks < stats.chunks / 4 &&
+            stats.stored_bytes < stats.file_bytes);
+    test("filesystem is consistent", export_image() &&
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // random data doesn't compress and is stored as it is
+    for (int i = 0; i < FILE_SIZE; i++)
+        text[i] = rand();
+
+    error = ext2_file_open(&ext2, "/random", &file);
+    error |= ext2_file_write(&ext2, &file, FILE_SIZE, text);
+    error |= ext2_file_close(&ext2, &file);
+    err = ext2_chunked_flush(chunked);
+
+    error |= ext2_file_seek(&ext2, &file, 0);
+    error |= ext2_file_read(&ext2, &file, FILE_SIZE, back);
+    test("incompressible data", err == 0 && error == 0 &&
+            memcmp(text, back, FILE_SIZE) == 0);
+
+    // chunks overwritten with zeros leave the file
+    uint64_t last = DISK_SIZE - CHUNK_SIZE;
+    static char chunk[CHUNK_SIZE];
+    memset(chunk, 'z', sizeof(chunk));
+    ext2_chunked_write(last, sizeof(chunk), chunk, chunked);
+    ext2_chunked_flush(chunked);
+    ext2_chunked_get_stats(chunked, &stats);
+    uint64_t stored = stats.stored_chunks;
+
+    memset(chunk, 0, sizeof(chunk));
+    ext2_chunked_write(last, sizeof(chunk), chunk, chunked);
+    ext2_chunked_flush(chunked);
+    ext2_chunked_get_stats(chunked, &stats);
+    test("zeroed chunks are dropped", stats.stored_chunks == stored - 1);
+
+    // random reads of small blocks mostly hit the cache
+    ext2_chunked_get_stats(chunked, &stats);
+    uint64_t misses = stats.cache_misses;
+    bool same = true;
+    for (int i = 0; i < 1000; i++) {
+        uint32_t off = rand() % (FILE_SIZE / 1024) * 1024;
+        ext2_file_seek(&ext2, &file, off);
+        ext2_file_read(&ext2, &file, 1024, back);
+        same = same && memcmp(back, text + off, 1024) == 0;
+    }
+    ext2_chunked_get_stats(chunked, &stats);
+    test("random reads", same && stats.cache_misses - misses < 1000);
+
+    test("still consistent", export_image() &&
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+    ext2_chunked_close(chunked);
+
+    // chunks rewritten over and over take the same space again. Until a 
+    // flush, the old copies are kept too
+    ext2_chunked_params_t small = { .chunk_size = CHUNK_SIZE, .cache_chunks = 1 };
+    ext2_chunked_t* c;
+    ext2_chunked_create(SMALL_FILE, 4 << 20, &small);
+    ext2_chunked_open(&c, SMALL_FILE, &small);
+    ext2_chunked_get_stats(c, &stats);
+    uint64_t empty = stats.file_bytes, most = 0;
+
+    err = 0;
+    for (int round = 0; round < 50; round++) {
+        // they compress less and less, then start over
+        int random = CHUNK_SIZE / 10 * (round % 10 + 1);
+        for (int i = 0; i < REWRITTEN * CHUNK_SIZE; i++)
+            text[i] = (i % CHUNK_SIZE < random) ? rand() : 'a' + i % 7;
+        err |= ext2_chunked_write(0, REWRITTEN * CHUNK_SIZE, text, c);
+        err |= ext2_chunked_flush(c);
+
+        ext2_chunked_get_stats(c, &stats);
+        most = (stats.file_bytes > most) ? stats.file_bytes : most;
+    }
+    test("rewrites reuse the space", err == 0 &&
+            most <= empty + 3 * REWRITTEN * CHUNK_SIZE);
+
+    memset(text, 0, REWRITTEN * CHUNK_SIZE);
+    err = ext2_chunked_write(0, REWRITTEN * CHUNK_SIZE, text, c);
+    err |= ext2_chunked_flush(c);
+    ext2_chunked_get_stats(c, &stats);
+    test("zeroed chunks give their space back", err == 0 &&
+            stats.file_bytes == empty && stats.stored_chunks == 0);
+
+    // a chunk stored when it left the cache doesn't replace the one the 
+    // file's index refers to until a flush
+    memset(chunk, 'a', sizeof(chunk));
+    ext2_chunked_write(0, sizeof(chunk), chunk, c);
+    ext2_chunked_flush(c);
+    memset(chunk, 'b', sizeof(chunk));
+    ext2_chunked_write(0, sizeof(chunk), chunk, c);
+    ext2_chunked_write(CHUNK_SIZE, sizeof(chunk), chunk, c); // evicts chunk 0
+
+    ext2_chunked_t* crashed;
+    err = ext2_chunked_open(&crashed, SMALL_FILE, &small);
+    err |= ext2_chunked_read(0, sizeof(chunk), chunk, crashed);
+    err |= ext2_chunked_close(crashed);
+    test("unflushed rewrites keep the old chunk", err == 0 &&
+            chunk[0] == 'a' && chunk[CHUNK_SIZE - 1] == 'a');
+
+    err = ext2_chunked_close(c);
+    err |= ext2_chunked_open(&c, SMALL_FILE, &small);
+    err |= ext2_chunked_read(0, sizeof(chunk), chunk, c);
+    ext2_chunked_close(c);
+    test("flushed rewrites replace it", err == 0 &&
+            chunk[0] == 'b' && chunk[CHUNK_SIZE - 1] == 'b');
+
+    // other files aren't taken for containers
+    test("bad containers are refused",
+            ext2_chunked_open(&chunked, DISKIMG_FILE, &params) ==
+            EXT2_CHUNKED_ERR_CORRUPT && chunked == NULL);
+
+    exec_cmd("rm -f %s %s %s", CONTAINER_FILE, SMALL_FILE, DISKIMG_FILE);
+    return 0;
+}
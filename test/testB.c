@@ -0,0 +1,154 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define BLOCKS_PER_GROUP 1024
+#define DUMMY_FILE_PATH "/tmp/hello"
+#define EMPTY_FILE_PATH "/tmp/empty"
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block);
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+};
+
+// big enough to need a doubly-indirect block
+#define BIG_FILE_SIZE ((12 + BLOCKSZ / 4 + 100) * BLOCKSZ)
+
+void prepare_file() {
+    FILE *file = fopen(DUMMY_FILE_PATH, "w");
+    if (file == NULL) {
+        perror("Failed to open file");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < BIG_FILE_SIZE; i++)
+        fputc('a' + i % 26, file);
+
+    fclose(file);
+
+    file = fopen(EMPTY_FILE_PATH, "w");
+    if (file == NULL) {
+        perror("Failed to open file");
+        exit(1);
+    }
+    fclose(file);
+}
+
+int main(void) {
+    testsuite("truncate and fallocate");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=1k count=4096", DISKIMG_FILE);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d -g %d %s", BLOCKSZ, BLOCKS_PER_GROUP,
+            DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"mkdir foo\"", DISKIMG_FILE);
+
+    prepare_file();
+
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/hello\"",
+            DISKIMG_FILE, DUMMY_FILE_PATH);
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/empty\"",
+            DISKIMG_FILE, EMPTY_FILE_PATH);
+
+    ext2_mount(&ext2, &cfg);
+    uint32_t free_before = ext2.superblk.free_blocks_count;
+
+    ext2_file_t file;
+    ext2_file_open(&ext2, "/foo/hello", &file);
+    ext2_file_seek(&ext2, &file, BIG_FILE_SIZE);
+
+    ext2_error_t err = ext2_file_truncate(&ext2, &file, 5000);
+
+    test("shrink ok", err == 0);
+    test("offset moved to end of file", ext2_file_tell(&ext2, &file) == 5000);
+    test("blocks were freed",
+            ext2.superblk.free_blocks_count - free_before >= 12 + BLOCKSZ / 4 + 100 - 5);
+
+    char buf[BLOCKSZ * 4];
+    ext2_file_seek(&ext2, &file, 4990);
+    err = ext2_file_read(&ext2, &file, 10, buf);
+
+    test("data before the cut is kept", err == 0 && buf[0] == 'a' + 4990 % 26);
+
+    err = ext2_file_read(&ext2, &file, 1, buf);
+
+    test("can't read past the cut", err == EXT2_ERR_DATA_OUT_OF_BOUNDS);
+    test("e2fsck is happy after shrink",
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    err = ext2_file_truncate(&ext2, &file, 5000 + sizeof(buf));
+
+    test("extend ok", err == 0);
+
+    ext2_file_seek(&ext2, &file, 5000);
+    err = ext2_file_read(&ext2, &file, sizeof(buf), buf);
+
+    uint32_t zeros = 0;
+    for (uint32_t i = 0; i < sizeof(buf); i++)
+        zeros += (buf[i] == 0);
+
+    test("extended part reads as zeros", err == 0 && zeros == sizeof(buf));
+
+    ext2_file_t empty;
+    ext2_file_open(&ext2, "/foo/empty", &empty);
+
+    err = ext2_file_fallocate(&ext2, &empty, 0, 300 * BLOCKSZ);
+
+    test("fallocate ok", err == 0);
+
+    bool contiguous = true;
+    uint32_t first, block;
+    block_map(&ext2, empty.inode, 0, &first);
+    for (uint32_t i = 1; i < 300; i++) {
+        block_map(&ext2, empty.inode, i * BLOCKSZ, &block);
+        contiguous = contiguous && (block == first + i);
+    }
+
+    test("blocks are contiguous", first != 0 && contiguous);
+
+    ext2_file_seek(&ext2, &empty, 299 * BLOCKSZ);
+    err = ext2_file_read(&ext2, &empty, BLOCKSZ, buf);
+
+    zeros = 0;
+    for (uint32_t i = 0; i < BLOCKSZ; i++)
+        zeros += (buf[i] == 0);
+
+    test("reserved blocks read as zeros", err == 0 && zeros == BLOCKSZ);
+
+    ext2_file_seek(&ext2, &empty, 10);
+    err = ext2_file_write(&ext2, &empty, 5, "hello");
+    block_map(&ext2, empty.inode, 0, &block);
+
+    test("write uses reserved block", err == 0 && block == first);
+    test("e2fsck is happy after fallocate",
+            exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    // the freed block of 'dirty' is taken by 'tail', whose end is in the
+    // middle of it
+    ext2_file_t dirty, tail;
+    memset(buf, 'X', BLOCKSZ);
+    ext2_file_open(&ext2, "/foo/dirty", &dirty);
+    ext2_file_write(&ext2, &dirty, BLOCKSZ, buf);
+    ext2_file_truncate(&ext2, &dirty, 0);
+
+    ext2_file_open(&ext2, "/foo/tail", &tail);
+    ext2_file_write(&ext2, &tail, 3, "abc");
+    err = ext2_file_fallocate(&ext2, &tail, 0, 1000);
+
+    ext2_file_seek(&ext2, &tail, 0);
+    err |= ext2_file_read(&ext2, &tail, 1000, buf);
+
+    zeros = 0;
+    for (uint32_t i = 3; i < 1000; i++)
+        zeros += (buf[i] == 0);
+
+    test("fallocate past a partial block reads as zeros", err == 0 &&
+            memcmp(buf, "abc", 3) == 0 && zeros == 997);
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk2.img"
+#define BLOCKSZ 1024
+#define EMPTY_FILE_PATH "/tmp/empty"
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block);
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read64 = readblock64,
+    .write64 = writeblock64,
+    .context = DISKIMG_FILE,
+};
+
+ext2_t ext2_32;
+ext2_config_t cfg_32 = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+};
+
+// past the first 4 GiB of the disk
+#define HIGH_BLOCK 4500000
+
+int main(void) {
+    testsuite("big disk and big file");
+
+    // sparse 6 GiB disk
+    exec_cmd_fail("rm -f %s && truncate -s 6G %s", DISKIMG_FILE, DISKIMG_FILE);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d -N 2048 %s", BLOCKSZ, DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"mkdir foo\"", DISKIMG_FILE);
+    exec_cmd_fail("touch %s", EMPTY_FILE_PATH);
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/big\"",
+            DISKIMG_FILE, EMPTY_FILE_PATH);
+
+    // mark the start of the disk as used, so new blocks come from its end
+    exec_cmd_fail("debugfs -w %s -R \"setb 1 %d\"", DISKIMG_FILE, HIGH_BLOCK);
+
+    ext2_error_t err = ext2_mount(&ext2, &cfg);
+
+    test("mount ok", err == 0);
+
+    ext2_file_t file;
+    ext2_file_open(&ext2, "/foo/big", &file);
+
+    const uint64_t big_offset = 5ULL << 30;
+    err = ext2_file_truncate(&ext2, &file, big_offset);
+
+    test("grow past 4 GiB ok", err == 0);
+    test("large_file feature is on",
+            ext2.superblk.feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE);
+
+    err = ext2_file_seek(&ext2, &file, big_offset);
+
+    test("seek past 4 GiB ok", err == 0);
+    test("tell past 4 GiB", ext2_file_tell(&ext2, &file) == big_offset);
+
+    char* buf = "far away";
+    err = ext2_file_write(&ext2, &file, strlen(buf), buf);
+
+    test("write past 4 GiB ok", err == 0);
+
+    char output_buf[100];
+    ext2_file_seek(&ext2, &file, big_offset);
+    err = ext2_file_read(&ext2, &file, strlen(buf), output_buf);
+    output_buf[strlen(buf)] = '\0';
+
+    test("read past 4 GiB ok", err == 0);
+    test("data is correct", strcmp(output_buf, buf) == 0);
+
+    uint32_t block;
+    block_map(&ext2, file.inode, big_offset, &block);
+
+    test("data is past 4 GiB of the disk", block > HIGH_BLOCK);
+
+    ext2_file_seek(&ext2, &file, 0);
+    err = ext2_file_read(&ext2, &file, 8, output_buf);
+
+    test("hole before it reads as zeros", err == 0 && output_buf[0] == 0);
+
+    // remount so the size is read back from the disk
+    ext2_mount(&ext2, &cfg);
+    ext2_file_open(&ext2, "/foo/big", &file);
+
+    test("size survives remount",
+            ext2_file_seek(&ext2, &file, big_offset + strlen(buf)) == 0);
+
+    ext2_mount(&ext2_32, &cfg_32);
+    ext2_file_open(&ext2_32, "/foo/big", &file);
+    ext2_file_seek(&ext2_32, &file, big_offset);
+    err = ext2_file_read(&ext2_32, &file, strlen(buf), output_buf);
+
+    test("32-bit callbacks can't reach the data", err == EXT2_ERR_BIG_ADDRESS);
+
+    exec_cmd("rm -f %s", DISKIMG_FILE);
+    return 0;
+}
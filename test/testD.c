@@ -0,0 +1,143 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define BLOCKS_PER_GROUP 1024
+#define DUMMY_FILE_PATH "/tmp/hello"
+#define EMPTY_FILE_PATH "/tmp/empty"
+
+ext2_error_t block_map(ext2_t* ext2, uint32_t inode, uint64_t offset, uint32_t* block);
+
+int copy_calls = 0;
+
+int count_copy(uint64_t dst, uint64_t src, uint32_t size, void* context) {
+    copy_calls++;
+    return copyblock64(dst, src, size, context);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read64 = readblock64,
+    .write64 = writeblock64,
+    .copy = count_copy,
+    .context = DISKIMG_FILE,
+};
+
+#define DATA_BLOCKS 300
+#define HOLE_BLOCKS 100
+
+void prepare_file() {
+    FILE *file = fopen(DUMMY_FILE_PATH, "w");
+    if (file == NULL) {
+        perror("Failed to open file");
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < DATA_BLOCKS * BLOCKSZ; i++)
+        fputc('a' + i % 26, file);
+
+    fclose(file);
+
+    exec_cmd_fail("touch %s", EMPTY_FILE_PATH);
+}
+
+bool same_contents(ext2_file_t* a, uint64_t a_off, ext2_file_t* b, 
+        uint64_t b_off, uint64_t len) {
+    char buf_a[BLOCKSZ], buf_b[BLOCKSZ];
+
+    while (len > 0) {
+        uint32_t chunk = (len < BLOCKSZ) ? len : BLOCKSZ;
+
+        ext2_file_seek(&ext2, a, a_off);
+        ext2_file_seek(&ext2, b, b_off);
+
+        if (ext2_file_read(&ext2, a, chunk, buf_a) || 
+                ext2_file_read(&ext2, b, chunk, buf_b) ||
+                memcmp(buf_a, buf_b, chunk) != 0)
+            return false;
+
+        a_off += chunk;
+        b_off += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+int main(void) {
+    testsuite("copy file range");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=1k count=4096", DISKIMG_FILE);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d -g %d %s", BLOCKSZ, BLOCKS_PER_GROUP,
+            DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"mkdir foo\"", DISKIMG_FILE);
+
+    prepare_file();
+
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/src\"",
+            DISKIMG_FILE, DUMMY_FILE_PATH);
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/dst\"",
+            DISKIMG_FILE, EMPTY_FILE_PATH);
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/dst2\"",
+            DISKIMG_FILE, EMPTY_FILE_PATH);
+
+    ext2_mount(&ext2, &cfg);
+
+    // src = data, then a hole, then one more block of data
+    ext2_file_t src, dst, dst2;
+    ext2_file_open(&ext2, "/foo/src", &src);
+    ext2_file_truncate(&ext2, &src, (DATA_BLOCKS + HOLE_BLOCKS) * BLOCKSZ);
+    ext2_file_seek(&ext2, &src, (DATA_BLOCKS + HOLE_BLOCKS) * BLOCKSZ);
+    ext2_file_write(&ext2, &src, 5, "tail!");
+
+    const uint64_t len = (DATA_BLOCKS + HOLE_BLOCKS) * BLOCKSZ + 5;
+
+    ext2_file_open(&ext2, "/foo/dst", &dst);
+    ext2_error_t err = ext2_copy_file_range(&ext2, &src, 0, &dst, 0, len);
+
+    test("aligned copy ok", err == 0);
+    test("copied data is correct", same_contents(&src, 0, &dst, 0, len));
+    // one device copy per run of consecutive source blocks
+    uint32_t first, block, prev, src_runs = 1;
+    block_map(&ext2, src.inode, 0, &prev);
+    for (uint32_t i = 1; i < DATA_BLOCKS; i++) {
+        block_map(&ext2, src.inode, (uint64_t)i * BLOCKSZ, &block);
+        src_runs += (block != prev + 1);
+        prev = block;
+    }
+
+    test("data moved in large device copies", copy_calls == src_runs);
+
+    bool contiguous = true;
+    block_map(&ext2, dst.inode, 0, &first);
+    for (uint32_t i = 1; i < DATA_BLOCKS; i++) {
+        block_map(&ext2, dst.inode, (uint64_t)i * BLOCKSZ, &block);
+        contiguous = contiguous && (block == first + i);
+    }
+
+    test("destination is contiguous", first != 0 && contiguous);
+
+    block_map(&ext2, dst.inode, (uint64_t)(DATA_BLOCKS + 1) * BLOCKSZ, &block);
+
+    test("hole stays a hole", block == 0);
+
+    ext2_file_open(&ext2, "/foo/dst2", &dst2);
+    ext2_file_truncate(&ext2, &dst2, 10);
+    err = ext2_copy_file_range(&ext2, &src, 3, &dst2, 10, 5000);
+
+    test("unaligned copy ok", err == 0);
+    test("unaligned data is correct", same_contents(&src, 3, &dst2, 10, 5000));
+
+    err = ext2_copy_file_range(&ext2, &src, 0, &src, 100, 200);
+
+    test("overlapping copy is refused", err == EXT2_ERR_RANGES_OVERLAP);
+
+    err = ext2_copy_file_range(&ext2, &src, len - 4, &dst2, 0, 5);
+
+    test("copy past end of source is refused", err == EXT2_ERR_DATA_OUT_OF_BOUNDS);
+    test("e2fsck is happy", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include "utils.h"
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define BLOCKS_PER_GROUP 1024
+#define EMPTY_FILE_PATH "/tmp/empty"
+#define RECORD_SIZE 100
+#define RECORD_COUNT 1000
+
+int write_calls = 0;
+
+int count_write(uint32_t start, uint32_t size, const void* buffer, void* context) {
+    write_calls++;
+    return writeblock(start, size, buffer, context);
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = count_write,
+    .context = DISKIMG_FILE,
+};
+
+void make_record(char* record, uint32_t i) {
+    memset(record, 'a' + i % 26, RECORD_SIZE);
+    record[RECORD_SIZE - 1] = '\n';
+}
+
+int write_records(ext2_file_t* file) {
+    char record[RECORD_SIZE];
+    int calls = write_calls;
+
+    for (uint32_t i = 0; i < RECORD_COUNT; i++) {
+        make_record(record, i);
+        if (ext2_file_write(&ext2, file, RECORD_SIZE, record))
+            return -1;
+    }
+
+    return write_calls - calls;
+}
+
+bool records_ok(ext2_file_t* file) {
+    char record[RECORD_SIZE], expected[RECORD_SIZE];
+
+    ext2_file_seek(&ext2, file, 0);
+    for (uint32_t i = 0; i < RECORD_COUNT; i++) {
+        make_record(expected, i);
+        if (ext2_file_read(&ext2, file, RECORD_SIZE, record) ||
+                memcmp(record, expected, RECORD_SIZE) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+int main(void) {
+    testsuite("write buffering");
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=1k count=4096", DISKIMG_FILE);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d -g %d %s", BLOCKSZ, BLOCKS_PER_GROUP,
+            DISKIMG_FILE);
+    exec_cmd_fail("debugfs -w %s -R \"mkdir foo\"", DISKIMG_FILE);
+    exec_cmd_fail("touch %s", EMPTY_FILE_PATH);
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/plain\"",
+            DISKIMG_FILE, EMPTY_FILE_PATH);
+    exec_cmd_fail("debugfs -w %s -R \"write %s foo/buffered\"",
+            DISKIMG_FILE, EMPTY_FILE_PATH);
+
+    ext2_mount(&ext2, &cfg);
+
+    ext2_file_t plain, buffered;
+    ext2_file_open(&ext2, "/foo/plain", &plain);
+    ext2_file_open(&ext2, "/foo/buffered", &buffered);
+
+    static uint8_t wbuf[4 * BLOCKSZ];
+
+    test("buffer smaller than a block is refused",
+            ext2_file_set_buffer(&ext2, &buffered, wbuf, BLOCKSZ - 1) ==
+            EXT2_ERR_BUFFER_TOO_SMALL);
+
+    ext2_error_t err = ext2_file_set_buffer(&ext2, &buffered, wbuf, sizeof(wbuf));
+
+    test("attach buffer ok", err == 0);
+
+    int plain_calls = write_records(&plain);
+    int buffered_calls = write_records(&buffered);
+
+    test("buffered writes ok", buffered_calls >= 0);
+    test("tell counts buffered data",
+            ext2_file_tell(&ext2, &buffered) == RECORD_SIZE * RECORD_COUNT);
+    test("buffering saves device writes", buffered_calls * 10 < plain_calls);
+
+    err = ext2_file_flush(&ext2, &buffered);
+
+    test("flush ok", err == 0);
+    test("unbuffered data is correct", records_ok(&plain));
+    test("buffered data is correct", records_ok(&buffered));
+
+    // seek flushes the buffer
+    ext2_file_seek(&ext2, &buffered, RECORD_SIZE * RECORD_COUNT);
+    ext2_file_write(&ext2, &buffered, 5, "tail!");
+    ext2_file_seek(&ext2, &buffered, RECORD_SIZE * RECORD_COUNT);
+
+    char tail[6] = { 0 };
+    err = ext2_file_read(&ext2, &buffered, 5, tail);
+
+    test("seek flushes", err == 0 && strcmp(tail, "tail!") == 0);
+
+    // a big write goes around the buffer
+    static char big[10 * BLOCKSZ];
+    memset(big, 'z', sizeof(big));
+    err = ext2_file_write(&ext2, &buffered, sizeof(big), big);
+
+    test("big write ok", err == 0);
+
+    err = ext2_file_close(&ext2, &buffered);
+
+    test("close ok", err == 0 && buffered.buf == NULL);
+
+    ext2_file_open(&ext2, "/foo/buffered", &buffered);
+    ext2_file_seek(&ext2, &buffered, RECORD_SIZE * RECORD_COUNT + 5);
+    err = ext2_file_read(&ext2, &buffered, sizeof(big), big);
+
+    test("big write data is correct", err == 0 && big[0] == 'z' && 
+            big[sizeof(big) - 1] == 'z');
+    test("e2fsck is happy", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    return 0;
+}
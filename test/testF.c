@@ -0,0 +1,149 @@
+#include "utils.h"
+#include <pthread.h>
+#define DISKIMG_FILE "test/disk1.img"
+#define BLOCKSZ 1024
+#define BLOCKS_PER_GROUP 1024
+#define INODES 1024
+
+#define NTHREADS 8
+#define FILES_PER_THREAD 20
+#define FILE_SIZE 3000
+
+/*************************************
+ * Locks                             *
+ *************************************/
+pthread_rwlock_t inode_locks[INODES + 1];
+pthread_rwlock_t group_locks[16];
+pthread_rwlock_t shared_lock = PTHREAD_RWLOCK_INITIALIZER;
+int shared_takes = 0; // shared (read) locks taken on inodes
+
+pthread_rwlock_t* get_lock(ext2_lock_kind_t kind, uint32_t id) {
+    if (kind == EXT2_LOCK_INODE)
+        return &inode_locks[id];
+    if (kind == EXT2_LOCK_GROUP)
+        return &group_locks[id];
+    return &shared_lock;
+}
+
+void lock(ext2_lock_kind_t kind, uint32_t id, bool exclusive, void* context) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(get_lock(kind, id));
+    } else {
+        pthread_rwlock_rdlock(get_lock(kind, id));
+        __atomic_fetch_add(&shared_takes, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void unlock(ext2_lock_kind_t kind, uint32_t id, bool exclusive, void* context) {
+    pthread_rwlock_unlock(get_lock(kind, id));
+}
+
+/*************************************
+ * Filesystem instance and config    *
+ *************************************/
+ext2_t ext2;
+ext2_config_t cfg = {
+    .read = readblock,
+    .write = writeblock,
+    .context = DISKIMG_FILE,
+    .lock = lock,
+    .unlock = unlock,
+};
+
+int bad_data = 0;
+int mkdir_ok = 0;
+int mkdir_exists = 0;
+uint32_t same_inodes[NTHREADS];
+
+void* worker(void* arg) {
+    int id = (int)(intptr_t)arg;
+    char path[64];
+    uint8_t buf[FILE_SIZE], output_buf[FILE_SIZE];
+    ext2_file_t file;
+
+    // everybody races to create the same things
+    ext2_error_t err = ext2_mkdir(&ext2, "/race");
+    if (err == 0)
+        __atomic_fetch_add(&mkdir_ok, 1, __ATOMIC_RELAXED);
+    else if (err == EXT2_ERR_FILE_EXISTS)
+        __atomic_fetch_add(&mkdir_exists, 1, __ATOMIC_RELAXED);
+
+    ext2_file_open(&ext2, "/same", &file);
+    same_inodes[id] = file.inode;
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        for (int j = 0; j < FILE_SIZE; j++)
+            buf[j] = id * 31 + i * 7 + j;
+
+        sprintf(path, "/shared/file-%d-%d", id, i);
+        if (ext2_file_open(&ext2, path, &file) != 0 ||
+                ext2_file_write(&ext2, &file, FILE_SIZE, buf) != 0)
+            __atomic_fetch_add(&bad_data, 1, __ATOMIC_RELAXED);
+    }
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        for (int j = 0; j < FILE_SIZE; j++)
+            buf[j] = id * 31 + i * 7 + j;
+
+        sprintf(path, "/shared/file-%d-%d", id, i);
+        if (ext2_file_open(&ext2, path, &file) != 0 ||
+                ext2_file_read(&ext2, &file, FILE_SIZE, output_buf) != 0 ||
+                memcmp(buf, output_buf, FILE_SIZE) != 0)
+            __atomic_fetch_add(&bad_data, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+int main(void) {
+    testsuite("threads");
+
+    for (int i = 0; i <= INODES; i++)
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    for (int i = 0; i < 16; i++)
+        pthread_rwlock_init(&group_locks[i], NULL);
+
+    exec_cmd_fail("dd if=/dev/zero of=%s bs=1k count=4096", DISKIMG_FILE);
+    exec_cmd_fail("mkfs.ext2 -r 0 -b %d -g %d -N %d %s", BLOCKSZ, 
+            BLOCKS_PER_GROUP, INODES, DISKIMG_FILE);
+
+    ext2_mount(&ext2, &cfg);
+    ext2_mkdir(&ext2, "/shared");
+
+    uint32_t free_before = ext2.superblk.free_blocks_count;
+
+    pthread_t threads[NTHREADS];
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_create(&threads[i], NULL, worker, (void*)(intptr_t)i);
+    for (int i = 0; i < NTHREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    test("every file has its own data", bad_data == 0);
+    test("a single mkdir wins the race", 
+            mkdir_ok == 1 && mkdir_exists == NTHREADS - 1);
+
+    bool same = true;
+    for (int i = 1; i < NTHREADS; i++)
+        same = same && (same_inodes[i] == same_inodes[0]);
+
+    test("racing opens create a single file", same);
+
+    ext2_dir_t dir;
+    ext2_dir_record_t entry;
+    int entries = 0;
+    ext2_dir_open(&ext2, "/shared", &dir);
+    do {
+        ext2_dir_read(&ext2, &dir, &entry);
+        entries += (entry.inode != 0);
+    } while (entry.inode != 0);
+
+    test("every entry is in the dir", 
+            entries == NTHREADS * FILES_PER_THREAD + 2);
+    test("free block count is consistent",
+            free_before - ext2.superblk.free_blocks_count >= 
+            NTHREADS * FILES_PER_THREAD * ((FILE_SIZE + BLOCKSZ - 1) / BLOCKSZ));
+    test("reads take shared locks", shared_takes > 0);
+    test("e2fsck is happy", exec_cmd("e2fsck -fn %s", DISKIMG_FILE) == 0);
+
+    return 0;
+}
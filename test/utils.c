@@ -36,6 +36,57 @@ int writeblock(uint32_t start, uint32_t size, const void* buffer, void* context)
     return (items_read < 1) ? -1 : 0;
 }
 
+int readblock64(uint64_t start, uint32_t size, void* buffer, void* context) {
+    FILE* diskfile = fopen((char*) context, "r+");
+
+    if (diskfile == NULL)
+        return -1;
+
+    // set read/write position to start of block
+    if (fseeko(diskfile, start, SEEK_SET))
+        return -1;
+
+    // read 1 string of 'size' elements into buffer
+    size_t items_read = fread(buffer, size, 1, diskfile);
+
+    fclose(diskfile);
+
+    return (items_read < 1) ? -1 : 0;
+}
+
+int writeblock64(uint64_t start, uint32_t size, const void* buffer, void* context) {
+    FILE* diskfile = fopen((char*) context, "r+");
+
+    if (diskfile == NULL)
+        return -1;
+
+    // set read/write position to start of block
+    if (fseeko(diskfile, start, SEEK_SET))
+        return -1;
+
+    // write 1 string of 'size' elements into buffer
+    size_t items_read = fwrite(buffer, size, 1, diskfile);
+
+    fclose(diskfile);
+
+    return (items_read < 1) ? -1 : 0;
+}
+
+int copyblock64(uint64_t dst, uint64_t src, uint32_t size, void* context) {
+    char* buffer = malloc(size);
+
+    if (buffer == NULL)
+        return -1;
+
+    int err = readblock64(src, size, buffer, context);
+
+    if (!err)
+        err = writeblock64(dst, size, buffer, context);
+
+    free(buffer);
+    return err;
+}
+
 int exec_cmd(const char* fmt, ...) {
     char* suffix = " >/dev/null 2>&1";
     char cmd[MAX_CMD_SIZE + 16]; // 16 = suffix size
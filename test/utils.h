@@ -1,3 +1,4 @@
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -23,3 +24,6 @@ void exec_cmd_fail(const char* fmt, ...);
  *************************************/
 int readblock(uint32_t start, uint32_t size, void* buffer, void* context); 
 int writeblock(uint32_t start, uint32_t size, const void* buffer, void* context);
+int readblock64(uint64_t start, uint32_t size, void* buffer, void* context); 
+int writeblock64(uint64_t start, uint32_t size, const void* buffer, void* context);
+int copyblock64(uint64_t dst, uint64_t src, uint32_t size, void* context);